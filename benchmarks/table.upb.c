@@ -0,0 +1,179 @@
+
+#include "main.c"
+
+#include <stdlib.h>
+#include "upb/table.h"
+
+// Measures one operation on one kind of table.  The Makefile builds this once
+// per combination, with one each of the following macros defined:
+//
+//   TABLE_inttable, TABLE_inttable32, TABLE_strtable: the table to measure.
+//   OP_hit, OP_miss: lookups of keys that are (or are not) in the table.
+//        The table is compacted first, as defs' tables are when finalized.
+//   OP_insert: building a table with all of the keys.
+//   OP_compact: upb_inttable_compact(), upb_inttable32_init() or
+//        upb_strtable_optimize() on a table with all of the keys.  Compacting
+//        an inttable is only measured on a freshly built table, which is
+//        rebuilt outside of the timed region for each run.
+//   KEYS_dense, KEYS_sparse: integer keys 1..n or scattered over 29 bits
+//        (the range of field numbers).
+//   KEYS_short, KEYS_long: string keys like field names ("field_17") or like
+//        fully-qualified message names ("google.protobuf.pkg.Message17").
+//
+// Reports operations per second, in units of 2^20 (main.c divides by 1 << 20
+// as it does for bytes).
+
+#define NUM_KEYS 1024
+
+#if defined(TABLE_inttable) || defined(TABLE_inttable32)
+typedef uintptr_t benchkey;
+static upb_inttable table;
+#elif defined(TABLE_strtable)
+typedef char *benchkey;
+static upb_strtable table;
+#else
+#error Must define one TABLE_* macro.
+#endif
+
+static benchkey keys[NUM_KEYS], misses[NUM_KEYS];
+
+#ifdef TABLE_inttable32
+static upb_inttable32 table32;
+#endif
+
+static uint32_t seed = 1;
+static volatile uintptr_t sink;
+
+static uint32_t randnum() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 3;
+}
+
+#if defined(TABLE_strtable)
+static char *makekey(int i, bool miss) {
+  char str[128];
+#if defined(KEYS_short)
+  snprintf(str, sizeof(str), "%s%d", miss ? "other_" : "field_", i);
+#elif defined(KEYS_long)
+  snprintf(str, sizeof(str), "google.protobuf.%s%d.Message%d",
+           miss ? "other" : "pkg", i / 16, i);
+#else
+#error Must define KEYS_short or KEYS_long.
+#endif
+  return strdup(str);
+}
+
+static void inserttable() {
+  upb_strtable_init(&table);
+  for (int i = 0; i < NUM_KEYS; i++)
+    upb_strtable_insert(&table, keys[i], upb_value_ptr(keys[i]));
+}
+
+INLINE void compacttable() { upb_strtable_optimize(&table); }
+static void uninittable() { upb_strtable_uninit(&table); }
+INLINE bool lookup(char *key) { return upb_strtable_lookup(&table, key); }
+#else
+static uintptr_t makekey(int i, bool miss) {
+#if defined(KEYS_dense)
+  return miss ? NUM_KEYS + 1 + i : i + 1;
+#elif defined(KEYS_sparse)
+  // Even keys are hits and odd keys are misses.
+  (void)i;
+  return (randnum() & ~1) | miss;
+#else
+#error Must define KEYS_dense or KEYS_sparse.
+#endif
+}
+
+static void inserttable() {
+  upb_inttable_init(&table);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    // Sparse keys are random, so skip the rare duplicate.
+    if (upb_inttable_lookup(&table, keys[i])) continue;
+    upb_inttable_insert(&table, keys[i], upb_value_ptr(&keys[i]));
+  }
+}
+
+static void uninittable() { upb_inttable_uninit(&table); }
+#ifdef TABLE_inttable32
+INLINE void compacttable() {
+  upb_inttable32_uninit(&table32);
+  upb_inttable32_init(&table32, &table);
+}
+INLINE bool lookup(uintptr_t key) {
+  return upb_inttable32_lookup(&table32, key);
+}
+#else
+INLINE void compacttable() { upb_inttable_compact(&table); }
+INLINE bool lookup(uintptr_t key) { return upb_inttable_lookup(&table, key); }
+#endif
+#endif
+
+static bool initialize()
+{
+  for (int i = 0; i < NUM_KEYS; i++) {
+    keys[i] = makekey(i, false);
+    misses[i] = makekey(i, true);
+  }
+  // Look up in a different order than we inserted.
+  for (int i = NUM_KEYS - 1; i > 0; i--) {
+    int j = randnum() % (i + 1);
+    benchkey tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+#ifdef TABLE_inttable32
+  table32.array = NULL;
+  table32.entries = NULL;
+#endif
+#ifndef OP_insert
+  inserttable();
+  compacttable();
+#endif
+  return true;
+}
+
+static void cleanup()
+{
+#ifndef OP_insert
+  uninittable();
+#endif
+#ifdef TABLE_inttable32
+  upb_inttable32_uninit(&table32);
+#endif
+#ifdef TABLE_strtable
+  for (int i = 0; i < NUM_KEYS; i++) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+#endif
+}
+
+static size_t run(int i)
+{
+  (void)i;
+  uintptr_t found = 0;
+#if defined(OP_hit)
+  for (int j = 0; j < NUM_KEYS; j++) found += lookup(keys[j]);
+  if (found != NUM_KEYS) return 0;
+#elif defined(OP_miss)
+  for (int j = 0; j < NUM_KEYS; j++) found += lookup(misses[j]);
+  if (found != 0) return 0;
+#elif defined(OP_insert)
+  inserttable();
+  uninittable();
+#elif defined(OP_compact)
+#ifdef TABLE_inttable
+  // The table is compacted already after the first run.
+  clock_t before = clock();
+  uninittable();
+  inserttable();
+  untimed_clocks += clock() - before;
+#endif
+  compacttable();
+#else
+#error Must define one OP_* macro.
+#endif
+  sink = found;
+  return NUM_KEYS;
+}
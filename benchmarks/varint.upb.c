@@ -0,0 +1,97 @@
+
+#include "main.c"
+
+#include <stdlib.h>
+#include "upb/pb/varint.h"
+
+// Measures one varint decoder on one distribution of varint lengths.  The
+// Makefile builds this once per combination, with DECODER set to the decoder
+// function and one LENGTHS_* macro defined:
+//
+//   LENGTHS_1byte:  values < 128, like most tags, bools and enums.
+//   LENGTHS_mixed:  a rough mix of what real messages contain: 50% 1 byte,
+//                   25% 2 bytes, 15% 3-5 bytes and 10% 10 bytes (negative
+//                   int32/int64 values).
+//   LENGTHS_5byte:  32-bit values with the top bit set, like fixed-width
+//                   hashes or ids stored as uint32.
+//   LENGTHS_10byte: negative 64-bit values.
+//
+// Decoders that need CPU support (NEEDS_BMI2) fail to initialize on CPUs that
+// lack it.  Reports millions of varints decoded per second.
+
+#define NUM_VARINTS 4096
+
+// The branchless decoders may read up to 8 bytes past the start of the last
+// varint's second byte, so leave room past the end.
+static char buf[NUM_VARINTS * UPB_PB_VARINT_MAX_LEN + 16];
+static volatile uint64_t sink;
+
+static uint64_t randval(uint32_t *seed, int bytes) {
+  // Builds a value that encodes in exactly "bytes" bytes.
+  *seed = *seed * 1103515245 + 12345;
+  uint64_t r = ((uint64_t)*seed << 32) | (*seed * 2654435761U);
+  if (bytes >= 10) return r | (1ULL << 63);
+  uint64_t min = bytes == 1 ? 0 : 1ULL << (7 * (bytes - 1));
+  uint64_t range = (1ULL << (7 * bytes)) - min;
+  return min + r % range;
+}
+
+static int randlength(uint32_t *seed) {
+#if defined(LENGTHS_1byte)
+  (void)seed;
+  return 1;
+#elif defined(LENGTHS_5byte)
+  (void)seed;
+  return 5;
+#elif defined(LENGTHS_10byte)
+  (void)seed;
+  return 10;
+#elif defined(LENGTHS_mixed)
+  *seed = *seed * 1103515245 + 12345;
+  uint32_t pct = (*seed >> 16) % 100;
+  if (pct < 50) return 1;
+  if (pct < 75) return 2;
+  if (pct < 80) return 3;
+  if (pct < 85) return 4;
+  if (pct < 90) return 5;
+  return 10;
+#else
+#error Must define one LENGTHS_* macro.
+#endif
+}
+
+static bool initialize()
+{
+#ifdef NEEDS_BMI2
+  if (!upb_cpu_hasbmi2()) return false;
+#endif
+  uint32_t seed = 1;
+  char *p = buf;
+  for (int i = 0; i < NUM_VARINTS; i++) {
+    int bytes = randlength(&seed);
+    size_t n = upb_vencode64(randval(&seed, bytes), p);
+    if ((int)n != bytes) return false;
+    p += n;
+  }
+  memset(p, 0, buf + sizeof(buf) - p);
+  return true;
+}
+
+static void cleanup()
+{
+}
+
+static size_t run(int i)
+{
+  (void)i;
+  const char *p = buf;
+  uint64_t sum = 0;
+  for (int j = 0; j < NUM_VARINTS; j++) {
+    upb_decoderet r = DECODER(p);
+    if (r.p == NULL) return 0;
+    sum += r.val;
+    p = r.p;
+  }
+  sink = sum;
+  return NUM_VARINTS;
+}
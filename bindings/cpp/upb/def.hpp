@@ -260,7 +260,7 @@ class MessageDef : public upb_msgdef {
   uint16_t instance_size() const { return upb_msgdef_size(this); }
 
   // The number of "hasbit" bytes in a message instance.
-  uint8_t hasbit_bytes() const { return upb_msgdef_hasbit_bytes(this); }
+  uint16_t hasbit_bytes() const { return upb_msgdef_hasbit_bytes(this); }
 
   uint32_t extension_start() const { return upb_msgdef_extstart(this); }
   uint32_t extension_end() const { return upb_msgdef_extend(this); }
@@ -271,7 +271,9 @@ class MessageDef : public upb_msgdef {
   void set_full_name(const std::string& name) { AsDef()->set_full_name(name); }
 
   void set_instance_size(uint16_t size) { upb_msgdef_setsize(this, size); }
-  void set_hasbit_bytes(uint16_t size) { upb_msgdef_setsize(this, size); }
+  void set_hasbit_bytes(uint16_t bytes) {
+    upb_msgdef_sethasbit_bytes(this, bytes);
+  }
   bool SetExtensionRange(uint32_t start, uint32_t end) {
     return upb_msgdef_setextrange(this, start, end);
   }
@@ -300,7 +302,7 @@ class MessageDef : public upb_msgdef {
     return FieldDef::Cast(upb_msgdef_ntof(this, name));
   }
   FieldDef* FindFieldByName(const std::string& name) {
-    return FieldDef::Cast(upb_msgdef_ntof(this, name.c_str()));
+    return FieldDef::Cast(upb_msgdef_ntofl(this, name.data(), name.size()));
   }
   FieldDef* FindFieldByNumber(uint32_t num) {
     return FieldDef::Cast(upb_msgdef_itof(this, num));
@@ -29,6 +29,7 @@ namespace upb {
 
 class DecoderPlan : public upb_decoderplan {
  public:
+  // Freezes the handlers; returns NULL if that runs out of memory.
   static DecoderPlan* New(Handlers* h, bool allow_jit) {
     return static_cast<DecoderPlan*>(upb_decoderplan_new(h, allow_jit));
   }
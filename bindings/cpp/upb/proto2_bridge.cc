@@ -4,6 +4,7 @@
 // Copyright (c) 2011-2012 Google Inc.  See LICENSE for details.
 // Author: Josh Haberman <jhaberman@gmail.com>
 
+#include <stddef.h>
 #include <string>
 #include <typeinfo>
 #include "upb/bytestream.hpp"
@@ -121,6 +122,53 @@ namespace proto2_bridge_opensource {
 // an enum value for STRING.
 #define UPB_CTYPE_STRING 0
 
+// Only StaticCheck<true> is complete, so UPB_BRIDGE_STATIC_ASSERT() of a false
+// constant expression fails to compile.
+template <bool> struct StaticCheck;
+template <> struct StaticCheck<true> {};
+#define UPB_BRIDGE_STATIC_ASSERT(expr) (void)sizeof(StaticCheck<(expr)>)
+
+// Mirrors the members that RepeatedField<T> starts with, so that we can give
+// the JIT their offsets (see upb_arraylayout) without seeing RepeatedField's
+// privates.  It lets the JIT append to the field directly and only call
+// Append<T>() when the field has to grow.
+template <typename T> struct RepeatedFieldMirror {
+  T* elements_;
+  int current_size_;
+  int total_size_;
+};
+
+// The mirror can't see whether proto2 has reordered its members, so before the
+// offsets are trusted they are checked against the public interface on a
+// field whose size and capacity differ.
+template <typename T> static bool MirrorMatches() {
+  typedef RepeatedFieldMirror<T> Mirror;
+  // The mirror has to fit in the real thing, and in upb_arraylayout.
+  UPB_BRIDGE_STATIC_ASSERT(sizeof(Mirror) <= sizeof(RepeatedField<T>));
+  UPB_BRIDGE_STATIC_ASSERT(sizeof(int) == sizeof(int32_t));
+  UPB_BRIDGE_STATIC_ASSERT(offsetof(Mirror, total_size_) <= 0xffff);
+  UPB_BRIDGE_STATIC_ASSERT(sizeof(T) <= 0xff);
+  RepeatedField<T> r;
+  r.Add(T());
+  const Mirror *m = reinterpret_cast<const Mirror*>(&r);
+  return r.size() != r.Capacity() && m->elements_ == r.mutable_data() &&
+         m->current_size_ == r.size() && m->total_size_ == r.Capacity();
+}
+
+// Returns NULL (so values are always appended with Append<T>()) if this
+// proto2's RepeatedField<T> doesn't match the mirror.
+template <typename T> static const upb_arraylayout *GetArrayLayout() {
+  typedef RepeatedFieldMirror<T> Mirror;
+  static const upb_arraylayout layout = {
+    offsetof(Mirror, elements_),
+    offsetof(Mirror, current_size_),
+    offsetof(Mirror, total_size_),
+    sizeof(T)
+  };
+  static const bool matches = MirrorMatches<T>();
+  return matches ? &layout : NULL;
+}
+
 // The code in this class depends on the internal representation of the proto2
 // generated classes, which is an internal implementation detail of proto2 and
 // is not a public interface.  As a result, this class's implementation may
@@ -245,7 +293,8 @@ class FieldAccessor {
       &PushOffset,  // StartSequence handler
       NULL,  // StartRepeatedSubMessage handler
       &Append<T>,
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      GetArrayLayout<T>()};
     return &vtbl;
   }
 
@@ -266,7 +315,8 @@ class FieldAccessor {
       &PushOffset,  // StartSequence handler
       NULL,  // StartRepeatedSubMessage handler
       &AppendString<T>,
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -297,7 +347,8 @@ class FieldAccessor {
       &PushOffset,  // StartSequence handler
       &StartRepeatedSubMessage,
       NULL,  // Repeated value handler
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -352,7 +403,8 @@ class FieldAccessor {
       &PushOffset,  // StartSequence handler
       NULL,  // StartRepeatedSubMessage handler
       &AppendCord,
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -519,7 +571,8 @@ class Proto1FieldAccessor {
       &PushOffset,  // StartSequence handler
       NULL,  // StartRepeatedSubMessage handler
       &Append<T>,
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      GetArrayLayout<T>()};
     return &vtbl;
   }
 
@@ -587,7 +640,8 @@ class Proto1FieldAccessor {
       &PushOffset,  // StartSequence handler
       NULL,  // StartRepeatedSubMessage handler
       &AppendCord,
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -613,7 +667,8 @@ class Proto1FieldAccessor {
       &PushOffset,  // StartSequence handler
       &StartRepeatedSubMessage,
       NULL,  // Repeated value handler
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -624,7 +679,8 @@ class Proto1FieldAccessor {
       &PushOffset,  // StartSequence handler
       &StartRepeatedSubMessage,
       NULL,  // Repeated value handler
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -635,7 +691,8 @@ class Proto1FieldAccessor {
       &PushOffset,  // StartSequence handler
       &StartRepeatedSubMessage,
       NULL,  // Repeated value handler
-      NULL, NULL, NULL, NULL, NULL, NULL};
+      NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL};  // Array layout
     return &vtbl;
   }
 
@@ -821,7 +821,8 @@ static upb_flow_t lupb_msg_stringval_r(void *a, upb_value fval, upb_value val) {
     &upb_stdmsg_get ## type, \
     &upb_stdmsg_seqbegin, \
     &upb_stdmsg_ ## size ## byte_seqnext, \
-    &upb_stdmsg_seqget ## type};
+    &upb_stdmsg_seqget ## type, \
+    NULL};
 
 #define RETURN_STDMSG(type, size) { STDMSG(type, size); return &vtbl; }
 
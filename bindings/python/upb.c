@@ -637,7 +637,8 @@ static upb_flow_t PyUpb_Message_AppendStringValue(void *a, upb_value fval, upb_v
     &upb_stdmsg_get ## type, \
     &upb_stdmsg_seqbegin, \
     &upb_stdmsg_ ## size ## byte_seqnext, \
-    &upb_stdmsg_seqget ## type};
+    &upb_stdmsg_seqget ## type, \
+    NULL};
 
 #define RETURN_STDMSG(type, size) { STDMSG(type, size); return &vtbl; }
 
@@ -30,3 +30,5 @@ run_with_flags () {
 # the JIT flag.
 run_with_flags "-DNDEBUG -DUPB_USE_JIT_X64" "plain"
 run_with_flags "-DNDEBUG -fomit-frame-pointer -DUPB_USE_JIT_X64" "omitfp"
+run_with_flags "-DNDEBUG -m32 -DUPB_USE_JIT_X86" "plain32jit"
+run_with_flags "-DNDEBUG -fomit-frame-pointer -m32 -DUPB_USE_JIT_X86" "omitfp32jit"
@@ -0,0 +1,26 @@
+
+
+tests/test.proto"
+A
+b (2.BRb"'
+B
+b (2.BRb
+c (2.CRc"K
+C
+a (2.ARa
+b (2.BRb
+d (2.DRd
+e (2.ERe"9
+D
+a (2.ARa
+d (2.DRd
+e (2.ERe"
+E
+e (2.ERe"
+F
+e (2.ERe"J
+SimplePrimitives
+a (Ra
+b (Rb
+c (Rc
+d (Rd
\ No newline at end of file
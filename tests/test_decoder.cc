@@ -26,10 +26,14 @@
 #endif
 
 #include <inttypes.h>
+#ifndef UPB_THREAD_UNSAFE
+#include <pthread.h>
+#endif
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include "upb/bytestream.h"
 #include "upb/handlers.h"
 #include "upb/pb/decoder.h"
 #include "upb/pb/varint.h"
@@ -145,6 +149,17 @@ buffer varint(uint64_t x) {
   return buffer(buf, len);
 }
 
+// Encodes "x" (which must fit) as a varint of exactly "len" bytes, padding it
+// with redundant continuation bytes.
+buffer longvarint(uint64_t x, size_t len) {
+  char buf[UPB_PB_VARINT_MAX_LEN];
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (x & 0x7f) | (i + 1 < len ? 0x80 : 0);
+    x >>= 7;
+  }
+  return buffer(buf, len);
+}
+
 // TODO: proper byte-swapping for big-endian machines.
 buffer fixed32(void *data) { return buffer(data, 4); }
 buffer fixed64(void *data) { return buffer(data, 8); }
@@ -282,9 +297,9 @@ void reg(upb_mhandlers *m, upb_fieldtype_t type, upb_value_handler *handler) {
 }
 
 void reg_subm(upb_mhandlers *m, uint32_t num, upb_fieldtype_t type,
-              bool repeated) {
+              bool repeated, upb_mhandlers *subm) {
   upb_fhandlers *f =
-      upb_mhandlers_newfhandlers_subm(m, num, type, repeated, m);
+      upb_mhandlers_newfhandlers_subm(m, num, type, repeated, subm);
   ASSERT(f);
   upb_fhandlers_setstartseq(f, &startseq);
   upb_fhandlers_setendseq(f, &endseq);
@@ -293,7 +308,9 @@ void reg_subm(upb_mhandlers *m, uint32_t num, upb_fieldtype_t type,
   upb_fhandlers_setfval(f, upb_value_uint32(num));
 }
 
-void reghandlers(upb_mhandlers *m) {
+// Submessages are of type "subm", usually m itself.  Groups are always of type
+// m, since a group's type also has to handle its ENDGROUP tag.
+void reghandlers(upb_mhandlers *m, upb_mhandlers *subm) {
   upb_mhandlers_setstartmsg(m, &startmsg);
   upb_mhandlers_setendmsg(m, &endmsg);
 
@@ -317,10 +334,10 @@ void reghandlers(upb_mhandlers *m) {
 
   // Register submessage/group handlers that are self-recursive
   // to this type, eg: message M { optional M m = 1; }
-  reg_subm(m, UPB_TYPE(MESSAGE),         UPB_TYPE(MESSAGE), false);
-  reg_subm(m, UPB_TYPE(GROUP),           UPB_TYPE(GROUP),   false);
-  reg_subm(m, rep_fn(UPB_TYPE(MESSAGE)), UPB_TYPE(MESSAGE), true);
-  reg_subm(m, rep_fn(UPB_TYPE(GROUP)),   UPB_TYPE(GROUP),   true);
+  reg_subm(m, UPB_TYPE(MESSAGE),         UPB_TYPE(MESSAGE), false, subm);
+  reg_subm(m, UPB_TYPE(GROUP),           UPB_TYPE(GROUP),   false, m);
+  reg_subm(m, rep_fn(UPB_TYPE(MESSAGE)), UPB_TYPE(MESSAGE), true,  subm);
+  reg_subm(m, rep_fn(UPB_TYPE(GROUP)),   UPB_TYPE(GROUP),   true,  m);
 
   // Register a no-op string field so we can pad the proto wherever we want.
   upb_mhandlers_newfhandlers(m, NOP_FIELD, UPB_TYPE(STRING), false);
@@ -696,6 +713,12 @@ void test_valid() {
   test_valid_data_for_type(UPB_TYPE(FIXED64), uint64(33), uint64(66));
   test_valid_data_for_type(UPB_TYPE(FIXED32), uint32(33), uint32(66));
 
+  // Every varint length, to exercise all of the decoders' varint paths.
+  for (size_t len = 1; len <= UPB_PB_VARINT_MAX_LEN; len++) {
+    test_valid_data_for_type(
+        UPB_TYPE(UINT64), longvarint(33, len), longvarint(66, len));
+  }
+
   // Test implicit startseq/endseq.
   uint32_t repfl_fn = rep_fn(UPB_TYPE(FLOAT));
   uint32_t repdb_fn = rep_fn(UPB_TYPE(DOUBLE));
@@ -772,6 +795,283 @@ void test_valid() {
   assert_successful_parse(buf, "%s", textbuf.buf());
 }
 
+// A growable array that the JIT can append to itself.
+typedef struct {
+  int32_t size;
+  int32_t *elements;
+  int32_t capacity;
+} int32_array;
+
+const upb_arraylayout int32_array_layout = {
+  offsetof(int32_array, elements), offsetof(int32_array, size),
+  offsetof(int32_array, capacity), sizeof(int32_t)};
+
+int append_calls;
+
+upb_sflow_t startarray(void *closure, upb_value fval) {
+  (void)fval;
+  return UPB_CONTINUE_WITH(closure);
+}
+
+upb_flow_t append_int32(void *closure, upb_value fval, upb_value val) {
+  (void)fval;
+  int32_array *a = (int32_array*)closure;
+  append_calls++;
+  if (a->size == a->capacity) {
+    a->capacity = a->capacity ? a->capacity * 2 : 4;
+    a->elements =
+        (int32_t*)realloc(a->elements, a->capacity * sizeof(int32_t));
+  }
+  a->elements[a->size++] = upb_value_getint32(val);
+  return UPB_CONTINUE;
+}
+
+void test_arraylayout(bool allowjit) {
+  upb_handlers *h = upb_handlers_new();
+  upb_mhandlers *m = upb_handlers_newmhandlers(h);
+  upb_fhandlers *f = upb_mhandlers_newfhandlers(m, 1, UPB_TYPE(INT32), true);
+  upb_fhandlers_setstartseq(f, &startarray);
+  upb_fhandlers_setvalue(f, &append_int32);
+  upb_fhandlers_setarraylayout(f, &int32_array_layout);
+  upb_mhandlers_newfhandlers(m, NOP_FIELD, UPB_TYPE(STRING), false);
+  upb_decoderplan *p = upb_decoderplan_new(h, allowjit);
+
+  const int n = 100;
+  buffer proto;
+  for (int i = 0; i < n; i++)
+    proto.append(cat( tag(1, UPB_WIRE_TYPE_VARINT), varint(i * 1000) ));
+  proto.append(thirty_byte_nop);
+
+  int32_array a = {0, NULL, 0};
+  upb_stringsrc src;
+  upb_stringsrc_init(&src);
+  upb_stringsrc_reset(&src, proto.buf(), proto.len());
+  upb_decoder d;
+  upb_decoder_init(&d);
+  upb_decoder_resetplan(&d, p, 0);
+  upb_decoder_resetinput(&d, upb_stringsrc_allbytes(&src), &a);
+  append_calls = 0;
+  ASSERT(upb_decoder_decode(&d) == UPB_OK);
+  ASSERT(a.size == n);
+  for (int i = 0; i < n; i++)
+    ASSERT(a.elements[i] == i * 1000);
+  if (upb_decoderplan_hasjitcode(p)) {
+    // The handler is only called when the array must grow.
+    ASSERT(append_calls < n);
+  } else {
+    ASSERT(append_calls == n);
+  }
+
+  free(a.elements);
+  upb_decoder_uninit(&d);
+  upb_stringsrc_uninit(&src);
+  upb_decoderplan_unref(p);
+  upb_handlers_unref(h);
+}
+
+#ifndef UPB_THREAD_UNSAFE
+// ASSERT() is not threadsafe, so decoders only count what they see and the
+// main thread checks the counts.
+struct tiered_decoder_state {
+  upb_decoderplan *plan;
+  const buffer *proto;
+  int64_t sum;
+  int failures;
+};
+
+upb_flow_t add_int32(void *closure, upb_value fval, upb_value val) {
+  (void)fval;
+  ((tiered_decoder_state*)closure)->sum += upb_value_getint32(val);
+  return UPB_CONTINUE;
+}
+
+void *tiered_decoder(void *_state) {
+  tiered_decoder_state *state = (tiered_decoder_state*)_state;
+  upb_stringsrc src;
+  upb_stringsrc_init(&src);
+  upb_decoder d;
+  upb_decoder_init(&d);
+  upb_decoder_resetplan(&d, state->plan, 0);
+  for (int i = 0; i < 200; i++) {
+    upb_stringsrc_reset(&src, state->proto->buf(), state->proto->len());
+    upb_decoder_resetinput(&d, upb_stringsrc_allbytes(&src), state);
+    if (upb_decoder_decode(&d) != UPB_OK) state->failures++;
+  }
+  upb_decoder_uninit(&d);
+  upb_stringsrc_uninit(&src);
+  return NULL;
+}
+
+// Several decoders share one tiered plan while it profiles and is JIT-ted.
+void test_tiered_concurrent() {
+  upb_handlers *h = upb_handlers_new();
+  upb_mhandlers *m = upb_handlers_newmhandlers(h);
+  for (uint32_t i = 1; i <= 3; i++) {
+    upb_fhandlers *f = upb_mhandlers_newfhandlers(m, i, UPB_TYPE(INT32), false);
+    upb_fhandlers_setvalue(f, &add_int32);
+  }
+  upb_decoderplan *p = upb_decoderplan_newtiered(h, 50);
+  buffer proto;
+  int64_t sum = 0;
+  for (int i = 0; i < 100; i++) {
+    uint32_t fn = 3 - (i % 3);
+    proto.append(cat( tag(fn, UPB_WIRE_TYPE_VARINT), varint(i) ));
+    sum += i;
+  }
+
+  const int n = 4;
+  tiered_decoder_state states[n];
+  pthread_t threads[n];
+  for (int i = 0; i < n; i++) {
+    tiered_decoder_state state = {p, &proto, 0, 0};
+    states[i] = state;
+    ASSERT(pthread_create(&threads[i], NULL, tiered_decoder, &states[i]) == 0);
+  }
+  for (int i = 0; i < n; i++) {
+    ASSERT(pthread_join(threads[i], NULL) == 0);
+    ASSERT(states[i].failures == 0);
+    ASSERT(states[i].sum == sum * 200);
+  }
+#ifdef UPB_USE_JIT
+  ASSERT(upb_decoderplan_hasjitcode(p));
+#endif
+  upb_decoderplan_unref(p);
+  upb_handlers_unref(h);
+}
+#endif
+
+struct cache_closure {
+  int registrations;
+  int32_t value;
+};
+
+upb_flow_t setvalue(void *closure, upb_value fval, upb_value val) {
+  (void)fval;
+  ((cache_closure*)closure)->value = upb_value_getint32(val);
+  return UPB_CONTINUE;
+}
+
+void onfreg_cache(void *closure, upb_fhandlers *fh, const upb_fielddef *f) {
+  (void)f;
+  ((cache_closure*)closure)->registrations++;
+  upb_fhandlers_setvalue(fh, &setvalue);
+}
+
+void test_plancache() {
+  upb_msgdef *m = upb_msgdef_new(&m);
+  upb_def_setfullname(UPB_UPCAST(m), "CacheMessage");
+  upb_fielddef *f = upb_fielddef_new(&f);
+  upb_fielddef_setname(f, "i");
+  upb_fielddef_setnumber(f, 1);
+  upb_fielddef_settype(f, UPB_TYPE(INT32));
+  ASSERT(upb_msgdef_addfield(m, f, &f));
+  upb_def *defs[] = {UPB_UPCAST(m)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT(upb_finalize(defs, 1, &status));
+  upb_status_uninit(&status);
+
+  // Only the first request for a key builds the plan.
+  cache_closure c = {0, 0}, c2 = {0, 0};
+  upb_decoderplan *p = upb_decoderplan_getcached(m, NULL, &onfreg_cache, &c,
+                                                 false);
+  ASSERT(c.registrations == 1);
+  ASSERT(upb_decoderplan_getcached(m, NULL, &onfreg_cache, &c, false) == p);
+  ASSERT(c.registrations == 1);
+  upb_decoderplan *jit = upb_decoderplan_getcached(m, NULL, &onfreg_cache, &c,
+                                                   true);
+  upb_decoderplan *other = upb_decoderplan_getcached(m, NULL, &onfreg_cache,
+                                                     &c2, false);
+  ASSERT(jit != p && other != p);
+  ASSERT(c.registrations == 2 && c2.registrations == 1);
+
+  // The cached plan decodes like any other.
+  buffer proto = cat( tag(1, UPB_WIRE_TYPE_VARINT), varint(1234) );
+  upb_stringsrc src;
+  upb_stringsrc_init(&src);
+  upb_stringsrc_reset(&src, proto.buf(), proto.len());
+  upb_decoder d;
+  upb_decoder_init(&d);
+  upb_decoder_resetplan(&d, p, 0);
+  upb_decoder_resetinput(&d, upb_stringsrc_allbytes(&src), &c);
+  ASSERT(upb_decoder_decode(&d) == UPB_OK);
+  ASSERT(c.value == 1234);
+  upb_decoder_uninit(&d);
+  upb_stringsrc_uninit(&src);
+
+  // A cache full of plans that are in use grows instead of evicting them.
+  const int n = UPB_PLANCACHE_MAX * 2;
+  cache_closure *cs = new cache_closure[n];
+  upb_decoderplan **ps = new upb_decoderplan*[n];
+  for (int i = 0; i < n; i++) {
+    cs[i].registrations = 0;
+    ps[i] = upb_decoderplan_getcached(m, NULL, &onfreg_cache, &cs[i], false);
+  }
+  for (int i = 0; i < n; i++) {
+    ASSERT(upb_decoderplan_getcached(m, NULL, &onfreg_cache, &cs[i], false) ==
+           ps[i]);
+    ASSERT(cs[i].registrations == 1);
+    upb_decoderplan_unref(ps[i]);
+    upb_decoderplan_unref(ps[i]);
+  }
+  ASSERT(upb_decoderplan_evictcached() == n);
+  delete[] cs;
+  delete[] ps;
+
+  // Plans are only evicted once nothing outside the cache refers to them, and
+  // the cache keeps the msgdef alive until then.
+  upb_msgdef_unref(m, &m);
+  ASSERT(upb_decoderplan_evictcached() == 0);
+  upb_decoderplan_unref(p);
+  upb_decoderplan_unref(other);
+  ASSERT(upb_decoderplan_evictcached() == 1);
+  ASSERT(upb_decoderplan_getcached(m, NULL, &onfreg_cache, &c, false) == p);
+  ASSERT(c.registrations == 2);
+  upb_decoderplan_unref(p);
+  upb_decoderplan_unref(p);
+  upb_decoderplan_unref(jit);
+  ASSERT(upb_decoderplan_evictcached() == 2);
+  ASSERT(upb_decoderplan_evictcached() == 0);
+}
+
+void test_frozen_handlers() {
+  upb_handlers *h = upb_handlers_new();
+  upb_mhandlers *m = upb_handlers_newmhandlers(h);
+  uint32_t nums[] = {5, 1, 3};
+  for (int i = 0; i < 3; i++) {
+    upb_fhandlers *f =
+        upb_mhandlers_newfhandlers(m, nums[i], UPB_TYPE(INT32), i == 2);
+    upb_fhandlers_setvalue(f, &setvalue);
+    upb_fhandlers_sethasbit(f, i);
+    upb_fhandlers_setfval(f, upb_value_uint32(nums[i]));
+  }
+  ASSERT(!upb_handlers_isfrozen(h));
+  upb_decoderplan *p = upb_decoderplan_new(h, false);
+  ASSERT(upb_handlers_isfrozen(h));
+  ASSERT(upb_handlers_freeze(h));
+
+  // Each message's slots are a flat array in field number order.
+  ASSERT(m->slot_count == 3);
+  for (uint32_t i = 0; i < m->slot_count; i++) {
+    const upb_fieldslot *s = &m->slots[i];
+    upb_fhandlers *f = s->f;
+    ASSERT(f->number == 2 * i + 1);
+    ASSERT(f->slot == s);
+    ASSERT(upb_mhandlers_lookup(m, f->number) == f);
+    ASSERT(upb_inttable32_lookup(&m->dispatch, f->number) == s);
+    ASSERT(s->type == UPB_TYPE(INT32));
+    ASSERT(s->repeated == (f->number == 3));
+    ASSERT(s->value == &setvalue);
+    ASSERT(s->hasbit == f->hasbit);
+    ASSERT(upb_value_getuint32(s->fval) == f->number);
+  }
+  ASSERT(!upb_inttable32_lookup(&m->dispatch, 2));
+  if (sizeof(void*) == 8 && sizeof(upb_value) == 8)
+    ASSERT(sizeof(upb_fieldslot) == 32);
+
+  upb_decoderplan_unref(p);
+  upb_handlers_unref(h);
+}
+
 void run_tests() {
   test_invalid();
   test_valid();
@@ -783,7 +1083,8 @@ int main() {
   }
   // Construct decoder plan.
   upb_handlers *h = upb_handlers_new();
-  reghandlers(upb_handlers_newmhandlers(h));
+  upb_mhandlers *m = upb_handlers_newmhandlers(h);
+  reghandlers(m, m);
 
   // Create an empty handlers to make sure that the decoder can handle empty
   // messages.
@@ -796,13 +1097,58 @@ int main() {
 
   // Test JIT.
   plan = upb_decoderplan_new(h, true);
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
+  ASSERT(upb_decoderplan_hasjitcode(plan));
+#else
+  ASSERT(!upb_decoderplan_hasjitcode(plan));
+#endif
+  run_tests();
+
+  // The handlers hold the JIT state of one plan at a time, so a second plan
+  // for them stays in the interpreter while the first is alive.
+  upb_decoderplan *plan2 = upb_decoderplan_new(h, true);
+  ASSERT(!upb_decoderplan_hasjitcode(plan2));
+  upb_decoderplan_unref(plan2);
+  upb_decoderplan_unref(plan);
+
+  // Test tiered JIT: the plan starts out interpreted and is JIT-ted partway
+  // through the tests, once it has profiled enough successful decodes.
+  plan = upb_decoderplan_newtiered(h, 10);
+  ASSERT(!upb_decoderplan_hasjitcode(plan));
+  run_tests();
+#ifdef UPB_USE_JIT
+  ASSERT(upb_decoderplan_hasjitcode(plan));
+#else
+  ASSERT(!upb_decoderplan_hasjitcode(plan));
+#endif
+  upb_decoderplan_unref(plan);
+
+  // Test a plan JIT-ted in parallel.  The message type is split into two types
+  // whose submessages are of the other type, which gives the same output but
+  // puts the two in different chunks, so the JIT-ted code calls between
+  // chunks.
+  upb_handlers *h2 = upb_handlers_new();
+  upb_mhandlers *m1 = upb_handlers_newmhandlers(h2);
+  upb_mhandlers *m2 = upb_handlers_newmhandlers(h2);
+  reghandlers(m1, m2);
+  reghandlers(m2, m1);
+  plan = upb_decoderplan_newparallel(h2, 2);
+#ifdef UPB_USE_JIT
   ASSERT(upb_decoderplan_hasjitcode(plan));
 #else
   ASSERT(!upb_decoderplan_hasjitcode(plan));
 #endif
   run_tests();
   upb_decoderplan_unref(plan);
+  upb_handlers_unref(h2);
+
+  test_arraylayout(false);
+  test_arraylayout(true);
+  test_plancache();
+  test_frozen_handlers();
+#ifndef UPB_THREAD_UNSAFE
+  test_tiered_concurrent();
+#endif
 
   plan = NULL;
   printf("All tests passed, %d assertions.\n", num_assertions);
@@ -7,11 +7,16 @@
  * (like attempts to link defs that don't have required properties set).
  */
 
+#include "upb/bytestream.h"
 #include "upb/def.h"
+#include "upb/image.h"
 #include "upb/pb/glue.h"
 #include "upb_test.h"
 #include <stdlib.h>
 #include <string.h>
+#ifndef UPB_THREAD_UNSAFE
+#include <pthread.h>
+#endif
 
 const char *descriptor_file;
 
@@ -45,6 +50,9 @@ static void test_cycles() {
   const upb_def *def = upb_symtab_lookup(s, "A", &def);
   ASSERT(def);
   ASSERT(upb_def_isfinalized(def));
+  const upb_def *def3 = upb_symtab_lookupl(s, "AB", 1, &def3);
+  ASSERT(def3 == def);
+  upb_def_unref(def3, &def3);
   upb_symtab_unref(s, &s);
 
   // Message A has only one subfield: "optional B b = 1".
@@ -124,6 +132,194 @@ INLINE upb_enumdef *upb_enumdef_newnamed(const char *name, void *owner) {
   return e;
 }
 
+static void test_compact_layout() {
+  // Fields are added out of order, with sparse numbers.
+  upb_msgdef *m1 = upb_msgdef_newnamed("M1", &m1);
+  upb_msgdef *m2 = upb_msgdef_newnamed("M2", &m2);
+  int32_t nums[] = {5, 1, 1000, 3, 2};
+  for (int i = 0; i < 6; i++) {
+    upb_fielddef *f = upb_fielddef_new(&f);
+    char name[16];
+    sprintf(name, "f%d", i < 5 ? nums[i] : 1);
+    upb_fielddef_setname(f, name);
+    upb_fielddef_setnumber(f, i < 5 ? nums[i] : 7);
+    upb_fielddef_settype(f, UPB_TYPE(INT32));
+    upb_fielddef_setlabel(f, UPB_LABEL(OPTIONAL));
+    ASSERT(upb_msgdef_addfield(i < 5 ? m1 : m2, f, &f));
+  }
+  ASSERT(upb_msgdef_itof(m1, 1000));
+  upb_def *defs[] = {UPB_UPCAST(m1), UPB_UPCAST(m2)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_finalize(defs, 2, &status), &status);
+  upb_status_uninit(&status);
+
+  // Finalized msgdefs iterate in number order.
+  int32_t last = 0;
+  int n = 0;
+  upb_msg_iter i;
+  for(upb_msg_begin(&i, m1); !upb_msg_done(&i); upb_msg_next(&i), n++) {
+    ASSERT(upb_fielddef_number(upb_msg_iter_field(&i)) > last);
+    last = upb_fielddef_number(upb_msg_iter_field(&i));
+  }
+  ASSERT(n == 5 && upb_msgdef_numfields(m1) == 5);
+  for (int j = 0; j < 5; j++) {
+    upb_fielddef *f = upb_msgdef_itof(m1, nums[j]);
+    ASSERT(f && upb_fielddef_number(f) == nums[j]);
+    ASSERT(upb_msgdef_ntof(m1, upb_fielddef_name(f)) == f);
+  }
+  ASSERT(!upb_msgdef_itof(m1, 0));
+  ASSERT(!upb_msgdef_itof(m1, 4));
+  ASSERT(!upb_msgdef_itof(m1, 999));
+  ASSERT(!upb_msgdef_itof(m1, 1001));
+
+  // Names that are equal within a batch are interned once.
+  ASSERT(upb_fielddef_name(upb_msgdef_itof(m1, 1)) ==
+         upb_fielddef_name(upb_msgdef_itof(m2, 7)));
+  ASSERT(strcmp(upb_def_fullname(UPB_UPCAST(m2)), "M2") == 0);
+
+  upb_msgdef_unref(m1, &m1);
+  upb_msgdef_unref(m2, &m2);
+}
+
+static upb_fielddef *newscalar(upb_msgdef *m, int32_t num, uint8_t type,
+                               uint8_t label) {
+  upb_fielddef *f = upb_fielddef_new(&f);
+  char name[16];
+  sprintf(name, "f%d", num);
+  upb_fielddef_setname(f, name);
+  upb_fielddef_setnumber(f, num);
+  upb_fielddef_settype(f, type);
+  upb_fielddef_setlabel(f, label);
+  ASSERT(upb_msgdef_addfield(m, f, &f));
+  return f;
+}
+
+// Checks that no two fields of the msgdef overlap, that every field is aligned
+// and within the message, and that the hasbits are distinct and dense.
+static void assert_layout_valid(const upb_msgdef *m) {
+  char used[UINT16_MAX] = {0};
+  size_t hasbits = 0;
+  upb_msg_iter i;
+  for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
+    upb_fielddef *f = upb_msg_iter_field(&i);
+    bool isseq = upb_isseq(f);
+    size_t size = isseq ? sizeof(void*) : upb_types[f->type].size;
+    size_t ofs = upb_fielddef_offset(f);
+    ASSERT(ofs >= upb_msgdef_hasbit_bytes(m));
+    ASSERT(ofs + size <= upb_msgdef_size(m));
+    ASSERT(ofs % size == 0);
+    for (size_t j = ofs; j < ofs + size; j++) ASSERT(!used[j]++);
+    if (isseq) {
+      ASSERT(upb_fielddef_hasbit(f) == -1);
+    } else {
+      ASSERT(upb_fielddef_hasbit(f) >= 0);
+      ASSERT(upb_fielddef_hasbit(f) < upb_msgdef_numfields(m));
+      hasbits++;
+    }
+  }
+  ASSERT(upb_msgdef_hasbit_bytes(m) == (hasbits + 7) / 8);
+}
+
+static uint32_t hotfreq(const upb_fielddef *f, void *closure) {
+  (void)closure;
+  int32_t num = upb_fielddef_number(f);
+  return num == 21 ? 1 : num >= 13 ? num : 0;
+}
+
+static void test_msgdef_layout() {
+  upb_msgdef *m = upb_msgdef_newnamed("Layout", &m);
+  newscalar(m, 1, UPB_TYPE(BOOL), UPB_LABEL(OPTIONAL));
+  newscalar(m, 2, UPB_TYPE(INT64), UPB_LABEL(OPTIONAL));
+  newscalar(m, 3, UPB_TYPE(INT32), UPB_LABEL(OPTIONAL));
+  newscalar(m, 4, UPB_TYPE(STRING), UPB_LABEL(OPTIONAL));
+  newscalar(m, 5, UPB_TYPE(INT32), UPB_LABEL(REPEATED));
+  newscalar(m, 6, UPB_TYPE(DOUBLE), UPB_LABEL(OPTIONAL));
+  newscalar(m, 7, UPB_TYPE(BOOL), UPB_LABEL(OPTIONAL));
+  ASSERT(upb_msgdef_layout(m));
+  assert_layout_valid(m);
+  // One byte of hasbits, the two bools, padding to 4 and the int32, then the
+  // 8-byte values: 4 bytes of padding, not the 7 + 3 + 6 of number order.
+  ASSERT(upb_msgdef_hasbit_bytes(m) == 1);
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 1)) == 1);
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 7)) == 2);
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 3)) == 4);
+  if (sizeof(void*) == 8)
+    ASSERT(upb_msgdef_size(m) == 8 + 4 * 8);
+
+  // A field without a type can't be laid out, and the msgdef is unchanged.
+  uint16_t size = upb_msgdef_size(m);
+  upb_fielddef *f = upb_fielddef_new(&f);
+  upb_fielddef_setname(f, "untyped");
+  upb_fielddef_setnumber(f, 8);
+  ASSERT(upb_msgdef_addfield(m, f, &f));
+  upb_def *defs[] = {UPB_UPCAST(m)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT(!upb_layout(defs, 1, NULL, NULL, &status));
+  ASSERT(strstr(upb_status_getstr(&status), "Layout"));
+  ASSERT(strstr(upb_status_getstr(&status), "untyped"));
+  ASSERT(upb_msgdef_size(m) == size);
+  upb_msgdef_unref(m, &m);
+
+  // More than 255 bytes of hasbits are fine, but the offsets only go to 64k.
+  m = upb_msgdef_newnamed("Wide", &m);
+  for (int i = 1; i <= 3000; i++)
+    newscalar(m, i, UPB_TYPE(INT32), UPB_LABEL(OPTIONAL));
+  ASSERT(upb_msgdef_layout(m));
+  assert_layout_valid(m);
+  ASSERT(upb_msgdef_hasbit_bytes(m) == 375);
+  for (int i = 3001; i <= 20000; i++)
+    newscalar(m, i, UPB_TYPE(INT32), UPB_LABEL(OPTIONAL));
+  defs[0] = UPB_UPCAST(m);
+  ASSERT(!upb_layout(defs, 1, NULL, NULL, &status));
+  ASSERT(strstr(upb_status_getstr(&status), "bytes"));
+  ASSERT(upb_msgdef_hasbit_bytes(m) == 375);
+  upb_status_uninit(&status);
+  upb_msgdef_unref(m, &m);
+
+  // With a profile the hottest fields go in the first cache line.  Each of
+  // fields 13..20 is hotter than the last but only seven 8-byte fields fit
+  // after the three bytes of hasbits, so 13 is left out; the bool still fits.
+  m = upb_msgdef_newnamed("Profiled", &m);
+  for (int i = 1; i <= 20; i++)
+    newscalar(m, i, UPB_TYPE(INT64), UPB_LABEL(OPTIONAL));
+  newscalar(m, 21, UPB_TYPE(BOOL), UPB_LABEL(OPTIONAL));
+  ASSERT(upb_msgdef_layoutwith(m, &hotfreq, NULL));
+  assert_layout_valid(m);
+  ASSERT(upb_msgdef_hasbit_bytes(m) == 3);
+  ASSERT(upb_msgdef_size(m) == 8 + 20 * 8);
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 21)) == 3);
+  ASSERT(upb_fielddef_hasbit(upb_msgdef_itof(m, 21)) == 0);
+  for (int i = 14; i <= 20; i++) {
+    const upb_fielddef *hot = upb_msgdef_itof(m, i);
+    ASSERT(upb_fielddef_offset(hot) == 8 + (20 - i) * 8);
+    ASSERT(upb_fielddef_hasbit(hot) == 1 + (20 - i));
+  }
+  // Field 13 is still the first of the cold fields.
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 13)) == UPB_LAYOUT_HOTBYTES);
+  ASSERT(upb_fielddef_offset(upb_msgdef_itof(m, 1)) == UPB_LAYOUT_HOTBYTES + 8);
+  upb_msgdef_unref(m, &m);
+}
+
+// Adding defs must not get stuck walking the cycles among existing defs.
+static void test_add_to_cycles() {
+  upb_symtab *s = load_test_proto(&s);
+  upb_msgdef *m = upb_msgdef_newnamed("G", &s);
+  upb_msgdef_addfield(m, newfield(
+      "c", 1, UPB_TYPE(MESSAGE), UPB_LABEL(OPTIONAL), ".C", &s), &s);
+  upb_def *newdefs[] = {UPB_UPCAST(m)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_symtab_add(s, newdefs, 1, &s, &status), &status);
+
+  const upb_msgdef *g = upb_symtab_lookupmsg(s, "G", &g);
+  const upb_msgdef *c = upb_symtab_lookupmsg(s, "C", &c);
+  ASSERT(g && c);
+  ASSERT(upb_fielddef_subdef(upb_msgdef_itof(g, 1)) == UPB_UPCAST(c));
+  upb_msgdef_unref(g, &g);
+  upb_msgdef_unref(c, &c);
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+}
+
 void test_replacement() {
   upb_symtab *s = upb_symtab_new(&s);
 
@@ -159,6 +355,599 @@ void test_replacement() {
   upb_symtab_unref(s, &s);
 }
 
+// Finalizes more than 64k defs at once, all in a single cycle, so the SCC
+// search has to go that deep.
+static void test_large_finalize() {
+  const int n = 70000;
+  upb_def **defs = malloc(sizeof(*defs) * n);
+  for (int i = 0; i < n; i++)
+    defs[i] = UPB_UPCAST(upb_msgdef_new(&defs));
+  for (int i = 0; i < n; i++) {
+    upb_fielddef *f = upb_fielddef_new(&f);
+    upb_fielddef_setname(f, "next");
+    upb_fielddef_setnumber(f, 1);
+    upb_fielddef_settype(f, UPB_TYPE(MESSAGE));
+    upb_fielddef_setlabel(f, UPB_LABEL(OPTIONAL));
+    ASSERT(upb_fielddef_setsubdef(f, defs[(i + 1) % n]));
+    ASSERT(upb_msgdef_addfield(upb_downcast_msgdef(defs[i]), f, &f));
+  }
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_finalize(defs, n, &status), &status);
+  ASSERT(upb_refcount_merged(&defs[0]->refcount, &defs[n - 1]->refcount));
+  for (int i = 0; i < n; i++) upb_def_unref(defs[i], &defs);
+  upb_status_uninit(&status);
+  free(defs);
+}
+
+// Adds defs one at a time, each referring to defs that are already in the
+// symtab, then replaces the def at the bottom of the chain.
+static void test_incremental_add() {
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_status status = UPB_STATUS_INIT;
+
+  upb_enumdef *e = upb_enumdef_newnamed("MyEnum", &s);
+  upb_def *defs1[] = {UPB_UPCAST(e)};
+  ASSERT_STATUS(upb_symtab_add(s, defs1, 1, &s, &status), &status);
+
+  upb_msgdef *m1 = upb_msgdef_newnamed("M1", &s);
+  upb_msgdef_addfield(m1, newfield(
+      "e", 1, UPB_TYPE(ENUM), UPB_LABEL(OPTIONAL), ".MyEnum", &s), &s);
+  upb_def *defs2[] = {UPB_UPCAST(m1)};
+  ASSERT_STATUS(upb_symtab_add(s, defs2, 1, &s, &status), &status);
+
+  upb_msgdef *m2 = upb_msgdef_newnamed("M2", &s);
+  upb_msgdef_addfield(m2, newfield(
+      "m1", 1, UPB_TYPE(MESSAGE), UPB_LABEL(OPTIONAL), ".M1", &s), &s);
+  upb_msgdef *unrelated = upb_msgdef_newnamed("Unrelated", &s);
+  upb_def *defs3[] = {UPB_UPCAST(m2), UPB_UPCAST(unrelated)};
+  ASSERT_STATUS(upb_symtab_add(s, defs3, 2, &s, &status), &status);
+  ASSERT(upb_fielddef_subdef(upb_msgdef_itof(m2, 1)) == UPB_UPCAST(m1));
+
+  // Replacing MyEnum must replace M1 (which refers to it) and M2 (which
+  // refers to M1), but not Unrelated.
+  upb_enumdef *e2 = upb_enumdef_newnamed("MyEnum", &s);
+  upb_def *defs4[] = {UPB_UPCAST(e2)};
+  ASSERT_STATUS(upb_symtab_add(s, defs4, 1, &s, &status), &status);
+
+  const upb_msgdef *newm1 = upb_symtab_lookupmsg(s, "M1", &newm1);
+  const upb_msgdef *newm2 = upb_symtab_lookupmsg(s, "M2", &newm2);
+  const upb_msgdef *newu = upb_symtab_lookupmsg(s, "Unrelated", &newu);
+  ASSERT(newm1 != m1);
+  ASSERT(newm2 != m2);
+  ASSERT(newu == unrelated);
+  ASSERT(upb_fielddef_subdef(upb_msgdef_itof(newm1, 1)) == UPB_UPCAST(e2));
+  ASSERT(upb_fielddef_subdef(upb_msgdef_itof(newm2, 1)) == UPB_UPCAST(newm1));
+  upb_msgdef_unref(newm1, &newm1);
+  upb_msgdef_unref(newm2, &newm2);
+  upb_msgdef_unref(newu, &newu);
+
+  // Enough adds to fold the recent additions into a new base table a few
+  // times; every def must stay visible exactly once.
+  for (int i = 0; i < 200; i++) {
+    char name[16];
+    sprintf(name, "E%d", i);
+    upb_enumdef *e = upb_enumdef_newnamed(name, &s);
+    upb_def *defs[] = {UPB_UPCAST(e)};
+    ASSERT_STATUS(upb_symtab_add(s, defs, 1, &s, &status), &status);
+  }
+  int count;
+  const upb_def **all = upb_symtab_getdefs(s, &count, UPB_DEF_ANY, NULL);
+  ASSERT(count == 204);
+  free(all);
+  for (int i = 0; i < 200; i++) {
+    char name[16];
+    sprintf(name, "E%d", i);
+    const upb_def *def = upb_symtab_lookup(s, name, &def);
+    ASSERT(def && strcmp(upb_def_fullname(def), name) == 0);
+    upb_def_unref(def, &def);
+  }
+
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+}
+
+static void test_immortal() {
+  upb_symtab *s = load_test_proto(&s);
+  const upb_msgdef *m = upb_symtab_lookupmsg(s, "A", &m);
+  ASSERT(!upb_def_isimmortal(UPB_UPCAST(m)));
+  upb_symtab_makeimmortal(s);
+  ASSERT(upb_def_isimmortal(UPB_UPCAST(m)));
+  // Fielddefs share their msgdef's refcount.
+  ASSERT(upb_def_isimmortal(UPB_UPCAST(upb_msgdef_itof(m, 1))));
+  // Releasing refs, whether they were taken before or after makeimmortal(),
+  // never frees anything.
+  upb_msgdef_unref(m, &m);
+  const upb_msgdef *m2 = upb_symtab_lookupmsg(s, "A", &m2);
+  ASSERT(m2 == m);
+  upb_msgdef_unref(m2, &m2);
+
+  // Defs added afterwards are immortal too.
+  upb_enumdef *e = upb_enumdef_newnamed("MyEnum", &s);
+  upb_def *newdefs[] = {UPB_UPCAST(e)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_symtab_add(s, newdefs, 1, &s, &status), &status);
+  const upb_def *def = upb_symtab_lookup(s, "MyEnum", &def);
+  ASSERT(def == UPB_UPCAST(e));
+  ASSERT(upb_def_isimmortal(def));
+  upb_def_unref(def, &def);
+  upb_status_uninit(&status);
+
+  upb_symtab_unref(s, &s);
+  ASSERT(strcmp(upb_def_fullname(UPB_UPCAST(m)), "A") == 0);
+  upb_def_freeimmortals();
+}
+
+static void assert_fields_equal(const upb_fielddef *f, const upb_fielddef *f2) {
+  ASSERT(strcmp(upb_fielddef_name(f), upb_fielddef_name(f2)) == 0);
+  ASSERT(upb_fielddef_type(f) == upb_fielddef_type(f2));
+  ASSERT(upb_fielddef_label(f) == upb_fielddef_label(f2));
+  ASSERT(upb_fielddef_hasbit(f) == upb_fielddef_hasbit(f2));
+  ASSERT(upb_fielddef_offset(f) == upb_fielddef_offset(f2));
+  if (upb_hassubdef(f)) {
+    ASSERT(strcmp(upb_def_fullname(upb_fielddef_subdef(f)),
+                  upb_def_fullname(upb_fielddef_subdef(f2))) == 0);
+  }
+  if (upb_isstring(f)) {
+    upb_byteregion *r = upb_value_getbyteregion(upb_fielddef_default(f));
+    upb_byteregion *r2 = upb_value_getbyteregion(upb_fielddef_default(f2));
+    size_t len, len2;
+    const char *p = upb_byteregion_getptr(r, upb_byteregion_startofs(r), &len);
+    const char *p2 =
+        upb_byteregion_getptr(r2, upb_byteregion_startofs(r2), &len2);
+    ASSERT(len == len2 && memcmp(p, p2, len) == 0);
+  } else if (!upb_issubmsg(f)) {
+    ASSERT(upb_fielddef_default(f).val.uint64 ==
+           upb_fielddef_default(f2).val.uint64);
+  }
+}
+
+// Writes the test proto (plus some defaults and an enum, which it lacks) to an
+// image, loads it into another symtab and checks that the two match.
+static void test_image() {
+  upb_symtab *s = load_test_proto(&s);
+  upb_status status = UPB_STATUS_INIT;
+  upb_enumdef *e = upb_enumdef_newnamed("ImageEnum", &s);
+  upb_enumdef_addval(e, "FOO", 1);
+  upb_enumdef_addval(e, "BAR", 2);
+  upb_enumdef_setdefault(e, 2);
+  upb_msgdef *m = upb_msgdef_newnamed("ImageMessage", &s);
+  upb_msgdef_setsize(m, 24);
+  upb_msgdef_sethasbit_bytes(m, 1);
+  upb_fielddef *f = newfield(
+      "e", 1, UPB_TYPE(ENUM), UPB_LABEL(OPTIONAL), ".ImageEnum", &s);
+  upb_fielddef_setdefaultcstr(f, "FOO");
+  upb_fielddef_sethasbit(f, 0);
+  upb_fielddef_setoffset(f, 4);
+  upb_msgdef_addfield(m, f, &s);
+  f = upb_fielddef_new(&s);
+  upb_fielddef_setname(f, "s");
+  upb_fielddef_setnumber(f, 2);
+  upb_fielddef_settype(f, UPB_TYPE(STRING));
+  upb_fielddef_setdefaultcstr(f, "default");
+  upb_msgdef_addfield(m, f, &s);
+  f = upb_fielddef_new(&s);
+  upb_fielddef_setname(f, "i");
+  upb_fielddef_setnumber(f, 3);
+  upb_fielddef_settype(f, UPB_TYPE(SINT64));
+  upb_fielddef_setlabel(f, UPB_LABEL(REQUIRED));
+  upb_fielddef_setdefault(f, upb_value_int64(-1234567890123LL));
+  upb_msgdef_addfield(m, f, &s);
+  f = newfield("a", 4, UPB_TYPE(MESSAGE), UPB_LABEL(REPEATED), ".A", &s);
+  upb_msgdef_addfield(m, f, &s);
+  upb_def *newdefs[] = {UPB_UPCAST(e), UPB_UPCAST(m)};
+  ASSERT_STATUS(upb_symtab_add(s, newdefs, 2, &s, &status), &status);
+
+  int n;
+  const upb_def **defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, &defs);
+  size_t len;
+  char *image = upb_image_write(defs, n, &len, &status);
+  ASSERT_STATUS(image, &status);
+  // Loading relocates the image, so keep a copy for the tests below.
+  char *orig = malloc(len);
+  memcpy(orig, image, len);
+
+  upb_symtab *s2 = upb_symtab_new(&s2);
+  ASSERT_STATUS(upb_image_load(s2, image, len, &status), &status);
+  int n2;
+  const upb_def **defs2 = upb_symtab_getdefs(s2, &n2, UPB_DEF_ANY, &defs2);
+  ASSERT(n2 == n);
+  for (int i = 0; i < n; i++) {
+    const upb_def *def = defs[i];
+    const upb_def *def2 = upb_symtab_lookup(s2, upb_def_fullname(def), &def2);
+    ASSERT(def2 && def2->type == def->type);
+    // The defs are the image itself.
+    ASSERT((const char*)def2 >= image && (const char*)def2 < image + len);
+    ASSERT(upb_def_isfinalized(def2) && upb_def_isimmortal(def2));
+    const upb_msgdef *m = upb_dyncast_msgdef_const(def);
+    const upb_enumdef *e = upb_dyncast_enumdef_const(def);
+    if (m) {
+      const upb_msgdef *m2 = upb_downcast_msgdef_const(def2);
+      ASSERT(upb_msgdef_numfields(m2) == upb_msgdef_numfields(m));
+      ASSERT(upb_msgdef_size(m2) == upb_msgdef_size(m));
+      ASSERT(upb_msgdef_hasbit_bytes(m2) == upb_msgdef_hasbit_bytes(m));
+      upb_msg_iter j;
+      for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
+        upb_fielddef *f = upb_msg_iter_field(&j);
+        upb_fielddef *f2 = upb_msgdef_itof(m2, upb_fielddef_number(f));
+        ASSERT(f2);
+        ASSERT(upb_msgdef_ntof(m2, upb_fielddef_name(f)) == f2);
+        assert_fields_equal(f, f2);
+      }
+    } else {
+      const upb_enumdef *e2 = upb_downcast_enumdef_const(def2);
+      ASSERT(upb_enumdef_numvals(e2) == upb_enumdef_numvals(e));
+      ASSERT(upb_enumdef_default(e2) == upb_enumdef_default(e));
+      upb_enum_iter j;
+      for(upb_enum_begin(&j, e); !upb_enum_done(&j); upb_enum_next(&j)) {
+        int32_t num;
+        ASSERT(upb_enumdef_ntoi(e2, upb_enum_iter_name(&j), &num));
+        ASSERT(num == upb_enum_iter_number(&j));
+        ASSERT(strcmp(upb_enumdef_iton(e2, num), upb_enum_iter_name(&j)) == 0);
+      }
+    }
+    upb_def_unref(def2, &def2);
+  }
+  const upb_msgdef *m2 = upb_symtab_lookupmsg(s2, "ImageMessage", &m2);
+  ASSERT(upb_value_getint32(upb_fielddef_default(upb_msgdef_itof(m2, 1))) == 1);
+  upb_msgdef_unref(m2, &m2);
+
+  // Getting the defs again doesn't relocate them twice.
+  int n3;
+  const upb_def *const*defs3 = upb_image_getdefs(image, len, &n3, &status);
+  ASSERT_STATUS(defs3, &status);
+  ASSERT(n3 == n);
+  for (int i = 0; i < n; i++) {
+    ASSERT(upb_symtab_lookup(s2, upb_def_fullname(defs3[i]), &defs3) ==
+           defs3[i]);
+    upb_def_unref(defs3[i], &defs3);
+  }
+
+  // A second copy of the defs conflicts with the first.
+  ASSERT(!upb_image_load(s2, orig, len, &status));
+
+  // A copy of a loaded image is relocated to its own address.
+  memcpy(orig, image, len);
+  char *copy = malloc(len);
+  memcpy(copy, image, len);
+  const upb_def *const*copydefs = upb_image_getdefs(copy, len, &n3, &status);
+  ASSERT_STATUS(copydefs, &status);
+  for (int i = 0; i < n3; i++) {
+    ASSERT((char*)copydefs[i] >= copy && (char*)copydefs[i] < copy + len);
+    const upb_msgdef *m = upb_dyncast_msgdef_const(copydefs[i]);
+    if (!m) continue;
+    const upb_msgdef *m2 =
+        upb_symtab_lookupmsg(s2, upb_def_fullname(copydefs[i]), &m2);
+    upb_msg_iter j;
+    for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
+      upb_fielddef *f = upb_msg_iter_field(&j);
+      ASSERT(upb_fielddef_msgdef(f) == m);
+      ASSERT(!upb_hassubdef(f) || (char*)upb_fielddef_subdef(f) >= copy);
+      assert_fields_equal(f, upb_msgdef_itof(m2, upb_fielddef_number(f)));
+    }
+    upb_msgdef_unref(m2, &m2);
+  }
+  free(copy);
+
+  // Damaged images must be rejected without changing them.
+  ASSERT(!upb_image_load(s2, orig, len - 1, &status));
+  ASSERT(!upb_image_load(s2, orig + 1, len - 1, &status));
+  ASSERT(memcmp(orig, image, len) == 0);
+  upb_image_header *h = (upb_image_header*)orig;
+  h->abi++;
+  ASSERT(!upb_image_load(s2, orig, len, &status));
+  h->abi--;
+  uint32_t *relocs = (uint32_t*)(orig + h->relocs_ofs);
+  uintptr_t ptr;
+  memcpy(&ptr, orig + relocs[0], sizeof(ptr));
+  uintptr_t bad = h->base + len;
+  memcpy(orig + relocs[0], &bad, sizeof(bad));
+  ASSERT(!upb_image_load(s2, orig, len, &status));
+  memcpy(orig + relocs[0], &ptr, sizeof(ptr));
+  relocs[0] = len;
+  ASSERT(!upb_image_load(s2, orig, len, &status));
+  memcpy(h->magic, "notimage", 8);
+  ASSERT(!upb_image_load(s2, orig, len, &status));
+
+  for (int i = 0; i < n; i++) upb_def_unref(defs[i], &defs);
+  for (int i = 0; i < n2; i++) upb_def_unref(defs2[i], &defs2);
+  free(defs);
+  free(defs2);
+  free(orig);
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+  upb_symtab_unref(s2, &s2);
+  free(image);
+}
+
+// Loads the test proto lazily: no defs are built until they are looked up.
+static void test_lazy() {
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(
+      upb_load_descriptor_file_into_symtab_lazy(s, descriptor_file, &status),
+      &status);
+  int n;
+  const upb_def **defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, NULL);
+  ASSERT(n == 0);
+  free(defs);
+
+  // A can reach B, C, D and E, but not F.
+  const upb_msgdef *m = upb_symtab_lookupmsg(s, "A", &m);
+  ASSERT(m);
+  ASSERT(upb_def_isfinalized(UPB_UPCAST(m)));
+  defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, NULL);
+  ASSERT(n == 5);
+  free(defs);
+  const upb_msgdef *m2 = upb_symtab_lookupmsg(s, "B", &m2);
+  ASSERT(UPB_UPCAST(m2) == upb_fielddef_subdef(upb_msgdef_itof(m, 1)));
+  upb_msgdef_unref(m2, &m2);
+  upb_msgdef_unref(m, &m);
+  ASSERT(!upb_symtab_lookup(s, "NoSuchDef", &m));
+  const upb_def *def = upb_symtab_resolve(s, "", ".F", &def);
+  ASSERT(def);
+  upb_def_unref(def, &def);
+  defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, NULL);
+  ASSERT(n == 6);
+  free(defs);
+  upb_symtab_unref(s, &s);
+
+  // descriptor.proto also has a package, nested defs and enum defaults.
+  const char *fname = "upb/descriptor.pb";
+  upb_symtab *eager = upb_symtab_new(&eager);
+  ASSERT_STATUS(
+      upb_load_descriptor_file_into_symtab(eager, fname, &status), &status);
+  s = upb_symtab_new(&s);
+  ASSERT_STATUS(
+      upb_load_descriptor_file_into_symtab_lazy(s, fname, &status), &status);
+  defs = upb_symtab_getdefs(eager, &n, UPB_DEF_ANY, &defs);
+  for (int i = 0; i < n; i++) {
+    const upb_def *def2 = upb_symtab_lookup(s, upb_def_fullname(defs[i]), &def2);
+    ASSERT(def2);
+    ASSERT(def2->type == defs[i]->type);
+    const upb_msgdef *m = upb_dyncast_msgdef_const(defs[i]);
+    const upb_msgdef *m2 = upb_dyncast_msgdef_const(def2);
+    if (m) {
+      ASSERT(upb_msgdef_numfields(m) == upb_msgdef_numfields(m2));
+      upb_msg_iter j;
+      for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
+        upb_fielddef *f = upb_msg_iter_field(&j);
+        upb_fielddef *f2 = upb_msgdef_itof(m2, upb_fielddef_number(f));
+        ASSERT(f2);
+        assert_fields_equal(f, f2);
+      }
+    } else {
+      const upb_enumdef *e = upb_downcast_enumdef_const(defs[i]);
+      const upb_enumdef *e2 = upb_downcast_enumdef_const(def2);
+      ASSERT(upb_enumdef_numvals(e) == upb_enumdef_numvals(e2));
+      ASSERT(upb_enumdef_default(e) == upb_enumdef_default(e2));
+    }
+    upb_def_unref(def2, &def2);
+    upb_def_unref(defs[i], &defs);
+  }
+  free(defs);
+  int n2;
+  defs = upb_symtab_getdefs(s, &n2, UPB_DEF_ANY, NULL);
+  ASSERT(n2 == n);
+  free(defs);
+  upb_symtab_unref(eager, &eager);
+
+  // A truncated descriptor can't be indexed.
+  size_t len;
+  char *data = upb_readfile(fname, &len);
+  ASSERT(data);
+  ASSERT(!upb_load_descriptor_into_symtab_lazy(s, data, len - 1, &status));
+  free(data);
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+}
+
+// Loads the test proto in a batch with a file that refers to it, and that
+// comes first so the files must be resolved together.
+static void test_batch_load() {
+  // The FileDescriptorSet holds a single FileDescriptorProto, as field 1.
+  size_t len;
+  char *set = upb_readfile(descriptor_file, &len);
+  ASSERT(set && len > 3 && set[0] == 0x0a);
+  const char *file = set + 1;
+  size_t file_len = 0;
+  int shift = 0;
+  do {
+    file_len |= (size_t)(*file & 0x7f) << shift;
+    shift += 7;
+  } while (*file++ & 0x80);
+  ASSERT(file + file_len == set + len);
+
+  // message Z { optional A a = 1; }
+  static const char z[] =
+      "\x22\x12"                  // message_type, 18 bytes
+        "\x0a\x01Z"               //   name
+        "\x12\x0d"                //   field, 13 bytes
+          "\x0a\x01" "a"          //     name
+          "\x18\x01\x20\x01\x28\x0b"  //     number, label, type
+          "\x32\x02.A";           //     type_name
+  const char *descs[] = {z, file};
+  size_t lens[] = {sizeof(z) - 1, file_len};
+
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_load_descriptors_into_symtab(s, descs, lens, 2, 4, &status),
+                &status);
+  const upb_msgdef *m = upb_symtab_lookupmsg(s, "Z", &m);
+  ASSERT(m);
+  const upb_def *a = upb_symtab_lookup(s, "A", &a);
+  ASSERT(a && upb_fielddef_subdef(upb_msgdef_itof(m, 1)) == a);
+  upb_def_unref(a, &a);
+  upb_msgdef_unref(m, &m);
+  int n, n2;
+  const upb_def **defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, NULL);
+  free(defs);
+  upb_symtab_unref(s, &s);
+  s = load_test_proto(&s);
+  defs = upb_symtab_getdefs(s, &n2, UPB_DEF_ANY, NULL);
+  free(defs);
+  ASSERT(n == n2 + 1);
+
+  // Without the test proto, Z can't be resolved and nothing is added.
+  upb_symtab_unref(s, &s);
+  s = upb_symtab_new(&s);
+  ASSERT(!upb_load_descriptors_into_symtab(s, descs, lens, 1, 4, &status));
+  // Nor if any of the files is malformed.
+  lens[1]--;
+  ASSERT(!upb_load_descriptors_into_symtab(s, descs, lens, 2, 4, &status));
+  defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, NULL);
+  free(defs);
+  ASSERT(n == 0);
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+  free(set);
+}
+
+static char *putvarint(char *p, uint32_t val) {
+  do {
+    *p++ = (val & 0x7f) | (val > 0x7f ? 0x80 : 0);
+    val >>= 7;
+  } while (val);
+  return p;
+}
+
+// A message that can't be laid out is still loaded, just without a layout.
+static void test_load_without_layout() {
+  // message Huge { optional int64 f1 = 1; ... optional int64 f9000 = 9000; }
+  const int fields = 9000;
+  char *msg = malloc(fields * 16 + 16);
+  char *p = msg;
+  *p++ = 0x0a;
+  *p++ = 4;
+  memcpy(p, "Huge", 4);
+  p += 4;
+  for (int i = 1; i <= fields; i++) {
+    char name[16];
+    int namelen = sprintf(name, "f%d", i);
+    char *num = name + namelen + 1;
+    int fieldlen = 2 + namelen + 1 + (putvarint(num, i) - num) + 4;
+    *p++ = 0x12;
+    p = putvarint(p, fieldlen);
+    *p++ = 0x0a;
+    *p++ = namelen;
+    memcpy(p, name, namelen);
+    p += namelen;
+    *p++ = 0x18;
+    p = putvarint(p, i);
+    memcpy(p, "\x20\x01\x28\x03", 4);  // label, type
+    p += 4;
+  }
+  size_t msglen = p - msg;
+
+  // FileDescriptorSet { file { message_type { Huge } } }
+  char *set = malloc(msglen + 16);
+  char lens[16];
+  char *end = putvarint(lens, msglen);
+  p = set;
+  *p++ = 0x0a;
+  p = putvarint(p, 1 + (end - lens) + msglen);
+  *p++ = 0x22;
+  p = putvarint(p, msglen);
+  memcpy(p, msg, msglen);
+  size_t len = p + msglen - set;
+  free(msg);
+
+  upb_status status = UPB_STATUS_INIT;
+  for (int lazy = 0; lazy <= 1; lazy++) {
+    upb_symtab *s = upb_symtab_new(&s);
+    if (lazy) {
+      ASSERT_STATUS(upb_load_descriptor_into_symtab_lazy(s, set, len, &status),
+                    &status);
+    } else {
+      ASSERT_STATUS(upb_load_descriptor_into_symtab(s, set, len, &status),
+                    &status);
+    }
+    const upb_msgdef *m = upb_symtab_lookupmsg(s, "Huge", &m);
+    ASSERT(m);
+    ASSERT(upb_msgdef_numfields(m) == fields);
+    ASSERT(upb_msgdef_size(m) == 0);
+    upb_msgdef_unref(m, &m);
+    upb_symtab_unref(s, &s);
+  }
+  upb_status_uninit(&status);
+  free(set);
+}
+
+#ifndef UPB_THREAD_UNSAFE
+static uint32_t stop_readers;
+
+// ASSERT() is not threadsafe, so readers only count what they see and the main
+// thread checks the counts.
+typedef struct {
+  const upb_symtab *s;
+  long lookups;
+  long failures;
+} concurrent_reader_state;
+
+static void *concurrent_reader(void *_state) {
+  concurrent_reader_state *state = _state;
+  while (!upb_atomic_read(&stop_readers)) {
+    const upb_msgdef *m = upb_symtab_lookupmsg(state->s, "MyMessage", &m);
+    state->lookups++;
+    if (!m) {
+      state->failures++;
+      continue;
+    }
+    upb_fielddef *f = upb_msgdef_itof(m, 1);
+    const upb_def *e = f ? upb_fielddef_subdef(f) : NULL;
+    if (strcmp(upb_def_fullname(UPB_UPCAST(m)), "MyMessage") != 0 ||
+        !e || strcmp(upb_def_fullname(e), "MyEnum") != 0)
+      state->failures++;
+    upb_msgdef_unref(m, &m);
+  }
+  return NULL;
+}
+
+// Replaces defs over and over while other threads are looking them up; every
+// lookup must see a complete, consistent set of defs.
+static void test_concurrent_replacement() {
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_msgdef *m = upb_msgdef_newnamed("MyMessage", &s);
+  upb_msgdef_addfield(m, newfield(
+      "field1", 1, UPB_TYPE(ENUM), UPB_LABEL(OPTIONAL), ".MyEnum", &s), &s);
+  upb_enumdef *e = upb_enumdef_newnamed("MyEnum", &s);
+  upb_def *newdefs[] = {UPB_UPCAST(m), UPB_UPCAST(e)};
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(upb_symtab_add(s, newdefs, 2, &s, &status), &status);
+
+  pthread_t threads[4];
+  concurrent_reader_state states[4];
+  upb_atomic_write(&stop_readers, false);
+  for (int i = 0; i < 4; i++) {
+    states[i].s = s;
+    states[i].lookups = 0;
+    states[i].failures = 0;
+    ASSERT(pthread_create(&threads[i], NULL, concurrent_reader,
+                          &states[i]) == 0);
+  }
+
+  const upb_msgdef *prev = upb_symtab_lookupmsg(s, "MyMessage", &prev);
+  for (int i = 0; i < 200; i++) {
+    upb_enumdef *e2 = upb_enumdef_newnamed("MyEnum", &s);
+    upb_def *newdefs2[] = {UPB_UPCAST(e2)};
+    ASSERT_STATUS(upb_symtab_add(s, newdefs2, 1, &s, &status), &status);
+  }
+  // The replaced MyMessage stays alive as long as we hold a ref to it.
+  ASSERT(strcmp(upb_def_fullname(UPB_UPCAST(prev)), "MyMessage") == 0);
+  const upb_msgdef *cur = upb_symtab_lookupmsg(s, "MyMessage", &cur);
+  ASSERT(cur != prev);
+  upb_msgdef_unref(cur, &cur);
+  upb_msgdef_unref(prev, &prev);
+
+  upb_atomic_write(&stop_readers, true);
+  for (int i = 0; i < 4; i++) {
+    ASSERT(pthread_join(threads[i], NULL) == 0);
+    ASSERT(states[i].failures == 0);
+  }
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+}
+#endif
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     fprintf(stderr, "Usage: test_def <test.proto.pb>\n");
@@ -167,8 +956,21 @@ int main(int argc, char *argv[]) {
   descriptor_file = argv[1];
   test_empty_symtab();
   test_cycles();
+  test_add_to_cycles();
   test_fielddef_accessors();
   test_fielddef_unref();
   test_replacement();
+  test_compact_layout();
+  test_msgdef_layout();
+  test_large_finalize();
+  test_incremental_add();
+  test_immortal();
+  test_image();
+  test_lazy();
+  test_batch_load();
+  test_load_without_layout();
+#ifndef UPB_THREAD_UNSAFE
+  test_concurrent_replacement();
+#endif
   return 0;
 }
@@ -29,6 +29,25 @@ double get_usertime() {
   return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec/1000000.0);
 }
 
+void check_strtable(const upb_strtable *table,
+                    const vector<std::string>& keys,
+                    std::map<std::string, int32_t>& m) {
+  for(uint32_t i = 0; i < keys.size(); i++) {
+    const std::string& key = keys[i];
+    const upb_value *v = upb_strtable_lookup(table, key.c_str());
+    /* The same lookup by length, from the middle of a larger buffer. */
+    std::string padded = "." + key + ".";
+    ASSERT(upb_strtable_lookupl(table, padded.data() + 1, key.size()) == v);
+    if(m.find(key) != m.end()) { /* Assume map implementation is correct. */
+      ASSERT(v);
+      ASSERT(upb_value_getint32(*v) == key[0]);
+      ASSERT(m[key] == key[0]);
+    } else {
+      ASSERT(v == NULL);
+    }
+  }
+}
+
 /* num_entries must be a power of 2. */
 void test_strtable(const vector<std::string>& keys, uint32_t num_to_insert) {
   /* Initialize structures. */
@@ -43,18 +62,11 @@ void test_strtable(const vector<std::string>& keys, uint32_t num_to_insert) {
     m[key] = key[0];
   }
 
-  /* Test correctness. */
-  for(uint32_t i = 0; i < keys.size(); i++) {
-    const std::string& key = keys[i];
-    const upb_value *v = upb_strtable_lookup(&table, key.c_str());
-    if(m.find(key) != m.end()) { /* Assume map implementation is correct. */
-      ASSERT(v);
-      ASSERT(upb_value_getint32(*v) == key[0]);
-      ASSERT(m[key] == key[0]);
-    } else {
-      ASSERT(v == NULL);
-    }
-  }
+  /* Test correctness, both before and after building the perfect hash. */
+  check_strtable(&table, keys, m);
+  ASSERT(upb_strtable_optimize(&table));
+  ASSERT(table.perfect);
+  check_strtable(&table, keys, m);
 
   upb_strtable_iter iter;
   for(upb_strtable_begin(&iter, &table); !upb_strtable_done(&iter);
@@ -67,6 +79,13 @@ void test_strtable(const vector<std::string>& keys, uint32_t num_to_insert) {
   }
   ASSERT(all.empty());
 
+  /* Inserting drops the perfect hash but keeps every key reachable. */
+  upb_strtable_insert(&table, "not.a.key", upb_value_int32('n'));
+  m["not.a.key"] = 'n';
+  ASSERT(table.perfect == NULL);
+  check_strtable(&table, keys, m);
+  ASSERT(upb_strtable_lookup(&table, "not.a.key"));
+
   upb_strtable_uninit(&table);
 }
 
@@ -137,6 +156,26 @@ void test_inttable(int32_t *keys, uint16_t num_entries, const char *desc) {
     }
   }
 
+  // Build a compact 32-bit copy (whose values must be pointers) and test it.
+  upb_inttable ptrtable;
+  upb_inttable_init(&ptrtable);
+  std::map<uint32_t, uint32_t>::iterator it;
+  for(it = m.begin(); it != m.end(); ++it)
+    upb_inttable_insert(&ptrtable, it->first, upb_value_ptr(&it->second));
+  upb_inttable32 table32;
+  ASSERT(upb_inttable32_init(&table32, &ptrtable));
+  ASSERT(table32.fallback == NULL);
+  for(uint32_t i = 0; i <= largest_key + 1; i++) {
+    const void *p = upb_inttable32_lookup(&table32, i);
+    if(m.find(i) != m.end()) {
+      ASSERT(p == &m[i]);
+    } else {
+      ASSERT(p == NULL);
+    }
+  }
+  upb_inttable32_uninit(&table32);
+  upb_inttable_uninit(&ptrtable);
+
   if(!benchmark) {
     upb_inttable_uninit(&table);
     return;
@@ -244,6 +283,196 @@ int32_t *get_contiguous_keys(int32_t num) {
   return buf;
 }
 
+// Interleaves inserts and removes of a few colliding keys in the hash part, so
+// that slots are emptied and reused while other chains still run through them.
+void test_inttable_churn() {
+  for (uint32_t seed = 1; seed <= 100; seed++) {
+    upb_inttable table;
+    upb_inttable_init(&table);
+    std::map<uintptr_t, uint32_t> m;
+    uint32_t x = seed;
+    for (uint32_t i = 0; i < 2000; i++) {
+      x = x * 1103515245 + 12345;
+      uintptr_t key = 0x10000 + ((x >> 16) % 16) * 8;
+      if (m.find(key) != m.end()) {
+        upb_value val;
+        ASSERT(upb_inttable_remove(&table, key, &val));
+        ASSERT(upb_value_getuint32(val) == m[key]);
+        m.erase(key);
+      } else {
+        upb_inttable_insert(&table, key, upb_value_uint32(i));
+        m[key] = i;
+      }
+    }
+    ASSERT(upb_inttable_count(&table) == m.size());
+    for (std::map<uintptr_t, uint32_t>::iterator it = m.begin(); it != m.end();
+         ++it) {
+      const upb_value *v = upb_inttable_lookup(&table, it->first);
+      ASSERT(v);
+      ASSERT(upb_value_getuint32(*v) == it->second);
+    }
+    upb_inttable_uninit(&table);
+  }
+}
+
+// Finds two keys whose hashes are equal and checks that the perfect hash can
+// still be built over them (and that building it doesn't take forever).
+void test_strtable_hashcollision(vector<std::string> keys) {
+  upb_strtable table;
+  upb_strtable_init(&table);
+  for(int i = 0; i < 300000; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "pkg.Message%d.field_%d", i / 7, i);
+    upb_strtable_insert(&table, buf, upb_value_int32(0));
+  }
+  std::map<uint32_t, std::string> byhash;
+  upb_strtable_iter iter;
+  for(upb_strtable_begin(&iter, &table); !upb_strtable_done(&iter);
+      upb_strtable_next(&iter)) {
+    const char *key = upb_strtable_iter_key(&iter);
+    std::map<uint32_t, std::string>::iterator it = byhash.find(iter.e->hash);
+    if (it != byhash.end()) {
+      keys.push_back(it->second);
+      keys.push_back(key);
+      break;
+    }
+    byhash[iter.e->hash] = key;
+  }
+  upb_strtable_uninit(&table);
+  ASSERT(!upb_strtable_done(&iter));
+  test_strtable(keys, keys.size());
+}
+
+// Checks "table" against "m" for every key in "keys", that iteration visits
+// each key of "m" exactly once, and that the control bytes hold no tombstones:
+// each is either empty (0x80) or the low 7 bits of its entry's hash.
+void check_strtable_probing(const upb_strtable *table,
+                            const vector<std::string>& keys,
+                            const std::map<std::string, int32_t>& m) {
+  ASSERT(upb_strtable_count(table) == m.size());
+  for(size_t i = 0; i < keys.size(); i++) {
+    const upb_value *v = upb_strtable_lookup(table, keys[i].c_str());
+    std::map<std::string, int32_t>::const_iterator it = m.find(keys[i]);
+    if (it == m.end()) {
+      ASSERT(v == NULL);
+    } else {
+      ASSERT(v);
+      ASSERT(upb_value_getint32(*v) == it->second);
+    }
+  }
+
+  std::set<std::string> seen;
+  upb_strtable_iter iter;
+  for(upb_strtable_begin(&iter, table); !upb_strtable_done(&iter);
+      upb_strtable_next(&iter)) {
+    std::string key(upb_strtable_iter_key(&iter),
+                    upb_strtable_iter_keylength(&iter));
+    ASSERT(m.find(key) != m.end());
+    ASSERT(seen.insert(key).second);
+  }
+  ASSERT(seen.size() == m.size());
+
+  for(size_t i = 0; i <= table->mask; i++) {
+    const upb_strent *e = &table->entries[i];
+    ASSERT(table->ctrl[i] == (e->key ? (e->hash & 0x7f) : 0x80));
+  }
+}
+
+// Builds runs of keys that all start probing two slots before the end of the
+// table, so that they fill whole groups, wrap around and hold many equal
+// 7-bit hash fragments.  Then removes and reinserts keys in those runs.
+void test_strtable_probing() {
+  // Keys whose hashes agree in the bits that pick the first slot of any table
+  // of up to 1024 slots.
+  upb_strtable scratch;
+  upb_strtable_init(&scratch);
+  for(int i = 0; i < 100000; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "probe.%d", i);
+    upb_strtable_insert(&scratch, buf, upb_value_int32(0));
+  }
+  vector<std::string> keys;
+  upb_strtable_iter iter;
+  for(upb_strtable_begin(&iter, &scratch); !upb_strtable_done(&iter);
+      upb_strtable_next(&iter)) {
+    if (((iter.e->hash >> 7) & 1023) == 1021 && keys.size() < 64)
+      keys.push_back(upb_strtable_iter_key(&iter));
+  }
+  upb_strtable_uninit(&scratch);
+  ASSERT(keys.size() == 64);
+
+  // Insert 48 of them between other keys, so that the table grows several
+  // times with the run in it.  The last 16 are only ever looked up for now.
+  upb_strtable table;
+  upb_strtable_init(&table);
+  std::map<std::string, int32_t> m;
+  vector<std::string> all(keys);
+  for(int i = 0; i < 48; i++) {
+    ASSERT(upb_strtable_insert(&table, keys[i].c_str(), upb_value_int32(i)));
+    m[keys[i]] = i;
+    for(int j = 0; j < 8; j++) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "filler.%d", i * 8 + j);
+      ASSERT(upb_strtable_insert(&table, buf, upb_value_int32(-1)));
+      m[buf] = -1;
+      all.push_back(buf);
+    }
+    check_strtable_probing(&table, all, m);
+  }
+  ASSERT(table.size_lg2 > 4 && table.size_lg2 <= 10);
+
+  // Delete then lookup, from the middle of the run.
+  for(int i = 0; i < 48; i += 2) {
+    upb_value val;
+    ASSERT(upb_strtable_remove(&table, keys[i].c_str(), &val));
+    ASSERT(upb_value_getint32(val) == i);
+    m.erase(keys[i]);
+    ASSERT(!upb_strtable_remove(&table, keys[i].c_str(), &val));
+    check_strtable_probing(&table, all, m);
+  }
+
+  // Delete then insert, into the gaps left behind.
+  for(int i = 0; i < 64; i++) {
+    if (m.find(keys[i]) != m.end()) continue;
+    ASSERT(upb_strtable_insert(&table, keys[i].c_str(),
+                               upb_value_int32(100 + i)));
+    m[keys[i]] = 100 + i;
+    check_strtable_probing(&table, all, m);
+  }
+
+  // Removing drops the perfect hash; removel() takes the key's length.
+  ASSERT(upb_strtable_optimize(&table));
+  std::string padded = "." + keys[1] + ".";
+  ASSERT(upb_strtable_removel(&table, padded.data() + 1, keys[1].size(), NULL));
+  m.erase(keys[1]);
+  ASSERT(table.perfect == NULL);
+  check_strtable_probing(&table, all, m);
+
+  // Random inserts and removes of the colliding keys.
+  uint32_t x = 1;
+  for(int i = 0; i < 2000; i++) {
+    x = x * 1103515245 + 12345;
+    const std::string& key = keys[(x >> 16) % keys.size()];
+    if (m.find(key) != m.end()) {
+      ASSERT(upb_strtable_remove(&table, key.c_str(), NULL));
+      m.erase(key);
+    } else {
+      ASSERT(upb_strtable_insert(&table, key.c_str(), upb_value_int32(i)));
+      m[key] = i;
+    }
+    check_strtable_probing(&table, all, m);
+  }
+
+  // Removing everything leaves every slot empty.
+  for(size_t i = 0; i < all.size(); i++) {
+    if (m.erase(all[i]))
+      ASSERT(upb_strtable_remove(&table, all[i].c_str(), NULL));
+  }
+  check_strtable_probing(&table, all, m);
+  ASSERT(upb_strtable_count(&table) == 0);
+  upb_strtable_uninit(&table);
+}
+
 int main(int argc, char *argv[]) {
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--benchmark") == 0) benchmark = true;
@@ -271,6 +500,18 @@ int main(int argc, char *argv[]) {
 
   test_strtable(keys, 18);
 
+  vector<std::string> manykeys;
+  for(int i = 0; i < 5000; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "pkg.Message%d.field_%d", i / 7, i);
+    manykeys.push_back(buf);
+  }
+  test_strtable(manykeys, 4000);
+  test_strtable_hashcollision(keys);
+  test_strtable_probing();
+
+  test_inttable_churn();
+
   int32_t *keys1 = get_contiguous_keys(8);
   test_inttable(keys1, 8, "Table size: 8, keys: 1-8 ====");
   delete[] keys1;
@@ -292,4 +533,15 @@ int main(int argc, char *argv[]) {
   }
   test_inttable(keys4, 64, "Table size: 64, keys: 1-32 and 10133-10164 ====\n");
   delete[] keys4;
+
+  // Sparse keys that all share a hash slot, for long chains.
+  int32_t *keys5 = new int32_t[64];
+  for(int32_t i = 0; i < 64; i++) {
+    if(i < 8)
+      keys5[i] = i+1;
+    else
+      keys5[i] = i*4096 + 3;
+  }
+  test_inttable(keys5, 64, "Table size: 64, keys: 1-8 and 32771-258051 ====\n");
+  delete[] keys5;
 }
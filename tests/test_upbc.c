@@ -0,0 +1,145 @@
+/*
+ * upb - a minimalist implementation of protocol buffers.
+ *
+ * Copyright (c) 2012 Google Inc.  See LICENSE for details.
+ *
+ * Test of the static defs generated by "upbc -d" (here for descriptor.proto),
+ * which should be indistinguishable from the same defs loaded at runtime.
+ */
+
+#include "upb/bytestream.h"
+#include "upb/def.h"
+#include "upb/pb/glue.h"
+#include "upb_test.h"
+#include "descriptor_defs.h"
+#include <string.h>
+
+#define DESCRIPTOR_FILE "upb/descriptor.pb"
+
+static void assert_fields_equal(const upb_fielddef *f, const upb_fielddef *f2) {
+  ASSERT(strcmp(upb_fielddef_name(f), upb_fielddef_name(f2)) == 0);
+  ASSERT(upb_fielddef_number(f) == upb_fielddef_number(f2));
+  ASSERT(upb_fielddef_type(f) == upb_fielddef_type(f2));
+  ASSERT(upb_fielddef_label(f) == upb_fielddef_label(f2));
+  ASSERT(upb_fielddef_hasbit(f) == upb_fielddef_hasbit(f2));
+  ASSERT(upb_fielddef_offset(f) == upb_fielddef_offset(f2));
+  ASSERT(upb_value_getfielddef(upb_fielddef_fval(f)) == f);
+  ASSERT(upb_hassubdef(f) == upb_hassubdef(f2));
+  if (upb_hassubdef(f)) {
+    ASSERT(strcmp(upb_def_fullname(upb_fielddef_subdef(f)),
+                  upb_def_fullname(upb_fielddef_subdef(f2))) == 0);
+  }
+  if (upb_isstring(f)) {
+    upb_byteregion *r = upb_value_getbyteregion(upb_fielddef_default(f));
+    upb_byteregion *r2 = upb_value_getbyteregion(upb_fielddef_default(f2));
+    size_t len = upb_byteregion_len(r);
+    ASSERT(len == upb_byteregion_len(r2));
+    char *str = upb_byteregion_strdup(r);
+    char *str2 = upb_byteregion_strdup(r2);
+    ASSERT(memcmp(str, str2, len) == 0);
+    free(str);
+    free(str2);
+  } else if (!upb_issubmsg(f)) {
+    ASSERT(upb_fielddef_default(f).val.uint64 ==
+           upb_fielddef_default(f2).val.uint64);
+  }
+}
+
+static void test_compare_with_loaded() {
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_status status = UPB_STATUS_INIT;
+  ASSERT_STATUS(
+      upb_load_descriptor_file_into_symtab(s, DESCRIPTOR_FILE, &status),
+      &status);
+  upb_status_uninit(&status);
+
+  int n;
+  const upb_def **defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, &defs);
+  ASSERT(n == DESCRIPTOR_DEFCOUNT);
+  for (int i = 0; i < n; i++) upb_def_unref(defs[i], &defs);
+  free(defs);
+
+  for (int i = 0; i < DESCRIPTOR_DEFCOUNT; i++) {
+    const upb_def *def = descriptor_defs[i];
+    ASSERT(upb_def_isfinalized(def));
+    ASSERT(upb_def_isimmortal(def));
+    const upb_def *def2 = upb_symtab_lookup(s, upb_def_fullname(def), &def2);
+    ASSERT(def2);
+    ASSERT(def->type == def2->type);
+
+    const upb_msgdef *m = upb_dyncast_msgdef_const(def);
+    const upb_msgdef *m2 = upb_dyncast_msgdef_const(def2);
+    const upb_enumdef *e = upb_dyncast_enumdef_const(def);
+    const upb_enumdef *e2 = upb_dyncast_enumdef_const(def2);
+    if (m) {
+      ASSERT(upb_msgdef_numfields(m) == upb_msgdef_numfields(m2));
+      upb_msg_iter j;
+      for(upb_msg_begin(&j, m2); !upb_msg_done(&j); upb_msg_next(&j)) {
+        upb_fielddef *f2 = upb_msg_iter_field(&j);
+        upb_fielddef *f = upb_msgdef_itof(m, upb_fielddef_number(f2));
+        ASSERT(f);
+        ASSERT(upb_msgdef_ntof(m, upb_fielddef_name(f2)) == f);
+        ASSERT(upb_fielddef_msgdef(f) == m);
+        assert_fields_equal(f, f2);
+      }
+      ASSERT(!upb_msgdef_itof(m, 12345));
+      ASSERT(!upb_msgdef_ntof(m, "no_such_field"));
+    } else {
+      ASSERT(e);
+      ASSERT(upb_enumdef_numvals(e) == upb_enumdef_numvals(e2));
+      ASSERT(upb_enumdef_default(e) == upb_enumdef_default(e2));
+      upb_enum_iter j;
+      for (upb_enum_begin(&j, e2); !upb_enum_done(&j); upb_enum_next(&j)) {
+        int32_t num;
+        ASSERT(upb_enumdef_ntoi(e, upb_enum_iter_name(&j), &num));
+        ASSERT(num == upb_enum_iter_number(&j));
+        const char *name = upb_enumdef_iton(e, upb_enum_iter_number(&j));
+        ASSERT(name);
+        ASSERT(strcmp(name, upb_enumdef_iton(e2, num)) == 0);
+      }
+    }
+    upb_def_unref(def2, &def2);
+  }
+  upb_symtab_unref(s, &s);
+}
+
+static void test_refs() {
+  // Refs on static defs are no-ops; they can't be freed.
+  const upb_msgdef *m = GOOGLE_PROTOBUF_FIELDDESCRIPTORPROTO_MSGDEF;
+  upb_msgdef_ref(m, &m);
+  upb_msgdef_unref(m, &m);
+  upb_msgdef_unref(m, &m);
+  ASSERT(upb_msgdef_ntof(m, "type"));
+  ASSERT(upb_fielddef_subdef(upb_msgdef_ntof(m, "type")) ==
+         UPB_UPCAST(GOOGLE_PROTOBUF_FIELDDESCRIPTORPROTO_TYPE_ENUMDEF));
+}
+
+static void test_link_to_static() {
+  // A dynamic def can use a static def as its subdef.
+  upb_msgdef *m = upb_msgdef_new(&m);
+  ASSERT(upb_def_setfullname(UPB_UPCAST(m), "LinksToStatic"));
+  upb_fielddef *f = upb_fielddef_new(&f);
+  ASSERT(upb_fielddef_setname(f, "type"));
+  ASSERT(upb_fielddef_setnumber(f, 1));
+  ASSERT(upb_fielddef_settype(f, UPB_TYPE(ENUM)));
+  ASSERT(upb_fielddef_setsubdef(f, (upb_def*)UPB_UPCAST(
+      GOOGLE_PROTOBUF_FIELDDESCRIPTORPROTO_TYPE_ENUMDEF)));
+  ASSERT(upb_msgdef_addfield(m, f, &f));
+  upb_status status = UPB_STATUS_INIT;
+  upb_def *defs[] = {UPB_UPCAST(m)};
+  ASSERT_STATUS(upb_finalize(defs, 1, &status), &status);
+  upb_status_uninit(&status);
+  ASSERT(upb_def_isfinalized(UPB_UPCAST(m)));
+  const upb_fielddef *f2 = upb_msgdef_itof(m, 1);
+  ASSERT(upb_fielddef_subdef(f2) ==
+         UPB_UPCAST(GOOGLE_PROTOBUF_FIELDDESCRIPTORPROTO_TYPE_ENUMDEF));
+  upb_msgdef_unref(m, &m);
+}
+
+int main() {
+  test_compare_with_loaded();
+  test_refs();
+  test_link_to_static();
+  printf("All tests passed (%d assertions).\n", num_assertions);
+  return 0;
+}
@@ -90,12 +90,21 @@ TEST_VARINT_DECODER(branch32);
 TEST_VARINT_DECODER(branch64);
 TEST_VARINT_DECODER(check2_wright);
 TEST_VARINT_DECODER(check2_massimino);
+TEST_VARINT_DECODER(check2_fast);
+#ifdef UPB_VDECODE_HAVE_BMI2
+TEST_VARINT_DECODER(check2_bmi2);
+#endif
 
 int main() {
   test_branch32();
   test_branch64();
   test_check2_wright();
   test_check2_massimino();
+  test_check2_fast();
+  ASSERT(upb_vdecode_max8_load() == upb_vdecode_max8_best());
+#ifdef UPB_VDECODE_HAVE_BMI2
+  if (upb_cpu_hasbmi2()) test_check2_bmi2();
+#endif
 }
 
 #if 0
@@ -4,9 +4,9 @@
  * Copyright (c) 2009 Google Inc.  See LICENSE for details.
  * Author: Josh Haberman <jhaberman@gmail.com>
  *
- * upbc is the upb compiler, which at the moment simply takes a
- * protocol descriptor and outputs a header file containing the
- * names and types of the fields.
+ * upbc is the upb compiler, which takes a protocol descriptor and outputs a
+ * header file containing the names and types of the fields, and optionally
+ * (with -d) the finalized defs themselves as static data.
  */
 
 #include <ctype.h>
@@ -18,6 +18,8 @@
 #include "upb/msg.h"
 #include "upb/pb/glue.h"
 
+void error(const char *err, ...);
+
 /* These are in-place string transformations that do not change the length of
  * the string (and thus never need to re-allocate). */
 
@@ -114,6 +116,422 @@ static void write_const_h(const upb_def *defs[], int num_entries,
   free(include_guard_name);
 }
 
+/* The _defs.h and _defs.c files contain the defs themselves, already finalized
+ * and with all of their tables laid out as constant data, so that a program
+ * that links them in pays nothing at startup and allocates nothing.
+ *
+ * Rather than duplicate the hashing, we build the defs for real and dump the
+ * resulting tables, so the generated data is only valid for a upb with the
+ * same table implementation and byte order as this upbc.  Every strtable is
+ * given a perfect hash (lookups with one never read the control bytes, whose
+ * layout depends on the target's SIMD support) and all defs share a single
+ * immortal refcount. */
+
+// Where each kind of constant data is written while the defs are traversed;
+// the pools are concatenated into the output file at the end.
+typedef enum {
+  POOL_TABENTS, POOL_ARRAYS, POOL_STRENTS, POOL_PERFECT, POOL_DISPLACE,
+  POOL_STRDEFAULTS, POOL_FIELDS, POOL_FIELDPTRS, POOL_MSGS, POOL_ENUMS,
+  POOL_COUNT
+} pool_t;
+
+static const struct {
+  const char *type;
+  const char *name;
+} pool_info[POOL_COUNT] = {
+  {"upb_tabent", "tabents"},
+  {"upb_value", "arrays"},
+  {"upb_strent", "strents"},
+  {"upb_strent *const", "perfect"},
+  {"uint32_t", "displace"},
+  {"upb_stringsrc", "strdefaults"},
+  {"upb_fielddef", "fields"},
+  {"upb_fielddef *const", "fieldptrs"},
+  {"upb_msgdef", NULL},  // Public, named after the output file.
+  {"upb_enumdef", NULL},
+};
+
+typedef struct {
+  FILE *pools[POOL_COUNT];
+  int len[POOL_COUNT];
+  // Maps the address of each def to its index in the fields, msgs or enums
+  // pool.
+  upb_inttable index;
+  const char *prefix;
+} defs_writer;
+
+// The kinds of values that the tables of a def can hold.
+typedef enum { VAL_FIELD, VAL_INT32, VAL_NAME } val_t;
+
+static void write_cstr(FILE *stream, const char *str, size_t len) {
+  fputc('"', stream);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(stream, "\\%c", c);
+    } else if (isprint(c)) {
+      fputc(c, stream);
+    } else {
+      fprintf(stream, "\\%03o", c);
+    }
+  }
+  fputc('"', stream);
+}
+
+static int def_index(defs_writer *w, const void *def) {
+  const upb_value *v = upb_inttable_lookup(&w->index, (uintptr_t)def);
+  if (!v) error("def is not being written.\n");
+  return upb_value_getint32(*v);
+}
+
+static const char *pool_name(defs_writer *w, pool_t pool) {
+  static char buf[256];
+  if (pool_info[pool].name) return pool_info[pool].name;
+  snprintf(buf, sizeof(buf), "%s_%s", w->prefix,
+           pool == POOL_MSGS ? "msgs" : "enums");
+  return buf;
+}
+
+static void write_value(defs_writer *w, FILE *stream, upb_value v, val_t t) {
+  switch (t) {
+    case VAL_FIELD:
+      fprintf(stream, "UPB_VALUE_INIT(_void, (void*)&fields[%d], "
+              "UPB_CTYPE_PTR)", def_index(w, v.val._void));
+      break;
+    case VAL_INT32:
+      fprintf(stream, "UPB_VALUE_INIT(int32, %" PRId32 ", UPB_CTYPE_INT32)",
+              v.val.int32);
+      break;
+    case VAL_NAME:
+      fputs("UPB_VALUE_INIT(_void, (void*)", stream);
+      write_cstr(stream, v.val._void, strlen(v.val._void));
+      fputs(", UPB_CTYPE_PTR)", stream);
+      break;
+  }
+}
+
+// Writes the initializer of "t" to "stream", and its entries to the pools.
+static void write_inttable(defs_writer *w, FILE *stream, const upb_inttable *t,
+                           val_t val) {
+  FILE *ents = w->pools[POOL_TABENTS];
+  int ents_base = w->len[POOL_TABENTS];
+  size_t size = (size_t)1 << t->t.size_lg2;
+  for (size_t i = 0; i < size; i++) {
+    const upb_tabent *e = &t->t.entries[i];
+    if (e->key.num == 0) {
+      fputs("  {.key = {0}},\n", ents);
+      continue;
+    }
+    fprintf(ents, "  {{%" PRIuPTR "}, ", e->key.num);
+    write_value(w, ents, e->val, val);
+    if (e->next) {
+      fprintf(ents, ", (upb_tabent*)&tabents[%d]},\n",
+              ents_base + (int)(e->next - t->t.entries));
+    } else {
+      fputs(", NULL},\n", ents);
+    }
+  }
+  w->len[POOL_TABENTS] += size;
+
+  FILE *arr = w->pools[POOL_ARRAYS];
+  int arr_base = w->len[POOL_ARRAYS];
+  for (size_t i = 0; i < t->array_size; i++) {
+    fputs("  ", arr);
+    if (upb_arrhas(t->array[i])) {
+      write_value(w, arr, t->array[i], val);
+    } else {
+      fputs("UPB_VALUE_INIT(uint64, UINT64_MAX, UPB_CTYPE_UINT64)", arr);
+    }
+    fputs(",\n", arr);
+  }
+  w->len[POOL_ARRAYS] += t->array_size;
+
+  fprintf(stream, "{{(upb_tabent*)&tabents[%d], %zu, %zu, %d}, ",
+          ents_base, t->t.count, t->t.mask, t->t.size_lg2);
+  if (t->array_size > 0) {
+    fprintf(stream, "(upb_value*)&arrays[%d], ", arr_base);
+  } else {
+    fputs("NULL, ", stream);
+  }
+  fprintf(stream, "%zu, %zu}", t->array_size, t->array_count);
+}
+
+static void write_strtable(defs_writer *w, FILE *stream, const upb_strtable *t,
+                           val_t val) {
+  FILE *ents = w->pools[POOL_STRENTS];
+  int ents_base = w->len[POOL_STRENTS];
+  size_t size = (size_t)1 << t->size_lg2;
+  for (size_t i = 0; i < size; i++) {
+    const upb_strent *e = &t->entries[i];
+    if (!e->key) {
+      fputs("  {.key = NULL},\n", ents);
+      continue;
+    }
+    fputs("  {(char*)", ents);
+    write_cstr(ents, e->key, e->keylen);
+    fprintf(ents, ", %" PRIu32 ", 0x%08" PRIx32 ", ", e->keylen, e->hash);
+    write_value(w, ents, e->val, val);
+    fputs("},\n", ents);
+  }
+  w->len[POOL_STRENTS] += size;
+
+  // A table with no keys gets the trivial perfect hash: a single empty slot.
+  FILE *perfect = w->pools[POOL_PERFECT];
+  FILE *displace = w->pools[POOL_DISPLACE];
+  int perfect_base = w->len[POOL_PERFECT];
+  int displace_base = w->len[POOL_DISPLACE];
+  uint32_t perfect_size = 1, perfect_buckets = 1;
+  if (upb_strtable_count(t) == 0) {
+    fputs("  NULL,\n", perfect);
+    fputs("  0,\n", displace);
+  } else if (t->perfect) {
+    perfect_size = t->perfect_size;
+    perfect_buckets = t->perfect_buckets;
+    for (uint32_t i = 0; i < perfect_size; i++) {
+      if (t->perfect[i]) {
+        fprintf(perfect, "  (upb_strent*)&strents[%d],\n",
+                ents_base + (int)(t->perfect[i] - t->entries));
+      } else {
+        fputs("  NULL,\n", perfect);
+      }
+    }
+    for (uint32_t i = 0; i < perfect_buckets; i++)
+      fprintf(displace, "  %" PRIu32 ",\n", t->displace[i]);
+  } else {
+    error("Couldn't build a perfect hash for a table.\n");
+  }
+  w->len[POOL_PERFECT] += perfect_size;
+  w->len[POOL_DISPLACE] += perfect_buckets;
+
+  fprintf(stream, "{(upb_strent*)&strents[%d], NULL, %zu, %zu, %d, "
+          "(upb_strent**)&perfect[%d], (uint32_t*)&displace[%d], "
+          "%" PRIu32 ", %" PRIu32 "}",
+          ents_base, t->count, t->mask, t->size_lg2, perfect_base,
+          displace_base, perfect_size, perfect_buckets);
+}
+
+// Writes the initializer of the upb_def for element "index" of "pool".
+static void write_defbase(defs_writer *w, FILE *stream, const upb_def *def,
+                          pool_t pool, int index, const char *type) {
+  fprintf(stream, "{UPB_REFCOUNT_STATICINIT(&%s[%d].base.refcount, "
+          "&refcount), (char*)", pool_name(w, pool), index);
+  write_cstr(stream, def->fullname, strlen(def->fullname));
+  fprintf(stream, ", %s, true, NULL}", type);
+}
+
+static const char *ctype_name(upb_ctype_t type) {
+  switch (type) {
+    case UPB_CTYPE_INT32: return "UPB_CTYPE_INT32";
+    case UPB_CTYPE_INT64: return "UPB_CTYPE_INT64";
+    case UPB_CTYPE_UINT32: return "UPB_CTYPE_UINT32";
+    case UPB_CTYPE_UINT64: return "UPB_CTYPE_UINT64";
+    case UPB_CTYPE_DOUBLE: return "UPB_CTYPE_DOUBLE";
+    case UPB_CTYPE_FLOAT: return "UPB_CTYPE_FLOAT";
+    case UPB_CTYPE_BOOL: return "UPB_CTYPE_BOOL";
+    default: return "UPB_CTYPE_PTR";
+  }
+}
+
+static void write_fielddef(defs_writer *w, const upb_fielddef *f) {
+  FILE *stream = w->pools[POOL_FIELDS];
+  int i = def_index(w, f);
+  w->len[POOL_FIELDS]++;
+  fputs("  {", stream);
+  write_defbase(w, stream, UPB_UPCAST(f), POOL_FIELDS, i, "UPB_DEF_FIELD");
+  fprintf(stream, ",\n   (upb_msgdef*)&%s[%d], ",
+          pool_name(w, POOL_MSGS), def_index(w, f->msgdef));
+  if (upb_hassubdef(f)) {
+    const upb_def *sub = upb_fielddef_subdef(f);
+    pool_t pool = sub->type == UPB_DEF_MSG ? POOL_MSGS : POOL_ENUMS;
+    fprintf(stream, "{.def = (upb_def*)&%s[%d].base}, ",
+            pool_name(w, pool), def_index(w, sub));
+  } else {
+    fputs("{.def = NULL}, ", stream);
+  }
+  fprintf(stream, "false, %s, false, %d, %d, %d, %d, %" PRId32 ",\n   ",
+          f->default_is_string ? "true" : "false", f->type, f->label,
+          f->hasbit, f->offset, f->number);
+  if (f->default_is_string) {
+    upb_byteregion *r = upb_value_getbyteregion(f->defaultval);
+    size_t len;
+    const char *ptr = upb_byteregion_getptr(r, upb_byteregion_startofs(r), &len);
+    FILE *strs = w->pools[POOL_STRDEFAULTS];
+    int s = w->len[POOL_STRDEFAULTS]++;
+    fprintf(strs, "  UPB_STRINGSRC_STATICINIT(&strdefaults[%d], ", s);
+    write_cstr(strs, ptr, len);
+    fprintf(strs, ", %zu),\n", len);
+    fprintf(stream, "UPB_VALUE_INIT(byteregion, "
+            "(upb_byteregion*)&strdefaults[%d].byteregion, "
+            "UPB_CTYPE_BYTEREGION)", s);
+  } else if (upb_issubmsg(f)) {
+    fputs("UPB_VALUE_INIT(_void, NULL, UPB_CTYPE_PTR)", stream);
+  } else {
+    fprintf(stream, "UPB_VALUE_INIT(uint64, UINT64_C(0x%016" PRIx64 "), %s)",
+            f->defaultval.val.uint64,
+            ctype_name(upb_types[f->type].inmemory_type));
+  }
+  fprintf(stream, ",\n   UPB_VALUE_INIT(fielddef, &fields[%d], "
+          "UPB_CTYPE_FIELDDEF), NULL, NULL},\n", i);
+}
+
+static void write_msgdef(defs_writer *w, const upb_msgdef *m) {
+  FILE *stream = w->pools[POOL_MSGS];
+  w->len[POOL_MSGS]++;
+  fputs("  {", stream);
+  write_defbase(w, stream, UPB_UPCAST(m), POOL_MSGS, def_index(w, m),
+                "UPB_DEF_MSG");
+  // Finalized msgdefs have no "itof"; numbers are looked up in "fields".
+  fputs(",\n   {{NULL, 0, 0, 0}, NULL, 0, 0},\n   ", stream);
+  write_strtable(w, stream, &m->ntof, VAL_FIELD);
+  FILE *ptrs = w->pools[POOL_FIELDPTRS];
+  if (m->field_count > 0) {
+    fprintf(stream, ",\n   (upb_fielddef**)&fieldptrs[%d], ",
+            w->len[POOL_FIELDPTRS]);
+  } else {
+    fputs(",\n   NULL, ", stream);
+  }
+  fprintf(stream, "%" PRIu32 ", %" PRIu32 ", %d, %d, %" PRIu32 ", %" PRIu32
+          ", NULL},\n", m->field_count, m->field_count, m->size,
+          m->hasbit_bytes, m->extstart, m->extend);
+  // The fields are written in number order, so they are contiguous and sorted
+  // in the fields pool too.
+  upb_msg_iter i;
+  for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
+    fprintf(ptrs, "  &fields[%d],\n", def_index(w, upb_msg_iter_field(&i)));
+    write_fielddef(w, upb_msg_iter_field(&i));
+  }
+  w->len[POOL_FIELDPTRS] += m->field_count;
+}
+
+static void write_enumdef(defs_writer *w, const upb_enumdef *e) {
+  FILE *stream = w->pools[POOL_ENUMS];
+  w->len[POOL_ENUMS]++;
+  fputs("  {", stream);
+  write_defbase(w, stream, UPB_UPCAST(e), POOL_ENUMS, def_index(w, e),
+                "UPB_DEF_ENUM");
+  fputs(",\n   ", stream);
+  write_strtable(w, stream, &e->ntoi, VAL_INT32);
+  fputs(",\n   ", stream);
+  write_inttable(w, stream, &e->iton, VAL_NAME);
+  fprintf(stream, ",\n   %" PRId32 "},\n", e->defaultval);
+}
+
+static int compare_defs(const void *_a, const void *_b) {
+  const upb_def *const*a = _a, *const*b = _b;
+  return strcmp(upb_def_fullname(*a), upb_def_fullname(*b));
+}
+
+static void write_defs(const upb_def *defs[], int num_entries,
+                       const char *outfile_base, FILE *h_stream,
+                       FILE *c_stream) {
+  defs_writer w;
+  memset(&w, 0, sizeof(w));
+  const char *basename = strrchr(outfile_base, '/');
+  basename = basename ? basename + 1 : outfile_base;
+  char *prefix = strdup(basename);
+  to_cident(prefix);
+  w.prefix = prefix;
+  if (!upb_inttable_init(&w.index)) error("Out of memory.\n");
+  for (int i = 0; i < POOL_COUNT; i++)
+    if (!(w.pools[i] = tmpfile())) error("Couldn't create temporary file.\n");
+
+  // Sort the defs, so that the output does not depend on the symtab's hash
+  // order, and number them.
+  qsort(defs, num_entries, sizeof(*defs), &compare_defs);
+  int nfields = 0, nmsgs = 0, nenums = 0;
+  for (int i = 0; i < num_entries; i++) {
+    const upb_msgdef *m = upb_dyncast_msgdef_const(defs[i]);
+    int index;
+    if (m) {
+      index = nmsgs++;
+      upb_msg_iter j;
+      for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
+        upb_inttable_insert(&w.index, (uintptr_t)upb_msg_iter_field(&j),
+                            upb_value_int32(nfields++));
+      }
+    } else {
+      index = nenums++;
+    }
+    upb_inttable_insert(&w.index, (uintptr_t)defs[i], upb_value_int32(index));
+  }
+  for (int i = 0; i < num_entries; i++) {
+    const upb_msgdef *m = upb_dyncast_msgdef_const(defs[i]);
+    const upb_enumdef *e = upb_dyncast_enumdef_const(defs[i]);
+    if (m) write_msgdef(&w, m);
+    if (e) write_enumdef(&w, e);
+  }
+
+  /* Header file. */
+  char *include_guard_name = strdup(basename);
+  to_preproc(include_guard_name);
+  fputs("/* This file was generated by upbc (the upb compiler).  "
+        "Do not edit. */\n\n", h_stream);
+  fprintf(h_stream, "#ifndef %s_DEFS_H\n", include_guard_name);
+  fprintf(h_stream, "#define %s_DEFS_H\n\n", include_guard_name);
+  fputs("#include \"upb/def.h\"\n\n", h_stream);
+  fputs("#ifdef __cplusplus\n", h_stream);
+  fputs("extern \"C\" {\n", h_stream);
+  fputs("#endif\n\n", h_stream);
+  fputs("/* Finalized, immortal defs in static storage.  They may be used like\n"
+        " * any other finalized defs, except that they are not in a symtab. */"
+        "\n\n", h_stream);
+  if (nmsgs > 0)
+    fprintf(h_stream, "extern const upb_msgdef %s_msgs[%d];\n", prefix, nmsgs);
+  if (nenums > 0)
+    fprintf(h_stream, "extern const upb_enumdef %s_enums[%d];\n", prefix,
+            nenums);
+  fprintf(h_stream, "extern const upb_def *const %s_defs[%d];\n",
+          prefix, UPB_MAX(num_entries, 1));
+  fprintf(h_stream, "#define %s_DEFCOUNT %d\n\n", include_guard_name,
+          num_entries);
+  for (int i = 0; i < num_entries; i++) {
+    bool msg = defs[i]->type == UPB_DEF_MSG;
+    char *name = strdup(upb_def_fullname(defs[i]));
+    to_preproc(name);
+    fprintf(h_stream, "#define %s_%s (&%s_%s[%d])\n", name,
+            msg ? "MSGDEF" : "ENUMDEF", prefix, msg ? "msgs" : "enums",
+            def_index(&w, defs[i]));
+    free(name);
+  }
+  fputs("\n#ifdef __cplusplus\n", h_stream);
+  fputs("}  /* extern \"C\" */\n", h_stream);
+  fputs("#endif\n\n", h_stream);
+  fprintf(h_stream, "#endif  /* %s_DEFS_H */\n", include_guard_name);
+
+  /* Source file. */
+  fputs("/* This file was generated by upbc (the upb compiler).  "
+        "Do not edit. */\n\n", c_stream);
+  fputs("#include \"upb/bytestream.h\"\n", c_stream);
+  fputs("#include \"upb/def.h\"\n", c_stream);
+  fprintf(c_stream, "#include \"%s_defs.h\"\n\n", basename);
+  fputs("static const uint32_t refcount = UPB_REFCOUNT_IMMORTAL;\n", c_stream);
+  if (nfields > 0)
+    fprintf(c_stream, "static const upb_fielddef fields[%d];\n", nfields);
+  for (int i = 0; i < POOL_COUNT; i++) {
+    if (w.len[i] == 0) continue;
+    fprintf(c_stream, "\n%sconst %s %s[%d] = {\n",
+            pool_info[i].name ? "static " : "", pool_info[i].type,
+            pool_name(&w, i), w.len[i]);
+    rewind(w.pools[i]);
+    int c;
+    while ((c = fgetc(w.pools[i])) != EOF) fputc(c, c_stream);
+    fputs("};\n", c_stream);
+  }
+  fprintf(c_stream, "\nconst upb_def *const %s_defs[%d] = {\n", prefix,
+          UPB_MAX(num_entries, 1));
+  for (int i = 0; i < num_entries; i++) {
+    bool msg = defs[i]->type == UPB_DEF_MSG;
+    fprintf(c_stream, "  &%s_%s[%d].base,\n", prefix, msg ? "msgs" : "enums",
+            def_index(&w, defs[i]));
+  }
+  fputs("};\n", c_stream);
+
+  for (int i = 0; i < POOL_COUNT; i++) fclose(w.pools[i]);
+  upb_inttable_uninit(&w.index);
+  free(include_guard_name);
+  free(prefix);
+}
+
 const char usage[] =
   "upbc -- upb compiler.\n"
   "upb v0.1  http://blog.reverberate.org/upb/\n"
@@ -122,6 +540,8 @@ const char usage[] =
   "\n"
   "  -o OUTFILE-BASE    Write to OUTFILE-BASE.h and OUTFILE-BASE.c instead\n"
   "                     of using the input file as a basename.\n"
+  "  -d                 Also write the finalized defs as static data to\n"
+  "                     OUTFILE-BASE_defs.h and OUTFILE-BASE_defs.c.\n"
 ;
 
 void usage_err(const char *err) {
@@ -142,8 +562,11 @@ void error(const char *err, ...) {
 int main(int argc, char *argv[]) {
   /* Parse arguments. */
   char *outfile_base = NULL, *input_file = NULL;
+  bool write_static_defs = false;
   for(int i = 1; i < argc; i++) {
-    if(strcmp(argv[i], "-o") == 0) {
+    if(strcmp(argv[i], "-d") == 0) {
+      write_static_defs = true;
+    } else if(strcmp(argv[i], "-o") == 0) {
       if(++i == argc)
         usage_err("-o must be followed by a FILE-BASE.");
       else if(outfile_base)
@@ -166,7 +589,7 @@ int main(int argc, char *argv[]) {
 
   // TODO: make upb_parsedesc use a separate symtab, so we can use it here when
   // importing descriptor.proto.
-  upb_symtab *s = upb_symtab_new();
+  upb_symtab *s = upb_symtab_new(&s);
   upb_status status = UPB_STATUS_INIT;
   upb_load_descriptor_into_symtab(s, descriptor, len, &status);
   if(!upb_ok(&status)) {
@@ -187,10 +610,25 @@ int main(int argc, char *argv[]) {
   int symcount;
   const upb_def **defs = upb_symtab_getdefs(s, &symcount, UPB_DEF_ANY, &defs);
   write_const_h(defs, symcount, h_const_filename, h_const_file);
+
+  if(write_static_defs) {
+    char h_defs_filename[256], c_defs_filename[256];
+    if(snprintf(h_defs_filename, maxsize, "%s_defs.h", outfile_base) >= maxsize ||
+       snprintf(c_defs_filename, maxsize, "%s_defs.c", outfile_base) >= maxsize)
+      error("File base too long.\n");
+    FILE *h_defs_file = fopen(h_defs_filename, "w");
+    if(!h_defs_file) error("Failed to open _defs.h output file\n");
+    FILE *c_defs_file = fopen(c_defs_filename, "w");
+    if(!c_defs_file) error("Failed to open _defs.c output file\n");
+    write_defs(defs, symcount, outfile_base, h_defs_file, c_defs_file);
+    if(fclose(h_defs_file) != 0 || fclose(c_defs_file) != 0)
+      error("Failed to write _defs output files\n");
+  }
+
   for (int i = 0; i < symcount; i++) upb_def_unref(defs[i], &defs);
   free(defs);
   free(descriptor);
-  upb_symtab_unref(s);
+  upb_symtab_unref(s, &s);
   fclose(h_const_file);
 
   return 0;
@@ -0,0 +1,94 @@
+/*
+ * upb - a minimalist implementation of protocol buffers.
+ *
+ * Copyright (c) 2012 Google Inc.  See LICENSE for details.
+ * Author: Josh Haberman <jhaberman@gmail.com>
+ *
+ * upbimg compiles a protocol descriptor into a upb_image (see upb/image.h),
+ * which can be loaded with upb_image_loadfile() much faster than the
+ * descriptor itself can be parsed.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "upb/def.h"
+#include "upb/image.h"
+#include "upb/pb/glue.h"
+
+const char usage[] =
+  "upbimg -- compiles a descriptor into a upb image.\n"
+  "upb v0.1  http://blog.reverberate.org/upb/\n"
+  "\n"
+  "Usage: upbimg [options] descriptor-file\n"
+  "\n"
+  "  -o OUTFILE         Write to OUTFILE instead of descriptor-file.img.\n"
+;
+
+void usage_err(const char *err) {
+  fprintf(stderr, "upbimg: %s\n\n", err);
+  fputs(usage, stderr);
+  exit(1);
+}
+
+void error(const char *err, ...) {
+  va_list args;
+  va_start(args, err);
+  fprintf(stderr, "upbimg: ");
+  vfprintf(stderr, err, args);
+  va_end(args);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  /* Parse arguments. */
+  char *outfile = NULL, *input_file = NULL;
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-o") == 0) {
+      if(++i == argc)
+        usage_err("-o must be followed by a FILE.");
+      else if(outfile)
+        usage_err("-o was specified multiple times.");
+      outfile = argv[i];
+    } else {
+      if(input_file)
+        usage_err("You can only specify one input file.");
+      input_file = argv[i];
+    }
+  }
+  if(!input_file) usage_err("You must specify an input file.");
+
+  char outfile_buf[256];
+  if(!outfile) {
+    const int maxsize = sizeof(outfile_buf);
+    if(snprintf(outfile_buf, maxsize, "%s.img", input_file) >= maxsize)
+      error("Input file name too long.\n");
+    outfile = outfile_buf;
+  }
+
+  upb_symtab *s = upb_symtab_new(&s);
+  upb_status status = UPB_STATUS_INIT;
+  if(!upb_load_descriptor_file_into_symtab(s, input_file, &status)) {
+    error("Failed to parse input file descriptor: %s\n",
+          upb_status_getstr(&status));
+  }
+
+  int n;
+  const upb_def **defs = upb_symtab_getdefs(s, &n, UPB_DEF_ANY, &defs);
+  size_t len;
+  char *image = upb_image_write(defs, n, &len, &status);
+  if(!image) error("Failed to write image: %s\n", upb_status_getstr(&status));
+  for (int i = 0; i < n; i++) upb_def_unref(defs[i], &defs);
+  free(defs);
+  upb_status_uninit(&status);
+  upb_symtab_unref(s, &s);
+
+  FILE *f = fopen(outfile, "wb");
+  if(!f) error("Failed to open output file %s\n", outfile);
+  if(fwrite(image, 1, len, f) != len || fclose(f) != 0)
+    error("Failed to write output file %s\n", outfile);
+  free(image);
+
+  return 0;
+}
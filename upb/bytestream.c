@@ -103,14 +103,15 @@ const char *upb_stringsrc_getptr(const void *_s, uint64_t ofs, size_t *len) {
   return src->str + ofs;
 }
 
+const upb_bytesrc_vtbl upb_stringsrc_vtbl = {
+  &upb_stringsrc_fetch,
+  &upb_stringsrc_discard,
+  &upb_stringsrc_copy,
+  &upb_stringsrc_getptr,
+};
+
 void upb_stringsrc_init(upb_stringsrc *s) {
-  static upb_bytesrc_vtbl vtbl = {
-    &upb_stringsrc_fetch,
-    &upb_stringsrc_discard,
-    &upb_stringsrc_copy,
-    &upb_stringsrc_getptr,
-  };
-  upb_bytesrc_init(&s->bytesrc, &vtbl);
+  upb_bytesrc_init(&s->bytesrc, &upb_stringsrc_vtbl);
   s->str = NULL;
   s->byteregion.bytesrc = &s->bytesrc;
   s->byteregion.toplevel = true;
@@ -420,6 +420,15 @@ typedef struct {
   upb_byteregion byteregion;
 } upb_stringsrc;
 
+extern const upb_bytesrc_vtbl upb_stringsrc_vtbl;
+
+// Initializer for a stringsrc in static storage (like the string defaults of
+// the defs generated by upbc), which has already fetched all of "str", so its
+// byteregion can be read without being written to.
+#define UPB_STRINGSRC_STATICINIT(self, str, len) \
+    {{&upb_stringsrc_vtbl, UPB_STATUS_INIT}, str, len, \
+     {0, 0, len, len, (upb_bytesrc*)&(self)->bytesrc, true}}
+
 // Create/free a stringsrc.
 void upb_stringsrc_init(upb_stringsrc *s);
 void upb_stringsrc_uninit(upb_stringsrc *s);
@@ -42,6 +42,74 @@ static bool upb_isident(const char *str, size_t len, bool full) {
 }
 
 
+/* upb_namepool ***************************************************************/
+
+// The names of a batch of defs finalized together, stored back-to-back after
+// this header with each distinct name stored once (many messages have a field
+// called "name", for example).  Every def whose name is in the pool holds a
+// count on it, since the defs may be freed independently.
+typedef struct _upb_namepool {
+  uint32_t refcount;
+} upb_namepool;
+
+static void upb_namepool_unref(upb_namepool *p) {
+  if (upb_atomic_dec(&p->refcount)) free(p);
+}
+
+// In the first pass (p == NULL) assigns def's name an offset in the pool, and
+// in the second points the def at it.  Returns false if out of memory.
+static bool upb_namepool_add(upb_namepool *p, upb_strtable *offsets,
+                             size_t *len, upb_def *def) {
+  if (!def->fullname) return true;  // Anonymous def.
+  const upb_value *v = upb_strtable_lookup(offsets, def->fullname);
+  if (p) {
+    free(def->fullname);
+    def->fullname = (char*)(p + 1) + upb_value_getuint64(*v);
+    def->namepool = p;
+    p->refcount++;
+  } else if (!v) {
+    if (!upb_strtable_insert(offsets, def->fullname, upb_value_uint64(*len)))
+      return false;
+    *len += strlen(def->fullname) + 1;
+  }
+  return true;
+}
+
+static bool upb_namepool_addall(upb_namepool *p, upb_strtable *offsets,
+                                size_t *len, upb_def *const*defs, int n) {
+  for (int i = 0; i < n; i++) {
+    if (!upb_namepool_add(p, offsets, len, defs[i])) return false;
+    upb_msgdef *m = upb_dyncast_msgdef(defs[i]);
+    if (!m) continue;
+    for (uint32_t j = 0; j < m->field_count; j++)
+      if (!upb_namepool_add(p, offsets, len, UPB_UPCAST(m->fields[j])))
+        return false;
+  }
+  return true;
+}
+
+// Moves the names of the given defs and of their fields into a new pool.  This
+// is only an optimization, so the names are left alone if memory runs out.
+static void upb_namepool_intern(upb_def *const*defs, int n) {
+  upb_strtable offsets;
+  if (!upb_strtable_init(&offsets)) return;
+  size_t len = 0;
+  upb_namepool *p;
+  if (upb_namepool_addall(NULL, &offsets, &len, defs, n) && len > 0 &&
+      (p = malloc(sizeof(*p) + len)) != NULL) {
+    p->refcount = 0;
+    upb_strtable_iter i;
+    upb_strtable_begin(&i, &offsets);
+    for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+      memcpy((char*)(p + 1) + upb_value_getuint64(upb_strtable_iter_value(&i)),
+             upb_strtable_iter_key(&i), upb_strtable_iter_keylength(&i) + 1);
+    }
+    upb_namepool_addall(p, &offsets, &len, defs, n);
+  }
+  upb_strtable_uninit(&offsets);
+}
+
+
 /* upb_def ********************************************************************/
 
 static void upb_msgdef_free(upb_msgdef *m);
@@ -64,12 +132,9 @@ void upb_def_ref(const upb_def *_def, const void *owner) {
   upb_refcount_ref(&def->refcount, owner);
 }
 
-void upb_def_unref(const upb_def *_def, const void *owner) {
-  upb_def *def = (upb_def*)_def;
-  if (!def) return;
-  if (!upb_refcount_unref(&def->refcount, owner)) return;
+// Frees all defs in the SCC.
+static void upb_def_freescc(upb_def *def) {
   upb_def *base = def;
-  // Free all defs in the SCC.
   do {
     upb_def *next = (upb_def*)def->refcount.next;
     switch (def->type) {
@@ -83,11 +148,71 @@ void upb_def_unref(const upb_def *_def, const void *owner) {
   } while(def != base);
 }
 
+void upb_def_unref(const upb_def *_def, const void *owner) {
+  upb_def *def = (upb_def*)_def;
+  if (!def) return;
+  if (upb_refcount_unref(&def->refcount, owner)) upb_def_freescc(def);
+}
+
 void upb_def_donateref(const upb_def *_def, const void *from, const void *to) {
   upb_def *def = (upb_def*)_def;
   upb_refcount_donateref(&def->refcount, from, to);
 }
 
+// One def from every SCC made immortal by upb_def_makeimmortal(), for
+// upb_def_freeimmortals().
+static uint32_t upb_immortals_lock = 0;
+static const upb_def **upb_immortals = NULL;
+static size_t upb_immortals_len = 0, upb_immortals_size = 0;
+
+void upb_def_makeimmortal(const upb_def *def) {
+  assert(upb_def_isfinalized(def));
+  if (!upb_refcount_makeimmortal(&def->refcount)) return;
+  upb_atomic_lock(&upb_immortals_lock);
+  if (upb_immortals_len == upb_immortals_size) {
+    size_t size = UPB_MAX(upb_immortals_size * 2, 16);
+    const upb_def **immortals =
+        realloc(upb_immortals, size * sizeof(*immortals));
+    // Without room to record it the SCC can't be freed, which is what being
+    // immortal means anyway.
+    if (!immortals) goto done;
+    upb_immortals = immortals;
+    upb_immortals_size = size;
+  }
+  upb_immortals[upb_immortals_len++] = def;
+done:
+  upb_atomic_unlock(&upb_immortals_lock);
+}
+
+void upb_def_freeimmortals() {
+  // Drop the refs that immortal defs hold on defs in other immortal SCCs
+  // first, so that freeing an SCC never touches one that is already freed.
+  for (size_t i = 0; i < upb_immortals_len; i++) {
+    const upb_def *def = upb_immortals[i];
+    do {
+      upb_fielddef *f = upb_dyncast_fielddef((upb_def*)def);
+      if (f && f->subdef_is_owned && upb_def_isimmortal(f->sub.def)) {
+        upb_def_unref(f->sub.def, &f->sub.def);
+        f->subdef_is_owned = false;
+      }
+      def = (const upb_def*)def->refcount.next;
+    } while (def != upb_immortals[i]);
+  }
+  for (size_t i = 0; i < upb_immortals_len; i++) {
+    upb_def *def = (upb_def*)upb_immortals[i];
+    upb_refcount_freeimmortal(&def->refcount);
+    upb_def_freescc(def);
+  }
+  free(upb_immortals);
+  upb_immortals = NULL;
+  upb_immortals_len = 0;
+  upb_immortals_size = 0;
+}
+
+bool upb_def_isimmortal(const upb_def *def) {
+  return upb_refcount_isimmortal(&def->refcount);
+}
+
 upb_def *upb_def_dup(const upb_def *def, const void *o) {
   switch (def->type) {
     case UPB_DEF_MSG:
@@ -104,12 +229,16 @@ static bool upb_def_init(upb_def *def, upb_deftype_t type, const void *owner) {
   def->type = type;
   def->is_finalized = false;
   def->fullname = NULL;
+  def->namepool = NULL;
   return upb_refcount_init(&def->refcount, owner);
 }
 
 static void upb_def_uninit(upb_def *def) {
   upb_refcount_uninit(&def->refcount);
-  free(def->fullname);
+  if (def->namepool)
+    upb_namepool_unref(def->namepool);
+  else
+    free(def->fullname);
 }
 
 static void upb_def_getsuccessors(upb_refcount *refcount, void *closure) {
@@ -163,12 +292,12 @@ static bool upb_validate_field(const upb_fielddef *f, upb_status *s) {
   return true;
 }
 
-bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
-  if (n >= UINT16_MAX - 1) {
-    upb_status_seterrliteral(s, "too many defs (max is 64k at a time)");
-    return false;
-  }
+static int upb_fielddef_cmpnumber(const void *_a, const void *_b) {
+  const upb_fielddef *const*a = _a, *const*b = _b;
+  return (*a)->number < (*b)->number ? -1 : (*a)->number > (*b)->number;
+}
 
+bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
   // First perform validation, in two passes so we can check that we have a
   // transitive closure without needing to search.
   for (int i = 0; i < n; i++) {
@@ -187,9 +316,13 @@ bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
   }
 
   for (int i = 0; i < n; i++) {
+    upb_enumdef *e = upb_dyncast_enumdef(defs[i]);
+    if (e) upb_strtable_optimize(&e->ntoi);
     upb_msgdef *m = upb_dyncast_msgdef(defs[i]);
     if (!m) continue;
-    upb_inttable_compact(&m->itof);
+    qsort(m->fields, m->field_count, sizeof(*m->fields),
+          &upb_fielddef_cmpnumber);
+    upb_strtable_optimize(&m->ntof);
     upb_msg_iter j;
     for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
       upb_fielddef *f = upb_msg_iter_field(&j);
@@ -200,7 +333,10 @@ bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
 
   // Validation all passed, now find strongly-connected components so that
   // our refcounting works with cycles.
-  upb_refcount_findscc((upb_refcount**)defs, n, &upb_def_getsuccessors);
+  if (!upb_refcount_findscc((upb_refcount**)defs, n, &upb_def_getsuccessors)) {
+    upb_status_seterrliteral(s, "out of memory");
+    goto err;
+  }
 
   // Now that ref cycles have been removed it is safe to have each fielddef
   // take a ref on its subdef (if any), but only if it's a member of another
@@ -208,6 +344,16 @@ bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
   for (int i = 0; i < n; i++) {
     upb_msgdef *m = upb_dyncast_msgdef(defs[i]);
     if (!m) continue;
+    // Numbers are looked up in the (now sorted) field array from here on.
+    upb_inttable_uninit(&m->itof);
+    if (m->field_count < m->fields_size) {
+      upb_fielddef **fields =
+          realloc(m->fields, m->field_count * sizeof(*fields));
+      if (fields) {
+        m->fields = fields;
+        m->fields_size = m->field_count;
+      }
+    }
     upb_msg_iter j;
     for(upb_msg_begin(&j, m); !upb_msg_done(&j); upb_msg_next(&j)) {
       upb_fielddef *f = upb_msg_iter_field(&j);
@@ -224,6 +370,7 @@ bool upb_finalize(upb_def *const*defs, int n, upb_status *s) {
     }
   }
 
+  upb_namepool_intern(defs, n);
   return true;
 
 err:
@@ -304,13 +451,18 @@ void upb_enum_begin(upb_enum_iter *i, const upb_enumdef *e) {
 void upb_enum_next(upb_enum_iter *iter) { upb_strtable_next(iter); }
 bool upb_enum_done(upb_enum_iter *iter) { return upb_strtable_done(iter); }
 
-bool upb_enumdef_ntoi(const upb_enumdef *def, const char *name, int32_t *num) {
-  const upb_value *v = upb_strtable_lookup(&def->ntoi, name);
+bool upb_enumdef_ntoil(const upb_enumdef *def, const char *name, size_t len,
+                       int32_t *num) {
+  const upb_value *v = upb_strtable_lookupl(&def->ntoi, name, len);
   if (!v) return false;
   if (num) *num = upb_value_getint32(*v);
   return true;
 }
 
+bool upb_enumdef_ntoi(const upb_enumdef *def, const char *name, int32_t *num) {
+  return upb_enumdef_ntoil(def, name, strlen(name), num);
+}
+
 const char *upb_enumdef_iton(const upb_enumdef *def, int32_t num) {
   const upb_value *v = upb_inttable_lookup32(&def->iton, num);
   return v ? upb_value_getptr(*v) : NULL;
@@ -384,6 +536,8 @@ static void upb_fielddef_uninit_default(upb_fielddef *f) {
 static void upb_fielddef_free(upb_fielddef *f) {
   if (f->subdef_is_owned)
     upb_def_unref(f->sub.def, &f->sub.def);
+  if (f->subdef_is_symbolic)
+    free(f->sub.name);
   upb_fielddef_uninit_default(f);
   upb_def_uninit(UPB_UPCAST(f));
   free(f);
@@ -406,7 +560,7 @@ upb_fielddef *upb_fielddef_dup(const upb_fielddef *f, const void *owner) {
     const char *ptr = upb_byteregion_getptr(r, 0, &len);
     assert(len == upb_byteregion_len(r));
     upb_fielddef_setdefaultstr(newf, ptr, len);
-  } else {
+  } else if (!upb_issubmsg(f)) {
     upb_fielddef_setdefault(newf, upb_fielddef_default(f));
   }
 
@@ -496,7 +650,7 @@ static bool upb_fielddef_resolvedefault(upb_fielddef *f, upb_status *s) {
     const char *ptr = upb_byteregion_getptr(
         bytes, upb_byteregion_startofs(bytes), &len);
     assert(len == upb_byteregion_len(bytes));  // Should all be in one chunk.
-    bool success = upb_enumdef_ntoi(e, ptr, &val);
+    bool success = upb_enumdef_ntoil(e, ptr, len, &val);
     if (!success) {
       upb_status_seterrf(
           s, "Default enum value (%s) is not a member of the enum", ptr);
@@ -632,6 +786,9 @@ upb_msgdef *upb_msgdef_new(const void *owner) {
   if (!upb_def_init(&m->base, UPB_DEF_MSG, owner)) goto err2;
   if (!upb_inttable_init(&m->itof)) goto err2;
   if (!upb_strtable_init(&m->ntof)) goto err1;
+  m->fields = NULL;
+  m->field_count = 0;
+  m->fields_size = 0;
   m->size = 0;
   m->hasbit_bytes = 0;
   m->extstart = 0;
@@ -646,8 +803,15 @@ err2:
 }
 
 static void upb_msgdef_free(upb_msgdef *m) {
+  // Until finalized, the fields are not in our SCC and we own a ref on each.
+  if (upb_def_ismutable(UPB_UPCAST(m))) {
+    upb_msg_iter i;
+    for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i))
+      upb_fielddef_unref(upb_msg_iter_field(&i), m);
+    upb_inttable_uninit(&m->itof);  // Already freed by upb_finalize().
+  }
   upb_strtable_uninit(&m->ntof);
-  upb_inttable_uninit(&m->itof);
+  free(m->fields);
   upb_def_uninit(&m->base);
   free(m);
 }
@@ -692,6 +856,145 @@ bool upb_msgdef_setextrange(upb_msgdef *m, uint32_t start, uint32_t end) {
   return true;
 }
 
+// Layout of one field while upb_msgdef_layoutwith() is computing it.
+typedef struct {
+  upb_fielddef *f;
+  uint32_t freq;
+  bool hot;
+  uint8_t size, align;
+  uint32_t offset;
+} upb_layoutent;
+
+static size_t upb_align_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+// Hottest first, for picking the hot fields.
+static int upb_layoutent_cmpfreq(const void *_a, const void *_b) {
+  const upb_layoutent *a = _a, *b = _b;
+  if (a->freq != b->freq) return a->freq > b->freq ? -1 : 1;
+  return a->f->number < b->f->number ? -1 : a->f->number > b->f->number;
+}
+
+// The order in which fields are placed: hot fields first, then in each group
+// by ascending alignment so that padding is only needed where the alignment
+// changes.
+static int upb_layoutent_cmpplace(const void *_a, const void *_b) {
+  const upb_layoutent *a = _a, *b = _b;
+  if (a->hot != b->hot) return a->hot ? -1 : 1;
+  if (a->align != b->align) return a->align < b->align ? -1 : 1;
+  return upb_layoutent_cmpfreq(a, b);
+}
+
+// The end of fields with the given total sizes per alignment (indexed by the
+// alignment) laid out in ascending alignment starting at "ofs".  This is
+// exact since every type's size is a multiple of its alignment.
+static size_t upb_layout_end(size_t ofs, const size_t *bytes) {
+  for (size_t align = 1; align <= 8; align *= 2)
+    ofs = upb_align_up(ofs, align) + bytes[align];
+  return ofs;
+}
+
+// Sets "status" (if non-NULL) to the reason when the layout fails.
+static bool upb_msgdef_dolayout(upb_msgdef *m, upb_fieldfreq *freq,
+                                void *closure, upb_status *status) {
+  assert(upb_def_ismutable(UPB_UPCAST(m)));
+  const char *name = upb_def_fullname(UPB_UPCAST(m));
+  int n = m->field_count;
+  upb_layoutent *ents = malloc(UPB_MAX(n, 1) * sizeof(*ents));
+  if (!ents) {
+    if (status) upb_status_seterrliteral(status, "out of memory");
+    return false;
+  }
+  size_t hasbits = 0;
+  for (int i = 0; i < n; i++) {
+    upb_layoutent *e = &ents[i];
+    e->f = m->fields[i];
+    e->freq = freq ? freq(e->f, closure) : 0;
+    e->hot = false;
+    if (e->f->type == UPB_TYPE_NONE) {
+      if (status)
+        upb_status_seterrf(status, "could not lay out message %s: field %s "
+                           "has no type", name, upb_fielddef_name(e->f));
+      free(ents);
+      return false;
+    }
+    // Strings and submessages are already pointers in upb_types.
+    bool isseq = upb_isseq(e->f);
+    e->size = isseq ? sizeof(void*) : upb_types[e->f->type].size;
+    e->align = isseq ? alignof(void*) : upb_types[e->f->type].align;
+    assert(e->align <= 8 && e->size % e->align == 0);
+    if (!isseq) hasbits++;
+  }
+  size_t hasbit_bytes = upb_align_up(hasbits, 8) / 8;
+
+  // Take fields in descending frequency as long as they still fit in the hot
+  // bytes along with the hot fields taken before them.
+  size_t hotbytes[9] = {0};
+  if (freq) {
+    qsort(ents, n, sizeof(*ents), &upb_layoutent_cmpfreq);
+    for (int i = 0; i < n && ents[i].freq > 0; i++) {
+      upb_layoutent *e = &ents[i];
+      hotbytes[e->align] += e->size;
+      if (upb_layout_end(hasbit_bytes, hotbytes) <= UPB_LAYOUT_HOTBYTES) {
+        e->hot = true;
+      } else {
+        hotbytes[e->align] -= e->size;
+      }
+    }
+  }
+
+  qsort(ents, n, sizeof(*ents), &upb_layoutent_cmpplace);
+  size_t ofs = hasbit_bytes, max_align = 1;
+  for (int i = 0; i < n; i++) {
+    upb_layoutent *e = &ents[i];
+    e->offset = ofs = upb_align_up(ofs, e->align);
+    ofs += e->size;
+    max_align = UPB_MAX(max_align, e->align);
+  }
+  // Like a C struct, the size is a multiple of the largest alignment so that
+  // arrays of the message keep every member aligned.
+  size_t size = upb_align_up(ofs, max_align);
+  if (hasbits > INT16_MAX || size > UINT16_MAX) {
+    if (status && hasbits > INT16_MAX) {
+      upb_status_seterrf(status, "could not lay out message %s: %zu hasbits "
+                         "needed but at most %d are supported", name, hasbits,
+                         INT16_MAX);
+    } else if (status) {
+      upb_status_seterrf(status, "could not lay out message %s: %zu bytes "
+                         "needed but at most %d are supported", name, size,
+                         UINT16_MAX);
+    }
+    free(ents);
+    return false;
+  }
+
+  // Hasbits are assigned in placement order, so hot fields get the first ones.
+  int16_t hasbit = 0;
+  for (int i = 0; i < n; i++) {
+    upb_layoutent *e = &ents[i];
+    upb_fielddef_setoffset(e->f, e->offset);
+    upb_fielddef_sethasbit(e->f, upb_isseq(e->f) ? -1 : hasbit++);
+  }
+  upb_msgdef_setsize(m, size);
+  upb_msgdef_sethasbit_bytes(m, hasbit_bytes);
+  free(ents);
+  return true;
+}
+
+bool upb_msgdef_layoutwith(upb_msgdef *m, upb_fieldfreq *freq, void *closure) {
+  return upb_msgdef_dolayout(m, freq, closure, NULL);
+}
+
+bool upb_layout(upb_def *const*defs, int n, upb_fieldfreq *freq, void *closure,
+                upb_status *status) {
+  for (int i = 0; i < n; i++) {
+    upb_msgdef *m = upb_dyncast_msgdef(defs[i]);
+    if (m && !upb_msgdef_dolayout(m, freq, closure, status)) return false;
+  }
+  return true;
+}
+
 bool upb_msgdef_addfields(upb_msgdef *m, upb_fielddef *const *fields, int n,
                           const void *ref_donor) {
   // Check constraints for all fields before performing any action.
@@ -703,11 +1006,19 @@ bool upb_msgdef_addfields(upb_msgdef *m, upb_fielddef *const *fields, int n,
         upb_msgdef_ntof(m, upb_fielddef_name(f)))
       return false;
   }
+  if (m->field_count + n > m->fields_size) {
+    uint32_t size = UPB_MAX(m->fields_size * 2, m->field_count + n);
+    upb_fielddef **new_fields = realloc(m->fields, size * sizeof(*new_fields));
+    if (!new_fields) return false;
+    m->fields = new_fields;
+    m->fields_size = size;
+  }
 
   // Constraint checks ok, perform the action.
   for (int i = 0; i < n; i++) {
     upb_fielddef *f = fields[i];
     f->msgdef = m;
+    m->fields[m->field_count++] = f;
     upb_inttable_insert(&m->itof, upb_fielddef_number(f), upb_value_ptr(f));
     upb_strtable_insert(&m->ntof, upb_fielddef_name(f), upb_value_ptr(f));
     upb_fielddef_ref(f, m);
@@ -716,20 +1027,383 @@ bool upb_msgdef_addfields(upb_msgdef *m, upb_fielddef *const *fields, int n,
   return true;
 }
 
+upb_fielddef *upb_msgdef_bsearch(const upb_msgdef *m, uint32_t i) {
+  assert(upb_def_isfinalized(UPB_UPCAST(m)));
+  uint32_t lo = 0, hi = m->field_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    uint32_t num = m->fields[mid]->number;
+    if (num == i) return m->fields[mid];
+    if (num < i) lo = mid + 1; else hi = mid;
+  }
+  return NULL;
+}
+
 void upb_msg_begin(upb_msg_iter *iter, const upb_msgdef *m) {
-  upb_inttable_begin(iter, &m->itof);
+  iter->field = m->fields;
+  iter->end = m->fields + m->field_count;
 }
 
-void upb_msg_next(upb_msg_iter *iter) { upb_inttable_next(iter); }
+void upb_msg_next(upb_msg_iter *iter) { iter->field++; }
 
 
 /* upb_symtab *****************************************************************/
 
+// A snapshot is a large "base" table that may be shared by many snapshots,
+// plus a small "delta" table holding the defs added since the base was built,
+// which shadows the base.  Each add copies only the delta; once the delta has
+// grown past about the square root of the base's size it is merged into a new
+// base.  This keeps an add at O(sqrt(n)) amortized, instead of copying the
+// whole map every time.
+//
+// Each table owns one ref on every def it maps: a base's refs are owned by the
+// base and a delta's by its snapshot, so a def shadowed by the delta stays
+// alive until its base is freed.  Only writers touch a base's snapshot count.
+
+typedef struct {
+  upb_strtable table;
+  uint32_t snapshots;  // Number of snapshots sharing this base.
+} upb_symtab_base;
+
+typedef struct _upb_symtab_snapshot {
+  upb_symtab_base *base;
+  upb_strtable delta;
+} upb_symtab_snapshot;
+
+static upb_def *upb_snapshot_lookupl(const upb_symtab_snapshot *snap,
+                                     const char *name, size_t len) {
+  const upb_value *v = upb_strtable_lookupl(&snap->delta, name, len);
+  if (!v) v = upb_strtable_lookupl(&snap->base->table, name, len);
+  return v ? upb_value_getptr(*v) : NULL;
+}
+
+static upb_def *upb_snapshot_lookup(const upb_symtab_snapshot *snap,
+                                    const char *name) {
+  return upb_snapshot_lookupl(snap, name, strlen(name));
+}
+
+// Iterates over the delta, then over the base entries it does not shadow.
+typedef struct {
+  const upb_symtab_snapshot *snap;
+  upb_strtable_iter iter;
+  bool in_base;
+} upb_snapshot_iter;
+
+static void upb_snapshot_skip(upb_snapshot_iter *i) {
+  if (!i->in_base && upb_strtable_done(&i->iter)) {
+    i->in_base = true;
+    upb_strtable_begin(&i->iter, &i->snap->base->table);
+  }
+  while (i->in_base && !upb_strtable_done(&i->iter) &&
+         upb_strtable_lookupl(&i->snap->delta, upb_strtable_iter_key(&i->iter),
+                              upb_strtable_iter_keylength(&i->iter)))
+    upb_strtable_next(&i->iter);
+}
+
+static void upb_snapshot_begin(upb_snapshot_iter *i,
+                               const upb_symtab_snapshot *snap) {
+  i->snap = snap;
+  i->in_base = false;
+  upb_strtable_begin(&i->iter, &snap->delta);
+  upb_snapshot_skip(i);
+}
+
+static bool upb_snapshot_done(upb_snapshot_iter *i) {
+  return i->in_base && upb_strtable_done(&i->iter);
+}
+
+static void upb_snapshot_next(upb_snapshot_iter *i) {
+  upb_strtable_next(&i->iter);
+  upb_snapshot_skip(i);
+}
+
+static upb_def *upb_snapshot_iter_def(upb_snapshot_iter *i) {
+  return upb_value_getptr(upb_strtable_iter_value(&i->iter));
+}
+
+static void upb_symtab_freetable(upb_strtable *t, const void *owner) {
+  upb_strtable_iter i;
+  upb_strtable_begin(&i, t);
+  for (; !upb_strtable_done(&i); upb_strtable_next(&i))
+    upb_def_unref(upb_value_getptr(upb_strtable_iter_value(&i)), owner);
+  upb_strtable_uninit(t);
+}
+
+static void upb_symtab_freesnapshot(upb_symtab_snapshot *snap) {
+  upb_symtab_freetable(&snap->delta, snap);
+  if (--snap->base->snapshots == 0) {
+    upb_symtab_freetable(&snap->base->table, snap->base);
+    free(snap->base);
+  }
+  free(snap);
+}
+
+// Frees a snapshot built by upb_symtab_newsnapshot() that was never
+// published, and so owns no refs.
+static void upb_symtab_discardsnapshot(upb_symtab_snapshot *next,
+                                       const upb_symtab_snapshot *cur) {
+  upb_strtable_uninit(&next->delta);
+  if (next->base != cur->base) {
+    upb_strtable_uninit(&next->base->table);
+    free(next->base);
+  }
+  free(next);
+}
+
+static bool upb_symtab_shouldmerge(size_t base_count, size_t delta_count) {
+  return delta_count > 16 && delta_count * delta_count > base_count;
+}
+
+// Builds the snapshot that results from adding "defs" to "cur", without taking
+// any refs.  Returns NULL if memory allocation failed.
+static upb_symtab_snapshot *upb_symtab_newsnapshot(
+    const upb_symtab_snapshot *cur, upb_def *const*defs, int n) {
+  upb_symtab_snapshot *next = malloc(sizeof(*next));
+  if (!next) return NULL;
+  if (!upb_strtable_init(&next->delta)) {
+    free(next);
+    return NULL;
+  }
+  next->base = cur->base;
+  upb_strtable *t = &next->delta;
+  if (upb_symtab_shouldmerge(upb_strtable_count(&cur->base->table),
+                             upb_strtable_count(&cur->delta) + n)) {
+    next->base = malloc(sizeof(*next->base));
+    if (!next->base) goto err;
+    if (!upb_strtable_init(&next->base->table)) {
+      free(next->base);
+      next->base = cur->base;
+      goto err;
+    }
+    next->base->snapshots = 0;
+    t = &next->base->table;
+    upb_snapshot_iter i;
+    for (upb_snapshot_begin(&i, cur); !upb_snapshot_done(&i);
+         upb_snapshot_next(&i)) {
+      if (!upb_strtable_insertl(t, upb_strtable_iter_key(&i.iter),
+                                upb_strtable_iter_keylength(&i.iter),
+                                upb_strtable_iter_value(&i.iter)))
+        goto err;
+    }
+  } else {
+    upb_strtable_iter i;
+    upb_strtable_begin(&i, &cur->delta);
+    for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+      if (!upb_strtable_insertl(t, upb_strtable_iter_key(&i),
+                                upb_strtable_iter_keylength(&i),
+                                upb_strtable_iter_value(&i)))
+        goto err;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    const char *name = upb_def_fullname(defs[i]);
+    upb_value *v = upb_strtable_lookup(t, name);
+    if (v) {
+      upb_value_setptr(v, defs[i]);
+    } else if (!upb_strtable_insert(t, name, upb_value_ptr(defs[i]))) {
+      goto err;
+    }
+  }
+  return next;
+
+err:
+  upb_symtab_discardsnapshot(next, cur);
+  return NULL;
+}
+
+// Takes the refs for the table that "next" does not share with "cur".  The
+// refs on the defs in "addtab" are donated by ref_donor instead.
+static void upb_symtab_refsnapshot(upb_symtab_snapshot *next,
+                                   const upb_symtab_snapshot *cur,
+                                   const upb_strtable *addtab,
+                                   const void *ref_donor) {
+  upb_strtable *t = &next->delta;
+  const void *owner = next;
+  if (next->base != cur->base) {
+    t = &next->base->table;
+    owner = next->base;
+    upb_strtable_optimize(t);
+  }
+  next->base->snapshots++;
+  upb_strtable_iter i;
+  upb_strtable_begin(&i, t);
+  for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+    upb_def *def = upb_value_getptr(upb_strtable_iter_value(&i));
+    const upb_value *v = !addtab ? NULL : upb_strtable_lookupl(
+        addtab, upb_strtable_iter_key(&i), upb_strtable_iter_keylength(&i));
+    if (v && upb_value_getptr(*v) == def) {
+      upb_def_donateref(def, ref_donor, owner);
+    } else {
+      upb_def_ref(def, owner);
+    }
+  }
+}
+
+// Read side: a reader registers itself in the counter for the current epoch
+// *before* loading the snapshot pointer.  If the epoch moved in between, it
+// re-registers; this guarantees that a writer draining the counter for the
+// epoch it just retired cannot miss a reader that holds the old snapshot.
+//
+// Snapshots of an immortal symtab are never freed while it is live, so
+// readers skip the counters altogether.
+static const upb_symtab_snapshot *upb_symtab_beginread(const upb_symtab *s,
+                                                       uint32_t **counter) {
+  upb_symtab *m = (upb_symtab*)s;
+  if (upb_atomic_read(&m->immortal)) {
+    *counter = NULL;
+    return upb_atomic_readptr((void*const*)&m->snapshot);
+  }
+  while (1) {
+    uint32_t epoch = upb_atomic_read(&m->epoch);
+    uint32_t *c = &m->readers[epoch & 1];
+    upb_atomic_inc(c);
+    if (upb_atomic_read(&m->epoch) == epoch) {
+      *counter = c;
+      return upb_atomic_readptr((void*const*)&m->snapshot);
+    }
+    upb_atomic_dec(c);
+  }
+}
+
+static void upb_symtab_endread(uint32_t *counter) {
+  if (counter) upb_atomic_dec(counter);
+}
+
+// Write side: publishes "next" as the current snapshot and frees the previous
+// one once all lookups that may have loaded it are done.  Lookups that start
+// after the epoch bump register in the other counter and can only see "next",
+// so the wait is bounded by the longest in-flight lookup.  Must be called with
+// the write lock held.
+static void upb_symtab_publish(upb_symtab *s, upb_symtab_snapshot *next) {
+  upb_symtab_snapshot *prev = s->snapshot;
+  upb_atomic_writeptr((void**)&s->snapshot, next);
+  if (s->immortal) {
+    upb_symtab_snapshot **retired =
+        realloc(s->retired, sizeof(*retired) * (s->retired_count + 1));
+    // Without room to record it the snapshot is leaked; its defs are
+    // immortal anyway.
+    if (!retired) return;
+    s->retired = retired;
+    s->retired[s->retired_count++] = prev;
+    return;
+  }
+  uint32_t epoch = upb_atomic_read(&s->epoch);
+  upb_atomic_inc(&s->epoch);
+  while (upb_atomic_read(&s->readers[epoch & 1]) != 0) upb_atomic_yield();
+  upb_symtab_freesnapshot(prev);
+}
+
+/* upb_symtab reverse-dependency index ***************************************/
+
+// s->rdeps maps a def name to the set of names of msgdefs in the current
+// snapshot that have a field referring to it.  Each set is a strtable of
+// name -> bool; since strtables do not support removal, an edge that goes
+// away is just set to false.  The index is private to writers.
+
+static void upb_symtab_freerdeps(upb_strtable *rdeps) {
+  upb_strtable_iter i;
+  upb_strtable_begin(&i, rdeps);
+  for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+    upb_strtable *set = upb_value_getptr(upb_strtable_iter_value(&i));
+    upb_strtable_uninit(set);
+    free(set);
+  }
+  upb_strtable_uninit(rdeps);
+}
+
+// Adds (live == true) or removes the edges from "def" to its subdefs.
+// Returns false if memory allocation failed, in which case the index is
+// incomplete.
+static bool upb_symtab_indexdef(upb_strtable *rdeps, const upb_def *def,
+                                bool live) {
+  const upb_msgdef *m = upb_dyncast_msgdef_const(def);
+  if (!m) return true;
+  const char *name = upb_def_fullname(def);
+  upb_msg_iter i;
+  for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
+    upb_fielddef *f = upb_msg_iter_field(&i);
+    const upb_def *subdef = upb_hassubdef(f) ? upb_fielddef_subdef(f) : NULL;
+    if (!subdef || !upb_def_fullname(subdef)) continue;
+    upb_value *v = upb_strtable_lookup(rdeps, upb_def_fullname(subdef));
+    upb_strtable *set;
+    if (v) {
+      set = upb_value_getptr(*v);
+    } else {
+      if (!live) continue;
+      set = malloc(sizeof(*set));
+      if (!set) return false;
+      if (!upb_strtable_init(set)) {
+        free(set);
+        return false;
+      }
+      if (!upb_strtable_insert(
+              rdeps, upb_def_fullname(subdef), upb_value_ptr(set))) {
+        upb_strtable_uninit(set);
+        free(set);
+        return false;
+      }
+    }
+    upb_value *edge = upb_strtable_lookup(set, name);
+    if (edge) {
+      upb_value_setbool(edge, live);
+    } else if (live && !upb_strtable_insert(set, name, upb_value_bool(true))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool upb_symtab_rebuildrdeps(upb_symtab *s) {
+  upb_symtab_freerdeps(&s->rdeps);
+  s->rdeps_valid = upb_strtable_init(&s->rdeps);
+  if (!s->rdeps_valid) return false;
+  upb_snapshot_iter i;
+  for (upb_snapshot_begin(&i, s->snapshot); !upb_snapshot_done(&i);
+       upb_snapshot_next(&i)) {
+    if (!upb_symtab_indexdef(&s->rdeps, upb_snapshot_iter_def(&i), true)) {
+      s->rdeps_valid = false;
+      return false;
+    }
+  }
+  return true;
+}
+
 upb_symtab *upb_symtab_new(const void *owner) {
   upb_symtab *s = malloc(sizeof(*s));
+  if (!s) return NULL;
+  upb_symtab_snapshot *snap = malloc(sizeof(*snap));
+  upb_symtab_base *base = malloc(sizeof(*base));
+  if (!snap || !base) goto err;
+  if (!upb_strtable_init(&base->table)) goto err;
+  if (!upb_strtable_init(&snap->delta)) goto err2;
+  if (!upb_strtable_init(&s->rdeps)) goto err3;
+  base->snapshots = 1;
+  snap->base = base;
+  s->snapshot = snap;
+  s->rdeps_valid = true;
+  s->epoch = 0;
+  s->readers[0] = 0;
+  s->readers[1] = 0;
+  s->writelock = 0;
+  s->immortal = false;
+  s->retired = NULL;
+  s->retired_count = 0;
+  s->load = NULL;
+  s->load_closure = NULL;
+  s->load_free = NULL;
+  s->loadlock = 0;
   upb_refcount_init(&s->refcount, owner);
-  upb_strtable_init(&s->symtab);
   return s;
+
+err3:
+  upb_strtable_uninit(&snap->delta);
+err2:
+  upb_strtable_uninit(&base->table);
+err:
+  free(base);
+  free(snap);
+  free(s);
+  return NULL;
 }
 
 void upb_symtab_ref(const upb_symtab *s, const void *owner) {
@@ -739,11 +1413,12 @@ void upb_symtab_ref(const upb_symtab *s, const void *owner) {
 void upb_symtab_unref(const upb_symtab *s, const void *owner) {
   if(s && upb_refcount_unref(&s->refcount, owner)) {
     upb_symtab *destroying = (upb_symtab*)s;
-    upb_strtable_iter i;
-    upb_strtable_begin(&i, &destroying->symtab);
-    for (; !upb_strtable_done(&i); upb_strtable_next(&i))
-      upb_def_unref(upb_value_getptr(upb_strtable_iter_value(&i)), s);
-    upb_strtable_uninit(&destroying->symtab);
+    upb_symtab_freesnapshot(destroying->snapshot);
+    for (size_t i = 0; i < destroying->retired_count; i++)
+      upb_symtab_freesnapshot(destroying->retired[i]);
+    free(destroying->retired);
+    upb_symtab_freerdeps(&destroying->rdeps);
+    if (destroying->load_free) destroying->load_free(destroying->load_closure);
     upb_refcount_uninit(&destroying->refcount);
     free(destroying);
   }
@@ -756,15 +1431,18 @@ void upb_symtab_donateref(
 
 const upb_def **upb_symtab_getdefs(const upb_symtab *s, int *count,
                                    upb_deftype_t type, const void *owner) {
-  int total = upb_strtable_count(&s->symtab);
+  uint32_t *reading;
+  const upb_symtab_snapshot *snap = upb_symtab_beginread(s, &reading);
+  int total = upb_strtable_count(&snap->base->table) +
+              upb_strtable_count(&snap->delta);
   // We may only use part of this, depending on how many symbols are of the
   // correct type.
   const upb_def **defs = malloc(sizeof(*defs) * total);
-  upb_strtable_iter iter;
-  upb_strtable_begin(&iter, &s->symtab);
+  upb_snapshot_iter iter;
+  upb_snapshot_begin(&iter, snap);
   int i = 0;
-  for(; !upb_strtable_done(&iter); upb_strtable_next(&iter)) {
-    upb_def *def = upb_value_getptr(upb_strtable_iter_value(&iter));
+  for(; !upb_snapshot_done(&iter); upb_snapshot_next(&iter)) {
+    upb_def *def = upb_snapshot_iter_def(&iter);
     assert(def);
     if(type == UPB_DEF_ANY || def->type == type)
       defs[i++] = def;
@@ -772,38 +1450,73 @@ const upb_def **upb_symtab_getdefs(const upb_symtab *s, int *count,
   *count = i;
   if (owner)
     for(i = 0; i < *count; i++) upb_def_ref(defs[i], owner);
+  upb_symtab_endread(reading);
   return defs;
 }
 
-const upb_def *upb_symtab_lookup(const upb_symtab *s, const char *sym,
-                                 const void *owner) {
-  const upb_value *v = upb_strtable_lookup(&s->symtab, sym);
-  upb_def *ret = v ? upb_value_getptr(*v) : NULL;
+void upb_symtab_setloader(upb_symtab *s, upb_symtab_loadfunc *load,
+                          void *closure, void (*free)(void *closure)) {
+  if (s->load_free) s->load_free(s->load_closure);
+  s->load = load;
+  s->load_closure = closure;
+  s->load_free = free;
+}
+
+// Gives the loader a chance to add "sym" after a lookup missed it.  Returns
+// false if there is no loader, so there is no point in retrying the lookup.
+static bool upb_symtab_load(const upb_symtab *s, const char *sym, size_t len) {
+  upb_symtab *m = (upb_symtab*)s;
+  if (!m->load) return false;
+  upb_atomic_lock(&m->loadlock);
+  m->load(m, sym, len, m->load_closure);
+  upb_atomic_unlock(&m->loadlock);
+  return true;
+}
+
+static const upb_def *upb_symtab_dolookupl(const upb_symtab *s,
+                                           const char *sym, size_t len,
+                                           const void *owner) {
+  uint32_t *reading;
+  upb_def *ret =
+      upb_snapshot_lookupl(upb_symtab_beginread(s, &reading), sym, len);
   if (ret) upb_def_ref(ret, owner);
+  upb_symtab_endread(reading);
   return ret;
 }
 
+const upb_def *upb_symtab_lookupl(const upb_symtab *s, const char *sym,
+                                  size_t len, const void *owner) {
+  const upb_def *ret = upb_symtab_dolookupl(s, sym, len, owner);
+  if (!ret && upb_symtab_load(s, sym, len))
+    ret = upb_symtab_dolookupl(s, sym, len, owner);
+  return ret;
+}
+
+const upb_def *upb_symtab_lookup(const upb_symtab *s, const char *sym,
+                                 const void *owner) {
+  return upb_symtab_lookupl(s, sym, strlen(sym), owner);
+}
+
 const upb_msgdef *upb_symtab_lookupmsg(const upb_symtab *s, const char *sym,
                                        const void *owner) {
-  const upb_value *v = upb_strtable_lookup(&s->symtab, sym);
-  upb_def *def = v ? upb_value_getptr(*v) : NULL;
-  upb_msgdef *ret = NULL;
-  if(def && def->type == UPB_DEF_MSG) {
-    ret = upb_downcast_msgdef(def);
-    upb_def_ref(def, owner);
+  const upb_def *def = upb_symtab_lookup(s, sym, owner);
+  if (def && def->type != UPB_DEF_MSG) {
+    upb_def_unref(def, owner);
+    return NULL;
   }
-  return ret;
+  return def ? upb_downcast_msgdef_const(def) : NULL;
 }
 
 // Given a symbol and the base symbol inside which it is defined, find the
 // symbol's definition in t.
 static upb_def *upb_resolvename(const upb_strtable *t,
                                 const char *base, const char *sym) {
-  if(strlen(sym) == 0) return NULL;
+  size_t len = strlen(sym);
+  if(len == 0) return NULL;
   if(sym[0] == UPB_SYMBOL_SEPARATOR) {
     // Symbols starting with '.' are absolute, so we do a single lookup.
     // Slice to omit the leading '.'
-    const upb_value *v = upb_strtable_lookup(t, sym + 1);
+    const upb_value *v = upb_strtable_lookupl(t, sym + 1, len - 1);
     return v ? upb_value_getptr(*v) : NULL;
   } else {
     // Remove components from base until we find an entry or run out.
@@ -814,90 +1527,37 @@ static upb_def *upb_resolvename(const upb_strtable *t,
   }
 }
 
+static upb_def *upb_snapshot_resolve(const upb_symtab_snapshot *snap,
+                                     const char *base, const char *sym) {
+  upb_def *ret = upb_resolvename(&snap->delta, base, sym);
+  return ret ? ret : upb_resolvename(&snap->base->table, base, sym);
+}
+
 const upb_def *upb_symtab_resolve(const upb_symtab *s, const char *base,
                                   const char *sym, const void *owner) {
-  upb_def *ret = upb_resolvename(&s->symtab, base, sym);
+  uint32_t *reading;
+  upb_def *ret =
+      upb_snapshot_resolve(upb_symtab_beginread(s, &reading), base, sym);
   if (ret) upb_def_ref(ret, owner);
+  upb_symtab_endread(reading);
+  // Only fully-qualified names are resolved (see upb_resolvename()), so the
+  // loader can be asked for the name itself.
+  if (!ret && s->load && sym[0] == UPB_SYMBOL_SEPARATOR)
+    return upb_symtab_lookup(s, sym + 1, owner);
   return ret;
 }
 
-// Adds dups of any existing def that can reach a def with the same name as one
-// of "defs."  This is to provide a consistent output graph as documented in
-// the header file.  We use a modified depth-first traversal that traverses
-// each SCC (which we already computed) as if it were a single node.  This
-// allows us to traverse the possibly-cyclic graph as if it were a DAG and to
-// easily dup the correct set of nodes with O(n) time.
-//
-// Returns true if defs that can reach "def" need to be duplicated into deftab.
-static bool upb_resolve_dfs(const upb_def *def, upb_strtable *deftab,
-                            const void *new_owner, upb_inttable *seen,
-                            upb_status *s) {
-  // Memoize results of this function for efficiency (since we're traversing a
-  // DAG this is not needed to limit the depth of the search).
-  upb_value *v = upb_inttable_lookup(seen, (uintptr_t)def);
-  if (v) return upb_value_getbool(*v);
-
-  // Visit submessages for all messages in the SCC.
-  bool need_dup = false;
-  const upb_def *base = def;
-  do {
-    assert(upb_def_isfinalized(def));
-    if (def->type == UPB_DEF_FIELD) continue;
-    upb_value *v = upb_strtable_lookup(deftab, upb_def_fullname(def));
-    if (v) {
-      upb_def *add_def = upb_value_getptr(*v);
-      if (add_def->refcount.next && add_def->refcount.next != &def->refcount) {
-        upb_status_seterrf(s, "conflicting existing defs for name: '%s'",
-                           upb_def_fullname(def));
-        return false;
-      }
-      need_dup = true;
-    }
-    const upb_msgdef *m = upb_dyncast_msgdef_const(def);
-    if (m) {
-      upb_msg_iter i;
-      for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
-        upb_fielddef *f = upb_msg_iter_field(&i);
-        if (!upb_hassubdef(f)) continue;
-        // |= to avoid short-circuit; we need its side-effects.
-        need_dup |= upb_resolve_dfs(
-            upb_fielddef_subdef_mutable(f), deftab, new_owner, seen, s);
-        if (!upb_ok(s)) return false;
-      }
-    }
-  } while ((def = (upb_def*)def->refcount.next) != base);
-
-  if (need_dup) {
-    // Dup any defs that don't already have entries in deftab.
-    def = base;
-    do {
-      if (def->type == UPB_DEF_FIELD) continue;
-      const char *name = upb_def_fullname(def);
-      if (upb_strtable_lookup(deftab, name) == NULL) {
-        upb_def *newdef = upb_def_dup(def, new_owner);
-        if (!newdef) goto oom;
-        // We temporarily use this field to track who we were dup'd from.
-        newdef->refcount.next = (upb_refcount*)def;
-        if (!upb_strtable_insert(deftab, name, upb_value_ptr(newdef)))
-          goto oom;
-      }
-    } while ((def = (upb_def*)def->refcount.next) != base);
-  }
-
-  upb_inttable_insert(seen, (uintptr_t)def, upb_value_bool(need_dup));
-  return need_dup;
-
-oom:
-  upb_status_seterrliteral(s, "out of memory");
-  return false;
-}
-
 bool upb_symtab_add(upb_symtab *s, upb_def *const*defs, int n, void *ref_donor,
                     upb_status *status) {
   upb_def **add_defs = NULL;
+  const char **queue = NULL;
+  upb_symtab_snapshot *next = NULL;
   upb_strtable addtab;
+  const int user_n = n;
+  upb_atomic_lock(&s->writelock);
   if (!upb_strtable_init(&addtab)) {
     upb_status_seterrliteral(status, "out of memory");
+    upb_atomic_unlock(&s->writelock);
     return false;
   }
 
@@ -923,17 +1583,45 @@ bool upb_symtab_add(upb_symtab *s, upb_def *const*defs, int n, void *ref_donor,
   }
 
   // Add dups of any existing def that can reach a def with the same name as
-  // one of "defs."
-  upb_inttable seen;
-  if (!upb_inttable_init(&seen)) goto oom_err;
+  // one of "defs," to provide a consistent output graph as documented in the
+  // header file.  This is a breadth-first walk of the reverse-dependency
+  // index starting from the added names, so it only visits defs that
+  // actually need to be dup'd rather than the whole symtab.
+  if (!s->rdeps_valid && !upb_symtab_rebuildrdeps(s)) goto oom_err;
+  size_t queue_size = UPB_MAX(n, 8), queue_len = 0;
+  queue = malloc(sizeof(*queue) * queue_size);
+  if (!queue) goto oom_err;
+  for (int i = 0; i < n; i++) queue[queue_len++] = upb_def_fullname(defs[i]);
   upb_strtable_iter i;
-  upb_strtable_begin(&i, &s->symtab);
-  for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
-    upb_def *def = upb_value_getptr(upb_strtable_iter_value(&i));
-    upb_resolve_dfs(def, &addtab, ref_donor, &seen, status);
-    if (!upb_ok(status)) goto err;
+  for (size_t head = 0; head < queue_len; head++) {
+    const upb_value *v = upb_strtable_lookup(&s->rdeps, queue[head]);
+    if (!v) continue;
+    upb_strtable_begin(&i, upb_value_getptr(*v));
+    for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+      if (!upb_value_getbool(upb_strtable_iter_value(&i))) continue;
+      const char *name = upb_strtable_iter_key(&i);
+      if (upb_strtable_lookup(&addtab, name)) continue;
+      upb_def *def = upb_snapshot_lookup(s->snapshot, name);
+      assert(def);
+      upb_def *newdef = upb_def_dup(def, ref_donor);
+      if (!newdef) goto oom_err;
+      // We temporarily use this field to track who we were dup'd from.
+      newdef->refcount.next = (upb_refcount*)def;
+      if (!upb_strtable_insert(&addtab, name, upb_value_ptr(newdef))) {
+        upb_def_unref(newdef, ref_donor);
+        goto oom_err;
+      }
+      if (queue_len == queue_size) {
+        queue_size *= 2;
+        const char **new_queue = realloc(queue, sizeof(*queue) * queue_size);
+        if (!new_queue) goto oom_err;
+        queue = new_queue;
+      }
+      queue[queue_len++] = upb_def_fullname(newdef);
+    }
   }
-  upb_inttable_uninit(&seen);
+  free(queue);
+  queue = NULL;
 
   // Now using the table, resolve symbolic references.
   upb_strtable_begin(&i, &addtab);
@@ -949,7 +1637,10 @@ bool upb_symtab_add(upb_symtab *s, upb_def *const*defs, int n, void *ref_donor,
       upb_fielddef *f = upb_msg_iter_field(&j);
       const char *name = upb_fielddef_subtypename(f);
       if (name) {
+        // Defs that are not being added or dup'd are referenced directly
+        // from the current snapshot.
         upb_def *subdef = upb_resolvename(&addtab, base, name);
+        if (!subdef) subdef = upb_snapshot_resolve(s->snapshot, base, name);
         if (subdef == NULL) {
           upb_status_seterrf(
               status, "couldn't resolve name '%s' in message '%s'", name, base);
@@ -975,41 +1666,120 @@ bool upb_symtab_add(upb_symtab *s, upb_def *const*defs, int n, void *ref_donor,
   for (n = 0; !upb_strtable_done(&i); upb_strtable_next(&i))
     add_defs[n++] = upb_value_getptr(upb_strtable_iter_value(&i));
 
+  // Build the next snapshot before finalizing, so that running out of memory
+  // leaves the symtab untouched.  Concurrent readers keep using the current
+  // snapshot.
+  next = upb_symtab_newsnapshot(s->snapshot, add_defs, n);
+  if (!next) goto oom_err;
+
   // Restore the next pointer that we stole.
   for (int i = 0; i < n; i++)
     add_defs[i]->refcount.next = &add_defs[i]->refcount;
 
   if (!upb_finalize(add_defs, n, status)) goto err;
-  upb_strtable_uninit(&addtab);
 
-  for (int i = 0; i < n; i++) {
-    upb_def *def = add_defs[i];
-    const char *name = upb_def_fullname(def);
-    upb_def_donateref(def, ref_donor, s);
-    upb_value *v = upb_strtable_lookup(&s->symtab, name);
-    if(v) {
-      upb_def_unref(upb_value_getptr(*v), s);
-      upb_value_setptr(v, def);
-    } else {
-      upb_strtable_insert(&s->symtab, name, upb_value_ptr(def));
-    }
+  // The new snapshot takes over the donated refs on the new defs.
+  upb_symtab_refsnapshot(next, s->snapshot, &addtab, ref_donor);
+  upb_strtable_uninit(&addtab);
+  if (s->immortal)
+    for (int i = 0; i < n; i++) upb_def_makeimmortal(add_defs[i]);
+
+  // Update the reverse-dependency index for the defs that changed.  If that
+  // runs out of memory, it is rebuilt from scratch by the next add.
+  for (int i = 0; i < n && s->rdeps_valid; i++) {
+    upb_def *old = upb_snapshot_lookup(s->snapshot,
+                                       upb_def_fullname(add_defs[i]));
+    if (old) upb_symtab_indexdef(&s->rdeps, old, false);
+    s->rdeps_valid = upb_symtab_indexdef(&s->rdeps, add_defs[i], true);
   }
+  upb_symtab_publish(s, next);
+  upb_atomic_unlock(&s->writelock);
   free(add_defs);
   return true;
 
 oom_err:
   upb_status_seterrliteral(status, "out of memory");
 err: {
-    // Need to unref any defs we dup'd (we can distinguish them from defs that
-    // the user passed in by their def->refcount.next pointers).
+    // The refs on all defs were donated, both the user's and the ones we dup'd.
+    // First release the user's defs that never made it into addtab (the ones
+    // rejected above), since they will not be found by iterating it.
+    for (int i = 0; i < user_n; i++) {
+      const char *name = upb_def_fullname(defs[i]);
+      const upb_value *v = name ? upb_strtable_lookup(&addtab, name) : NULL;
+      if (!v || upb_value_getptr(*v) != defs[i])
+        upb_def_unref(defs[i], ref_donor);
+    }
     upb_strtable_iter i;
     upb_strtable_begin(&i, &addtab);
     for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
       upb_def *def = upb_value_getptr(upb_strtable_iter_value(&i));
-      if (def->refcount.next) upb_def_unref(def, s);
+      // Restore the next pointer in case we stole it.
+      def->refcount.next = &def->refcount;
+      upb_def_unref(def, ref_donor);
     }
   }
   upb_strtable_uninit(&addtab);
+  free(queue);
+  if (next) upb_symtab_discardsnapshot(next, s->snapshot);
+  upb_atomic_unlock(&s->writelock);
   free(add_defs);
   return false;
 }
+
+bool upb_symtab_addfinalized(upb_symtab *s, const upb_def *const*defs, int n,
+                             upb_status *status) {
+  upb_strtable names;
+  if (!upb_strtable_init(&names)) {
+    upb_status_seterrliteral(status, "out of memory");
+    return false;
+  }
+  upb_atomic_lock(&s->writelock);
+  for (int i = 0; i < n; i++) {
+    assert(upb_def_isfinalized(defs[i]));
+    const char *name = upb_def_fullname(defs[i]);
+    if (!name) {
+      upb_status_seterrliteral(
+          status, "Anonymous defs cannot be added to a symtab");
+      goto err;
+    }
+    if (upb_strtable_lookup(&names, name) ||
+        upb_snapshot_lookup(s->snapshot, name)) {
+      upb_status_seterrf(status, "Conflicting defs named '%s'", name);
+      goto err;
+    }
+    if (!upb_strtable_insert(&names, name, upb_value_bool(true))) goto oom;
+  }
+  upb_symtab_snapshot *next =
+      upb_symtab_newsnapshot(s->snapshot, (upb_def*const*)defs, n);
+  if (!next) goto oom;
+  // The snapshot takes its own refs, on these defs as on the others.
+  upb_symtab_refsnapshot(next, s->snapshot, NULL, NULL);
+  // Static defs are immortal already, and may be in read-only memory.
+  for (int i = 0; i < n && s->immortal; i++)
+    if (!upb_def_isimmortal(defs[i])) upb_def_makeimmortal(defs[i]);
+  for (int i = 0; i < n && s->rdeps_valid; i++)
+    s->rdeps_valid = upb_symtab_indexdef(&s->rdeps, defs[i], true);
+  upb_symtab_publish(s, next);
+  upb_atomic_unlock(&s->writelock);
+  upb_strtable_uninit(&names);
+  return true;
+
+oom:
+  upb_status_seterrliteral(status, "out of memory");
+err:
+  upb_atomic_unlock(&s->writelock);
+  upb_strtable_uninit(&names);
+  return false;
+}
+
+void upb_symtab_makeimmortal(upb_symtab *s) {
+  upb_atomic_lock(&s->writelock);
+  upb_snapshot_iter i;
+  for (upb_snapshot_begin(&i, s->snapshot); !upb_snapshot_done(&i);
+       upb_snapshot_next(&i))
+    upb_def_makeimmortal(upb_snapshot_iter_def(&i));
+  // Readers that registered before this store still drain their counter;
+  // later ones skip it.
+  upb_atomic_write(&s->immortal, true);
+  upb_atomic_unlock(&s->writelock);
+}
@@ -65,11 +65,15 @@ typedef enum {
   UPB_DEF_ANY = -1,         // Wildcard for upb_symtab_get*()
 } upb_deftype_t;
 
+struct _upb_namepool;
+
 typedef struct _upb_def {
   upb_refcount refcount;
   char *fullname;
   upb_deftype_t type;
   bool is_finalized;
+  // If set, fullname is interned in this pool instead of being malloc'd.
+  struct _upb_namepool *namepool;
 } upb_def;
 
 #define UPB_UPCAST(ptr) (&(ptr)->base)
@@ -80,6 +84,19 @@ void upb_def_ref(const upb_def *def, const void *owner);
 void upb_def_unref(const upb_def *def, const void *owner);
 void upb_def_donateref(const upb_def *def, const void *from, const void *to);
 
+// Makes a finalized def immortal (along with every def in its strongly-
+// connected component): ref/unref/donateref become no-ops that do not touch
+// the shared refcount, and the def is never freed.  Defs it can reach in
+// other SCCs are kept alive forever too, but remain refcounted.
+void upb_def_makeimmortal(const upb_def *def);
+bool upb_def_isimmortal(const upb_def *def);
+
+// Frees every def made immortal by upb_def_makeimmortal(), for leak checkers
+// at exit.  All refs on them must have been released (under UPB_DEBUG_REFS
+// refs on immortal defs are still tracked), and none of them may be used
+// afterwards.  Not thread-safe.
+void upb_def_freeimmortals(void);
+
 upb_def *upb_def_dup(const upb_def *def, const void *owner);
 
 // A def is mutable until it has been finalized.
@@ -110,9 +127,12 @@ bool upb_def_setfullname(upb_def *def, const char *fullname);
 // elsewhere in "defs."  "defs" may not contain fielddefs, but any fielddefs
 // reachable from the given msgdefs will be finalized.
 //
-// n is currently limited to 64k defs, if more are required break them into
-// batches of 64k (or we could raise this limit, at the cost of a bigger
-// upb_def structure or complexity in upb_finalize()).
+// There is no limit on n; finalizing takes time and memory linear in the
+// number of defs and fields.
+//
+// Finalizing also compacts the defs: the names of all the defs and fields are
+// interned in a single string pool shared by the whole batch, and each
+// msgdef's fields are sorted by number (see upb_msgdef below).
 bool upb_finalize(upb_def *const*defs, int n, upb_status *status);
 
 
@@ -352,13 +372,19 @@ const char *upb_fielddef_subtypename(upb_fielddef *f);
 typedef struct _upb_msgdef {
   upb_def base;
 
-  // Tables for looking up fields by number and name.
+  // Tables for looking up fields by number and name.  Once the msgdef is
+  // finalized "itof" is freed, and numbers are looked up in "fields" instead.
   upb_inttable itof;  // int to field
   upb_strtable ntof;  // name to field
 
+  // The fields in the order they were added, then sorted by number when the
+  // msgdef is finalized.
+  upb_fielddef **fields;
+  uint32_t field_count, fields_size;
+
   // The following fields may be modified while mutable.
   uint16_t size;
-  uint8_t hasbit_bytes;
+  uint16_t hasbit_bytes;
   // The range of tag numbers used to store extensions.
   uint32_t extstart, extend;
   // Used for proto2 integration.
@@ -384,7 +410,7 @@ upb_msgdef *upb_msgdef_dup(const upb_msgdef *m, const void *owner);
 
 // Read accessors.  May be called at any time.
 INLINE size_t upb_msgdef_size(const upb_msgdef *m) { return m->size; }
-INLINE uint8_t upb_msgdef_hasbit_bytes(const upb_msgdef *m) {
+INLINE uint16_t upb_msgdef_hasbit_bytes(const upb_msgdef *m) {
   return m->hasbit_bytes;
 }
 INLINE uint32_t upb_msgdef_extstart(const upb_msgdef *m) { return m->extstart; }
@@ -395,6 +421,37 @@ void upb_msgdef_setsize(upb_msgdef *m, uint16_t size);
 void upb_msgdef_sethasbit_bytes(upb_msgdef *m, uint16_t bytes);
 bool upb_msgdef_setextrange(upb_msgdef *m, uint32_t start, uint32_t end);
 
+// Computes an in-memory layout for the message and sets it with the write
+// accessors above: the size and hasbit_bytes of the msgdef and the offset and
+// hasbit of every field, replacing any values set before.  The hasbits come
+// first, one per non-repeated field (repeated fields get -1) and packed
+// densely; then come the fields, grouped by alignment to minimize padding.
+// Strings, submessages and repeated fields are stored as a pointer.
+//
+// If "freq" is non-NULL it is called once per field and returns how often the
+// field is accessed (for example, counts from a decoding profile).  Fields with
+// a nonzero frequency are then placed first, hottest first, for as long as they
+// fit in the first UPB_LAYOUT_HOTBYTES bytes of the message along with the
+// hasbits, and they get the lowest hasbits.  Otherwise fields of the same
+// alignment are laid out in number order, so the layout is deterministic.
+//
+// The msgdef must be mutable.  Returns false (and leaves the msgdef unchanged)
+// if a field has no type, if the message would be too large for a uint16_t
+// size, if it needs more hasbits than an int16_t can number, or if out of
+// memory.
+#define UPB_LAYOUT_HOTBYTES 64
+typedef uint32_t upb_fieldfreq(const upb_fielddef *f, void *closure);
+bool upb_msgdef_layoutwith(upb_msgdef *m, upb_fieldfreq *freq, void *closure);
+INLINE bool upb_msgdef_layout(upb_msgdef *m) {
+  return upb_msgdef_layoutwith(m, NULL, NULL);
+}
+
+// Lays out every msgdef in "defs" as upb_msgdef_layoutwith() does, skipping
+// other defs.  On failure status names the msgdef that could not be laid out
+// and the reason; the msgdefs before it have already been laid out.
+bool upb_layout(upb_def *const*defs, int n, upb_fieldfreq *freq, void *closure,
+                upb_status *status);
+
 // Adds a set of fields (upb_fielddef objects) to a msgdef.  Requires that the
 // msgdef and all the fielddefs are mutable.  The fielddef's name and number
 // must be set, and the message may not already contain any field with this
@@ -416,7 +473,14 @@ INLINE bool upb_msgdef_addfield(upb_msgdef *m, upb_fielddef *f,
 // Looks up a field by name or number.  While these are written to be as fast
 // as possible, it will still be faster to cache the results of this lookup if
 // possible.  These return NULL if no such field is found.
+upb_fielddef *upb_msgdef_bsearch(const upb_msgdef *m, uint32_t i);
 INLINE upb_fielddef *upb_msgdef_itof(const upb_msgdef *m, uint32_t i) {
+  if (m->base.is_finalized) {
+    // Fields numbered 1..n are found directly, others by binary search.
+    if (i - 1 < m->field_count && m->fields[i - 1]->number == (int32_t)i)
+      return m->fields[i - 1];
+    return upb_msgdef_bsearch(m, i);
+  }
   const upb_value *val = upb_inttable_lookup32(&m->itof, i);
   return val ? (upb_fielddef*)upb_value_getptr(*val) : NULL;
 }
@@ -426,27 +490,39 @@ INLINE upb_fielddef *upb_msgdef_ntof(const upb_msgdef *m, const char *name) {
   return val ? (upb_fielddef*)upb_value_getptr(*val) : NULL;
 }
 
+// Like upb_msgdef_ntof(), but the name need not be NULL-terminated.
+INLINE upb_fielddef *upb_msgdef_ntofl(const upb_msgdef *m, const char *name,
+                                      size_t len) {
+  const upb_value *val = upb_strtable_lookupl(&m->ntof, name, len);
+  return val ? (upb_fielddef*)upb_value_getptr(*val) : NULL;
+}
+
 INLINE int upb_msgdef_numfields(const upb_msgdef *m) {
-  return upb_strtable_count(&m->ntof);
+  return m->field_count;
 }
 
-// Iteration over fields.  The order is undefined.
-// TODO: the iteration should be in field order.
+// Iteration over fields.  Finalized msgdefs are iterated in field number
+// order, mutable ones in the order the fields were added.
 // Iterators are invalidated when a field is added or removed.
 //   upb_msg_iter i;
 //   for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
 //     upb_fielddef *f = upb_msg_iter_field(&i);
 //     // ...
 //   }
-typedef upb_inttable_iter upb_msg_iter;
+typedef struct {
+  upb_fielddef *const*field;
+  upb_fielddef *const*end;
+} upb_msg_iter;
 
 void upb_msg_begin(upb_msg_iter *iter, const upb_msgdef *m);
 void upb_msg_next(upb_msg_iter *iter);
-INLINE bool upb_msg_done(upb_msg_iter *iter) { return upb_inttable_done(iter); }
+INLINE bool upb_msg_done(upb_msg_iter *iter) {
+  return iter->field == iter->end;
+}
 
 // Iterator accessor.
 INLINE upb_fielddef *upb_msg_iter_field(upb_msg_iter *iter) {
-  return (upb_fielddef*)upb_value_getptr(upb_inttable_iter_value(iter));
+  return *iter->field;
 }
 
 
@@ -490,8 +566,11 @@ INLINE int upb_enumdef_numvals(const upb_enumdef *e) {
 // these failure cases in the future).
 bool upb_enumdef_addval(upb_enumdef *e, const char *name, int32_t num);
 
-// Lookups from name to integer, returning true if found.
+// Lookups from name to integer, returning true if found.  The ntoil() variant
+// takes the name's length, so it need not be NULL-terminated.
 bool upb_enumdef_ntoi(const upb_enumdef *e, const char *name, int32_t *num);
+bool upb_enumdef_ntoil(const upb_enumdef *e, const char *name, size_t len,
+                       int32_t *num);
 
 // Finds the name corresponding to the given number, or NULL if none was found.
 // If more than one name corresponds to this number, returns the first one that
@@ -524,9 +603,46 @@ INLINE int32_t upb_enum_iter_number(upb_enum_iter *iter) {
 // A symtab (symbol table) stores a name->def map of upb_defs.  Clients could
 // always create such tables themselves, but upb_symtab has logic for resolving
 // symbolic references, which is nontrivial.
-typedef struct {
+//
+// Lookups are lock-free and may run concurrently with upb_symtab_add().  The
+// name->def map is published as an immutable snapshot: readers look up
+// against whichever snapshot is current, while upb_symtab_add() builds the
+// next snapshot off to the side and swaps it in with a single pointer store.
+// A retired snapshot (and the refs it holds on its defs) is freed by the
+// writer once every lookup that could still see it has finished; readers
+// never wait on writers.  upb_symtab_add() calls are serialized internally.
+struct _upb_symtab_snapshot;
+struct _upb_symtab;
+
+// A function that a symtab calls when a lookup misses, so that defs can be
+// added on demand (see upb_symtab_setloader()).  It may add the def named
+// "sym" (which is not NULL-terminated), and any defs it refers to, with
+// upb_symtab_add(); the lookup is then retried.  Calls are serialized, and
+// must not look up defs in "s" themselves.
+typedef void upb_symtab_loadfunc(struct _upb_symtab *s, const char *sym,
+                                 size_t len, void *closure);
+
+typedef struct _upb_symtab {
   upb_refcount refcount;
-  upb_strtable symtab;
+  struct _upb_symtab_snapshot *snapshot;  // Current name->def map.
+  uint32_t epoch;       // Bumped after each new snapshot is published.
+  uint32_t readers[2];  // In-progress lookups, by parity of their epoch.
+  uint32_t writelock;
+  uint32_t immortal;    // A bool, read and written with upb_atomic_*().
+  // Snapshots retired while immortal; lookups don't register as readers in
+  // that mode, so these are only freed along with the symtab.
+  struct _upb_symtab_snapshot **retired;
+  size_t retired_count;
+  // Maps each def name to the names of defs that refer to it, so that
+  // upb_symtab_add() only visits the defs affected by a change.  Only used
+  // with the write lock held.
+  upb_strtable rdeps;
+  bool rdeps_valid;
+  // Populates the symtab on demand; see upb_symtab_setloader().
+  upb_symtab_loadfunc *load;
+  void *load_closure;
+  void (*load_free)(void *closure);
+  uint32_t loadlock;
 } upb_symtab;
 
 upb_symtab *upb_symtab_new(const void *owner);
@@ -550,17 +666,27 @@ const upb_def *upb_symtab_resolve(const upb_symtab *s, const char *base,
 
 // Finds an entry in the symbol table with this exact name.  If a def is found,
 // the caller owns one ref on the returned def, owned by owner.  Otherwise
-// returns NULL.
+// returns NULL.  The lookupl() variant takes the name's length, so it need not
+// be NULL-terminated.
 const upb_def *upb_symtab_lookup(
     const upb_symtab *s, const char *sym, const void *owner);
+const upb_def *upb_symtab_lookupl(
+    const upb_symtab *s, const char *sym, size_t len, const void *owner);
 const upb_msgdef *upb_symtab_lookupmsg(
     const upb_symtab *s, const char *sym, const void *owner);
 
+// Sets a function that is called with "closure" when a lookup (or resolve)
+// misses, to load the missing def; see upb_symtab_loadfunc.  "free" (if
+// non-NULL) is called on the closure when the symtab is freed or the loader is
+// replaced.  Must not be called concurrently with lookups.
+void upb_symtab_setloader(upb_symtab *s, upb_symtab_loadfunc *load,
+                          void *closure, void (*free)(void *closure));
+
 // Gets an array of pointers to all currently active defs in this symtab.  The
 // caller owns the returned array (which is of length *count) as well as a ref
 // to each symbol inside (owned by owner).  If type is UPB_DEF_ANY then defs of
 // all types are returned, otherwise only defs of the required type are
-// returned.
+// returned.  Defs that the loader (if any) has not loaded yet are not included.
 const upb_def **upb_symtab_getdefs(
     const upb_symtab *s, int *n, upb_deftype_t type, const void *owner);
 
@@ -570,9 +696,15 @@ const upb_def **upb_symtab_getdefs(
 // have a name -- anonymous defs are not allowed.  Anonymous defs can still be
 // finalized by calling upb_def_finalize() directly.
 //
+// Symbolic references are resolved against the defs being added first, and
+// then against the defs already in the symtab, so defs can be added one file
+// at a time.
+//
 // Any existing defs that can reach defs that are being replaced will
 // themselves be replaced also, so that the resulting set of defs is fully
-// consistent.
+// consistent.  The symtab keeps an index of which defs refer to each name, so
+// the cost of an add is proportional to the defs it adds or replaces, not to
+// the size of the symtab.
 //
 // This logic implemented in this method is a convenience; ultimately it calls
 // some combination of upb_fielddef_setsubdef(), upb_def_dup(), and
@@ -585,6 +717,22 @@ const upb_def **upb_symtab_getdefs(
 bool upb_symtab_add(upb_symtab *s, upb_def *const*defs, int n, void *ref_donor,
                     upb_status *status);
 
+// Adds defs that are already finalized, like the static defs generated by upbc
+// or those of a upb_image, to the symtab as they are: no names are resolved
+// and nothing is copied, so their subdefs stay whatever defs they were
+// finalized with.  For that reason none of the defs may have the name of a def
+// already in the symtab.  The symtab takes its own refs on the defs.  Either
+// all of the defs are added or (on error) none are.
+bool upb_symtab_addfinalized(upb_symtab *s, const upb_def *const*defs, int n,
+                             upb_status *status);
+
+// Makes every def in the symtab immortal (see upb_def_makeimmortal()), as
+// well as every def added from now on.  Intended for long-lived symtabs that
+// many threads look up defs from: afterwards lookups and the refs they return
+// do not write to any shared memory.  Defs that are later replaced are not
+// freed until the process exits.
+void upb_symtab_makeimmortal(upb_symtab *s);
+
 
 /* upb_def casts **************************************************************/
 
@@ -75,7 +75,8 @@ static void upb_deflist_qualify(upb_deflist *l, char *str, int32_t start) {
 }
 
 // Forward declares for top-level file descriptors.
-static upb_mhandlers *upb_msgdef_register_DescriptorProto(upb_handlers *h);
+static upb_mhandlers *upb_msgdef_register_DescriptorProto(upb_handlers *h,
+                                                          bool nested);
 static upb_mhandlers * upb_enumdef_register_EnumDescriptorProto(upb_handlers *h);
 
 void upb_descreader_init(upb_descreader *r) {
@@ -84,6 +85,7 @@ void upb_descreader_init(upb_descreader *r) {
   r->stack_len = 0;
   r->name = NULL;
   r->default_string = NULL;
+  r->f = NULL;
 }
 
 void upb_descreader_uninit(upb_descreader *r) {
@@ -91,6 +93,8 @@ void upb_descreader_uninit(upb_descreader *r) {
   upb_status_uninit(&r->status);
   upb_deflist_uninit(&r->defs);
   free(r->default_string);
+  // A field that was still being read when decoding stopped.
+  if (r->f) upb_fielddef_unref(r->f, &r->defs);
   while (r->stack_len > 0) {
     upb_descreader_frame *f = &r->stack[--r->stack_len];
     free(f->name);
@@ -172,7 +176,7 @@ static upb_mhandlers *upb_descreader_register_FileDescriptorProto(
   upb_fhandlers_setvalue(f, &upb_descreader_FileDescriptorProto_package);
 
   upb_mhandlers_newfhandlers_subm(m, FNUM(MESSAGE_TYPE), FTYPE(MESSAGE_TYPE), true,
-                                  upb_msgdef_register_DescriptorProto(h));
+                                  upb_msgdef_register_DescriptorProto(h, true));
   upb_mhandlers_newfhandlers_subm(m, FNUM(ENUM_TYPE), FTYPE(ENUM_TYPE), true,
                                   upb_enumdef_register_EnumDescriptorProto(h));
   // TODO: services, extensions
@@ -198,6 +202,29 @@ upb_mhandlers *upb_descreader_reghandlers(upb_handlers *h) {
   return upb_descreader_register_FileDescriptorSet(h);
 }
 
+upb_mhandlers *upb_descreader_reghandlers_file(upb_handlers *h) {
+  h->should_jit = false;
+  return upb_descreader_register_FileDescriptorProto(h);
+}
+
+upb_mhandlers *upb_descreader_reghandlers_def(upb_handlers *h,
+                                              upb_deftype_t type) {
+  assert(type == UPB_DEF_MSG || type == UPB_DEF_ENUM);
+  h->should_jit = false;
+  return type == UPB_DEF_MSG ?
+      upb_msgdef_register_DescriptorProto(h, false) :
+      upb_enumdef_register_EnumDescriptorProto(h);
+}
+
+void upb_descreader_startscope(upb_descreader *r, const char *scope) {
+  upb_descreader_startcontainer(r);
+  upb_descreader_setscopename(r, strdup(scope));
+}
+
+void upb_descreader_endscope(upb_descreader *r) {
+  upb_descreader_endcontainer(r);
+}
+
 // google.protobuf.EnumValueDescriptorProto.
 static upb_flow_t upb_enumdef_EnumValueDescriptorProto_startmsg(void *_r) {
   upb_descreader *r = _r;
@@ -534,7 +561,8 @@ static upb_flow_t upb_msgdef_onname(void *_r, upb_value fval, upb_value val) {
   return UPB_CONTINUE;
 }
 
-static upb_mhandlers *upb_msgdef_register_DescriptorProto(upb_handlers *h) {
+static upb_mhandlers *upb_msgdef_register_DescriptorProto(upb_handlers *h,
+                                                          bool nested) {
   upb_mhandlers *m = upb_handlers_newmhandlers(h);
   upb_mhandlers_setstartmsg(m, &upb_msgdef_startmsg);
   upb_mhandlers_setendmsg(m, &upb_msgdef_endmsg);
@@ -547,6 +575,7 @@ static upb_mhandlers *upb_msgdef_register_DescriptorProto(upb_handlers *h) {
 
   upb_mhandlers_newfhandlers_subm(m, FNUM(FIELD), FTYPE(FIELD), true,
                                   upb_fielddef_register_FieldDescriptorProto(h));
+  if (!nested) return m;  // Nested defs are skipped by the decoder.
   upb_mhandlers_newfhandlers_subm(m, FNUM(ENUM_TYPE), FTYPE(ENUM_TYPE), true,
                                   upb_enumdef_register_EnumDescriptorProto(h));
 
@@ -69,6 +69,24 @@ void upb_descreader_uninit(upb_descreader *r);
 // closure.
 upb_mhandlers *upb_descreader_reghandlers(upb_handlers *h);
 
+// Like upb_descreader_reghandlers(), but the handlers read a single
+// FileDescriptorProto instead of a FileDescriptorSet.
+upb_mhandlers *upb_descreader_reghandlers_file(upb_handlers *h);
+
+// Like upb_descreader_reghandlers(), but the handlers read a single def from
+// a DescriptorProto (if type is UPB_DEF_MSG) or an EnumDescriptorProto (if
+// type is UPB_DEF_ENUM) instead of a FileDescriptorSet.  The defs nested in a
+// DescriptorProto are skipped.
+upb_mhandlers *upb_descreader_reghandlers_def(upb_handlers *h,
+                                              upb_deftype_t type);
+
+// Qualifies the names of the defs read until the matching endscope() with
+// "scope" (for example "google.protobuf.FieldDescriptorProto").  A lone
+// DescriptorProto doesn't say which package or message it was nested in, so
+// with the previous this must bracket the parse.
+void upb_descreader_startscope(upb_descreader *r, const char *scope);
+void upb_descreader_endscope(upb_descreader *r);
+
 // Gets the array of defs that have been parsed and removes them from the
 // descreader.  Ownership of the defs is passed to the caller using the given
 // owner), but the ownership of the returned array is retained and is
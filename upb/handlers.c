@@ -14,10 +14,13 @@
 static upb_mhandlers *upb_mhandlers_new(void) {
   upb_mhandlers *m = malloc(sizeof(*m));
   upb_inttable_init(&m->fieldtab);
+  m->slots = NULL;
+  m->slot_count = 0;
   m->startmsg = NULL;
   m->endmsg = NULL;
   m->is_group = false;
-#ifdef UPB_USE_JIT_X64
+  m->msgdef = NULL;
+#ifdef UPB_USE_JIT
   m->tablearray = NULL;
 #endif
   return m;
@@ -26,13 +29,15 @@ static upb_mhandlers *upb_mhandlers_new(void) {
 static upb_fhandlers *_upb_mhandlers_newfhandlers(upb_mhandlers *m, uint32_t n,
                                                   upb_fieldtype_t type,
                                                   bool repeated) {
+  assert(!m->slots);
   const upb_value *v = upb_inttable_lookup(&m->fieldtab, n);
   // TODO: design/refine the API for changing the set of fields or modifying
   // existing handlers.
   if (v) return NULL;
   upb_fhandlers new_f = {type, repeated, 0,
-      n, -1, m, NULL, UPB_NO_VALUE, NULL, NULL, NULL, NULL, NULL,
-#ifdef UPB_USE_JIT_X64
+      n, -1, m, NULL, UPB_NO_VALUE, NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL,
+#ifdef UPB_USE_JIT
       0, 0, 0,
 #endif
   };
@@ -78,6 +83,10 @@ upb_handlers *upb_handlers_new() {
   h->msgs_size = 4;
   h->msgs = malloc(h->msgs_size * sizeof(*h->msgs));
   h->should_jit = true;
+  h->is_frozen = false;
+#ifdef UPB_USE_JIT
+  h->jit_lock = 0;
+#endif
   return h;
 }
 
@@ -90,12 +99,16 @@ void upb_handlers_unref(upb_handlers *h) {
       upb_inttable_iter j;
       upb_inttable_begin(&j, &mh->fieldtab);
       for(; !upb_inttable_done(&j); upb_inttable_next(&j)) {
-        free(upb_value_getptr(upb_inttable_iter_value(&j)));
+        upb_fhandlers *fh = upb_value_getptr(upb_inttable_iter_value(&j));
+        free(fh);
+      }
+      if (mh->slots) {
+        upb_inttable32_uninit(&mh->dispatch);
+        upb_inttable_uninit(&mh->slottab);
+        free(mh->slots);
       }
       upb_inttable_uninit(&mh->fieldtab);
-#ifdef UPB_USE_JIT_X64
-      free(mh->tablearray);
-#endif
+      if (mh->msgdef) upb_msgdef_unref(mh->msgdef, mh);
       free(mh);
     }
     free(h->msgs);
@@ -104,6 +117,7 @@ void upb_handlers_unref(upb_handlers *h) {
 }
 
 upb_mhandlers *upb_handlers_newmhandlers(upb_handlers *h) {
+  assert(!h->is_frozen);
   if (h->msgs_len == h->msgs_size) {
     h->msgs_size *= 2;
     h->msgs = realloc(h->msgs, h->msgs_size * sizeof(*h->msgs));
@@ -113,12 +127,66 @@ upb_mhandlers *upb_handlers_newmhandlers(upb_handlers *h) {
   return mh;
 }
 
+static int upb_fhandlers_cmpnumber(const void *_a, const void *_b) {
+  const upb_fhandlers *a = *(upb_fhandlers*const*)_a;
+  const upb_fhandlers *b = *(upb_fhandlers*const*)_b;
+  return a->number < b->number ? -1 : a->number > b->number;
+}
+
+// Builds the message's slots, returning false if out of memory.
+static bool upb_mhandlers_freeze(upb_mhandlers *m) {
+  size_t n = upb_inttable_count(&m->fieldtab);
+  upb_fhandlers **fields = malloc(UPB_MAX(n, 1) * sizeof(*fields));
+  upb_fieldslot *slots = malloc(UPB_MAX(n, 1) * sizeof(*slots));
+  if (!fields || !slots || !upb_inttable_init(&m->slottab)) goto err;
+  size_t i = 0;
+  upb_inttable_iter j;
+  upb_inttable_begin(&j, &m->fieldtab);
+  for(; !upb_inttable_done(&j); upb_inttable_next(&j))
+    fields[i++] = upb_value_getptr(upb_inttable_iter_value(&j));
+  qsort(fields, n, sizeof(*fields), &upb_fhandlers_cmpnumber);
+  for (i = 0; i < n; i++) {
+    upb_fhandlers *f = fields[i];
+    upb_fieldslot slot = {f->fval, f->value, f, f->hasbit, f->type,
+                          f->repeated};
+    slots[i] = slot;
+    if (!upb_inttable_insert(&m->slottab, f->number, upb_value_ptr(&slots[i])))
+      goto err2;
+  }
+  // If this fails the dispatch table still works, by looking up in slottab.
+  upb_inttable32_init(&m->dispatch, &m->slottab);
+  for (i = 0; i < n; i++) fields[i]->slot = &slots[i];
+  m->slots = slots;
+  m->slot_count = n;
+  free(fields);
+  return true;
+
+err2:
+  upb_inttable_uninit(&m->slottab);
+err:
+  free(fields);
+  free(slots);
+  return false;
+}
+
+bool upb_handlers_freeze(upb_handlers *h) {
+  if (h->is_frozen) return true;
+  for (int i = 0; i < h->msgs_len; i++) {
+    // Messages may have been frozen by an earlier call that ran out of memory.
+    if (!h->msgs[i]->slots && !upb_mhandlers_freeze(h->msgs[i])) return false;
+  }
+  h->is_frozen = true;
+  return true;
+}
+
 static upb_mhandlers *upb_regmsg_dfs(upb_handlers *h, const upb_msgdef *m,
                                      upb_onmsgreg *msgreg_cb,
                                      upb_onfieldreg *fieldreg_cb,
                                      void *closure, upb_strtable *mtab) {
   upb_mhandlers *mh = upb_handlers_newmhandlers(h);
   upb_strtable_insert(mtab, upb_def_fullname(UPB_UPCAST(m)), upb_value_ptr(mh));
+  mh->msgdef = m;
+  upb_msgdef_ref(m, mh);
   if (msgreg_cb) msgreg_cb(closure, mh, m);
   upb_msg_iter i;
   for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
@@ -133,6 +133,19 @@ typedef upb_flow_t (upb_endfield_handler)(void *closure, upb_value fval);
 
 /* upb_fhandlers **************************************************************/
 
+// Describes a growable array that a repeated field's value handler appends
+// to, like proto2's RepeatedField<T>.  If a field has one, the JIT appends to
+// the array itself while it has room and only calls the value handler (which
+// must do the same append, growing the array first) when it is full.  The
+// closure for the field's values (the one returned by the startseq handler)
+// must point to the array.
+typedef struct {
+  uint16_t elements_ofs;  // Offset of the pointer to the elements.
+  uint16_t size_ofs;      // Offset of the int32_t number of elements.
+  uint16_t capacity_ofs;  // Offset of the int32_t number allocated.
+  uint8_t elem_size;      // sizeof() an element.
+} upb_arraylayout;
+
 // A upb_fhandlers object represents the set of handlers associated with one
 // specific message field.
 //
@@ -141,6 +154,7 @@ typedef upb_flow_t (upb_endfield_handler)(void *closure, upb_value fval);
 // added.
 struct _upb_decoder;
 struct _upb_mhandlers;
+struct _upb_fieldslot;
 typedef struct _upb_fieldent {
   upb_fieldtype_t type;
   bool repeated;
@@ -155,7 +169,10 @@ typedef struct _upb_fieldent {
   upb_endfield_handler *endsubmsg;
   upb_startfield_handler *startseq;
   upb_endfield_handler *endseq;
-#ifdef UPB_USE_JIT_X64
+  const upb_arraylayout *arraylayout;
+  // This field's entry in its message's slots, once the handlers are frozen.
+  const struct _upb_fieldslot *slot;
+#ifdef UPB_USE_JIT
   uint32_t jit_pclabel;
   uint32_t jit_pclabel_notypecheck;
   uint32_t jit_submsg_done_pclabel;
@@ -169,7 +186,10 @@ void upb_fhandlers_unref(upb_fhandlers *m);
 
 // upb_fhandlers accessors
 #define UPB_FHANDLERS_ACCESSORS(name, type) \
-  INLINE void upb_fhandlers_set ## name(upb_fhandlers *f, type v){f->name = v;} \
+  INLINE void upb_fhandlers_set ## name(upb_fhandlers *f, type v) { \
+    assert(!f->slot); \
+    f->name = v; \
+  } \
   INLINE type upb_fhandlers_get ## name(const upb_fhandlers *f) { return f->name; }
 // TODO(haberman): need a way of keeping the fval alive even if a plan outlasts
 // the handlers.
@@ -188,6 +208,24 @@ UPB_FHANDLERS_ACCESSORS(submsg, struct _upb_mhandlers*)
 // called.  For seq and submsg, the hasbit is set *after* the start handler is
 // called, but before any of the handlers for the submsg or sequence.
 UPB_FHANDLERS_ACCESSORS(hasbit, int32_t)
+// Only used for repeated fields with a value handler; see upb_arraylayout.
+// The layout must outlive the handlers.
+UPB_FHANDLERS_ACCESSORS(arraylayout, const upb_arraylayout*)
+
+// The part of a upb_fhandlers that is needed to dispatch a field's values,
+// copied by upb_handlers_freeze() into one flat array per message so that the
+// decoder's per-field work touches a single entry (32 bytes on 64-bit release
+// builds, where a upb_value is 8 bytes) instead of following pointers into the
+// upb_fhandlers.  Everything else, including the refcount, the submessage and
+// sequence handlers and the JIT's state, stays in the upb_fhandlers.
+typedef struct _upb_fieldslot {
+  upb_value fval;
+  upb_value_handler *value;
+  upb_fhandlers *f;
+  int32_t hasbit;
+  int8_t type;   // A upb_fieldtype_t, which may be UPB_TYPE_NONE.
+  bool repeated;
+} upb_fieldslot;
 
 
 /* upb_mhandlers **************************************************************/
@@ -200,8 +238,18 @@ typedef struct _upb_mhandlers {
   upb_startmsg_handler *startmsg;
   upb_endmsg_handler *endmsg;
   upb_inttable fieldtab;  // Maps field number -> upb_fhandlers.
+  // Built by upb_handlers_freeze(): the fields' slots in number order, and a
+  // compact table mapping field numbers to them for the decoder's dispatch
+  // (with "slottab" as its source, which it may fall back to).
+  upb_fieldslot *slots;
+  uint32_t slot_count;
+  upb_inttable slottab;
+  upb_inttable32 dispatch;
   bool is_group;
-#ifdef UPB_USE_JIT_X64
+  // The msgdef that upb_handlers_regmsgdef() registered these handlers for
+  // (we own a ref), else NULL.  For debugging and profiling only.
+  const upb_msgdef *msgdef;
+#ifdef UPB_USE_JIT
   // Used inside the JIT to track labels (jmp targets) in the generated code.
   uint32_t jit_startmsg_pclabel;  // Starting a parse of this (sub-)message.
   uint32_t jit_afterstartmsg_pclabel;  // After calling the startmsg handler.
@@ -215,6 +263,10 @@ typedef struct _upb_mhandlers {
   void **tablearray;
   // Pointer to the JIT code for parsing this message.
   void *jit_func;
+  // Same, but before the startmsg handler is called; for calls from other
+  // chunks of the plan's code (see upb/pb/jit_common.h).
+  void *jit_startmsg_func;
+  uint32_t jit_chunk;  // Which chunk of the plan's code this message is in.
 #endif
 } upb_mhandlers;
 
@@ -253,6 +305,13 @@ struct _upb_handlers {
   upb_mhandlers **msgs;  // Array of msgdefs, [0]=toplevel.
   int msgs_len, msgs_size;
   bool should_jit;
+  bool is_frozen;
+#ifdef UPB_USE_JIT
+  // The JIT state in the mhandlers and fhandlers (labels, dispatch tables and
+  // entry points) belongs to a single upb_decoderplan at a time, which holds
+  // this lock until it is freed.
+  uint32_t jit_lock;
+#endif
 };
 typedef struct _upb_handlers upb_handlers;
 
@@ -260,6 +319,16 @@ upb_handlers *upb_handlers_new(void);
 void upb_handlers_ref(upb_handlers *h);
 void upb_handlers_unref(upb_handlers *h);
 
+// Freezes the handlers, building each message's upb_fieldslot array.  After
+// this no messages or fields may be added and no fhandlers may be changed.
+// upb_decoderplan_new() freezes the handlers it is given.  Returns false if
+// out of memory, in which case some messages may already be frozen and the
+// call may be retried.  Freezing frozen handlers does nothing.
+bool upb_handlers_freeze(upb_handlers *h);
+INLINE bool upb_handlers_isfrozen(const upb_handlers *h) {
+  return h->is_frozen;
+}
+
 // Appends a new message to the graph of handlers and returns it.  This message
 // can be obtained later at index upb_handlers_msgcount()-1.  All handlers will
 // be initialized to no-op handlers.
@@ -383,6 +452,14 @@ INLINE void upb_dispatch_value(upb_dispatcher *d, upb_fhandlers *f,
   _upb_dispatcher_sethas(d->top->closure, f->hasbit);
   if (flow != UPB_CONTINUE) _upb_dispatcher_abortjmp(d);
 }
+// Like the previous, from a frozen field's slot.
+INLINE void upb_dispatch_slotvalue(upb_dispatcher *d, const upb_fieldslot *s,
+                                   upb_value val) {
+  upb_flow_t flow = UPB_CONTINUE;
+  if (s->value) flow = s->value(d->top->closure, s->fval, val);
+  _upb_dispatcher_sethas(d->top->closure, s->hasbit);
+  if (flow != UPB_CONTINUE) _upb_dispatcher_abortjmp(d);
+}
 void upb_dispatch_startmsg(upb_dispatcher *d);
 void upb_dispatch_endmsg(upb_dispatcher *d, upb_status *status);
 upb_dispatcher_frame *upb_dispatch_startsubmsg(upb_dispatcher *d,
@@ -0,0 +1,653 @@
+/*
+ * upb - a minimalist implementation of protocol buffers.
+ *
+ * Copyright (c) 2012 Google Inc.  See LICENSE for details.
+ * Author: Josh Haberman <jhaberman@gmail.com>
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "upb/bytestream.h"
+#include "upb/image.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define UPB_IMAGE_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Writing ********************************************************************/
+
+// A fingerprint of everything the image's layout depends on, so that an image
+// is only ever loaded by a build of upb whose structs match the writer's.
+static uint32_t upb_image_abi() {
+  const size_t sizes[] = {
+    sizeof(void*), sizeof(upb_value), sizeof(upb_refcount), sizeof(upb_def),
+    sizeof(upb_fielddef), sizeof(upb_msgdef), sizeof(upb_enumdef),
+    sizeof(upb_tabent), sizeof(upb_strent), sizeof(upb_inttable),
+    sizeof(upb_strtable), sizeof(upb_stringsrc),
+    offsetof(upb_fielddef, defaultval), offsetof(upb_msgdef, ntof),
+    offsetof(upb_enumdef, iton),
+  };
+  uint32_t h = 2166136261u;  // FNV-1a.
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    h = (h ^ (uint32_t)sizes[i]) * 16777619u;
+  return h;
+}
+
+typedef struct {
+  uint32_t *ofs;
+  size_t len, size;
+} upb_image_ofslist;
+
+static bool upb_image_push(upb_image_ofslist *l, size_t ofs) {
+  if (l->len == l->size) {
+    size_t size = UPB_MAX(l->size * 2, 64);
+    uint32_t *new_ofs = realloc(l->ofs, size * sizeof(*new_ofs));
+    if (!new_ofs) return false;
+    l->ofs = new_ofs;
+    l->size = size;
+  }
+  l->ofs[l->len++] = ofs;
+  return true;
+}
+
+typedef struct {
+  char *buf;          // The header and data; see image.h.
+  size_t len, size;
+  char *strings;      // The string pool, which is appended to the data.
+  size_t strings_len, strings_size;
+  upb_strtable strindex;       // String -> offset in the pool.
+  upb_inttable index;          // Address of a def -> offset in the data.
+  upb_image_ofslist relocs;    // Pointers to the data.
+  upb_image_ofslist strrelocs; // Pointers to the pool, relative to the pool.
+  upb_image_ofslist srcs;
+  size_t count_ofs;            // The refcount shared by all of the defs.
+  bool oom;
+  upb_status *status;
+} upb_image_writer;
+
+// Returns the offset of "size" bytes of zeroed, 8-byte aligned data, or 0 if
+// memory allocation failed (the header is at offset 0).
+static size_t upb_image_alloc(upb_image_writer *w, size_t size) {
+  size_t ofs = (w->len + 7) & ~(size_t)7;
+  if (w->oom || ofs + size > UINT32_MAX) goto oom;
+  if (ofs + size > w->size) {
+    size_t new_size = UPB_MAX(UPB_MAX(w->size * 2, ofs + size), 4096);
+    char *buf = realloc(w->buf, new_size);
+    if (!buf) goto oom;
+    w->buf = buf;
+    w->size = new_size;
+  }
+  memset(w->buf + w->len, 0, ofs + size - w->len);
+  w->len = ofs + size;
+  return ofs;
+
+oom:
+  w->oom = true;
+  return 0;
+}
+
+static void upb_image_put(upb_image_writer *w, size_t ofs, const void *data,
+                          size_t len) {
+  if (!w->oom) memcpy(w->buf + ofs, data, len);
+}
+
+// Points the pointer at "slot" to the data at "target".
+static void upb_image_setptr(upb_image_writer *w, size_t slot, size_t target) {
+  if (w->oom) return;
+  uintptr_t ptr = target;
+  memcpy(w->buf + slot, &ptr, sizeof(ptr));
+  if (!upb_image_push(&w->relocs, slot)) w->oom = true;
+}
+
+// Points the pointer at "slot" to a NULL-terminated copy of "str" in the pool.
+static void upb_image_setstr(upb_image_writer *w, size_t slot, const char *str,
+                             size_t len) {
+  if (w->oom) return;
+  uintptr_t ofs;
+  const upb_value *v = upb_strtable_lookupl(&w->strindex, str, len);
+  if (v) {
+    ofs = upb_value_getuint32(*v);
+  } else {
+    ofs = w->strings_len;
+    if (len >= UINT32_MAX - ofs) goto oom;
+    if (ofs + len + 1 > w->strings_size) {
+      size_t size = UPB_MAX(UPB_MAX(w->strings_size * 2, ofs + len + 1), 4096);
+      char *strings = realloc(w->strings, size);
+      if (!strings) goto oom;
+      w->strings = strings;
+      w->strings_size = size;
+    }
+    memcpy(w->strings + ofs, str, len);
+    w->strings[ofs + len] = '\0';
+    w->strings_len += len + 1;
+    if (!upb_strtable_insertl(&w->strindex, str, len, upb_value_uint32(ofs)))
+      goto oom;
+  }
+  memcpy(w->buf + slot, &ofs, sizeof(ofs));
+  if (!upb_image_push(&w->strrelocs, slot)) goto oom;
+  return;
+
+oom:
+  w->oom = true;
+}
+
+static size_t upb_image_defofs(upb_image_writer *w, const void *def) {
+  const upb_value *v = upb_inttable_lookup(&w->index, (uintptr_t)def);
+  return v ? upb_value_getuint32(*v) : 0;
+}
+
+// The structs in the image are built up from zeroed memory, member by member,
+// rather than copied from the defs: copying would bring along the pointers
+// and the padding, which would make the image leak addresses and heap contents
+// and differ from one run to the next.
+
+// The kinds of values that a def can hold.
+typedef enum {
+  UPB_IMAGE_SCALAR,
+  UPB_IMAGE_FIELD,  // A upb_fielddef*.
+  UPB_IMAGE_NAME,   // A NULL-terminated string.
+  UPB_IMAGE_NULL,   // A pointer that the image leaves NULL.
+} upb_image_val_t;
+
+static void upb_image_putval(upb_image_writer *w, size_t ofs, upb_value v,
+                             upb_image_val_t type) {
+  upb_value copy;
+  memset(&copy, 0, sizeof(copy));
+  if (type == UPB_IMAGE_SCALAR) copy.val = v.val;
+#ifndef NDEBUG
+  copy.type = v.type;
+#endif
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+  if (type == UPB_IMAGE_FIELD) {
+    upb_image_setptr(w, ofs, upb_image_defofs(w, v.val._void));
+  } else if (type == UPB_IMAGE_NAME) {
+    upb_image_setstr(w, ofs, v.val._void, strlen(v.val._void));
+  }
+}
+
+// Writes the table "t" into the upb_inttable at "ofs", and its entries after
+// it.
+static void upb_image_writeinttable(upb_image_writer *w, size_t ofs,
+                                    const upb_inttable *t,
+                                    upb_image_val_t type) {
+  upb_inttable copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.t.count = t->t.count;
+  copy.t.mask = t->t.mask;
+  copy.t.size_lg2 = t->t.size_lg2;
+  copy.array_size = t->array_size;
+  copy.array_count = t->array_count;
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+  if (t->t.entries) {
+    size_t size = (size_t)1 << t->t.size_lg2;
+    size_t ents = upb_image_alloc(w, size * sizeof(upb_tabent));
+    upb_image_setptr(w, ofs + offsetof(upb_inttable, t.entries), ents);
+    for (size_t i = 0; i < size; i++) {
+      const upb_tabent *e = &t->t.entries[i];
+      size_t e_ofs = ents + i * sizeof(upb_tabent);
+      if (e->key.num == 0) continue;  // Empty; already zeroed.
+      upb_image_put(w, e_ofs + offsetof(upb_tabent, key), &e->key,
+                    sizeof(e->key));
+      upb_image_putval(w, e_ofs + offsetof(upb_tabent, val), e->val, type);
+      if (e->next) {
+        upb_image_setptr(w, e_ofs + offsetof(upb_tabent, next),
+                         ents + (e->next - t->t.entries) * sizeof(upb_tabent));
+      }
+    }
+  }
+  if (t->array_size > 0) {
+    size_t arr = upb_image_alloc(w, t->array_size * sizeof(upb_value));
+    upb_image_setptr(w, ofs + offsetof(upb_inttable, array), arr);
+    for (size_t i = 0; i < t->array_size; i++) {
+      upb_value v = t->array[i];
+      upb_image_putval(w, arr + i * sizeof(upb_value), v,
+                       upb_arrhas(v) ? type : UPB_IMAGE_SCALAR);
+    }
+  }
+}
+
+// Writes the table "t" into the upb_strtable at "ofs", and its entries and
+// perfect hash after it.  Like upbc's static tables it has no control bytes,
+// so it must have a perfect hash.
+static void upb_image_writestrtable(upb_image_writer *w, size_t ofs,
+                                    const upb_strtable *t,
+                                    upb_image_val_t type) {
+  if (upb_strtable_count(t) > 0 && !t->perfect) {
+    upb_status_seterrliteral(w->status,
+                             "couldn't build a perfect hash for a table");
+    w->oom = true;
+    return;
+  }
+  upb_strtable copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.count = t->count;
+  copy.mask = t->mask;
+  copy.size_lg2 = t->size_lg2;
+  copy.perfect_size = t->perfect_size;
+  copy.perfect_buckets = t->perfect_buckets;
+  // A table with no keys gets the trivial perfect hash: a single empty slot.
+  if (upb_strtable_count(t) == 0) copy.perfect_size = copy.perfect_buckets = 1;
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+
+  size_t size = (size_t)1 << t->size_lg2;
+  size_t ents = upb_image_alloc(w, size * sizeof(upb_strent));
+  upb_image_setptr(w, ofs + offsetof(upb_strtable, entries), ents);
+  for (size_t i = 0; t->entries && i < size; i++) {
+    const upb_strent *e = &t->entries[i];
+    size_t e_ofs = ents + i * sizeof(upb_strent);
+    if (!e->key) continue;
+    upb_strent ent;
+    memset(&ent, 0, sizeof(ent));
+    ent.keylen = e->keylen;
+    ent.hash = e->hash;
+    upb_image_put(w, e_ofs, &ent, sizeof(ent));
+    upb_image_setstr(w, e_ofs + offsetof(upb_strent, key), e->key, e->keylen);
+    upb_image_putval(w, e_ofs + offsetof(upb_strent, val), e->val, type);
+  }
+
+  size_t perfect =
+      upb_image_alloc(w, copy.perfect_size * sizeof(upb_strent*));
+  size_t displace =
+      upb_image_alloc(w, copy.perfect_buckets * sizeof(uint32_t));
+  upb_image_setptr(w, ofs + offsetof(upb_strtable, perfect), perfect);
+  upb_image_setptr(w, ofs + offsetof(upb_strtable, displace), displace);
+  if (upb_strtable_count(t) == 0) return;
+  for (uint32_t i = 0; i < t->perfect_size; i++) {
+    if (!t->perfect[i]) continue;
+    upb_image_setptr(w, perfect + i * sizeof(upb_strent*),
+                     ents + (t->perfect[i] - t->entries) * sizeof(upb_strent));
+  }
+  upb_image_put(w, displace, t->displace,
+                t->perfect_buckets * sizeof(uint32_t));
+}
+
+// Writes the upb_def at "ofs" as an immortal def, like UPB_REFCOUNT_STATICINIT
+// does for upbc's defs: every def shares the one count and is its own SCC.
+static void upb_image_writebase(upb_image_writer *w, size_t ofs,
+                                const upb_def *def) {
+  upb_def base;
+  memset(&base, 0, sizeof(base));
+  base.refcount.index = UPB_INDEX_NOT_IN_STACK;
+  base.refcount.lowlink = UPB_INDEX_NOT_IN_STACK;
+  base.type = def->type;
+  base.is_finalized = def->is_finalized;
+  upb_image_put(w, ofs, &base, sizeof(base));
+  upb_image_setptr(w, ofs + offsetof(upb_def, refcount.count), w->count_ofs);
+  upb_image_setptr(w, ofs + offsetof(upb_def, refcount.next), ofs);
+  if (def->fullname) {
+    upb_image_setstr(w, ofs + offsetof(upb_def, fullname), def->fullname,
+                     strlen(def->fullname));
+  }
+}
+
+static void upb_image_writefield(upb_image_writer *w, const upb_fielddef *f) {
+  size_t ofs = upb_image_defofs(w, f);
+  upb_fielddef copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.default_is_string = f->default_is_string;
+  copy.type = f->type;
+  copy.label = f->label;
+  copy.hasbit = f->hasbit;
+  copy.offset = f->offset;
+  copy.number = f->number;
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+  upb_image_writebase(w, ofs + offsetof(upb_fielddef, base), UPB_UPCAST(f));
+  upb_image_setptr(w, ofs + offsetof(upb_fielddef, msgdef),
+                   upb_image_defofs(w, f->msgdef));
+  if (upb_hassubdef(f)) {
+    size_t sub = upb_image_defofs(w, upb_fielddef_subdef(f));
+    if (!sub) {
+      upb_status_seterrf(w->status, "field '%s' refers to '%s', which is not "
+                         "being written", upb_fielddef_name(f),
+                         upb_def_fullname(upb_fielddef_subdef(f)));
+      w->oom = true;
+      return;
+    }
+    upb_image_setptr(w, ofs + offsetof(upb_fielddef, sub.def), sub);
+  }
+  upb_image_putval(w, ofs + offsetof(upb_fielddef, fval), f->fval,
+                   UPB_IMAGE_FIELD);
+  upb_image_putval(w, ofs + offsetof(upb_fielddef, defaultval), f->defaultval,
+                   f->default_is_string || upb_issubmsg(f) ?
+                       UPB_IMAGE_NULL : UPB_IMAGE_SCALAR);
+  if (f->default_is_string) {
+    upb_byteregion *r = upb_value_getbyteregion(f->defaultval);
+    size_t len;
+    const char *ptr = upb_byteregion_getptr(r, upb_byteregion_startofs(r), &len);
+    assert(len == upb_byteregion_len(r));
+    // Like UPB_STRINGSRC_STATICINIT(), except that the vtbl is set by the
+    // loader.
+    upb_stringsrc src;
+    memset(&src, 0, sizeof(src));
+    src.len = len;
+    src.byteregion.fetch = len;
+    src.byteregion.end = len;
+    src.byteregion.toplevel = true;
+    size_t src_ofs = upb_image_alloc(w, sizeof(src));
+    upb_image_put(w, src_ofs, &src, sizeof(src));
+    upb_image_setstr(w, src_ofs + offsetof(upb_stringsrc, str), ptr, len);
+    upb_image_setptr(w, src_ofs + offsetof(upb_stringsrc, byteregion.bytesrc),
+                     src_ofs + offsetof(upb_stringsrc, bytesrc));
+    upb_image_setptr(w, ofs + offsetof(upb_fielddef, defaultval.val.byteregion),
+                     src_ofs + offsetof(upb_stringsrc, byteregion));
+    if (!w->oom && !upb_image_push(&w->srcs, src_ofs)) w->oom = true;
+  }
+}
+
+static void upb_image_writemsg(upb_image_writer *w, const upb_msgdef *m) {
+  size_t ofs = upb_image_defofs(w, m);
+  // Finalized msgdefs have no "itof"; numbers are looked up in "fields".
+  upb_msgdef copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.field_count = m->field_count;
+  copy.fields_size = m->field_count;
+  copy.size = m->size;
+  copy.hasbit_bytes = m->hasbit_bytes;
+  copy.extstart = m->extstart;
+  copy.extend = m->extend;
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+  upb_image_writebase(w, ofs + offsetof(upb_msgdef, base), UPB_UPCAST(m));
+  upb_image_writestrtable(w, ofs + offsetof(upb_msgdef, ntof), &m->ntof,
+                          UPB_IMAGE_FIELD);
+  if (m->field_count == 0) return;
+  size_t fields = upb_image_alloc(w, m->field_count * sizeof(upb_fielddef*));
+  upb_image_setptr(w, ofs + offsetof(upb_msgdef, fields), fields);
+  for (uint32_t i = 0; i < m->field_count; i++) {
+    upb_image_setptr(w, fields + i * sizeof(upb_fielddef*),
+                     upb_image_defofs(w, m->fields[i]));
+    upb_image_writefield(w, m->fields[i]);
+  }
+}
+
+static void upb_image_writeenum(upb_image_writer *w, const upb_enumdef *e) {
+  size_t ofs = upb_image_defofs(w, e);
+  upb_enumdef copy;
+  memset(&copy, 0, sizeof(copy));
+  copy.defaultval = e->defaultval;
+  upb_image_put(w, ofs, &copy, sizeof(copy));
+  upb_image_writebase(w, ofs + offsetof(upb_enumdef, base), UPB_UPCAST(e));
+  upb_image_writestrtable(w, ofs + offsetof(upb_enumdef, ntoi), &e->ntoi,
+                          UPB_IMAGE_SCALAR);
+  upb_image_writeinttable(w, ofs + offsetof(upb_enumdef, iton), &e->iton,
+                          UPB_IMAGE_NAME);
+}
+
+static int upb_image_cmpdefs(const void *_a, const void *_b) {
+  const upb_def *const*a = _a, *const*b = _b;
+  return strcmp(upb_def_fullname(*a), upb_def_fullname(*b));
+}
+
+static int upb_image_cmpofs(const void *_a, const void *_b) {
+  const uint32_t *a = _a, *b = _b;
+  return *a < *b ? -1 : *a > *b;
+}
+
+char *upb_image_write(const upb_def *const*defs, int n, size_t *len,
+                      upb_status *status) {
+  upb_image_writer w;
+  memset(&w, 0, sizeof(w));
+  w.status = status;
+  const upb_def **sorted = malloc(UPB_MAX(n, 1) * sizeof(*sorted));
+  bool tables = upb_strtable_init(&w.strindex);
+  if (!tables || !upb_inttable_init(&w.index)) {
+    if (tables) upb_strtable_uninit(&w.strindex);
+    free(sorted);
+    upb_status_seterrliteral(status, "out of memory");
+    return NULL;
+  }
+  if (!sorted) goto oom;
+
+  // Sort the defs, so that the image does not depend on the order they were
+  // given in, and give every def and field its place in the data.
+  for (int i = 0; i < n; i++) {
+    const upb_def *def = defs[i];
+    if (!upb_def_isfinalized(def) || (def->type != UPB_DEF_MSG &&
+                                      def->type != UPB_DEF_ENUM)) {
+      upb_status_seterrliteral(
+          status, "only finalized msgdefs and enumdefs can be written");
+      goto err;
+    }
+    sorted[i] = def;
+  }
+  qsort(sorted, n, sizeof(*sorted), &upb_image_cmpdefs);
+  upb_image_alloc(&w, sizeof(upb_image_header));
+  w.count_ofs = upb_image_alloc(&w, sizeof(uint32_t));
+  uint32_t count = UPB_REFCOUNT_IMMORTAL;
+  upb_image_put(&w, w.count_ofs, &count, sizeof(count));
+  size_t defs_ofs = upb_image_alloc(&w, UPB_MAX(n, 1) * sizeof(upb_def*));
+  for (int i = 0; i < n; i++) {
+    const upb_msgdef *m = upb_dyncast_msgdef_const(sorted[i]);
+    if (i > 0 && upb_image_cmpdefs(&sorted[i - 1], &sorted[i]) == 0) {
+      upb_status_seterrf(status, "Conflicting defs named '%s'",
+                         upb_def_fullname(sorted[i]));
+      goto err;
+    }
+    size_t ofs = upb_image_alloc(&w, m ? sizeof(upb_msgdef) :
+                                         sizeof(upb_enumdef));
+    if (!upb_inttable_insert(&w.index, (uintptr_t)sorted[i],
+                             upb_value_uint32(ofs)))
+      goto oom;
+    upb_image_setptr(&w, defs_ofs + i * sizeof(upb_def*), ofs);
+    for (uint32_t j = 0; m && j < m->field_count; j++) {
+      size_t f_ofs = upb_image_alloc(&w, sizeof(upb_fielddef));
+      if (!upb_inttable_insert(&w.index, (uintptr_t)m->fields[j],
+                               upb_value_uint32(f_ofs)))
+        goto oom;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    const upb_msgdef *m = upb_dyncast_msgdef_const(sorted[i]);
+    if (m) {
+      upb_image_writemsg(&w, m);
+    } else {
+      upb_image_writeenum(&w, upb_downcast_enumdef_const(sorted[i]));
+    }
+  }
+
+  // Append the relocations, the stringsrcs and the pool, then point the
+  // pointers to the pool at its final place.
+  size_t relocs_ofs = upb_image_alloc(&w, 0);
+  size_t reloc_count = w.relocs.len + w.strrelocs.len;
+  size_t srcs_ofs = relocs_ofs + reloc_count * sizeof(uint32_t);
+  size_t strings_ofs = srcs_ofs + w.srcs.len * sizeof(uint32_t);
+  size_t size = strings_ofs + w.strings_len;
+  if (!w.oom && size > UINT32_MAX) {
+    upb_status_seterrliteral(status, "image would be larger than 4GB");
+    goto err;
+  }
+  upb_image_alloc(&w, size - relocs_ofs);
+  if (w.oom) goto oom;
+  for (size_t i = 0; i < w.strrelocs.len; i++) {
+    uintptr_t ptr;
+    memcpy(&ptr, w.buf + w.strrelocs.ofs[i], sizeof(ptr));
+    ptr += strings_ofs;
+    memcpy(w.buf + w.strrelocs.ofs[i], &ptr, sizeof(ptr));
+    if (!upb_image_push(&w.relocs, w.strrelocs.ofs[i])) goto oom;
+  }
+  // In order, so that loading walks the image front to back.
+  qsort(w.relocs.ofs, w.relocs.len, sizeof(uint32_t), &upb_image_cmpofs);
+  memcpy(w.buf + relocs_ofs, w.relocs.ofs, reloc_count * sizeof(uint32_t));
+  memcpy(w.buf + srcs_ofs, w.srcs.ofs, w.srcs.len * sizeof(uint32_t));
+  memcpy(w.buf + strings_ofs, w.strings, w.strings_len);
+
+  upb_image_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, UPB_IMAGE_MAGIC, sizeof(h.magic));
+  h.byteorder = UPB_IMAGE_BYTEORDER;
+  h.abi = upb_image_abi();
+  h.size = size;
+  h.def_count = n;
+  h.defs_ofs = defs_ofs;
+  h.relocs_ofs = relocs_ofs;
+  h.reloc_count = reloc_count;
+  h.srcs_ofs = srcs_ofs;
+  h.src_count = w.srcs.len;
+  memcpy(w.buf, &h, sizeof(h));
+  *len = size;
+  goto done;
+
+oom:
+  // Errors found while writing the defs were reported already.
+  if (upb_ok(status)) upb_status_seterrliteral(status, "out of memory");
+err:
+  free(w.buf);
+  w.buf = NULL;
+done:
+  upb_strtable_uninit(&w.strindex);
+  upb_inttable_uninit(&w.index);
+  free(w.strings);
+  free(w.relocs.ofs);
+  free(w.strrelocs.ofs);
+  free(w.srcs.ofs);
+  free(sorted);
+  return w.buf;
+}
+
+
+/* Loading ********************************************************************/
+
+static bool upb_image_checksection(size_t len, uint32_t ofs, uint32_t count,
+                                   size_t recsize, size_t align) {
+  return ofs % align == 0 && ofs <= len && count <= (len - ofs) / recsize;
+}
+
+// Checks the image as a whole and every pointer in it, without changing it.
+static bool upb_image_check(const void *image, size_t len, upb_status *s) {
+  const upb_image_header *h = image;
+  if ((uintptr_t)image % 8 != 0) {
+    upb_status_seterrliteral(s, "image is not 8-byte aligned");
+    return false;
+  }
+  if (len < sizeof(*h) || memcmp(h->magic, UPB_IMAGE_MAGIC, 8) != 0) {
+    upb_status_seterrliteral(s, "not a upb image");
+    return false;
+  }
+  if (h->byteorder != UPB_IMAGE_BYTEORDER) {
+    upb_status_seterrliteral(s, "image was written with another byte order");
+    return false;
+  }
+  if (h->abi != upb_image_abi()) {
+    upb_status_seterrliteral(s, "image was written by another build of upb");
+    return false;
+  }
+  if (h->size != len ||
+      !upb_image_checksection(len, h->defs_ofs, h->def_count,
+                              sizeof(upb_def*), sizeof(upb_def*)) ||
+      !upb_image_checksection(len, h->relocs_ofs, h->reloc_count,
+                              sizeof(uint32_t), sizeof(uint32_t)) ||
+      !upb_image_checksection(len, h->srcs_ofs, h->src_count,
+                              sizeof(uint32_t), sizeof(uint32_t)) ||
+      h->def_count > INT32_MAX) {
+    upb_status_seterrliteral(s, "image is truncated or corrupt");
+    return false;
+  }
+  // Every pointer must be inside the data and point inside the image.
+  const char *base = image;
+  const uint32_t *relocs = (const void*)(base + h->relocs_ofs);
+  for (uint32_t i = 0; i < h->reloc_count; i++) {
+    uintptr_t ptr;
+    if (relocs[i] < sizeof(*h) || relocs[i] > h->relocs_ofs ||
+        relocs[i] % sizeof(ptr) != 0 ||
+        h->relocs_ofs - relocs[i] < sizeof(ptr))
+      goto corrupt;
+    memcpy(&ptr, base + relocs[i], sizeof(ptr));
+    if (ptr - (uintptr_t)h->base >= len) goto corrupt;
+  }
+  const uint32_t *srcs = (const void*)(base + h->srcs_ofs);
+  for (uint32_t i = 0; i < h->src_count; i++) {
+    if (srcs[i] < sizeof(*h) || srcs[i] > h->relocs_ofs || srcs[i] % 8 != 0 ||
+        h->relocs_ofs - srcs[i] < sizeof(upb_stringsrc))
+      goto corrupt;
+  }
+  return true;
+
+corrupt:
+  upb_status_seterrliteral(s, "image contains an invalid pointer");
+  return false;
+}
+
+const upb_def *const*upb_image_getdefs(void *image, size_t len, int *n,
+                                       upb_status *status) {
+  if (!upb_image_check(image, len, status)) return NULL;
+  upb_image_header *h = image;
+  char *base = image;
+  if (h->base != (uintptr_t)image) {
+    const uint32_t *relocs = (const void*)(base + h->relocs_ofs);
+    uintptr_t delta = (uintptr_t)image - (uintptr_t)h->base;
+    for (uint32_t i = 0; i < h->reloc_count; i++) {
+      uintptr_t ptr;
+      memcpy(&ptr, base + relocs[i], sizeof(ptr));
+      ptr += delta;
+      memcpy(base + relocs[i], &ptr, sizeof(ptr));
+    }
+    const uint32_t *srcs = (const void*)(base + h->srcs_ofs);
+    for (uint32_t i = 0; i < h->src_count; i++)
+      ((upb_stringsrc*)(base + srcs[i]))->bytesrc.vtbl = &upb_stringsrc_vtbl;
+    h->base = (uintptr_t)image;
+  }
+  const upb_def *const*defs = (const void*)(base + h->defs_ofs);
+  for (uint32_t i = 0; i < h->def_count; i++) {
+    // A def pointer that wasn't relocated can point anywhere.
+    if ((uintptr_t)defs[i] - (uintptr_t)image >= len) {
+      upb_status_seterrliteral(status, "image contains an invalid def");
+      return NULL;
+    }
+  }
+  *n = h->def_count;
+  return defs;
+}
+
+bool upb_image_load(upb_symtab *s, void *image, size_t len,
+                    upb_status *status) {
+  int n;
+  const upb_def *const*defs = upb_image_getdefs(image, len, &n, status);
+  return defs && upb_symtab_addfinalized(s, defs, n, status);
+}
+
+bool upb_image_loadfile(upb_symtab *s, const char *fname, upb_status *status) {
+#ifdef UPB_IMAGE_USE_MMAP
+  int fd = open(fname, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) close(fd);
+    upb_status_seterrf(status, "Couldn't read file: %s", fname);
+    return false;
+  }
+  size_t len = st.st_size;
+  // Private and writable, so that relocating the image only copies the pages
+  // that hold pointers.
+  void *image = len > 0 ?
+      mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (image == MAP_FAILED) {
+    upb_status_seterrf(status, "Couldn't map file: %s", fname);
+    return false;
+  }
+  bool success = upb_image_load(s, image, len, status);
+  if (!success) munmap(image, len);
+  return success;
+#else
+  FILE *f = fopen(fname, "rb");
+  long size = -1;
+  if (f && fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+  // malloc() memory is suitably aligned for the image.
+  char *image = size >= 0 ? malloc(UPB_MAX(size, 1)) : NULL;
+  if (!image || fseek(f, 0, SEEK_SET) != 0 ||
+      fread(image, 1, size, f) != (size_t)size) {
+    if (f) fclose(f);
+    free(image);
+    upb_status_seterrf(status, "Couldn't read file: %s", fname);
+    return false;
+  }
+  fclose(f);
+  bool success = upb_image_load(s, image, size, status);
+  if (!success) free(image);
+  return success;
+#endif
+}
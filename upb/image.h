@@ -0,0 +1,99 @@
+/*
+ * upb - a minimalist implementation of protocol buffers.
+ *
+ * Copyright (c) 2012 Google Inc.  See LICENSE for details.
+ * Author: Josh Haberman <jhaberman@gmail.com>
+ *
+ * A upb_image is a precompiled set of finalized defs (msgdefs and enumdefs,
+ * with their fields, values, layout, defaults and name tables) that is used in
+ * place, so that startup does not need to decode and resolve a
+ * FileDescriptorSet.  It is produced ahead of time (see tools/upbimg.c).
+ *
+ * The image holds the very structs that the defs are made of, laid out like
+ * the static defs that upbc generates: the defs are finalized and immortal,
+ * and every strtable has a perfect hash.  Every pointer in it is stored as an
+ * offset from the start of the image and listed in a relocation table, so
+ * the image can be mmap()'d at any address: loading it just adds the image's
+ * address to each of those pointers.  Nothing is parsed, allocated or copied,
+ * and the pages that hold no pointers (like the string pool) are never
+ * written, so they stay shared between the processes that map the image.
+ *
+ * Since it holds upb's own structs the image is only valid for the upb build
+ * that wrote it (the same byte order, pointer size and struct layouts, which
+ * the loader checks); images are a cache, not an interchange format.  Beyond
+ * those checks and the bounds of the relocations the image is trusted, like
+ * generated code.
+ *
+ * Layout (all offsets are from the start of the image):
+ *
+ *   upb_image_header
+ *   data: the defs and their tables (8-byte aligned)
+ *   uint32_t relocs[reloc_count]: the offsets of the pointers in the data
+ *   uint32_t srcs[src_count]: the offsets of the upb_stringsrcs of string
+ *       defaults, whose vtbl pointers are set when the image is loaded
+ *   string pool: names and string defaults
+ */
+
+#ifndef UPB_IMAGE_H_
+#define UPB_IMAGE_H_
+
+#include "upb/def.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UPB_IMAGE_MAGIC "upbimg03"
+#define UPB_IMAGE_BYTEORDER 0x01020304
+
+typedef struct {
+  char magic[8];        // UPB_IMAGE_MAGIC, not NULL-terminated.
+  uint32_t byteorder;   // UPB_IMAGE_BYTEORDER, in the writer's byte order.
+  uint32_t abi;         // Fingerprint of the writer's struct layouts.
+  uint32_t size;        // Total size of the image in bytes.
+  uint32_t def_count;
+  uint32_t defs_ofs;    // upb_def *defs[def_count], in name order.
+  uint32_t relocs_ofs;
+  uint32_t reloc_count;
+  uint32_t srcs_ofs;
+  uint32_t src_count;
+  uint32_t pad;
+  // The address that the pointers in the image are currently relative to: 0
+  // as written, and the image's own address once it has been loaded.
+  uint64_t base;
+} upb_image_header;
+
+// Serializes the given defs into a newly malloc()'d image, returning NULL and
+// setting status on error.  The defs must be finalized msgdefs and enumdefs,
+// and must include the subdef of every field (ie. be closed under references,
+// as the output of upb_symtab_getdefs() is).  The caller owns the image.
+char *upb_image_write(const upb_def *const*defs, int n, size_t *len,
+                      upb_status *status);
+
+// Relocates the image to its current address and returns its defs, which
+// live in the image itself: *n finalized, immortal defs, as good as those
+// generated by upbc.  The returned array is in the image too.  The image must
+// be 8-byte aligned and writable (a MAP_PRIVATE mapping only copies the pages
+// that hold pointers), and must outlive every use of the defs, which in
+// practice means it is never freed.  Calling this again on the same image is
+// cheap, and calling it on a copy of a loaded image relocates the copy.  On
+// error (including an image written by another build of upb) NULL is
+// returned, status is set and the image is left unchanged.
+const upb_def *const*upb_image_getdefs(void *image, size_t len, int *n,
+                                       upb_status *status);
+
+// Like the previous but also adds the defs to the given symtab with
+// upb_symtab_addfinalized(), so none of them may be in the symtab already.
+bool upb_image_load(upb_symtab *s, void *image, size_t len,
+                    upb_status *status);
+
+// Like the previous but also reads the image from the given file, which is
+// mmap()'d privately where available rather than copied into memory.  Once
+// loaded, the image is never unmapped or freed.
+bool upb_image_loadfile(upb_symtab *s, const char *fname, upb_status *status);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* UPB_IMAGE_H_ */
@@ -38,6 +38,7 @@ static void upb_accessors_onfreg(void *c, upb_fhandlers *fh,
     if (upb_isseq(f)) {
       upb_fhandlers_setstartseq(fh, f->accessor->startseq);
       upb_fhandlers_setvalue(fh, f->accessor->append);
+      upb_fhandlers_setarraylayout(fh, f->accessor->appendlayout);
       upb_fhandlers_setstartsubmsg(fh, f->accessor->appendsubmsg);
     } else {
       upb_fhandlers_setvalue(fh, f->accessor->set);
@@ -66,6 +66,10 @@ typedef struct _upb_accessor_vtbl {
   upb_seqbegin_handler   *seqbegin;
   upb_seqnext_handler    *seqnext;
   upb_seqget_handler     *seqget;
+
+  // Optional layout of the array that "append" appends to, which lets the JIT
+  // append values itself (see upb_arraylayout).
+  const upb_arraylayout  *appendlayout;
 } upb_accessor_vtbl;
 
 // Registers handlers for writing into a message of the given type using
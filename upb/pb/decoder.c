@@ -45,12 +45,33 @@ static const upb_decoder_typeinfo upb_decoder_types[] = {
 
 /* upb_decoderplan ************************************************************/
 
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
+// The code for a plan is generated in one or more chunks, each of which has
+// its own DynASM state so that the chunks can be generated on different
+// threads.  A chunk has the code for a contiguous range of h->msgs, laid out
+// one after the other in plan->jit_code.  Code can only refer to labels in its
+// own chunk, so calls to a message in another chunk go indirectly through
+// m->jit_startmsg_func, which is filled in once all chunks are linked.  The
+// first chunk also contains the trampoline that enters the JIT.
+typedef struct {
+  upb_decoderplan *plan;
+
+  // This pointer is allocated by dasm_init() and freed by dasm_free().
+  struct dasm_State *dynasm;
+  void **globals;  // Addresses of DynASM's global labels, after encoding.
+
+  uint32_t chunk;
+  int msgs_begin, msgs_end;  // This chunk's range of h->msgs.
+  uint32_t pclabel_count;
+  size_t size;  // Set by dasm_link().
+  size_t ofs;   // Where this chunk starts in plan->jit_code.
+} upb_jitcompiler;
+
 // These defines are necessary for DynASM codegen.
 // See dynasm/dasm_proto.h for more info.
-#define Dst_DECL upb_decoderplan *plan
-#define Dst_REF (plan->dynasm)
-#define Dst (plan)
+#define Dst_DECL upb_jitcompiler *jc
+#define Dst_REF (jc->dynasm)
+#define Dst (jc)
 
 // In debug mode, make DynASM do internal checks (must be defined before any
 // dasm header is included.
@@ -59,33 +80,101 @@ static const upb_decoder_typeinfo upb_decoder_types[] = {
 #endif
 
 #include "dynasm/dasm_proto.h"
+
+static void upb_decoder_setmsgend(upb_decoder *d);
+
+#if defined(UPB_USE_JIT_X64)
 #include "upb/pb/decoder_x64.h"
+#elif defined(UPB_USE_JIT_X86)
+#include "upb/pb/decoder_x86.h"
+#endif
 #endif
 
 upb_decoderplan *upb_decoderplan_new(upb_handlers *h, bool allowjit) {
+  if (!upb_handlers_freeze(h)) return NULL;
   upb_decoderplan *p = malloc(sizeof(*p));
+  p->refcount = 1;
   p->handlers = h;
   upb_handlers_ref(h);
-  h->should_jit = allowjit;
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
   p->jit_code = NULL;
-  if (allowjit) upb_decoderplan_makejit(p);
+  p->profile_decodes = 0;
+  p->profile = NULL;
+  p->profile_lock = 0;
+  if (allowjit) upb_decoderplan_makejit(p, 1);
+#else
+  (void)allowjit;
 #endif
   return p;
 }
 
+upb_decoderplan *upb_decoderplan_newtiered(upb_handlers *h,
+                                           uint32_t profile_decodes) {
+#ifdef UPB_USE_JIT
+  if (profile_decodes == 0) return upb_decoderplan_new(h, true);
+  upb_decoderplan *p = upb_decoderplan_new(h, false);
+  if (!p) return NULL;
+  p->profile = malloc(sizeof(*p->profile));
+  if (!p->profile || !upb_inttable_init(p->profile)) {
+    free(p->profile);
+    p->profile = NULL;
+    upb_decoderplan_unref(p);
+    return NULL;
+  }
+  p->profile_decodes = profile_decodes;
+  return p;
+#else
+  (void)profile_decodes;
+  return upb_decoderplan_new(h, false);
+#endif
+}
+
+upb_decoderplan *upb_decoderplan_newparallel(upb_handlers *h, int threads) {
+#ifdef UPB_USE_JIT
+  upb_decoderplan *p = upb_decoderplan_new(h, false);
+  if (p) upb_decoderplan_makejit(p, UPB_MAX(threads, 1));
+  return p;
+#else
+  (void)threads;
+  return upb_decoderplan_new(h, true);
+#endif
+}
+
+void upb_decoderplan_ref(upb_decoderplan *p) { upb_atomic_inc(&p->refcount); }
+
+#ifdef UPB_USE_JIT
+static void upb_decoderplan_freeprofile(upb_decoderplan *p) {
+  if (!p->profile) return;
+  upb_inttable_iter i;
+  upb_inttable_begin(&i, p->profile);
+  for(; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    upb_jitprofile *prof = upb_value_getptr(upb_inttable_iter_value(&i));
+    upb_inttable_uninit(&prof->next);
+    free(prof);
+  }
+  upb_inttable_uninit(p->profile);
+  free(p->profile);
+  p->profile = NULL;
+}
+#endif
+
 void upb_decoderplan_unref(upb_decoderplan *p) {
-  // TODO: make truly refcounted.
-  upb_handlers_unref(p->handlers);
-#ifdef UPB_USE_JIT_X64
+  if (!upb_atomic_dec(&p->refcount)) return;
+#ifdef UPB_USE_JIT
+  // The JIT state lives in the handlers, so release it first.
   if (p->jit_code) upb_decoderplan_freejit(p);
+  upb_decoderplan_freeprofile(p);
 #endif
+  upb_handlers_unref(p->handlers);
   free(p);
 }
 
 bool upb_decoderplan_hasjitcode(upb_decoderplan *p) {
-#ifdef UPB_USE_JIT_X64
-  return p->jit_code != NULL;
+#ifdef UPB_USE_JIT
+  upb_atomic_lock(&p->profile_lock);
+  bool ret = p->jit_code != NULL;
+  upb_atomic_unlock(&p->profile_lock);
+  return ret;
 #else
   (void)p;
   return false;
@@ -93,6 +182,179 @@ bool upb_decoderplan_hasjitcode(upb_decoderplan *p) {
 }
 
 
+/* upb_decoderplan cache ******************************************************/
+
+// The cache maps each msgdef to a list of the plans built for it, one for
+// each distinct set of registration callbacks, closure and JIT flag.  It is
+// protected by a spinlock, which is never held while a plan is being built.
+typedef struct _upb_plancache_ent {
+  upb_onmsgreg *onmreg;
+  upb_onfieldreg *onfreg;
+  void *closure;
+  bool allowjit;
+  const upb_msgdef *msgdef;  // We own a ref.
+  upb_decoderplan *plan;     // We own a ref.
+  struct _upb_plancache_ent *next;  // Next plan for the same msgdef.
+} upb_plancache_ent;
+
+static uint32_t upb_plancache_lock;
+static bool upb_plancache_initialized;
+static upb_inttable upb_plancache;  // msgdef -> upb_plancache_ent list.
+static int upb_plancache_count;
+static int upb_plancache_limit = UPB_PLANCACHE_MAX;
+
+static upb_plancache_ent *upb_plancache_find(
+    upb_plancache_ent *e, upb_onmsgreg *onmreg, upb_onfieldreg *onfreg,
+    void *closure, bool allowjit) {
+  for (; e; e = e->next) {
+    if (e->onmreg == onmreg && e->onfreg == onfreg && e->closure == closure &&
+        e->allowjit == allowjit)
+      return e;
+  }
+  return NULL;
+}
+
+// Unlinks the entries whose plans nobody else holds a ref on, returning them
+// as a list for upb_plancache_free() to free once the lock is released.
+// Requires the lock; nobody can take a new ref on a plan the cache alone
+// holds without it.
+static upb_plancache_ent *upb_plancache_evict(int *evicted) {
+  upb_plancache_ent *ret = NULL;
+  *evicted = 0;
+  if (!upb_plancache_initialized) return NULL;
+  upb_inttable_iter i;
+  upb_inttable_begin(&i, &upb_plancache);
+  for(; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    upb_value *v = upb_inttable_lookup(&upb_plancache,
+                                       upb_inttable_iter_key(&i));
+    upb_plancache_ent *e = upb_value_getptr(*v), *keep = NULL;
+    while (e) {
+      upb_plancache_ent *next = e->next;
+      if (upb_atomic_read(&e->plan->refcount) == 1) {
+        e->next = ret;
+        ret = e;
+        (*evicted)++;
+      } else {
+        e->next = keep;
+        keep = e;
+      }
+      e = next;
+    }
+    upb_value_setptr(v, keep);
+  }
+  // Msgdefs whose lists are now empty can't be removed while iterating.
+  for (upb_plancache_ent *e = ret; e; e = e->next) {
+    upb_value *v = upb_inttable_lookup(&upb_plancache, (uintptr_t)e->msgdef);
+    if (v && !upb_value_getptr(*v))
+      upb_inttable_remove(&upb_plancache, (uintptr_t)e->msgdef, NULL);
+  }
+  upb_plancache_count -= *evicted;
+  // An insert scans the cache once it holds this many plans.  If a scan
+  // finds them all in use, scanning again on every insert would make inserts
+  // O(n), so the next scan waits for another UPB_PLANCACHE_MAX plans.
+  upb_plancache_limit = *evicted > 0 ? UPB_PLANCACHE_MAX :
+      upb_plancache_count + UPB_PLANCACHE_MAX;
+  return ret;
+}
+
+// Frees a list returned by upb_plancache_evict(), without the lock: freeing a
+// plan can mean freeing its JIT-ted code and its msgdefs.
+static void upb_plancache_free(upb_plancache_ent *e) {
+  while (e) {
+    upb_plancache_ent *next = e->next;
+    upb_decoderplan_unref(e->plan);
+    upb_msgdef_unref(e->msgdef, e);
+    free(e);
+    e = next;
+  }
+}
+
+upb_decoderplan *upb_decoderplan_getcached(const upb_msgdef *m,
+                                           upb_onmsgreg *onmreg,
+                                           upb_onfieldreg *onfreg,
+                                           void *closure, bool allowjit) {
+  upb_atomic_lock(&upb_plancache_lock);
+  if (upb_plancache_initialized) {
+    upb_value *v = upb_inttable_lookup(&upb_plancache, (uintptr_t)m);
+    upb_plancache_ent *e = v ? upb_plancache_find(
+        upb_value_getptr(*v), onmreg, onfreg, closure, allowjit) : NULL;
+    if (e) {
+      upb_decoderplan_ref(e->plan);
+      upb_atomic_unlock(&upb_plancache_lock);
+      return e->plan;
+    }
+  }
+  upb_atomic_unlock(&upb_plancache_lock);
+
+  // Build the plan without the lock, since it may be JIT-ted.  If another
+  // thread cached a plan for the same key in the meantime we use that one.
+  upb_handlers *h = upb_handlers_new();
+  upb_handlers_regmsgdef(h, m, onmreg, onfreg, closure);
+  upb_decoderplan *p = upb_decoderplan_new(h, allowjit);
+  upb_handlers_unref(h);
+  if (!p) return NULL;
+  upb_plancache_ent *e = malloc(sizeof(*e));
+  upb_plancache_ent *evicted = NULL;
+
+  upb_atomic_lock(&upb_plancache_lock);
+  if (!upb_plancache_initialized)
+    upb_plancache_initialized = upb_inttable_init(&upb_plancache);
+  upb_value *v = upb_plancache_initialized ?
+      upb_inttable_lookup(&upb_plancache, (uintptr_t)m) : NULL;
+  upb_plancache_ent *existing = v ? upb_plancache_find(
+      upb_value_getptr(*v), onmreg, onfreg, closure, allowjit) : NULL;
+  if (existing) {
+    upb_decoderplan_ref(existing->plan);
+    upb_atomic_unlock(&upb_plancache_lock);
+    upb_decoderplan_unref(p);
+    free(e);
+    return existing->plan;
+  }
+  if (e && upb_plancache_initialized) {
+    if (upb_plancache_count >= upb_plancache_limit) {
+      int n;
+      evicted = upb_plancache_evict(&n);
+      v = upb_inttable_lookup(&upb_plancache, (uintptr_t)m);
+    }
+    e->onmreg = onmreg;
+    e->onfreg = onfreg;
+    e->closure = closure;
+    e->allowjit = allowjit;
+    e->msgdef = m;
+    e->plan = p;
+    e->next = v ? upb_value_getptr(*v) : NULL;
+    if (v) {
+      upb_value_setptr(v, e);
+    } else if (!upb_inttable_insert(&upb_plancache, (uintptr_t)m,
+                                    upb_value_ptr(e))) {
+      free(e);
+      e = NULL;
+    }
+  } else {
+    free(e);
+    e = NULL;
+  }
+  if (e) {
+    upb_msgdef_ref(m, e);
+    upb_decoderplan_ref(p);
+    upb_plancache_count++;
+  }
+  upb_atomic_unlock(&upb_plancache_lock);
+  upb_plancache_free(evicted);
+  // If we couldn't cache the plan the caller still gets an uncached one.
+  return p;
+}
+
+int upb_decoderplan_evictcached() {
+  int n;
+  upb_atomic_lock(&upb_plancache_lock);
+  upb_plancache_ent *evicted = upb_plancache_evict(&n);
+  upb_atomic_unlock(&upb_plancache_lock);
+  upb_plancache_free(evicted);
+  return n;
+}
+
+
 /* upb_decoder ****************************************************************/
 
 // It's unfortunate that we have to micro-manage the compiler this way,
@@ -148,7 +410,7 @@ static void upb_decoder_setmsgend(upb_decoder *d) {
   d->delim_end = (f->end_ofs != UPB_NONDELIMITED && delimlen <= buflen) ?
       d->buf + delimlen : NULL;  // NULL if not in this buf.
   d->top_is_packed = f->is_packed;
-  d->dispatch_table = &d->dispatcher.msgent->fieldtab;
+  d->dispatch_table = &d->dispatcher.msgent->dispatch;
 }
 
 static void upb_decoder_skiptonewbuf(upb_decoder *d, uint64_t ofs) {
@@ -159,7 +421,7 @@ static void upb_decoder_skiptonewbuf(upb_decoder *d, uint64_t ofs) {
   d->ptr = NULL;
   d->end = NULL;
   d->delim_end = NULL;
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
   d->jit_end = NULL;
 #endif
   d->bufstart_ofs = ofs;
@@ -186,7 +448,7 @@ static bool upb_trypullbuf(upb_decoder *d) {
   d->ptr = d->buf;
   d->end = d->buf + len;
   upb_decoder_setmsgend(d);
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
   // If we start parsing a value, we can parse up to 20 bytes without
   // having to bounds-check anything (2 10-byte varints).  Since the
   // JIT bounds-checks only *between* values (and for strings), the
@@ -335,6 +597,9 @@ INLINE upb_byteregion *upb_decode_string(upb_decoder *d) {
 INLINE void upb_push_msg(upb_decoder *d, upb_fhandlers *f, uint64_t end) {
   upb_dispatch_startsubmsg(&d->dispatcher, f)->end_ofs = end;
   upb_decoder_setmsgend(d);
+#ifdef UPB_USE_JIT
+  d->jit_prevfield[d->dispatcher.top - d->dispatcher.stack] = NULL;
+#endif
 }
 
 
@@ -345,10 +610,10 @@ INLINE void upb_push_msg(upb_decoder *d, upb_fhandlers *f, uint64_t end) {
 // but proto2 does not do this, so we pass.
 
 #define T(type, wt, valtype, convfunc) \
-  INLINE void upb_decode_ ## type(upb_decoder *d, upb_fhandlers *f) { \
+  INLINE void upb_decode_ ## type(upb_decoder *d, const upb_fieldslot *s) { \
     upb_value val; \
     upb_value_set ## valtype(&val, (convfunc)(upb_decode_ ## wt(d))); \
-    upb_dispatch_value(&d->dispatcher, f, val); \
+    upb_dispatch_slotvalue(&d->dispatcher, s, val); \
   } \
 
 T(INT32,    varint,  int32,  int32_t)
@@ -367,40 +632,112 @@ T(STRING,   string,  byteregion, upb_byteregion*)
 
 #undef T
 
-INLINE void upb_decode_DOUBLE(upb_decoder *d, upb_fhandlers *f) {
+INLINE void upb_decode_DOUBLE(upb_decoder *d, const upb_fieldslot *s) {
   upb_value val;
   double dbl;
   uint64_t wireval = upb_decode_fixed64(d);
   memcpy(&dbl, &wireval, 8);
   upb_value_setdouble(&val, dbl);
-  upb_dispatch_value(&d->dispatcher, f, val);
+  upb_dispatch_slotvalue(&d->dispatcher, s, val);
 }
 
-INLINE void upb_decode_FLOAT(upb_decoder *d, upb_fhandlers *f) {
+INLINE void upb_decode_FLOAT(upb_decoder *d, const upb_fieldslot *s) {
   upb_value val;
   float flt;
   uint64_t wireval = upb_decode_fixed32(d);
   memcpy(&flt, &wireval, 4);
   upb_value_setfloat(&val, flt);
-  upb_dispatch_value(&d->dispatcher, f, val);
+  upb_dispatch_slotvalue(&d->dispatcher, s, val);
 }
 
-static void upb_decode_GROUP(upb_decoder *d, upb_fhandlers *f) {
-  upb_push_msg(d, f, UPB_NONDELIMITED);
+static void upb_decode_GROUP(upb_decoder *d, const upb_fieldslot *s) {
+  upb_push_msg(d, s->f, UPB_NONDELIMITED);
 }
-static void upb_endgroup(upb_decoder *d, upb_fhandlers *f) {
-  (void)f;
+static void upb_endgroup(upb_decoder *d, const upb_fieldslot *s) {
+  (void)s;
   upb_dispatch_endsubmsg(&d->dispatcher);
   upb_decoder_setmsgend(d);
 }
-static void upb_decode_MESSAGE(upb_decoder *d, upb_fhandlers *f) {
+static void upb_decode_MESSAGE(upb_decoder *d, const upb_fieldslot *s) {
   uint32_t len = upb_decode_varint32(d);
-  upb_push_msg(d, f, upb_decoder_offset(d) + len);
+  upb_push_msg(d, s->f, upb_decoder_offset(d) + len);
 }
 
 
 /* The main decoding loop *****************************************************/
 
+#ifdef UPB_USE_JIT
+// Returns the profile of "f" in a tiered plan, creating it if this is the
+// first time "f" has been seen.  Returns NULL if out of memory.
+static upb_jitprofile *upb_decoder_getprofile(upb_decoder *d,
+                                              const upb_fhandlers *f) {
+  upb_inttable *t = d->plan->profile;
+  upb_value *v = upb_inttable_lookup(t, (uintptr_t)f);
+  if (v) return upb_value_getptr(*v);
+  upb_jitprofile *prof = malloc(sizeof(*prof));
+  if (!prof) return NULL;
+  prof->count = 0;
+  if (!upb_inttable_init(&prof->next)) {
+    free(prof);
+    return NULL;
+  }
+  if (!upb_inttable_insert(t, (uintptr_t)f, upb_value_ptr(prof))) {
+    upb_inttable_uninit(&prof->next);
+    free(prof);
+    return NULL;
+  }
+  return prof;
+}
+
+// Records "f" in the profile of a tiered plan that has not been JIT-ted yet.
+// Must be called after any sequence frame for "f" has been pushed.  The
+// profile only steers code layout, so a failed allocation just loses a sample.
+static void upb_decoder_profile(upb_decoder *d, upb_fhandlers *f) {
+  upb_dispatcher_frame *fr = d->dispatcher.top;
+  int depth = (fr - d->dispatcher.stack) - (fr->is_sequence ? 1 : 0);
+  upb_fhandlers *prev = d->jit_prevfield[depth];
+  d->jit_prevfield[depth] = f;
+  upb_decoderplan *p = d->plan;
+  upb_atomic_lock(&p->profile_lock);
+  if (!p->profile) {
+    // Another decoder JIT-ted the plan.
+    d->jit_code = p->jit_code;
+    d->jit_profiling = false;
+    goto done;
+  }
+  upb_jitprofile *prof = upb_decoder_getprofile(d, f);
+  if (prof) prof->count++;
+  // Repeats of the same field are handled by a loop in the JIT-ted code, so
+  // they don't need to be predicted.
+  if (!prev || prev == f) goto done;
+  upb_jitprofile *prevprof = upb_decoder_getprofile(d, prev);
+  if (!prevprof) goto done;
+  upb_value *v = upb_inttable_lookup(&prevprof->next, f->number);
+  if (v) {
+    upb_value_setuint32(v, upb_value_getuint32(*v) + 1);
+  } else {
+    upb_inttable_insert(&prevprof->next, f->number, upb_value_uint32(1));
+  }
+done:
+  upb_atomic_unlock(&p->profile_lock);
+}
+
+// Counts a successful decode against a tiered plan's profile, JIT-ting the
+// plan if it has seen enough, and picks up the plan's JIT-ted code if it has
+// any now.
+static void upb_decoder_endprofile(upb_decoder *d) {
+  upb_decoderplan *p = d->plan;
+  upb_atomic_lock(&p->profile_lock);
+  if (p->profile_decodes > 0 && --p->profile_decodes == 0) {
+    upb_decoderplan_makejit(p, 1);
+    upb_decoderplan_freeprofile(p);
+  }
+  d->jit_code = p->jit_code;
+  d->jit_profiling = p->profile != NULL;
+  upb_atomic_unlock(&p->profile_lock);
+}
+#endif
+
 static void upb_decoder_checkdelim(upb_decoder *d) {
   // TODO: This doesn't work for the case that no buffer is currently loaded
   // (ie. d->buf == NULL) because delim_end is NULL even if we are at
@@ -419,28 +756,33 @@ static void upb_decoder_checkdelim(upb_decoder *d) {
   }
 }
 
-INLINE upb_fhandlers *upb_decode_tag(upb_decoder *d) {
+// Returns the slot of the next field, or NULL at the end of the input.  The
+// slot has everything needed to decode and dispatch a value; only sequences
+// and submessages need the field's upb_fhandlers (s->f).
+INLINE const upb_fieldslot *upb_decode_tag(upb_decoder *d) {
   while (1) {
     uint32_t tag;
     if (!upb_trydecode_varint32(d, &tag)) return NULL;
     uint8_t wire_type = tag & 0x7;
     uint32_t fieldnum = tag >> 3;
-    const upb_value *val = upb_inttable_lookup32(d->dispatch_table, fieldnum);
-    upb_fhandlers *f = val ? upb_value_getptr(*val) : NULL;
+    const upb_fieldslot *s =
+        (const upb_fieldslot*)upb_inttable32_lookup(d->dispatch_table,
+                                                    fieldnum);
     bool is_packed = false;
 
-    if (f) {
+    if (s) {
       // Wire type check.
-      if (wire_type == upb_decoder_types[f->type].native_wire_type) {
+      if (wire_type == upb_decoder_types[s->type].native_wire_type) {
         // Wire type is ok.
       } else if ((wire_type == UPB_WIRE_TYPE_DELIMITED &&
-                 upb_decoder_types[f->type].is_numeric)) {
+                 upb_decoder_types[s->type].is_numeric)) {
         // Wire type is ok (and packed).
         is_packed = true;
       } else {
-        f = NULL;
+        s = NULL;
       }
     }
+    upb_fhandlers *f = s ? s->f : NULL;
 
     // There are no explicit "startseq" or "endseq" markers in protobuf
     // streams, so we have to infer them by noticing when a repeated field
@@ -451,7 +793,7 @@ INLINE upb_fhandlers *upb_decode_tag(upb_decoder *d) {
       upb_decoder_setmsgend(d);
       fr = d->dispatcher.top;
     }
-    if (f && f->repeated && !fr->is_sequence) {
+    if (s && s->repeated && !fr->is_sequence) {
       upb_dispatcher_frame *fr2 = upb_dispatch_startseq(&d->dispatcher, f);
       if (is_packed) {
         // Packed primitive field.
@@ -465,7 +807,12 @@ INLINE upb_fhandlers *upb_decode_tag(upb_decoder *d) {
       upb_decoder_setmsgend(d);
     }
 
-    if (f) return f;
+    if (s) {
+#ifdef UPB_USE_JIT
+      if (d->jit_profiling) upb_decoder_profile(d, f);
+#endif
+      return s;
+    }
 
     // Unknown field.
     if (fieldnum == 0 || fieldnum > UPB_MAX_FIELDNUMBER)
@@ -498,15 +845,16 @@ upb_success_t upb_decoder_decode(upb_decoder *d) {
   upb_dispatch_startmsg(&d->dispatcher);
   // Prime the buf so we can hit the JIT immediately.
   upb_trypullbuf(d);
-  upb_fhandlers *f = d->dispatcher.top->f;
   while(1) {
     upb_decoder_checkdelim(d);
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
     upb_decoder_enterjit(d);
     upb_decoder_checkpoint(d);
 #endif
-    if (!d->top_is_packed) f = upb_decode_tag(d);
-    if (!f) {
+    // Inside a packed field there are no tags, just the field's values.
+    const upb_fieldslot *s = d->top_is_packed ?
+        d->dispatcher.top->f->slot : upb_decode_tag(d);
+    if (!s) {
       // Sucessful EOF.  We may need to dispatch a top-level implicit frame.
       if (d->dispatcher.top->is_sequence) {
         assert(d->dispatcher.top == d->dispatcher.stack + 1);
@@ -514,29 +862,34 @@ upb_success_t upb_decoder_decode(upb_decoder *d) {
       }
       assert(d->dispatcher.top == d->dispatcher.stack);
       upb_dispatch_endmsg(&d->dispatcher, &d->status);
+#ifdef UPB_USE_JIT
+      // A tiered plan that has seen enough input gets JIT-ted now, so the
+      // next decode with this plan will use the JIT.
+      if (d->jit_profiling) upb_decoder_endprofile(d);
+#endif
       return UPB_OK;
     }
 
-    switch (f->type) {
-      case UPB_TYPE_ENDGROUP:  upb_endgroup(d, f);        break;
-      case UPB_TYPE(DOUBLE):   upb_decode_DOUBLE(d, f);   break;
-      case UPB_TYPE(FLOAT):    upb_decode_FLOAT(d, f);    break;
-      case UPB_TYPE(INT64):    upb_decode_INT64(d, f);    break;
-      case UPB_TYPE(UINT64):   upb_decode_UINT64(d, f);   break;
-      case UPB_TYPE(INT32):    upb_decode_INT32(d, f);    break;
-      case UPB_TYPE(FIXED64):  upb_decode_FIXED64(d, f);  break;
-      case UPB_TYPE(FIXED32):  upb_decode_FIXED32(d, f);  break;
-      case UPB_TYPE(BOOL):     upb_decode_BOOL(d, f);     break;
+    switch (s->type) {
+      case UPB_TYPE_ENDGROUP:  upb_endgroup(d, s);        break;
+      case UPB_TYPE(DOUBLE):   upb_decode_DOUBLE(d, s);   break;
+      case UPB_TYPE(FLOAT):    upb_decode_FLOAT(d, s);    break;
+      case UPB_TYPE(INT64):    upb_decode_INT64(d, s);    break;
+      case UPB_TYPE(UINT64):   upb_decode_UINT64(d, s);   break;
+      case UPB_TYPE(INT32):    upb_decode_INT32(d, s);    break;
+      case UPB_TYPE(FIXED64):  upb_decode_FIXED64(d, s);  break;
+      case UPB_TYPE(FIXED32):  upb_decode_FIXED32(d, s);  break;
+      case UPB_TYPE(BOOL):     upb_decode_BOOL(d, s);     break;
       case UPB_TYPE(STRING):
-      case UPB_TYPE(BYTES):    upb_decode_STRING(d, f);   break;
-      case UPB_TYPE(GROUP):    upb_decode_GROUP(d, f);    break;
-      case UPB_TYPE(MESSAGE):  upb_decode_MESSAGE(d, f);  break;
-      case UPB_TYPE(UINT32):   upb_decode_UINT32(d, f);   break;
-      case UPB_TYPE(ENUM):     upb_decode_ENUM(d, f);     break;
-      case UPB_TYPE(SFIXED32): upb_decode_SFIXED32(d, f); break;
-      case UPB_TYPE(SFIXED64): upb_decode_SFIXED64(d, f); break;
-      case UPB_TYPE(SINT32):   upb_decode_SINT32(d, f);   break;
-      case UPB_TYPE(SINT64):   upb_decode_SINT64(d, f);   break;
+      case UPB_TYPE(BYTES):    upb_decode_STRING(d, s);   break;
+      case UPB_TYPE(GROUP):    upb_decode_GROUP(d, s);    break;
+      case UPB_TYPE(MESSAGE):  upb_decode_MESSAGE(d, s);  break;
+      case UPB_TYPE(UINT32):   upb_decode_UINT32(d, s);   break;
+      case UPB_TYPE(ENUM):     upb_decode_ENUM(d, s);     break;
+      case UPB_TYPE(SFIXED32): upb_decode_SFIXED32(d, s); break;
+      case UPB_TYPE(SFIXED64): upb_decode_SFIXED64(d, s); break;
+      case UPB_TYPE(SINT32):   upb_decode_SINT32(d, s);   break;
+      case UPB_TYPE(SINT64):   upb_decode_SINT64(d, s);   break;
       case UPB_TYPE_NONE: assert(false); break;
     }
     upb_decoder_checkpoint(d);
@@ -556,6 +909,12 @@ void upb_decoder_resetplan(upb_decoder *d, upb_decoderplan *p, int msg_offset) {
   d->plan = p;
   d->msg_offset = msg_offset;
   d->input = NULL;
+#ifdef UPB_USE_JIT
+  upb_atomic_lock(&p->profile_lock);
+  d->jit_code = p->jit_code;
+  d->jit_profiling = p->profile != NULL;
+  upb_atomic_unlock(&p->profile_lock);
+#endif
 }
 
 void upb_decoder_resetinput(upb_decoder *d, upb_byteregion *input,
@@ -572,6 +931,9 @@ void upb_decoder_resetinput(upb_decoder *d, upb_byteregion *input,
   d->bufstart_ofs = 0;
   d->ptr = NULL;
   d->buf = NULL;
+#ifdef UPB_USE_JIT
+  d->jit_prevfield[0] = NULL;
+#endif
   upb_decoder_skiptonewbuf(d, upb_byteregion_startofs(input));
 }
 
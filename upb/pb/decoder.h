@@ -34,14 +34,71 @@ extern "C" {
 struct _upb_decoderplan;
 typedef struct _upb_decoderplan upb_decoderplan;
 
+// Freezes the handlers (see upb_handlers_freeze()), which may not be modified
+// afterwards; returns NULL if that runs out of memory.
+//
 // TODO: add parameter for a list of other decoder plans that we can share
 // generated code with.
 upb_decoderplan *upb_decoderplan_new(upb_handlers *h, bool allowjit);
+void upb_decoderplan_ref(upb_decoderplan *p);
 void upb_decoderplan_unref(upb_decoderplan *p);
 
+// Returns a plan for decoding messages of type "m" with the handlers that
+// upb_handlers_regmsgdef(h, m, onmreg, onfreg, closure) would register, like
+// upb_decoderplan_new(h, allowjit) for those handlers.  Plans are kept in a
+// global cache keyed by (m, onmreg, onfreg, closure, allowjit), so only the
+// first request for a given key builds the handlers and the plan (and JITs
+// it); later requests just take another ref on the same plan.  The caller
+// owns a ref on the returned plan and must release it with
+// upb_decoderplan_unref().  Returns NULL if out of memory.  Threadsafe.
+//
+// The cache holds its own refs on the plan and on "m".  A cached plan is only
+// evicted once no ref is held on it outside of the cache: either by
+// upb_decoderplan_evictcached() or, when the cache holds more than
+// UPB_PLANCACHE_MAX plans, by the request that adds another.  If all of the
+// cached plans are in use, the cache grows by another UPB_PLANCACHE_MAX
+// plans before a request tries to evict again.  The callbacks
+// must not change what they register for a given closure while it is cached.
+#define UPB_PLANCACHE_MAX 256
+upb_decoderplan *upb_decoderplan_getcached(const upb_msgdef *m,
+                                           upb_onmsgreg *onmreg,
+                                           upb_onfieldreg *onfreg,
+                                           void *closure, bool allowjit);
+
+// Evicts every cached plan that has no refs outside of the cache, returning
+// how many were evicted.
+int upb_decoderplan_evictcached(void);
+
+// Like upb_decoderplan_new(h, true), but the plan is not JIT-ted right away.
+// Instead the first "profile_decodes" successful calls to upb_decoder_decode()
+// run in the interpreter and record how often each field is seen and which
+// field usually follows it.  The plan is then JIT-ted with the code for hot
+// fields laid out first and each field's next-tag prediction taken from the
+// profile instead of from field number order.
+//
+// Like any plan, a tiered plan can be used by many upb_decoders at once: the
+// decoders that use it while it is profiling each add to the one profile, and
+// a decoder picks up the JIT-ted code at its next upb_decoder_decode() call.
+// If JIT support was not compiled in this is equivalent to
+// upb_decoderplan_new(h, false).
+upb_decoderplan *upb_decoderplan_newtiered(upb_handlers *h,
+                                           uint32_t profile_decodes);
+
+// Like upb_decoderplan_new(h, true), but the code for different messages is
+// generated on up to "threads" threads at once.  This is for creating plans
+// for very large schemas ahead of time, where JIT-ting on one core is slow.
+// Threads are only used if upb was compiled with UPB_USE_PTHREADS.
+upb_decoderplan *upb_decoderplan_newparallel(upb_handlers *h, int threads);
+
 // Returns true if the plan contains JIT-ted code.  This may not be the same as
 // the "allowjit" parameter to the constructor if support for JIT-ting was not
-// compiled in.
+// compiled in, or if another plan that is still alive has JIT-ted the same
+// handlers (the handlers hold the JIT state of only one plan at a time).
+//
+// If the UPB_JIT_PERF_MAP environment variable is set when a plan is JIT-ted,
+// a symbol for each message's and field's code is appended to
+// /tmp/perf-<pid>.map so that perf(1) can attribute samples in the JIT-ted
+// code.
 bool upb_decoderplan_hasjitcode(upb_decoderplan *p);
 
 
@@ -57,7 +114,7 @@ typedef struct _upb_decoder {
   upb_status      status;          // Where we store errors that occur.
   upb_byteregion  str_byteregion;  // For passing string data to callbacks.
 
-  upb_inttable    *dispatch_table;
+  const upb_inttable32 *dispatch_table;
 
   // Current input buffer and its stream offset.
   const char *buf, *ptr, *end;
@@ -68,9 +125,19 @@ typedef struct _upb_decoder {
   // True if the top stack frame represents a packed field.
   bool top_is_packed;
 
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
   // For JIT, which doesn't do bounds checks in the middle of parsing a field.
   const char *jit_end, *effective_end;  // == MIN(jit_end, submsg_end)
+
+  // The plan's JIT-ted code (or NULL) and whether it is collecting a profile,
+  // as of the last time we looked: a tiered plan changes both when it is
+  // JIT-ted, which we only see at the end of a decode.
+  char *jit_code;
+  bool jit_profiling;
+
+  // For tiered plans that are collecting a profile: the last field we saw
+  // at each level of message nesting.
+  upb_fhandlers *jit_prevfield[UPB_MAX_NESTING];
 #endif
 
   // For exiting the decoder on error.
@@ -110,17 +177,44 @@ INLINE const upb_status *upb_decoder_status(upb_decoder *d) {
 
 // Implementation details
 
+#ifdef UPB_USE_JIT
+// How many times a tiered plan saw a field while profiling, and how many times
+// each other field (keyed by number) immediately followed it.
+typedef struct {
+  uint32_t count;
+  upb_inttable next;
+} upb_jitprofile;
+#endif
+
 struct _upb_decoderplan {
+  uint32_t refcount;
   upb_handlers *handlers;  // owns reference.
 
-#ifdef UPB_USE_JIT_X64
+#ifdef UPB_USE_JIT
   // JIT-generated machine code (else NULL).
   char *jit_code;
   size_t jit_size;
   char *debug_info;
 
-  // This pointer is allocated by dasm_init() and freed by dasm_free().
-  struct dasm_State *dynasm;
+  // Number of successful decodes left to profile before we JIT (0 if we are
+  // not profiling).
+  uint32_t profile_decodes;
+
+  // The profile of a tiered plan, until it is JIT-ted (else NULL): a
+  // upb_jitprofile for each field seen so far, keyed by its upb_fhandlers*.
+  upb_inttable *profile;
+
+  // Protects "profile", "profile_decodes" and (for tiered plans) "jit_code",
+  // since any of the decoders using a tiered plan may JIT it.
+  uint32_t profile_lock;
+
+  // Whether the generated code may use BMI1/BMI2 instructions; detected from
+  // the CPU when the plan is JIT-ted.
+  bool jit_bmi2;
+
+  // Distance from jit_code to the address the code was written at, if that
+  // was a separate writable mapping (see upb_jitarena in jit_common.h).
+  ptrdiff_t jit_reldelta;
 #endif
 };
 
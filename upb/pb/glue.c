@@ -6,23 +6,27 @@
  */
 
 #include "upb/bytestream.h"
+#include "upb/descriptor/descriptor_const.h"
 #include "upb/descriptor/reader.h"
 #include "upb/pb/decoder.h"
 #include "upb/pb/glue.h"
+#include "upb/pb/varint.h"
+#if defined(UPB_USE_PTHREADS) && !defined(UPB_THREAD_UNSAFE)
+#include <pthread.h>
+#endif
 
-upb_def **upb_load_defs_from_descriptor(const char *str, size_t len, int *n,
-                                        void *owner, upb_status *status) {
+// Decodes a descriptor with a plan built from the descreader's handlers.  The
+// returned array of defs (of length *n) is newly allocated, and the caller owns
+// it and a ref on each def.
+static upb_def **upb_decode_descriptor(upb_decoderplan *p, const char *str,
+                                       size_t len, int *n, void *owner,
+                                       upb_status *status) {
   upb_stringsrc strsrc;
   upb_stringsrc_init(&strsrc);
   upb_stringsrc_reset(&strsrc, str, len);
 
-  upb_handlers *h = upb_handlers_new();
-  upb_descreader_reghandlers(h);
-
-  upb_decoderplan *p = upb_decoderplan_new(h, false);
   upb_decoder d;
   upb_decoder_init(&d);
-  upb_handlers_unref(h);
   upb_descreader r;
   upb_descreader_init(&r);
   upb_decoder_resetplan(&d, p, 0);
@@ -32,7 +36,6 @@ upb_def **upb_load_defs_from_descriptor(const char *str, size_t len, int *n,
   if (status) upb_status_copy(status, upb_decoder_status(&d));
   upb_stringsrc_uninit(&strsrc);
   upb_decoder_uninit(&d);
-  upb_decoderplan_unref(p);
   if (ret != UPB_OK) {
     upb_descreader_uninit(&r);
     return NULL;
@@ -42,9 +45,31 @@ upb_def **upb_load_defs_from_descriptor(const char *str, size_t len, int *n,
   memcpy(defscopy, defs, sizeof(upb_def*) * (*n));
   upb_descreader_uninit(&r);
 
+  // Give the messages a default layout.  The defs are still usable without
+  // one, so a message that can't be laid out (eg. one too large for the
+  // msgdef's offsets) is simply left without it.
+  for (int i = 0; i < *n; i++) {
+    upb_msgdef *m = upb_dyncast_msgdef(defscopy[i]);
+    if (m) upb_msgdef_layout(m);
+  }
   return defscopy;
 }
 
+upb_def **upb_load_defs_from_descriptor(const char *str, size_t len, int *n,
+                                        void *owner, upb_status *status) {
+  upb_handlers *h = upb_handlers_new();
+  upb_descreader_reghandlers(h);
+  upb_decoderplan *p = upb_decoderplan_new(h, false);
+  upb_handlers_unref(h);
+  if (!p) {
+    upb_status_seterrliteral(status, "out of memory");
+    return NULL;
+  }
+  upb_def **defs = upb_decode_descriptor(p, str, len, n, owner, status);
+  upb_decoderplan_unref(p);
+  return defs;
+}
+
 bool upb_load_descriptor_into_symtab(upb_symtab *s, const char *str, size_t len,
                                      upb_status *status) {
   int n;
@@ -55,6 +80,495 @@ bool upb_load_descriptor_into_symtab(upb_symtab *s, const char *str, size_t len,
   return success;
 }
 
+/* Batch loading **************************************************************/
+
+// Each worker decodes every "stride"th file, starting with file "first", with
+// its own decoder and descreader; the plan is shared, since decoding does not
+// modify it.  The defs of file i go to defs[i].
+typedef struct {
+  upb_decoderplan *plan;
+  const char *const *descs;
+  const size_t *lens;
+  int files;
+  upb_def ***defs;
+  int *counts;
+  upb_status *statuses;
+  const void *owner;
+} upb_loadbatch;
+
+typedef struct {
+  upb_loadbatch *batch;
+  int first, stride;
+} upb_loadworker;
+
+static void *upb_loadworker_run(void *_w) {
+  upb_loadworker *w = _w;
+  upb_loadbatch *b = w->batch;
+  for (int i = w->first; i < b->files; i += w->stride) {
+    b->defs[i] = upb_decode_descriptor(b->plan, b->descs[i], b->lens[i],
+                                       &b->counts[i], (void*)b->owner,
+                                       &b->statuses[i]);
+  }
+  return NULL;
+}
+
+static void upb_loadbatch_run(upb_loadbatch *b, int threads) {
+#if defined(UPB_USE_PTHREADS) && !defined(UPB_THREAD_UNSAFE)
+  threads = UPB_MAX(UPB_MIN(threads, b->files), 1);
+  upb_loadworker *workers = malloc(threads * sizeof(*workers));
+  pthread_t *tids = malloc(threads * sizeof(*tids));
+  bool *started = malloc(threads * sizeof(*started));
+  if (!workers || !tids || !started) threads = 1;
+  for (int i = 1; i < threads; i++) {
+    workers[i].batch = b;
+    workers[i].first = i;
+    workers[i].stride = threads;
+    started[i] =
+        pthread_create(&tids[i], NULL, &upb_loadworker_run, &workers[i]) == 0;
+  }
+  upb_loadworker w = {b, 0, threads};
+  upb_loadworker_run(&w);
+  for (int i = 1; i < threads; i++) {
+    if (started[i])
+      pthread_join(tids[i], NULL);
+    else
+      upb_loadworker_run(&workers[i]);
+  }
+  free(workers);
+  free(tids);
+  free(started);
+#else
+  (void)threads;
+  upb_loadworker w = {b, 0, 1};
+  upb_loadworker_run(&w);
+#endif
+}
+
+bool upb_load_descriptors_into_symtab(upb_symtab *s, const char *const *descs,
+                                      const size_t *lens, int n, int threads,
+                                      upb_status *status) {
+  upb_handlers *h = upb_handlers_new();
+  upb_descreader_reghandlers_file(h);
+  upb_loadbatch b = {upb_decoderplan_new(h, false), descs, lens, n,
+                     calloc(n, sizeof(*b.defs)), calloc(n, sizeof(int)),
+                     malloc(n * sizeof(upb_status)), &b};
+  upb_handlers_unref(h);
+  bool success = false;
+  upb_def **all = NULL;
+  if (!b.plan || !b.defs || !b.counts || !b.statuses) {
+    upb_status_seterrliteral(status, "out of memory");
+    goto done;
+  }
+  for (int i = 0; i < n; i++) upb_status_init(&b.statuses[i]);
+  upb_loadbatch_run(&b, threads);
+
+  // Resolve and finalize all the files at once, so they may refer to each
+  // other in any order.
+  int total = 0;
+  for (int i = 0; i < n; i++) {
+    if (!b.defs[i]) {
+      upb_status_copy(status, &b.statuses[i]);
+      goto done;
+    }
+    total += b.counts[i];
+  }
+  all = malloc(UPB_MAX(total, 1) * sizeof(*all));
+  if (!all) {
+    upb_status_seterrliteral(status, "out of memory");
+    goto done;
+  }
+  total = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(all + total, b.defs[i], b.counts[i] * sizeof(*all));
+    total += b.counts[i];
+    free(b.defs[i]);
+    b.defs[i] = NULL;
+  }
+  success = upb_symtab_add(s, all, total, &b, status);
+
+done:
+  for (int i = 0; b.defs && i < n; i++) {
+    for (int j = 0; b.defs[i] && j < b.counts[i]; j++)
+      upb_def_unref(b.defs[i][j], &b);
+    free(b.defs[i]);
+  }
+  for (int i = 0; b.statuses && i < n; i++) upb_status_uninit(&b.statuses[i]);
+  free(all);
+  free(b.defs);
+  free(b.counts);
+  free(b.statuses);
+  if (b.plan) upb_decoderplan_unref(b.plan);
+  return success;
+}
+
+/* Lazy loading ***************************************************************/
+
+// The index only records where each def is in the descriptor; a def is
+// decoded from there the first time it is looked up, along with every def it
+// refers to that has not been loaded yet.
+
+typedef struct {
+  char *fullname;
+  const char *ptr;  // The def's DescriptorProto or EnumDescriptorProto.
+  size_t len;
+  upb_deftype_t type;
+  bool loaded;
+  bool queued;
+} upb_lazydef;
+
+typedef struct {
+  char *data;            // Our copy of the descriptor.
+  upb_lazydef *defs;
+  size_t len, size;
+  upb_strtable index;    // Full name -> index in "defs".
+  upb_decoderplan *msgplan, *enumplan;  // Built by the first load.
+} upb_lazyloader;
+
+// A minimal, bounds-checked reader for the protobuf wire format, which is all
+// that indexing needs.
+typedef struct {
+  const char *ptr, *end;
+  uint32_t number;
+  const char *data;  // For delimited fields.
+  size_t len;
+  bool error;
+} upb_wireiter;
+
+static void upb_wireiter_begin(upb_wireiter *i, const char *ptr, size_t len) {
+  i->ptr = ptr;
+  i->end = ptr + len;
+  i->error = false;
+}
+
+static bool upb_wireiter_varint(upb_wireiter *i, uint64_t *val) {
+  *val = 0;
+  for (int bitpos = 0; bitpos < 70 && i->ptr < i->end; bitpos += 7) {
+    uint8_t byte = *i->ptr++;
+    *val |= (uint64_t)(byte & 0x7f) << bitpos;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// Advances to the next field, returning false at the end of the data or if it
+// is malformed (which sets i->error).
+static bool upb_wireiter_next(upb_wireiter *i) {
+  if (i->ptr == i->end) return false;
+  uint64_t tag, val;
+  if (!upb_wireiter_varint(i, &tag)) goto err;
+  i->number = tag >> 3;
+  i->data = NULL;
+  i->len = 0;
+  switch (tag & 0x7) {
+    case UPB_WIRE_TYPE_VARINT:
+      if (!upb_wireiter_varint(i, &val)) goto err;
+      return true;
+    case UPB_WIRE_TYPE_64BIT: val = 8; break;
+    case UPB_WIRE_TYPE_32BIT: val = 4; break;
+    case UPB_WIRE_TYPE_DELIMITED:
+      if (!upb_wireiter_varint(i, &val)) goto err;
+      i->data = i->ptr;
+      i->len = val;
+      break;
+    default: goto err;  // Descriptors don't use groups.
+  }
+  if (val > (uint64_t)(i->end - i->ptr)) goto err;
+  i->ptr += val;
+  return true;
+
+err:
+  i->error = true;
+  return false;
+}
+
+// Finds the first occurrence of delimited field "number", if any.
+static bool upb_wire_findstr(const char *ptr, size_t len, uint32_t number,
+                             const char **str, size_t *str_len) {
+  upb_wireiter i;
+  upb_wireiter_begin(&i, ptr, len);
+  while (upb_wireiter_next(&i)) {
+    if (i.number == number && i.data) {
+      *str = i.data;
+      *str_len = i.len;
+      return true;
+    }
+  }
+  return false;
+}
+
+static char *upb_lazyloader_join(const char *scope, const char *name,
+                                 size_t len) {
+  size_t scope_len = strlen(scope);
+  char *ret = malloc(scope_len + len + 2);
+  if (!ret) return NULL;
+  char *p = ret;
+  if (scope_len > 0) {
+    memcpy(p, scope, scope_len);
+    p += scope_len;
+    *p++ = UPB_SYMBOL_SEPARATOR;
+  }
+  memcpy(p, name, len);
+  p[len] = '\0';
+  return ret;
+}
+
+// Indexes the def in the given DescriptorProto or EnumDescriptorProto, and
+// any defs nested in it.
+static bool upb_lazyloader_index(upb_lazyloader *l, const char *scope,
+                                 const char *ptr, size_t len,
+                                 upb_deftype_t type, int depth,
+                                 upb_status *status) {
+  if (depth > UPB_MAX_TYPE_DEPTH) {
+    upb_status_seterrliteral(status, "Defs are nested too deeply.");
+    return false;
+  }
+  const char *name;
+  size_t name_len;
+  if (!upb_wire_findstr(ptr, len, 1, &name, &name_len)) {
+    upb_status_seterrliteral(status, "Encountered def with no name.");
+    return false;
+  }
+  char *fullname = upb_lazyloader_join(scope, name, name_len);
+  if (!fullname) goto oom;
+  if (upb_strtable_lookup(&l->index, fullname)) {
+    upb_status_seterrf(status, "Conflicting defs named '%s'", fullname);
+    free(fullname);
+    return false;
+  }
+  if (l->len == l->size) {
+    size_t size = UPB_MAX(l->size * 2, 8);
+    upb_lazydef *defs = realloc(l->defs, sizeof(*defs) * size);
+    if (!defs) goto oom2;
+    l->defs = defs;
+    l->size = size;
+  }
+  if (!upb_strtable_insert(&l->index, fullname, upb_value_uint64(l->len)))
+    goto oom2;
+  upb_lazydef *d = &l->defs[l->len++];
+  d->fullname = fullname;
+  d->ptr = ptr;
+  d->len = len;
+  d->type = type;
+  d->loaded = false;
+  d->queued = false;
+  if (type == UPB_DEF_ENUM) return true;
+
+  upb_wireiter i;
+  upb_wireiter_begin(&i, ptr, len);
+  while (upb_wireiter_next(&i)) {
+#define FNUM(f) GOOGLE_PROTOBUF_DESCRIPTORPROTO_ ## f ## __FIELDNUM
+    if (i.data && i.number == FNUM(NESTED_TYPE)) {
+      if (!upb_lazyloader_index(l, fullname, i.data, i.len, UPB_DEF_MSG,
+                                depth + 1, status))
+        return false;
+    } else if (i.data && i.number == FNUM(ENUM_TYPE)) {
+      if (!upb_lazyloader_index(l, fullname, i.data, i.len, UPB_DEF_ENUM,
+                                depth + 1, status))
+        return false;
+    }
+#undef FNUM
+  }
+  return true;
+
+oom2:
+  free(fullname);
+oom:
+  upb_status_seterrliteral(status, "out of memory");
+  return false;
+}
+
+static bool upb_lazyloader_indexfile(upb_lazyloader *l, const char *ptr,
+                                     size_t len, upb_status *status) {
+#define FNUM(f) GOOGLE_PROTOBUF_FILEDESCRIPTORPROTO_ ## f ## __FIELDNUM
+  const char *package = "";
+  size_t package_len = 0;
+  upb_wire_findstr(ptr, len, FNUM(PACKAGE), &package, &package_len);
+  char *scope = upb_lazyloader_join("", package, package_len);
+  if (!scope) {
+    upb_status_seterrliteral(status, "out of memory");
+    return false;
+  }
+  bool ret = true;
+  upb_wireiter i;
+  upb_wireiter_begin(&i, ptr, len);
+  while (ret && upb_wireiter_next(&i)) {
+    if (i.data && i.number == FNUM(MESSAGE_TYPE)) {
+      ret = upb_lazyloader_index(l, scope, i.data, i.len, UPB_DEF_MSG, 1,
+                                 status);
+    } else if (i.data && i.number == FNUM(ENUM_TYPE)) {
+      ret = upb_lazyloader_index(l, scope, i.data, i.len, UPB_DEF_ENUM, 1,
+                                 status);
+    }
+  }
+#undef FNUM
+  if (i.error) {
+    upb_status_seterrliteral(status, "Malformed descriptor.");
+    ret = false;
+  }
+  free(scope);
+  return ret;
+}
+
+static void upb_lazyloader_free(void *closure) {
+  upb_lazyloader *l = closure;
+  for (size_t i = 0; i < l->len; i++) free(l->defs[i].fullname);
+  free(l->defs);
+  upb_strtable_uninit(&l->index);
+  if (l->msgplan) upb_decoderplan_unref(l->msgplan);
+  if (l->enumplan) upb_decoderplan_unref(l->enumplan);
+  free(l->data);
+  free(l);
+}
+
+static upb_decoderplan *upb_lazyloader_newplan(upb_deftype_t type) {
+  upb_handlers *h = upb_handlers_new();
+  upb_descreader_reghandlers_def(h, type);
+  upb_decoderplan *p = upb_decoderplan_new(h, false);
+  upb_handlers_unref(h);
+  return p;
+}
+
+// Decodes the given def, returning NULL if it is malformed.
+static upb_def *upb_lazyloader_decode(upb_lazyloader *l, upb_lazydef *d,
+                                      void *owner) {
+  upb_decoderplan **p = d->type == UPB_DEF_MSG ? &l->msgplan : &l->enumplan;
+  if (!*p) *p = upb_lazyloader_newplan(d->type);
+  if (!*p) return NULL;
+
+  // The def is named within the scope that encloses it.
+  char *scope = strdup(d->fullname);
+  char *sep = strrchr(scope, UPB_SYMBOL_SEPARATOR);
+  *(sep ? sep : scope) = '\0';
+
+  upb_stringsrc strsrc;
+  upb_stringsrc_init(&strsrc);
+  upb_stringsrc_reset(&strsrc, d->ptr, d->len);
+  upb_decoder dec;
+  upb_decoder_init(&dec);
+  upb_decoder_resetplan(&dec, *p, 0);
+  upb_descreader r;
+  upb_descreader_init(&r);
+  upb_descreader_startscope(&r, scope);
+  upb_decoder_resetinput(&dec, upb_stringsrc_allbytes(&strsrc), &r);
+  upb_def *def = NULL;
+  if (upb_decoder_decode(&dec) == UPB_OK) {
+    upb_descreader_endscope(&r);
+    int n;
+    upb_def **defs = upb_descreader_getdefs(&r, owner, &n);
+    assert(n == 1);
+    def = defs[0];
+    // Same default layout as upb_decode_descriptor() gives, so this may also
+    // leave the message without one.
+    upb_msgdef *m = upb_dyncast_msgdef(def);
+    if (m) upb_msgdef_layout(m);
+  }
+  upb_descreader_uninit(&r);
+  upb_decoder_uninit(&dec);
+  upb_stringsrc_uninit(&strsrc);
+  free(scope);
+  return def;
+}
+
+static void upb_lazyloader_load(upb_symtab *s, const char *sym, size_t len,
+                                void *closure) {
+  upb_lazyloader *l = closure;
+  const upb_value *v = upb_strtable_lookupl(&l->index, sym, len);
+  if (!v || l->defs[upb_value_getuint64(*v)].loaded) return;
+
+  // Decode the def and, breadth-first, the defs it can reach that have not
+  // been loaded yet.  Names are fully-qualified, as upb_symtab_add() requires.
+  upb_deflist defs;
+  upb_deflist_init(&defs);
+  size_t *queue = malloc(sizeof(*queue) * l->len);
+  size_t head = 0, tail = 0;
+  if (!queue) goto done;
+  queue[tail++] = upb_value_getuint64(*v);
+  l->defs[queue[0]].queued = true;
+  while (head < tail) {
+    upb_def *def = upb_lazyloader_decode(l, &l->defs[queue[head++]],
+                                         &defs.defs);
+    if (!def) goto done;
+    upb_deflist_push(&defs, def);
+    upb_msgdef *m = upb_dyncast_msgdef(def);
+    if (!m) continue;
+    upb_msg_iter i;
+    for(upb_msg_begin(&i, m); !upb_msg_done(&i); upb_msg_next(&i)) {
+      upb_fielddef *f = upb_msg_iter_field(&i);
+      const char *name = upb_hassubdef(f) ? upb_fielddef_subtypename(f) : NULL;
+      if (!name || name[0] != UPB_SYMBOL_SEPARATOR) continue;
+      const upb_value *sub = upb_strtable_lookup(&l->index, name + 1);
+      if (!sub) continue;
+      upb_lazydef *d = &l->defs[upb_value_getuint64(*sub)];
+      if (d->loaded || d->queued) continue;
+      d->queued = true;
+      queue[tail++] = upb_value_getuint64(*sub);
+    }
+  }
+
+  // The symtab can resolve references to defs that were loaded before.
+  upb_status status = UPB_STATUS_INIT;
+  defs.owned = false;  // The refs are passed to the symtab.
+  if (upb_symtab_add(s, defs.defs, defs.len, &defs.defs, &status))
+    for (size_t i = 0; i < tail; i++) l->defs[queue[i]].loaded = true;
+  upb_status_uninit(&status);
+
+done:
+  for (size_t i = 0; i < tail; i++) l->defs[queue[i]].queued = false;
+  free(queue);
+  upb_deflist_uninit(&defs);
+}
+
+// Indexes the descriptor in "data" and installs the loader; takes ownership
+// of "data" in any case.
+static bool upb_lazyloader_install(upb_symtab *s, char *data, size_t len,
+                                   upb_status *status) {
+  upb_lazyloader *l = malloc(sizeof(*l));
+  if (!l) goto oom;
+  if (!upb_strtable_init(&l->index)) goto oom2;
+  l->data = data;
+  l->defs = NULL;
+  l->len = 0;
+  l->size = 0;
+  l->msgplan = NULL;
+  l->enumplan = NULL;
+
+  upb_wireiter i;
+  upb_wireiter_begin(&i, data, len);
+  while (upb_wireiter_next(&i)) {
+    if (i.data && i.number == GOOGLE_PROTOBUF_FILEDESCRIPTORSET_FILE__FIELDNUM &&
+        !upb_lazyloader_indexfile(l, i.data, i.len, status)) {
+      upb_lazyloader_free(l);
+      return false;
+    }
+  }
+  if (i.error) {
+    upb_status_seterrliteral(status, "Malformed descriptor.");
+    upb_lazyloader_free(l);
+    return false;
+  }
+  upb_strtable_optimize(&l->index);
+  upb_symtab_setloader(s, &upb_lazyloader_load, l, &upb_lazyloader_free);
+  return true;
+
+oom2:
+  free(l);
+oom:
+  free(data);
+  upb_status_seterrliteral(status, "out of memory");
+  return false;
+}
+
+bool upb_load_descriptor_into_symtab_lazy(upb_symtab *s, const char *str,
+                                          size_t len, upb_status *status) {
+  char *data = malloc(len);
+  if (!data) {
+    upb_status_seterrliteral(status, "out of memory");
+    return false;
+  }
+  memcpy(data, str, len);
+  return upb_lazyloader_install(s, data, len, status);
+}
+
 char *upb_readfile(const char *filename, size_t *len) {
   FILE *f = fopen(filename, "rb");
   if(!f) return NULL;
@@ -85,3 +599,15 @@ bool upb_load_descriptor_file_into_symtab(upb_symtab *symtab, const char *fname,
   free(data);
   return success;
 }
+
+bool upb_load_descriptor_file_into_symtab_lazy(upb_symtab *symtab,
+                                               const char *fname,
+                                               upb_status *status) {
+  size_t len;
+  char *data = upb_readfile(fname, &len);
+  if (!data) {
+    if (status) upb_status_seterrf(status, "Couldn't read file: %s", fname);
+    return false;
+  }
+  return upb_lazyloader_install(symtab, data, len, status);
+}
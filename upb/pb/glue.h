@@ -35,9 +35,11 @@ extern "C" {
 #endif
 
 // Loads all defs from the given protobuf binary descriptor, setting default
-// accessors and a default layout on all messages.  The caller owns the
-// returned array of defs, which will be of length *n.  On error NULL is
-// returned and status is set (if non-NULL).
+// accessors and a default layout on all messages.  A message that
+// upb_msgdef_layout() can't lay out (see def.h for the limits) is loaded
+// anyway, with no layout (a size of zero).  The caller owns the returned array
+// of defs, which will be of length *n.  On error NULL is returned and status
+// is set (if non-NULL).
 upb_def **upb_load_defs_from_descriptor(const char *str, size_t len, int *n,
                                         void *owner, upb_status *status);
 
@@ -49,6 +51,31 @@ bool upb_load_descriptor_into_symtab(upb_symtab *symtab, const char *str,
 bool upb_load_descriptor_file_into_symtab(upb_symtab *symtab, const char *fname,
                                           upb_status *status);
 
+// Loads the defs from "n" serialized FileDescriptorProtos (not
+// FileDescriptorSets), where descs[i] is lens[i] bytes long, and adds them to
+// the symtab with a single upb_symtab_add(), so the files may refer to each
+// other in any order.  The files are decoded on up to "threads" threads if upb
+// was built with UPB_USE_PTHREADS, otherwise one at a time.  Either all of
+// the files are added or, on error, none of them.
+bool upb_load_descriptors_into_symtab(upb_symtab *s, const char *const *descs,
+                                      const size_t *lens, int n, int threads,
+                                      upb_status *status);
+
+// Like upb_load_descriptor_into_symtab(), but the defs are loaded on demand:
+// up front the descriptor is only scanned for the names of its defs, and each
+// def is decoded and added to the symtab (along with the defs it refers to)
+// by the first lookup that asks for it, as a upb_symtab_loadfunc.  Replaces
+// any loader the symtab had.  The descriptor is copied.
+//
+// Errors in a def are only found when it is loaded, and make the lookup fail;
+// only a descriptor that can't be indexed makes this return false.  Type
+// names must be fully-qualified (as they are in descriptors from protoc).
+bool upb_load_descriptor_into_symtab_lazy(upb_symtab *symtab, const char *str,
+                                          size_t len, upb_status *status);
+bool upb_load_descriptor_file_into_symtab_lazy(upb_symtab *symtab,
+                                               const char *fname,
+                                               upb_status *status);
+
 // Reads the given filename into a character string, returning NULL if there
 // was an error.
 char *upb_readfile(const char *filename, size_t *len);
@@ -0,0 +1,691 @@
+/*
+ * upb - a minimalist implementation of protocol buffers.
+ *
+ * Copyright (c) 2012 Google Inc.  See LICENSE for details.
+ * Author: Josh Haberman <jhaberman@gmail.com>
+ *
+ * Parts of the decoder JIT that do not depend on the target architecture:
+ * mapping and freeing the code, assigning pclabels, field ordering and the
+ * perf(1) symbol map.  This is not a normal header; it is included by each
+ * decoder_<arch>.dasc after its DynASM directives and macros, because it refers
+ * to the action list and globals that DynASM generates, and it calls the
+ * backend's upb_decoderplan_jitinit(), upb_decoderplan_jit() and
+ * upb_reg_jit_gdb(), which must be defined (or declared) before it.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "upb/pb/varint.h"
+#include "upb/msg.h"
+
+#ifdef UPB_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// We map into the low 32 bits when we can, but if this is not available
+// (like on OS X) we take what we can get.  It's not required for correctness,
+// it's just a performance thing that makes it more likely that our jumps
+// can be rel32 (i.e. within 32-bits of our pc) instead of the longer
+// sequence required for other jumps (see callp).
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+static void upb_decoderplan_jitinit(upb_decoderplan *plan);
+static void upb_decoderplan_jit(upb_jitcompiler *jc);
+
+
+/* upb_jitarena ***************************************************************/
+
+// JIT-ted code from all plans is packed into one shared arena, so that many
+// small plans don't each need their own pages (and iTLB entries).  The arena
+// is a memfd that is mapped twice: read/execute where the code runs, and
+// read/write where we write it, so no page is ever both writable and
+// executable.  It grows in 2MB regions, backed by huge pages if the system
+// has them reserved (MFD_HUGETLB), otherwise we ask for transparent huge
+// pages with madvise().
+//
+// Both views are carved out of fixed address space reservations, so the
+// distance from the executable view to the writable one (the "reldelta") is
+// the same for all code in the arena.  DynASM computes the rel32 of calls to
+// absolute addresses from the buffer it writes to, so the generated code adds
+// plan->jit_reldelta to the targets of those calls.
+//
+// If the arena is unavailable (no memfd_create(), or it is full) each plan's
+// code gets its own mapping instead, which is made executable only once it
+// has been written.
+
+#define UPB_JITARENA_REGION (2 * 1024 * 1024)
+#define UPB_JITARENA_MAXSIZE (32 * UPB_JITARENA_REGION)
+#define UPB_JITARENA_ALIGN 64  // Each plan's code starts on a cache line.
+
+typedef struct _upb_jitarena_block {
+  size_t ofs, len;
+  struct _upb_jitarena_block *next;
+} upb_jitarena_block;
+
+typedef struct {
+  bool initialized;
+  int fd;                   // -1 if the arena is unavailable.
+  pid_t pid;                // Process that owns the arena (see below).
+  bool hugetlb;
+  char *rx, *rw;            // Executable and writable views.
+  size_t mapped;            // Bytes of each view that are backed so far.
+  size_t used;              // High-water mark of allocations.
+  upb_jitarena_block *free; // Freed blocks, sorted by offset and coalesced.
+} upb_jitarena;
+
+static upb_jitarena upb_jitarena_global = {false, -1, 0, false, NULL, NULL,
+                                           0, 0, NULL};
+
+#ifdef UPB_THREAD_UNSAFE
+static void upb_jitarena_lock() {}
+static void upb_jitarena_unlock() {}
+#else
+static int upb_jitarena_locked = 0;
+static void upb_jitarena_lock() {
+  while (__sync_lock_test_and_set(&upb_jitarena_locked, 1)) {}
+}
+static void upb_jitarena_unlock() { __sync_lock_release(&upb_jitarena_locked); }
+#endif
+
+// Reserves (but does not back) "len" bytes of address space aligned to a
+// region, so that the views can use huge pages.
+static char *upb_jitarena_reserve(size_t len, int flags) {
+  size_t padded = len + UPB_JITARENA_REGION;
+  char *p = mmap(NULL, padded, PROT_NONE,
+                 flags | MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  char *aligned = (char*)(((uintptr_t)p + UPB_JITARENA_REGION - 1) &
+                          ~(uintptr_t)(UPB_JITARENA_REGION - 1));
+  if (aligned > p) munmap(p, aligned - p);
+  munmap(aligned + len, (p + padded) - (aligned + len));
+  return aligned;
+}
+
+static bool upb_jitarena_grow(upb_jitarena *a, size_t mapped) {
+  if (mapped > UPB_JITARENA_MAXSIZE) return false;
+  if (ftruncate(a->fd, mapped) != 0) return false;
+  size_t len = mapped - a->mapped;
+  char *rx = a->rx + a->mapped, *rw = a->rw + a->mapped;
+  if (mmap(rx, len, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+           a->fd, a->mapped) == MAP_FAILED) {
+    return false;
+  }
+  if (mmap(rw, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+           a->fd, a->mapped) == MAP_FAILED) {
+    // Put the reservation back.
+    mmap(rx, len, PROT_NONE,
+         MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (!a->hugetlb) {
+    madvise(rx, len, MADV_HUGEPAGE);
+    madvise(rw, len, MADV_HUGEPAGE);
+  }
+#endif
+  a->mapped = mapped;
+  return true;
+}
+
+static bool upb_jitarena_open(upb_jitarena *a, bool hugetlb) {
+#ifdef SYS_memfd_create
+  unsigned int flags = MFD_CLOEXEC | (hugetlb ? MFD_HUGETLB : 0);
+  a->fd = syscall(SYS_memfd_create, "upb_jit", flags);
+  a->hugetlb = hugetlb;
+  if (a->fd >= 0 && !upb_jitarena_grow(a, UPB_JITARENA_REGION)) {
+    close(a->fd);
+    a->fd = -1;
+  }
+#else
+  (void)hugetlb;
+#endif
+  return a->fd >= 0;
+}
+
+static void upb_jitarena_init(upb_jitarena *a) {
+  a->initialized = true;
+  a->pid = getpid();
+  // Calls from the executable view use rel32 (see callp), so like the
+  // per-plan mappings it lives in the low 2GB when the OS lets us.
+  a->rx = upb_jitarena_reserve(UPB_JITARENA_MAXSIZE, MAP_32BIT);
+  a->rw = upb_jitarena_reserve(UPB_JITARENA_MAXSIZE, 0);
+  if (a->rx && a->rw &&
+      (upb_jitarena_open(a, true) || upb_jitarena_open(a, false))) {
+    return;
+  }
+  if (a->rx) munmap(a->rx, UPB_JITARENA_MAXSIZE);
+  if (a->rw) munmap(a->rw, UPB_JITARENA_MAXSIZE);
+}
+
+// The arena's memory is shared with any children we fork, so only the process
+// that created it may put new code into it.
+static bool upb_jitarena_usable(upb_jitarena *a) {
+  if (!a->initialized) upb_jitarena_init(a);
+  return a->fd >= 0 && a->pid == getpid();
+}
+
+// Returns the reldelta that code must be generated with to be placed in the
+// arena, or 0 if the arena can't be used.
+static ptrdiff_t upb_jitarena_reldelta() {
+  upb_jitarena *a = &upb_jitarena_global;
+  upb_jitarena_lock();
+  ptrdiff_t ret = upb_jitarena_usable(a) ? a->rw - a->rx : 0;
+  upb_jitarena_unlock();
+  return ret;
+}
+
+// Allocates "len" bytes of code, returning its executable address and
+// setting "*rw" to the address it must be written at, or returning NULL if
+// the arena is unavailable or full.
+static char *upb_jitarena_alloc(size_t len, char **rw) {
+  upb_jitarena *a = &upb_jitarena_global;
+  char *ret = NULL;
+  len = (len + UPB_JITARENA_ALIGN - 1) & ~(size_t)(UPB_JITARENA_ALIGN - 1);
+  upb_jitarena_lock();
+  if (!upb_jitarena_usable(a)) goto done;
+  size_t ofs;
+  upb_jitarena_block **b = &a->free;
+  for (; *b; b = &(*b)->next) {
+    if ((*b)->len < len) continue;
+    // First fit.
+    upb_jitarena_block *block = *b;
+    ofs = block->ofs;
+    block->ofs += len;
+    block->len -= len;
+    if (block->len == 0) {
+      *b = block->next;
+      free(block);
+    }
+    goto found;
+  }
+  size_t needed = a->used + len;
+  if (needed > a->mapped) {
+    size_t mapped = (needed + UPB_JITARENA_REGION - 1) &
+                    ~(size_t)(UPB_JITARENA_REGION - 1);
+    if (!upb_jitarena_grow(a, mapped)) goto done;
+  }
+  ofs = a->used;
+  a->used = needed;
+found:
+  ret = a->rx + ofs;
+  *rw = a->rw + ofs;
+done:
+  upb_jitarena_unlock();
+  return ret;
+}
+
+static bool upb_jitarena_owns(const char *p) {
+  upb_jitarena *a = &upb_jitarena_global;
+  return a->fd >= 0 && p >= a->rx && p < a->rx + a->mapped;
+}
+
+static void upb_jitarena_free(char *p, size_t len) {
+  upb_jitarena *a = &upb_jitarena_global;
+  len = (len + UPB_JITARENA_ALIGN - 1) & ~(size_t)(UPB_JITARENA_ALIGN - 1);
+  size_t ofs = p - a->rx;
+  upb_jitarena_lock();
+  upb_jitarena_block **b = &a->free;
+  while (*b && (*b)->ofs < ofs) b = &(*b)->next;
+  upb_jitarena_block *next = *b;
+  if (next && ofs + len == next->ofs) {
+    // Merge with the following block.
+    next->ofs = ofs;
+    next->len += len;
+  } else {
+    upb_jitarena_block *block = malloc(sizeof(*block));
+    block->ofs = ofs;
+    block->len = len;
+    block->next = next;
+    *b = block;
+    next = block;
+  }
+  // Merge with the preceding block.
+  if (b != &a->free) {
+    upb_jitarena_block *prev =
+        (upb_jitarena_block*)((char*)b - offsetof(upb_jitarena_block, next));
+    if (prev->ofs + prev->len == next->ofs) {
+      prev->len += next->len;
+      prev->next = next->next;
+      free(next);
+    }
+  }
+  upb_jitarena_unlock();
+}
+
+
+/* upb_decoderplan JIT ********************************************************/
+
+// Has to be a separate function, otherwise GCC will complain about
+// expressions like (&foo != NULL) because they will never evaluate
+// to false.
+static void upb_assert_notnull(void *addr) { assert(addr != NULL); (void)addr; }
+
+// perf(1) finds symbols for JIT-ted code in /tmp/perf-<pid>.map, which has
+// one "START SIZE name" line (in hex) per symbol.  If the UPB_JIT_PERF_MAP
+// environment variable is set we append a symbol for the code of every
+// message and field in the plan, so profiles of a live process show which
+// message type or field decode time is going to.
+
+typedef struct {
+  int ofs;
+  char *name;
+} upb_jit_sym;
+
+static int upb_jit_compare_syms(const void *_a, const void *_b) {
+  const upb_jit_sym *a = _a, *b = _b;
+  return a->ofs - b->ofs;
+}
+
+// Adds a symbol named "upb_jit:<msgname><sep><name>".
+static void upb_jit_addsym(upb_jit_sym *syms, int *n, int ofs,
+                           const char *msgname, const char *sep,
+                           const char *name) {
+  static const char prefix[] = "upb_jit:";
+  size_t msglen = strlen(msgname), seplen = strlen(sep), len = strlen(name);
+  char *buf = malloc(sizeof(prefix) + msglen + seplen + len);
+  if (!buf) return;
+  char *p = buf;
+  memcpy(p, prefix, sizeof(prefix) - 1); p += sizeof(prefix) - 1;
+  memcpy(p, msgname, msglen); p += msglen;
+  memcpy(p, sep, seplen); p += seplen;
+  memcpy(p, name, len + 1);
+  syms[*n].ofs = ofs;
+  syms[*n].name = buf;
+  (*n)++;
+}
+
+// Must be called after dasm_link() but before dasm_free().
+static void upb_reg_jit_perf(upb_decoderplan *plan, upb_jitcompiler *jcs,
+                             int chunks) {
+  if (!getenv("UPB_JIT_PERF_MAP")) return;
+  upb_handlers *h = plan->handlers;
+  int max_syms = chunks;
+  for (int i = 0; i < h->msgs_len; i++)
+    max_syms += 2 + upb_inttable_count(&h->msgs[i]->fieldtab);
+  upb_jit_sym *syms = malloc(max_syms * sizeof(*syms));
+  int n = 0;
+  upb_jit_addsym(syms, &n, 0, "trampoline", "", "");
+  // Other chunks start with their copy of ->exit_jit.
+  for (int i = 1; i < chunks; i++)
+    upb_jit_addsym(syms, &n, jcs[i].ofs, "exit", "", "");
+
+  for (int i = 0; i < h->msgs_len; i++) {
+    upb_mhandlers *m = h->msgs[i];
+    upb_jitcompiler *jc = &jcs[m->jit_chunk];
+    // Unnamed messages and fields are identified by index and number.
+    char msgbuf[32], fieldbuf[32];
+    const char *msgname =
+        m->msgdef ? upb_def_fullname(UPB_UPCAST(m->msgdef)) : NULL;
+    if (!msgname) {
+      snprintf(msgbuf, sizeof(msgbuf), "msg%d", i);
+      msgname = msgbuf;
+    }
+    upb_jit_addsym(syms, &n,
+                   jc->ofs + dasm_getpclabel(jc, m->jit_afterstartmsg_pclabel),
+                   msgname, "", "");
+    upb_inttable_iter j;
+    upb_inttable_begin(&j, &m->fieldtab);
+    for(; !upb_inttable_done(&j); upb_inttable_next(&j)) {
+      upb_fhandlers *f = upb_value_getptr(upb_inttable_iter_value(&j));
+      const upb_fielddef *fd =
+          m->msgdef ? upb_msgdef_itof(m->msgdef, f->number) : NULL;
+      const char *fieldname = fd ? upb_fielddef_name(fd) : NULL;
+      if (!fieldname) {
+        snprintf(fieldbuf, sizeof(fieldbuf), "%" PRIu32, f->number);
+        fieldname = fieldbuf;
+      }
+      upb_jit_addsym(syms, &n, jc->ofs + dasm_getpclabel(jc, f->jit_pclabel),
+                     msgname, ".", fieldname);
+    }
+    // Groups have no end-of-buf label; their eob just exits the JIT.
+    uint32_t end_pclabel =
+        m->is_group ? m->jit_endofmsg_pclabel : m->jit_endofbuf_pclabel;
+    upb_jit_addsym(syms, &n, jc->ofs + dasm_getpclabel(jc, end_pclabel),
+                   msgname, " (end)", "");
+  }
+
+  qsort(syms, n, sizeof(*syms), &upb_jit_compare_syms);
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *f = fopen(path, "a");
+  for (int i = 0; i < n; i++) {
+    int end = (i + 1 < n) ? syms[i + 1].ofs : (int)plan->jit_size;
+    if (f && end > syms[i].ofs) {
+      fprintf(f, "%" PRIxPTR " %x %s\n",
+              (uintptr_t)plan->jit_code + syms[i].ofs, end - syms[i].ofs,
+              syms[i].name);
+    }
+    free(syms[i].name);
+  }
+  if (f) fclose(f);
+  free(syms);
+}
+
+// Returns true if we can append f's values to its array ourselves (see
+// upb_arraylayout), only calling the value handler when the array is full.
+static bool upb_decoderplan_jit_canappend(const upb_fhandlers *f) {
+  const upb_arraylayout *l = f->arraylayout;
+  if (!f->repeated || !f->value || !l) return false;
+  switch (f->type) {
+    case UPB_TYPE(STRING):
+    case UPB_TYPE(BYTES):
+    case UPB_TYPE(MESSAGE):
+    case UPB_TYPE(GROUP):
+    case UPB_TYPE_ENDGROUP:
+      return false;
+    default:
+      return l->elem_size == upb_types[f->type].size;
+  }
+}
+
+static uint64_t upb_get_encoded_tag(upb_fhandlers *f) {
+  uint32_t tag = (f->number << 3) | upb_decoder_types[f->type].native_wire_type;
+  uint64_t encoded_tag = upb_vencode32(tag);
+  // No tag should be greater than 5 bytes.
+  assert(encoded_tag <= 0xffffffffff);
+  return encoded_tag;
+}
+
+// Returns the profile a tiered plan collected for "f", or NULL if there is
+// none.
+static const upb_jitprofile *upb_decoderplan_jit_profile(
+    upb_decoderplan *plan, const upb_fhandlers *f) {
+  if (!plan->profile) return NULL;
+  const upb_value *v = upb_inttable_lookup(plan->profile, (uintptr_t)f);
+  return v ? upb_value_getptr(*v) : NULL;
+}
+
+typedef struct {
+  upb_fhandlers *f;
+  uint32_t count;
+} upb_jitfield;
+
+// Orders fields by how often they were seen while profiling (most frequent
+// first), then by field number.  Without a profile all counts are zero, which
+// gives plain field number order.
+static int upb_compare_jitfields(const void *_a, const void *_b) {
+  // TODO: always put ENDGROUP at the end.
+  const upb_jitfield *a = _a, *b = _b;
+  if (a->count != b->count) return a->count > b->count ? -1 : 1;
+  if (a->f->number != b->f->number) return a->f->number < b->f->number ? -1 : 1;
+  return 0;
+}
+
+// Returns m's fields in the order their code is laid out (inttable ordering is
+// undefined), storing how many there are in *n.  The caller must free() the
+// array.
+static upb_fhandlers **upb_decoderplan_jit_fields(upb_decoderplan *plan,
+                                                  upb_mhandlers *m, int *n) {
+  *n = upb_inttable_count(&m->fieldtab);
+  upb_jitfield *order = malloc(UPB_MAX(*n, 1) * sizeof(*order));
+  int idx = 0;
+  upb_inttable_iter i;
+  upb_inttable_begin(&i, &m->fieldtab);
+  for(; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    upb_fhandlers *f = upb_value_getptr(upb_inttable_iter_value(&i));
+    const upb_jitprofile *prof = upb_decoderplan_jit_profile(plan, f);
+    order[idx].f = f;
+    order[idx++].count = prof ? prof->count : 0;
+  }
+  qsort(order, *n, sizeof(*order), &upb_compare_jitfields);
+  upb_fhandlers **fields = malloc(UPB_MAX(*n, 1) * sizeof(*fields));
+  for (int j = 0; j < *n; j++) fields[j] = order[j].f;
+  free(order);
+  return fields;
+}
+
+// Returns the field we should predict will follow "f": the field that most
+// often followed it while profiling, otherwise the next one in code order.
+static upb_fhandlers *upb_decoderplan_jit_nextfield(upb_decoderplan *plan,
+                                                    upb_mhandlers *m,
+                                                    upb_fhandlers *f,
+                                                    upb_fhandlers *fallback) {
+  const upb_jitprofile *prof = upb_decoderplan_jit_profile(plan, f);
+  if (!prof) return fallback;
+  upb_fhandlers *best = NULL;
+  uint32_t best_count = 0;
+  upb_inttable_iter i;
+  upb_inttable_begin(&i, &prof->next);
+  for(; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    uint32_t count = upb_value_getuint32(upb_inttable_iter_value(&i));
+    upb_fhandlers *next_f = upb_mhandlers_lookup(m, upb_inttable_iter_key(&i));
+    if (next_f && count > best_count) {
+      best = next_f;
+      best_count = count;
+    }
+  }
+  return best ? best : fallback;
+}
+
+static void upb_decoderplan_jit_assignfieldlabs(upb_fhandlers *f,
+                                                uint32_t *pclabel_count) {
+  f->jit_pclabel = (*pclabel_count)++;
+  f->jit_pclabel_notypecheck = (*pclabel_count)++;
+}
+
+static void upb_decoderplan_jit_assignmsglabs(upb_mhandlers *m,
+                                              uint32_t *pclabel_count) {
+  m->jit_startmsg_pclabel = (*pclabel_count)++;
+  m->jit_afterstartmsg_pclabel = (*pclabel_count)++;
+  m->jit_endofbuf_pclabel = (*pclabel_count)++;
+  m->jit_endofmsg_pclabel = (*pclabel_count)++;
+  m->jit_dyndispatch_pclabel = (*pclabel_count)++;
+  m->jit_unknownfield_pclabel = (*pclabel_count)++;
+  m->max_field_number = 0;
+  upb_inttable_iter i;
+  upb_inttable_begin(&i, &m->fieldtab);
+  for(; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    uint32_t key = upb_inttable_iter_key(&i);
+    m->max_field_number = UPB_MAX(m->max_field_number, key);
+    upb_fhandlers *f = upb_value_getptr(upb_inttable_iter_value(&i));
+    upb_decoderplan_jit_assignfieldlabs(f, pclabel_count);
+  }
+  // TODO: support large field numbers by either using a hash table or
+  // generating code for a binary search.  For now large field numbers
+  // will just fall back to the table decoder.
+  m->max_field_number = UPB_MIN(m->max_field_number, 16000);
+  m->tablearray = malloc((m->max_field_number + 1) * sizeof(void*));
+}
+
+// Splits the plan's messages into at most "threads" chunks with about the
+// same number of fields each, returning the number of chunks.
+static int upb_decoderplan_jitchunks(upb_decoderplan *plan,
+                                     upb_jitcompiler *jcs, int threads,
+                                     uint32_t pclabel_count) {
+  upb_handlers *h = plan->handlers;
+  int n = UPB_MAX(1, UPB_MIN(threads, h->msgs_len));
+  size_t total = 0, seen = 0;
+  for (int i = 0; i < h->msgs_len; i++)
+    total += 1 + upb_inttable_count(&h->msgs[i]->fieldtab);
+
+  uint32_t chunk = 0;
+  jcs[0].msgs_begin = 0;
+  for (int i = 0; i < h->msgs_len; i++) {
+    if (seen * n >= total * (chunk + 1)) {
+      jcs[chunk++].msgs_end = i;
+      jcs[chunk].msgs_begin = i;
+    }
+    h->msgs[i]->jit_chunk = chunk;
+    seen += 1 + upb_inttable_count(&h->msgs[i]->fieldtab);
+  }
+  jcs[chunk].msgs_end = h->msgs_len;
+
+  for (uint32_t i = 0; i <= chunk; i++) {
+    jcs[i].plan = plan;
+    jcs[i].chunk = i;
+    jcs[i].globals = malloc(UPB_JIT_GLOBAL__MAX * sizeof(void*));
+    // Every chunk has room for all of the plan's labels, but only defines
+    // (and refers to) those of its own messages.
+    jcs[i].pclabel_count = pclabel_count;
+  }
+  return chunk + 1;
+}
+
+// Generates the chunk's code into its DynASM state and links it, which sets
+// jc->size.
+static void *upb_jitcompiler_gen(void *_jc) {
+  upb_jitcompiler *jc = _jc;
+  dasm_init(jc, 1);
+  dasm_setupglobal(jc, jc->globals, UPB_JIT_GLOBAL__MAX);
+  dasm_growpc(jc, jc->pclabel_count);
+  dasm_setup(jc, upb_jit_actionlist);
+
+  upb_decoderplan_jit(jc);
+
+  int dasm_status = dasm_link(jc, &jc->size);
+  (void)dasm_status;
+  assert(dasm_status == DASM_S_OK);
+  return NULL;
+}
+
+// Generates and links all the chunks, one thread per chunk if we have
+// threads, then lays them out and sets plan->jit_size.
+static void upb_decoderplan_jitgen(upb_decoderplan *plan, upb_jitcompiler *jcs,
+                                   int chunks) {
+#ifdef UPB_USE_PTHREADS
+  pthread_t *threads = malloc(chunks * sizeof(*threads));
+  bool *started = malloc(chunks * sizeof(*started));
+  for (int i = 1; i < chunks; i++) {
+    started[i] =
+        pthread_create(&threads[i], NULL, &upb_jitcompiler_gen, &jcs[i]) == 0;
+  }
+  upb_jitcompiler_gen(&jcs[0]);
+  for (int i = 1; i < chunks; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      upb_jitcompiler_gen(&jcs[i]);
+  }
+  free(threads);
+  free(started);
+#else
+  for (int i = 0; i < chunks; i++)
+    upb_jitcompiler_gen(&jcs[i]);
+#endif
+
+  size_t ofs = 0;
+  for (int i = 0; i < chunks; i++) {
+    ofs = (ofs + 15) & ~(size_t)15;
+    jcs[i].ofs = ofs;
+    ofs += jcs[i].size;
+  }
+  plan->jit_size = ofs;
+}
+
+static void upb_decoderplan_makejit(upb_decoderplan *plan, int threads) {
+  plan->debug_info = NULL;
+  // If another live plan has JIT-ted these handlers, its code uses the JIT
+  // state they hold, so this plan stays in the interpreter.
+  upb_handlers *h = plan->handlers;
+  if (!upb_atomic_trylock(&h->jit_lock)) return;
+  upb_decoderplan_jitinit(plan);
+
+  // Assign pclabels.
+  uint32_t pclabel_count = 0;
+  for (int i = 0; i < h->msgs_len; i++)
+    upb_decoderplan_jit_assignmsglabs(h->msgs[i], &pclabel_count);
+
+  upb_jitcompiler *jcs =
+      malloc(UPB_MAX(1, UPB_MIN(threads, h->msgs_len)) * sizeof(*jcs));
+  int chunks = upb_decoderplan_jitchunks(plan, jcs, threads, pclabel_count);
+  plan->jit_reldelta = upb_jitarena_reldelta();
+  upb_decoderplan_jitgen(plan, jcs, chunks);
+
+  // Where we write the code; an alias of plan->jit_code if it is in the arena.
+  char *buf = NULL;
+  plan->jit_code = NULL;
+  if (plan->jit_reldelta != 0)
+    plan->jit_code = upb_jitarena_alloc(plan->jit_size, &buf);
+  if (!plan->jit_code) {
+    if (plan->jit_reldelta != 0) {
+      // The arena is full, and the code we generated only works in the arena.
+      for (int i = 0; i < chunks; i++) dasm_free(&jcs[i]);
+      plan->jit_reldelta = 0;
+      upb_decoderplan_jitgen(plan, jcs, chunks);
+    }
+    plan->jit_code = mmap(NULL, plan->jit_size, PROT_READ | PROT_WRITE,
+                          MAP_32BIT | MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+    buf = plan->jit_code;
+  }
+
+  upb_reg_jit_gdb(plan);
+
+  for (int i = 0; i < chunks; i++)
+    dasm_encode(&jcs[i], buf + jcs[i].ofs);
+  upb_reg_jit_perf(plan, jcs, chunks);
+
+  // Create dispatch tables.
+  for (int i = 0; i < h->msgs_len; i++) {
+    upb_mhandlers *m = h->msgs[i];
+    upb_jitcompiler *jc = &jcs[m->jit_chunk];
+    char *code = plan->jit_code + jc->ofs;
+    // DynASM gives us the global labels' addresses in "buf".
+    char *exit_jit =
+        plan->jit_code + ((char*)jc->globals[UPB_JIT_GLOBAL_exit_jit] - buf);
+    m->jit_startmsg_func = code + dasm_getpclabel(jc, m->jit_startmsg_pclabel);
+    // We jump to after the startmsg handler since it is called before entering
+    // the JIT (either by upb_decoder or by a previous call to the JIT).
+    m->jit_func = code + dasm_getpclabel(jc, m->jit_afterstartmsg_pclabel);
+    for (uint32_t j = 0; j <= m->max_field_number; j++) {
+      upb_fhandlers *f = upb_mhandlers_lookup(m, j);
+      if (f) {
+        m->tablearray[j] = code + dasm_getpclabel(jc, f->jit_pclabel);
+      } else {
+        // TODO: extend the JIT to handle unknown fields.
+        // For the moment we exit the JIT for any unknown field.
+        m->tablearray[j] = exit_jit;
+      }
+    }
+  }
+
+  for (int i = 0; i < chunks; i++) {
+    dasm_free(&jcs[i]);
+    free(jcs[i].globals);
+  }
+  free(jcs);
+
+  if (buf == plan->jit_code)
+    mprotect(plan->jit_code, plan->jit_size, PROT_EXEC | PROT_READ);
+
+  // View with: objdump -M intel -D -b binary -mi386 -Mx86-64 /tmp/machine-code
+  // Or: ndisasm -b 64 /tmp/machine-code
+  // (for the x86 backend, leave out -Mx86-64 or use ndisasm -b 32).
+  FILE *f = fopen("/tmp/machine-code", "wb");
+  fwrite(buf, plan->jit_size, 1, f);
+  fclose(f);
+}
+
+static void upb_decoderplan_freejit(upb_decoderplan *plan) {
+  if (upb_jitarena_owns(plan->jit_code))
+    upb_jitarena_free(plan->jit_code, plan->jit_size);
+  else
+    munmap(plan->jit_code, plan->jit_size);
+  free(plan->debug_info);
+  // TODO: unregister
+  upb_handlers *h = plan->handlers;
+  for (int i = 0; i < h->msgs_len; i++) {
+    upb_mhandlers *m = h->msgs[i];
+    free(m->tablearray);
+    m->tablearray = NULL;
+    m->jit_func = NULL;
+    m->jit_startmsg_func = NULL;
+  }
+  upb_atomic_unlock(&h->jit_lock);
+}
@@ -52,3 +52,87 @@ upb_decoderet upb_vdecode_max8_wright(upb_decoderet r) {
                         r.val | (b << 14)};
   return my_r;
 }
+
+#ifdef UPB_VDECODE_HAVE_BMI2
+#include <immintrin.h>
+
+__attribute__((target("bmi,bmi2")))
+upb_decoderet upb_vdecode_max8_bmi2(upb_decoderet r) {
+  uint64_t b;
+  memcpy(&b, r.p, sizeof(b));
+  uint64_t stop_bit = upb_get_vstopbit(b);
+  if (stop_bit == 0) {
+    // Error: unterminated varint.
+    upb_decoderet err_r = {(void*)0, 0};
+    return err_r;
+  }
+  b = _pext_u64(b, 0x7f7f7f7f7f7f7f7fULL & (stop_bit - 1));
+  upb_decoderet my_r = {r.p + ((_tzcnt_u64(stop_bit) + 1) / 8),
+                        r.val | (b << 14)};
+  return my_r;
+}
+#endif
+
+
+/* CPU dispatch ***************************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static void upb_cpuid(uint32_t leaf, uint32_t regs[4]) {
+  __asm__ ("cpuid"
+           : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+           : "a"(leaf), "c"(0));
+}
+
+// Stores the CPU's BMI1+BMI2 support in *bmi2 and whether it is an AMD CPU
+// from before Zen 3 (family 0x19) in *slow_pext.
+static void upb_cpu_bmi2(bool *bmi2, bool *slow_pext) {
+  uint32_t regs[4];
+  *bmi2 = false;
+  *slow_pext = false;
+  upb_cpuid(0, regs);
+  if (regs[0] < 7) return;
+  bool amd = regs[1] == 0x68747541;  // "AuthenticAMD"
+  upb_cpuid(1, regs);
+  uint32_t family = (regs[0] >> 8) & 0xf;
+  if (family == 0xf) family += (regs[0] >> 20) & 0xff;
+  *slow_pext = amd && family < 0x19;
+  upb_cpuid(7, regs);
+  *bmi2 = (regs[1] & (1 << 3)) && (regs[1] & (1 << 8));
+}
+#else
+static void upb_cpu_bmi2(bool *bmi2, bool *slow_pext) {
+  *bmi2 = false;
+  *slow_pext = false;
+}
+#endif
+
+bool upb_cpu_hasbmi2() {
+  bool bmi2, slow_pext;
+  upb_cpu_bmi2(&bmi2, &slow_pext);
+  return bmi2;
+}
+
+bool upb_cpu_fastpext() {
+  bool bmi2, slow_pext;
+  upb_cpu_bmi2(&bmi2, &slow_pext);
+  return bmi2 && !slow_pext;
+}
+
+upb_vdecode_max8_func *upb_vdecode_max8_best() {
+#ifdef UPB_VDECODE_HAVE_BMI2
+  if (upb_cpu_fastpext()) return &upb_vdecode_max8_bmi2;
+#endif
+  // SSE4 offers nothing for a single varint that the 64-bit SWAR decoders do
+  // not already do in one register.
+  return &upb_vdecode_max8_massimino;
+}
+
+// Chooses the decoder on first use and replaces itself with it.  Racing
+// threads all store the same pointer, so this needs no lock.
+static upb_decoderet upb_vdecode_max8_resolve(upb_decoderet r) {
+  upb_vdecode_max8_func *f = upb_vdecode_max8_best();
+  upb_vdecode_max8_store(f);
+  return f(r);
+}
+
+upb_vdecode_max8_func *upb_vdecode_max8_selected = &upb_vdecode_max8_resolve;
@@ -103,6 +103,45 @@ upb_decoderet upb_vdecode_max8_wright(upb_decoderet r);
 // Another implementation of the previous.
 upb_decoderet upb_vdecode_max8_massimino(upb_decoderet r);
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define UPB_VDECODE_HAVE_BMI2
+// Another implementation of the previous, with one BMI2 pext.  Must only be
+// called if upb_cpu_hasbmi2() returns true.
+upb_decoderet upb_vdecode_max8_bmi2(upb_decoderet r);
+#endif
+
+// CPU feature detection, for choosing among implementations at runtime.
+// upb_cpu_fastpext() is like upb_cpu_hasbmi2(), but is false on CPUs that
+// implement pext in microcode (AMD before Zen 3), where it is slower than the
+// plain-C decoders.  Both are false if we can't detect features on this
+// platform.
+bool upb_cpu_hasbmi2(void);
+bool upb_cpu_fastpext(void);
+
+// The max8 decoder that is fastest on the CPU we are running on.  It is
+// chosen with CPUID on the first call, so a single binary can run well on a
+// mix of CPUs.
+typedef upb_decoderet upb_vdecode_max8_func(upb_decoderet r);
+extern upb_vdecode_max8_func *upb_vdecode_max8_selected;
+upb_vdecode_max8_func *upb_vdecode_max8_best(void);
+
+// The pointer is read and written atomically, since threads may resolve it
+// concurrently.  Relaxed ordering suffices: every value it ever holds points
+// to a function, which needs no other data to be published with it.
+#ifdef __GNUC__
+#define upb_vdecode_max8_load() \
+  __atomic_load_n(&upb_vdecode_max8_selected, __ATOMIC_RELAXED)
+#define upb_vdecode_max8_store(f) \
+  __atomic_store_n(&upb_vdecode_max8_selected, f, __ATOMIC_RELAXED)
+#else
+#define upb_vdecode_max8_load() upb_vdecode_max8_selected
+#define upb_vdecode_max8_store(f) (void)(upb_vdecode_max8_selected = f)
+#endif
+
+INLINE upb_decoderet upb_vdecode_max8_fast(upb_decoderet r) {
+  return upb_vdecode_max8_load()(r);
+}
+
 // Template for a function that checks the first two bytes with branching
 // and dispatches 2-10 bytes with a separate function.
 #define UPB_VARINT_DECODER_CHECK2(name, decode_max8_function)                \
@@ -116,22 +155,23 @@ INLINE upb_decoderet upb_vdecode_check2_ ## name(const char *_p) {           \
 
 UPB_VARINT_DECODER_CHECK2(wright, upb_vdecode_max8_wright);
 UPB_VARINT_DECODER_CHECK2(massimino, upb_vdecode_max8_massimino);
+#ifdef UPB_VDECODE_HAVE_BMI2
+UPB_VARINT_DECODER_CHECK2(bmi2, upb_vdecode_max8_bmi2);
+#endif
+UPB_VARINT_DECODER_CHECK2(fast, upb_vdecode_max8_fast);
 #undef UPB_VARINT_DECODER_CHECK2
 
-// Our canonical functions for decoding varints, based on the currently
+// Our canonical function for decoding varints, based on the currently
 // favored best-performing implementations.
 INLINE upb_decoderet upb_vdecode_fast(const char *p) {
-  // Use nobranch2 on 64-bit, branch32 on 32-bit.
+  // Use check2 with the runtime-selected max8 decoder on 64-bit, branch32 on
+  // 32-bit.
   if (sizeof(long) == 8)
-    return upb_vdecode_check2_massimino(p);
+    return upb_vdecode_check2_fast(p);
   else
     return upb_vdecode_branch32(p);
 }
 
-INLINE upb_decoderet upb_vdecode_max8_fast(upb_decoderet r) {
-  return upb_vdecode_max8_massimino(r);
-}
-
 
 /* Encoding *******************************************************************/
 
@@ -6,9 +6,17 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "upb/refcount.h"
 
-// TODO(haberman): require client to define these if ref debugging is on.
+// Clients may supply their own lock for the ref-tracking tables; by default
+// we use a global spinlock, since refs are taken from many threads at once.
+#if defined(UPB_DEBUG_REFS) && !defined(UPB_LOCK)
+static uint32_t upb_refcount_lock;
+#define UPB_LOCK upb_atomic_lock(&upb_refcount_lock)
+#define UPB_UNLOCK upb_atomic_unlock(&upb_refcount_lock)
+#endif
+
 #ifndef UPB_LOCK
 #define UPB_LOCK
 #endif
@@ -17,38 +25,6 @@
 #define UPB_UNLOCK
 #endif
 
-/* arch-specific atomic primitives  *******************************************/
-
-#ifdef UPB_THREAD_UNSAFE  //////////////////////////////////////////////////////
-
-INLINE void upb_atomic_inc(uint32_t *a) { (*a)++; }
-INLINE bool upb_atomic_dec(uint32_t *a) { return --(*a) == 0; }
-
-#elif (__GNUC__ == 4 && __GNUC_MINOR__ >= 1) || __GNUC__ > 4 ///////////////////
-
-INLINE void upb_atomic_inc(uint32_t *a) { __sync_fetch_and_add(a, 1); }
-INLINE bool upb_atomic_dec(uint32_t *a) {
-  return __sync_sub_and_fetch(a, 1) == 0;
-}
-
-#elif defined(WIN32) ///////////////////////////////////////////////////////////
-
-#include <Windows.h>
-
-INLINE void upb_atomic_inc(upb_atomic_t *a) { InterlockedIncrement(&a->val); }
-INLINE bool upb_atomic_dec(upb_atomic_t *a) {
-  return InterlockedDecrement(&a->val) == 0;
-}
-
-#else
-#error Atomic primitives not defined for your platform/CPU.  \
-       Implement them or compile with UPB_THREAD_UNSAFE.
-#endif
-
-// Reserved index values.
-#define UPB_INDEX_UNDEFINED UINT16_MAX
-#define UPB_INDEX_NOT_IN_STACK (UINT16_MAX - 1)
-
 static void upb_refcount_merge(upb_refcount *r, upb_refcount *from) {
   if (upb_refcount_merged(r, from)) return;
   *r->count += *from->count;
@@ -66,57 +42,151 @@ static void upb_refcount_merge(upb_refcount *r, upb_refcount *from) {
 
 // Tarjan's algorithm, see:
 //   http://en.wikipedia.org/wiki/Tarjan%27s_strongly_connected_components_algorithm
+//
+// The traversal is iterative, so deep graphs cannot overflow the C stack, and
+// its stacks grow with the input instead of being preallocated.  SCCs are only
+// merged once the whole traversal has succeeded, so running out of memory
+// leaves every refcount as it was.
 
 typedef struct {
-  int index;
-  upb_refcount **stack;
-  int stack_len;
+  upb_refcount *obj;
+  // This object's successors are succ[begin, end); succ[next, end) are the
+  // ones not visited yet.
+  size_t begin, next, end;
+} upb_tarjan_frame;
+
+typedef struct {
+  uint32_t index;
   upb_getsuccessors *func;
+  bool oom;
+  upb_refcount **stack;  // Tarjan's stack of objects in unfinished SCCs.
+  size_t stack_len, stack_size;
+  upb_tarjan_frame *frames;  // DFS call stack.
+  size_t frames_len, frames_size;
+  upb_refcount **succ;  // Successors of the objects in "frames."
+  size_t succ_len, succ_size;
+  upb_refcount **sccs;  // Each SCC found: its root, other members, then NULL.
+  size_t sccs_len, sccs_size;
 } upb_tarjan_state;
 
-static void upb_refcount_dofindscc(upb_refcount *obj, upb_tarjan_state *state);
+// Ensures there is room for "len" elements of size "elem" in *arr.
+static bool upb_tarjan_reserve(void *arr, size_t *size, size_t len,
+                               size_t elem) {
+  if (len <= *size) return true;
+  size_t new_size = UPB_MAX(*size * 2, 16);
+  while (new_size < len) new_size *= 2;
+  void *new_arr = realloc(*(void**)arr, new_size * elem);
+  if (!new_arr) return false;
+  *(void**)arr = new_arr;
+  *size = new_size;
+  return true;
+}
 
 void upb_refcount_visit(upb_refcount *obj, upb_refcount *subobj, void *_state) {
+  (void)obj;
   upb_tarjan_state *state = _state;
-  if (subobj->index == UPB_INDEX_UNDEFINED) {
-    // Subdef has not yet been visited; recurse on it.
-    upb_refcount_dofindscc(subobj, state);
-    obj->lowlink = UPB_MIN(obj->lowlink, subobj->lowlink);
-  } else if (subobj->index != UPB_INDEX_NOT_IN_STACK) {
-    // Subdef is in the stack and hence in the current SCC.
-    obj->lowlink = UPB_MIN(obj->lowlink, subobj->index);
+  if (!upb_tarjan_reserve(&state->succ, &state->succ_size, state->succ_len + 1,
+                          sizeof(*state->succ))) {
+    state->oom = true;
+    return;
   }
+  state->succ[state->succ_len++] = subobj;
 }
 
-static void upb_refcount_dofindscc(upb_refcount *obj, upb_tarjan_state *state) {
+// Starts visiting obj: numbers it, pushes it on both stacks and collects its
+// successors.
+static bool upb_tarjan_begin(upb_tarjan_state *state, upb_refcount *obj) {
+  if (!upb_tarjan_reserve(&state->frames, &state->frames_size,
+                          state->frames_len + 1, sizeof(*state->frames)) ||
+      !upb_tarjan_reserve(&state->stack, &state->stack_size,
+                          state->stack_len + 1, sizeof(*state->stack)))
+    return false;
   obj->index = state->index;
   obj->lowlink = state->index;
   state->index++;
   state->stack[state->stack_len++] = obj;
+  upb_tarjan_frame *f = &state->frames[state->frames_len++];
+  f->obj = obj;
+  f->begin = f->next = state->succ_len;
+  state->func(obj, state);  // Collect successors.
+  f->end = state->succ_len;
+  return !state->oom;
+}
 
-  state->func(obj, state);  // Visit successors.
+// Pops the SCC rooted at obj off the stack and records it.
+static bool upb_tarjan_popscc(upb_tarjan_state *state, upb_refcount *obj) {
+  size_t root = state->stack_len;
+  while (state->stack[--root] != obj) {}
+  size_t members = state->stack_len - root;
+  if (!upb_tarjan_reserve(&state->sccs, &state->sccs_size,
+                          state->sccs_len + members + 1, sizeof(*state->sccs)))
+    return false;
+  state->sccs[state->sccs_len++] = obj;
+  for (size_t i = root + 1; i < state->stack_len; i++)
+    state->sccs[state->sccs_len++] = state->stack[i];
+  state->sccs[state->sccs_len++] = NULL;
+  for (size_t i = root; i < state->stack_len; i++)
+    state->stack[i]->index = UPB_INDEX_NOT_IN_STACK;
+  state->stack_len = root;
+  return true;
+}
+
+static bool upb_tarjan(upb_tarjan_state *state, upb_refcount *start) {
+  if (!upb_tarjan_begin(state, start)) return false;
+  while (state->frames_len > 0) {
+    upb_tarjan_frame *f = &state->frames[state->frames_len - 1];
+    upb_refcount *obj = f->obj;
+    if (f->next < f->end) {
+      upb_refcount *subobj = state->succ[f->next++];
+      if (subobj->index == UPB_INDEX_UNDEFINED) {
+        // Subobj has not yet been visited; "recurse" on it.
+        if (!upb_tarjan_begin(state, subobj)) return false;
+      } else if (subobj->index != UPB_INDEX_NOT_IN_STACK) {
+        // Subobj is in the stack and hence in the current SCC.
+        obj->lowlink = UPB_MIN(obj->lowlink, subobj->index);
+      }
+      continue;
+    }
 
-  if (obj->lowlink == obj->index) {
-    upb_refcount *scc_obj;
-    while ((scc_obj = state->stack[--state->stack_len]) != obj) {
-      upb_refcount_merge(obj, scc_obj);
-      scc_obj->index = UPB_INDEX_NOT_IN_STACK;
+    // All successors are done; "return" to the caller.
+    state->succ_len = f->begin;
+    state->frames_len--;
+    if (state->frames_len > 0) {
+      upb_refcount *caller = state->frames[state->frames_len - 1].obj;
+      caller->lowlink = UPB_MIN(caller->lowlink, obj->lowlink);
     }
-    obj->index = UPB_INDEX_NOT_IN_STACK;
+    if (obj->lowlink == obj->index && !upb_tarjan_popscc(state, obj))
+      return false;
   }
+  return true;
 }
 
 bool upb_refcount_findscc(upb_refcount **refs, int n, upb_getsuccessors *func) {
-  // TODO(haberman): allocate less memory.  We can't use n as a bound because
-  // it doesn't include fielddefs.  Could either use a dynamically-resizing
-  // array or think of some other way.
-  upb_tarjan_state state = {0, malloc(UINT16_MAX * sizeof(void*)), 0, func};
-  if (state.stack == NULL) return false;
-  for (int i = 0; i < n; i++)
+  upb_tarjan_state state;
+  memset(&state, 0, sizeof(state));
+  state.func = func;
+  bool ok = true;
+  for (int i = 0; ok && i < n; i++)
     if (refs[i]->index == UPB_INDEX_UNDEFINED)
-      upb_refcount_dofindscc(refs[i], &state);
+      ok = upb_tarjan(&state, refs[i]);
+
+  if (ok) {
+    for (size_t i = 0; i < state.sccs_len; i++) {
+      upb_refcount *root = state.sccs[i];
+      while (state.sccs[++i]) upb_refcount_merge(root, state.sccs[i]);
+    }
+  } else {
+    // Undo the numbering so that a later attempt starts from scratch.
+    for (size_t i = 0; i < state.stack_len; i++)
+      state.stack[i]->index = UPB_INDEX_UNDEFINED;
+    for (size_t i = 0; i < state.sccs_len; i++)
+      if (state.sccs[i]) state.sccs[i]->index = UPB_INDEX_UNDEFINED;
+  }
   free(state.stack);
-  return true;
+  free(state.frames);
+  free(state.succ);
+  free(state.sccs);
+  return ok;
 }
 
 #ifdef UPB_DEBUG_REFS
@@ -197,10 +267,15 @@ void upb_refcount_uninit(upb_refcount *r) {
 
 // Thread-safe operations //////////////////////////////////////////////////////
 
+// Refs on immortal objects are still tracked under UPB_DEBUG_REFS, so that
+// leaked refs are reported and released ones free their tracking memory.
+// Only objects in static storage have no table to track refs in.
+
 void upb_refcount_ref(const upb_refcount *r, const void *owner) {
   (void)owner;
-  upb_atomic_inc(r->count);
+  if (!upb_refcount_isimmortal(r)) upb_atomic_inc(r->count);
 #ifdef UPB_DEBUG_REFS
+  if (!r->refs) return;
   UPB_LOCK;
   upb_refcount_track(r, owner);
   UPB_UNLOCK;
@@ -209,12 +284,17 @@ void upb_refcount_ref(const upb_refcount *r, const void *owner) {
 
 bool upb_refcount_unref(const upb_refcount *r, const void *owner) {
   (void)owner;
-  bool ret = upb_atomic_dec(r->count);
 #ifdef UPB_DEBUG_REFS
-  UPB_LOCK;
-  upb_refcount_untrack(r, owner);
-  UPB_UNLOCK;
+  // Untrack before dropping the count, otherwise another thread could release
+  // the last ref and free the object while our ref is still being tracked.
+  if (r->refs) {
+    UPB_LOCK;
+    upb_refcount_untrack(r, owner);
+    UPB_UNLOCK;
+  }
 #endif
+  if (upb_refcount_isimmortal(r)) return false;
+  bool ret = upb_atomic_dec(r->count);
   if (ret) free(r->count);
   return ret;
 }
@@ -224,6 +304,7 @@ void upb_refcount_donateref(
   (void)r; (void)from; (void)to;
   assert(from != to);
 #ifdef UPB_DEBUG_REFS
+  if (!r->refs) return;
   UPB_LOCK;
   upb_refcount_track(r, to);
   upb_refcount_untrack(r, from);
@@ -231,6 +312,22 @@ void upb_refcount_donateref(
 #endif
 }
 
+bool upb_refcount_makeimmortal(const upb_refcount *r) {
+  // Statically-initialized counts may be in read-only memory.
+  if (upb_refcount_isimmortal(r)) return false;
+  return (upb_atomic_or(r->count, UPB_REFCOUNT_IMMORTAL) &
+          UPB_REFCOUNT_IMMORTAL) == 0;
+}
+
+void upb_refcount_freeimmortal(const upb_refcount *r) {
+  assert(upb_refcount_isimmortal(r));
+  free(r->count);
+}
+
+bool upb_refcount_isimmortal(const upb_refcount *r) {
+  return (upb_atomic_read(r->count) & UPB_REFCOUNT_IMMORTAL) != 0;
+}
+
 bool upb_refcount_merged(const upb_refcount *r, const upb_refcount *r2) {
   return r->count == r2->count;
 }
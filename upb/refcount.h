@@ -22,11 +22,20 @@
 #define UPB_DEBUG_REFS
 #endif
 
+// Set in the count of an immortal SCC.  Refs that raced with
+// upb_refcount_makeimmortal() only touch the low bits, so the count can never
+// drop to zero once this is set.
+#define UPB_REFCOUNT_IMMORTAL 0x80000000
+
+// Reserved index values.
+#define UPB_INDEX_UNDEFINED UINT32_MAX
+#define UPB_INDEX_NOT_IN_STACK (UINT32_MAX - 1)
+
 typedef struct _upb_refcount {
   uint32_t *count;
   struct _upb_refcount *next;  // Circularly-linked list of this SCC.
-  uint16_t index;    // For SCC algorithm.
-  uint16_t lowlink;  // For SCC algorithm.
+  uint32_t index;    // For SCC algorithm.
+  uint32_t lowlink;  // For SCC algorithm.
 #ifdef UPB_DEBUG_REFS
   // Make this a pointer so that we can modify it inside of const methods
   // without ugly casts.
@@ -34,6 +43,149 @@ typedef struct _upb_refcount {
 #endif
 } upb_refcount;
 
+// Initializer for the refcount of an object in static storage, like the defs
+// generated by upbc.  The object is immortal from the start and is already
+// done with upb_refcount_findscc(); "count" must point to a uint32_t whose
+// value has UPB_REFCOUNT_IMMORTAL set, and which may be const.
+#ifdef UPB_DEBUG_REFS
+#define UPB_REFCOUNT_STATICINIT(self, count) \
+    {(uint32_t*)(count), (upb_refcount*)(self), UPB_INDEX_NOT_IN_STACK, \
+     UPB_INDEX_NOT_IN_STACK, NULL}
+#else
+#define UPB_REFCOUNT_STATICINIT(self, count) \
+    {(uint32_t*)(count), (upb_refcount*)(self), UPB_INDEX_NOT_IN_STACK, \
+     UPB_INDEX_NOT_IN_STACK}
+#endif
+
+/* arch-specific atomic primitives  *******************************************/
+
+// Shared by the refcounts and by upb_symtab's snapshot publication.  The
+// non-trivial versions are all full memory barriers, except that
+// upb_atomic_readptr() is only an acquire and upb_atomic_writeptr() only a
+// release, which is all that publishing a pointer to immutable data needs.
+// upb_atomic_or() returns the value from before the OR.
+
+#ifdef UPB_THREAD_UNSAFE  //////////////////////////////////////////////////////
+
+INLINE void upb_atomic_inc(uint32_t *a) { (*a)++; }
+INLINE bool upb_atomic_dec(uint32_t *a) { return --(*a) == 0; }
+INLINE void upb_atomic_barrier() {}
+INLINE void upb_atomic_yield() {}
+INLINE uint32_t upb_atomic_or(uint32_t *a, uint32_t bits) {
+  uint32_t old = *a;
+  *a |= bits;
+  return old;
+}
+INLINE bool upb_atomic_trylock(uint32_t *l) {
+  if (*l) return false;
+  *l = 1;
+  return true;
+}
+INLINE void upb_atomic_unlock(uint32_t *l) { *l = 0; }
+INLINE uint32_t upb_atomic_read(const uint32_t *a) { return *a; }
+INLINE void upb_atomic_write(uint32_t *a, uint32_t v) { *a = v; }
+INLINE void *upb_atomic_readptr(void *const *p) { return *p; }
+INLINE void upb_atomic_writeptr(void **p, void *v) { *p = v; }
+
+#elif (__GNUC__ == 4 && __GNUC_MINOR__ >= 1) || __GNUC__ > 4 ///////////////////
+
+#include <sched.h>
+
+INLINE void upb_atomic_inc(uint32_t *a) { __sync_fetch_and_add(a, 1); }
+INLINE bool upb_atomic_dec(uint32_t *a) {
+  return __sync_sub_and_fetch(a, 1) == 0;
+}
+INLINE void upb_atomic_barrier() { __sync_synchronize(); }
+INLINE void upb_atomic_yield() { sched_yield(); }
+INLINE uint32_t upb_atomic_or(uint32_t *a, uint32_t bits) {
+  return __sync_fetch_and_or(a, bits);
+}
+INLINE bool upb_atomic_trylock(uint32_t *l) {
+  return __sync_lock_test_and_set(l, 1) == 0;
+}
+INLINE void upb_atomic_unlock(uint32_t *l) { __sync_lock_release(l); }
+#ifdef __ATOMIC_SEQ_CST
+INLINE uint32_t upb_atomic_read(const uint32_t *a) {
+  return __atomic_load_n(a, __ATOMIC_SEQ_CST);
+}
+INLINE void upb_atomic_write(uint32_t *a, uint32_t v) {
+  __atomic_store_n(a, v, __ATOMIC_SEQ_CST);
+}
+INLINE void *upb_atomic_readptr(void *const *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+INLINE void upb_atomic_writeptr(void **p, void *v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#else
+// GCC before 4.7 has no __atomic builtins.
+INLINE uint32_t upb_atomic_read(const uint32_t *a) {
+  __sync_synchronize();
+  uint32_t v = *(const volatile uint32_t*)a;
+  __sync_synchronize();
+  return v;
+}
+INLINE void upb_atomic_write(uint32_t *a, uint32_t v) {
+  __sync_synchronize();
+  *(volatile uint32_t*)a = v;
+  __sync_synchronize();
+}
+INLINE void *upb_atomic_readptr(void *const *p) {
+  void *v = *(void *const volatile*)p;
+  __sync_synchronize();
+  return v;
+}
+INLINE void upb_atomic_writeptr(void **p, void *v) {
+  __sync_synchronize();
+  *(void *volatile*)p = v;
+}
+#endif
+
+#elif defined(WIN32) ///////////////////////////////////////////////////////////
+
+#include <Windows.h>
+
+INLINE void upb_atomic_inc(uint32_t *a) {
+  InterlockedIncrement((volatile LONG*)a);
+}
+INLINE bool upb_atomic_dec(uint32_t *a) {
+  return InterlockedDecrement((volatile LONG*)a) == 0;
+}
+INLINE void upb_atomic_barrier() { MemoryBarrier(); }
+INLINE void upb_atomic_yield() { SwitchToThread(); }
+INLINE uint32_t upb_atomic_or(uint32_t *a, uint32_t bits) {
+  return InterlockedOr((volatile LONG*)a, bits);
+}
+INLINE bool upb_atomic_trylock(uint32_t *l) {
+  return InterlockedExchange((volatile LONG*)l, 1) == 0;
+}
+INLINE void upb_atomic_unlock(uint32_t *l) {
+  InterlockedExchange((volatile LONG*)l, 0);
+}
+INLINE uint32_t upb_atomic_read(const uint32_t *a) {
+  return InterlockedCompareExchange((volatile LONG*)a, 0, 0);
+}
+INLINE void upb_atomic_write(uint32_t *a, uint32_t v) {
+  InterlockedExchange((volatile LONG*)a, v);
+}
+INLINE void *upb_atomic_readptr(void *const *p) {
+  return InterlockedCompareExchangePointer((PVOID volatile*)p, NULL, NULL);
+}
+INLINE void upb_atomic_writeptr(void **p, void *v) {
+  InterlockedExchangePointer((PVOID volatile*)p, v);
+}
+
+#else
+#error Atomic primitives not defined for your platform/CPU.  \
+       Implement them or compile with UPB_THREAD_UNSAFE.
+#endif
+
+// Spins until the lock is acquired, yielding the CPU in between attempts so
+// that a preempted holder can finish.
+INLINE void upb_atomic_lock(uint32_t *l) {
+  while (!upb_atomic_trylock(l)) upb_atomic_yield();
+}
+
 // NON THREAD SAFE operations //////////////////////////////////////////////////
 
 // Initializes the refcount with a single ref for the given owner.  Returns
@@ -48,7 +200,8 @@ void upb_refcount_uninit(upb_refcount *r);
 // algorithm needs to visit children of a particular object; the function
 // should call upb_refcount_visit() once for each child obj.
 //
-// Returns false if memory allocation failed.
+// Returns false if memory allocation failed, in which case no refcounts have
+// been merged.
 typedef void upb_getsuccessors(upb_refcount *obj, void*);
 bool upb_refcount_findscc(upb_refcount **objs, int n, upb_getsuccessors *func);
 void upb_refcount_visit(upb_refcount *obj, upb_refcount *subobj, void *closure);
@@ -67,6 +220,23 @@ bool upb_refcount_unref(const upb_refcount *r, const void *owner);
 void upb_refcount_donateref(
     const upb_refcount *r, const void *from, const void *to);
 
+// Makes every object in r's SCC immortal: from now on ref(), unref() and
+// donateref() are no-ops that never write to the shared count, so hot paths
+// can take and release refs from many threads without bouncing its cache
+// line.  Immortal objects are never freed.  May be called concurrently with
+// ref()/unref(), but only once the SCC is final (ie. after findscc()).
+// Returns true if this call made the SCC immortal, false if it already was.
+//
+// Under UPB_DEBUG_REFS refs on immortal objects are still tracked, so they
+// must still be released by their owners.
+bool upb_refcount_makeimmortal(const upb_refcount *r);
+bool upb_refcount_isimmortal(const upb_refcount *r);
+
+// Frees the shared count of an SCC made immortal by makeimmortal(), after
+// which its objects may be uninit-ed and freed.  Not thread-safe: nothing may
+// use the objects concurrently or afterwards.
+void upb_refcount_freeimmortal(const upb_refcount *r);
+
 // Returns true if these two objects share a refcount.
 bool upb_refcount_merged(const upb_refcount *r, const upb_refcount *r2);
 
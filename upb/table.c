@@ -35,12 +35,6 @@ int upb_log2(uint64_t v) {
   return UPB_MIN(UPB_MAXARRSIZE, ret);
 }
 
-static upb_tabkey upb_strkey(const char *str) {
-  upb_tabkey k;
-  k.str = (char*)str;
-  return k;
-}
-
 static uint32_t MurmurHash2(const void *key, size_t len, uint32_t seed);
 typedef upb_tabent *upb_hashfunc_t(const upb_table *t, upb_tabkey key);
 typedef bool upb_eqlfunc_t(upb_tabkey k1, upb_tabkey k2);
@@ -91,7 +85,9 @@ static void upb_table_insert(upb_table *t, upb_tabkey key, upb_value val,
   t->count++;
   upb_tabent *mainpos_e = hash(t, key);
   upb_tabent *our_e = mainpos_e;
-  if (!upb_tabent_isempty(mainpos_e)) {  // Collision.
+  if (upb_tabent_isempty(mainpos_e)) {
+    our_e->next = NULL;  // May be left over from a removed entry.
+  } else {  // Collision.
     upb_tabent *new_e = upb_table_emptyent(t);
     upb_tabent *chain = hash(t, mainpos_e->key);  // Head of collider's chain.
     if (chain == mainpos_e) {
@@ -119,6 +115,7 @@ static void upb_table_insert(upb_table *t, upb_tabkey key, upb_value val,
 static bool upb_table_remove(upb_table *t, upb_tabkey key, upb_value *val,
                              upb_hashfunc_t *hash, upb_eqlfunc_t *eql) {
   upb_tabent *chain = hash(t, key);
+  if (upb_tabent_isempty(chain)) return false;
   if (eql(chain->key, key)) {
     t->count--;
     if (val) *val = chain->val;
@@ -126,6 +123,7 @@ static bool upb_table_remove(upb_table *t, upb_tabkey key, upb_value *val,
       upb_tabent *move = chain->next;
       *chain = *move;
       move->key.num = 0;  // Make the slot empty.
+      move->next = NULL;
     } else {
       chain->key.num = 0;  // Make the slot empty.
     }
@@ -135,9 +133,11 @@ static bool upb_table_remove(upb_table *t, upb_tabkey key, upb_value *val,
       chain = chain->next;
     if (chain->next) {
       // Found element to remove.
-      if (val) *val = chain->next->val;
-      chain->next->key.num = 0;
-      chain->next = chain->next->next;
+      upb_tabent *rm = chain->next;
+      if (val) *val = rm->val;
+      rm->key.num = 0;
+      chain->next = rm->next;
+      rm->next = NULL;
       t->count--;
       return true;
     } else {
@@ -159,55 +159,426 @@ static upb_tabent *upb_table_begin(const upb_table *t) {
 
 /* upb_strtable ***************************************************************/
 
-// A simple "subclass" of upb_table that only adds a hash function for strings.
+// Unlike the inttable, the strtable uses open addressing with one control byte
+// per slot, after Abseil's "Swiss tables".  A key's hash is split in two: the
+// low 7 bits are stored in its slot's control byte (empty slots are
+// UPB_CTRL_EMPTY, the only byte with the high bit set) and the rest pick where
+// probing starts.  Probing loads a whole group of control bytes at once; each
+// byte that matches the key's 7 bits is a candidate, whose stored hash and
+// length are checked before the key itself is compared.  A group with an
+// empty byte ends the search.
+//
+// Removes need no tombstones either.  A slot is only marked empty again if
+// every group that holds it has another empty slot, so that no probe sequence
+// can have passed over it; otherwise the table is rebuilt at the same size.
+//
+// The control array has UPB_CTRL_GROUP - 1 extra bytes at the end that mirror
+// the first ones, so a group can be loaded from any slot without wrapping.
+//
+// Defining UPB_NO_SSE2 selects the portable probing even where SSE2 is
+// available, so that it can be tested there.
+
+#define UPB_CTRL_EMPTY 0x80
+
+#if defined(__SSE2__) && !defined(UPB_NO_SSE2)
+
+#include <emmintrin.h>
+
+#define UPB_CTRL_GROUP 16
+typedef uint32_t upb_ctrlmask;
+
+// Returns a mask with bit i set if byte i of the group equals "byte".
+static upb_ctrlmask upb_ctrl_match(const uint8_t *group, uint8_t byte) {
+  __m128i g = _mm_loadu_si128((const __m128i*)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(byte)));
+}
+
+static int upb_ctrl_first(upb_ctrlmask mask) { return __builtin_ctz(mask); }
+
+#else
+
+#define UPB_CTRL_GROUP 8
+typedef uint64_t upb_ctrlmask;
+
+// Portable version that matches eight bytes at a time in a 64-bit word.  It
+// returns the high bit of each matching byte; a borrow can also flag a byte
+// just above a true match, but such false candidates are rejected by the hash
+// compare, and the lowest flagged byte is always a true match.
+static upb_ctrlmask upb_ctrl_match(const uint8_t *group, uint8_t byte) {
+  const uint64_t lsbs = 0x0101010101010101ULL;
+  uint64_t w = 0;
+  for (int i = 0; i < UPB_CTRL_GROUP; i++) w |= (uint64_t)group[i] << (i * 8);
+  w ^= lsbs * byte;
+  return (w - lsbs) & ~w & (lsbs << 7);
+}
+
+static int upb_ctrl_first(upb_ctrlmask mask) {
+#ifdef __GNUC__
+  return __builtin_ctzll(mask) / 8;
+#else
+  int ret = 0;
+  while (!(mask & 0x80)) { mask >>= 8; ret++; }
+  return ret;
+#endif
+}
+
+#endif
+
+static size_t upb_strtable_size(const upb_strtable *t) {
+  return 1 << t->size_lg2;
+}
+
+static uint32_t upb_strtable_hash(const char *key, size_t len) {
+  return MurmurHash2(key, len, 0);
+}
+
+static uint8_t upb_ctrl_frag(uint32_t hash) { return hash & 0x7f; }
+
+static void upb_ctrl_set(upb_strtable *t, size_t i, uint8_t byte) {
+  t->ctrl[i] = byte;
+  if (i < UPB_CTRL_GROUP - 1) t->ctrl[upb_strtable_size(t) + i] = byte;
+}
+
+static bool upb_strent_eql(const upb_strent *e, const char *key, size_t len,
+                           uint32_t hash) {
+  return e->hash == hash && e->keylen == len && memcmp(e->key, key, len) == 0;
+}
+
+// Groups are visited in triangular order (pos, pos+1g, pos+3g, pos+6g...),
+// which covers every group of a power-of-two table before repeating.
+static upb_strent *upb_strtable_find(const upb_strtable *t, const char *key,
+                                     size_t len, uint32_t hash) {
+  size_t pos = (hash >> 7) & t->mask;
+  for (size_t step = UPB_CTRL_GROUP; true; step += UPB_CTRL_GROUP) {
+    const uint8_t *group = t->ctrl + pos;
+    upb_ctrlmask m = upb_ctrl_match(group, upb_ctrl_frag(hash));
+    for (; m; m &= m - 1) {
+      upb_strent *e = &t->entries[(pos + upb_ctrl_first(m)) & t->mask];
+      if (upb_strent_eql(e, key, len, hash)) return e;
+    }
+    if (upb_ctrl_match(group, UPB_CTRL_EMPTY)) return NULL;
+    pos = (pos + step) & t->mask;
+  }
+}
+
+// Moves the given entry into the first empty slot of its probe sequence.
+static void upb_strtable_place(upb_strtable *t, const upb_strent *ent) {
+  size_t pos = (ent->hash >> 7) & t->mask;
+  for (size_t step = UPB_CTRL_GROUP; true; step += UPB_CTRL_GROUP) {
+    upb_ctrlmask m = upb_ctrl_match(t->ctrl + pos, UPB_CTRL_EMPTY);
+    if (m) {
+      size_t i = (pos + upb_ctrl_first(m)) & t->mask;
+      upb_ctrl_set(t, i, upb_ctrl_frag(ent->hash));
+      t->entries[i] = *ent;
+      t->count++;
+      return;
+    }
+    pos = (pos + step) & t->mask;
+  }
+}
 
-static upb_tabent *upb_strhash(const upb_table *t, upb_tabkey key) {
-  // Could avoid the strlen() by using a hash function that terminates on NULL.
-  return t->entries + (MurmurHash2(key.str, strlen(key.str), 0) & t->mask);
+static bool upb_strtable_sizedinit(upb_strtable *t, uint8_t size_lg2) {
+  t->count = 0;
+  t->size_lg2 = size_lg2;
+  t->mask = upb_strtable_size(t) - 1;
+  t->perfect = NULL;
+  t->displace = NULL;
+  t->perfect_size = 0;
+  t->perfect_buckets = 0;
+  size_t ctrl_bytes = upb_strtable_size(t) + UPB_CTRL_GROUP - 1;
+  t->entries = calloc(upb_strtable_size(t), sizeof(upb_strent));
+  t->ctrl = malloc(ctrl_bytes);
+  if (!t->entries || !t->ctrl) {
+    free(t->entries);
+    free(t->ctrl);
+    return false;
+  }
+  memset(t->ctrl, UPB_CTRL_EMPTY, ctrl_bytes);
+  return true;
 }
 
-static bool upb_streql(upb_tabkey k1, upb_tabkey k2) {
-  return strcmp(k1.str, k2.str) == 0;
+bool upb_strtable_init(upb_strtable *t) { return upb_strtable_sizedinit(t, 4); }
+
+// Moves the entries to a new table of 2^size_lg2 slots; their stored hashes
+// spare us from rehashing the keys.
+static bool upb_strtable_resize(upb_strtable *t, uint8_t size_lg2) {
+  upb_strtable new_table;
+  if (!upb_strtable_sizedinit(&new_table, size_lg2)) return false;
+  for (size_t i = 0; i < upb_strtable_size(t); i++)
+    if (t->entries[i].key) upb_strtable_place(&new_table, &t->entries[i]);
+  free(t->entries);
+  free(t->ctrl);
+  *t = new_table;
+  return true;
 }
 
-bool upb_strtable_init(upb_strtable *t) { return upb_table_init(&t->t, 4); }
+static void upb_strtable_unoptimize(upb_strtable *t) {
+  free(t->perfect);
+  free(t->displace);
+  t->perfect = NULL;
+  t->displace = NULL;
+  t->perfect_size = 0;
+  t->perfect_buckets = 0;
+}
 
 void upb_strtable_uninit(upb_strtable *t) {
-  for (size_t i = 0; i < upb_table_size(&t->t); i++)
-    free(t->t.entries[i].key.str);
-  upb_table_uninit(&t->t);
+  for (size_t i = 0; i < upb_strtable_size(t); i++)
+    free(t->entries[i].key);
+  free(t->entries);
+  free(t->ctrl);
+  upb_strtable_unoptimize(t);
+}
+
+bool upb_strtable_insertl(upb_strtable *t, const char *k, size_t len,
+                          upb_value v) {
+  upb_strtable_unoptimize(t);
+  if ((double)(t->count + 1) / upb_strtable_size(t) > MAX_LOAD &&
+      !upb_strtable_resize(t, t->size_lg2 + 1)) {
+    return false;
+  }
+  upb_strent e;
+  e.keylen = len;
+  e.hash = upb_strtable_hash(k, len);
+  e.val = v;
+  assert(upb_strtable_find(t, k, len, e.hash) == NULL);
+  if ((e.key = malloc(len + 1)) == NULL) return false;
+  memcpy(e.key, k, len);
+  e.key[len] = '\0';
+  upb_strtable_place(t, &e);
+  return true;
 }
 
 bool upb_strtable_insert(upb_strtable *t, const char *k, upb_value v) {
-  if (upb_table_isfull(&t->t)) {
-    // Need to resize.  New table of double the size, add old elements to it.
-    upb_strtable new_table;
-    if (!upb_table_init(&new_table.t, t->t.size_lg2 + 1)) return false;
-    upb_strtable_iter i;
-    upb_strtable_begin(&i, t);
-    for ( ; !upb_strtable_done(&i); upb_strtable_next(&i)) {
-      upb_strtable_insert(
-          &new_table, upb_strtable_iter_key(&i), upb_strtable_iter_value(&i));
-    }
-    upb_strtable_uninit(t);
-    *t = new_table;
+  return upb_strtable_insertl(t, k, strlen(k), v);
+}
+
+// Returns true if slot i can be marked empty without cutting a probe sequence
+// short, which is when no run of UPB_CTRL_GROUP full slots goes through it.
+static bool upb_strtable_canempty(const upb_strtable *t, size_t i) {
+  int before = 0, after = 0;
+  while (before < UPB_CTRL_GROUP &&
+         t->ctrl[(i - before - 1) & t->mask] != UPB_CTRL_EMPTY)
+    before++;
+  while (after < UPB_CTRL_GROUP &&
+         t->ctrl[(i + after + 1) & t->mask] != UPB_CTRL_EMPTY)
+    after++;
+  return before + 1 + after < UPB_CTRL_GROUP;
+}
+
+bool upb_strtable_removel(upb_strtable *t, const char *k, size_t len,
+                          upb_value *v) {
+  upb_strent *e = upb_strtable_find(t, k, len, upb_strtable_hash(k, len));
+  if (!e) return false;
+  upb_strtable_unoptimize(t);
+  size_t i = e - t->entries;
+  char *key = e->key;
+  upb_value val = e->val;
+  e->key = NULL;
+  if (upb_strtable_canempty(t, i)) {
+    upb_ctrl_set(t, i, UPB_CTRL_EMPTY);
+    t->count--;
+  } else if (!upb_strtable_resize(t, t->size_lg2)) {
+    e->key = key;
+    return false;
   }
-  if ((k = strdup(k)) == NULL) return false;
-  upb_table_insert(&t->t, upb_strkey(k), v, &upb_strhash, &upb_streql);
+  free(key);
+  if (v) *v = val;
   return true;
 }
 
+bool upb_strtable_remove(upb_strtable *t, const char *k, upb_value *v) {
+  return upb_strtable_removel(t, k, strlen(k), v);
+}
+
+// Perfect hashing uses the same 32-bit hash as the table itself: its high bits
+// (scaled into range with a multiply instead of a modulus, since the sizes are
+// not powers of two) pick the bucket, and the hash mixed with the bucket's
+// displacement picks the slot.
+static uint32_t upb_scale32(uint32_t h, uint32_t n) {
+  return ((uint64_t)h * n) >> 32;
+}
+
+// Two keys whose hashes are equal would need the same slot for every
+// displacement.  So a bucket holding such keys has this bit set in its
+// displacement, and all of its keys pick their slot with a second, differently
+// seeded hash; other lookups never compute it.
+#define UPB_PERFECT_REHASH 0x80000000
+
+static uint32_t upb_perfect_rehash(const char *key, size_t len) {
+  return MurmurHash2(key, len, 0x9e3779b9);
+}
+
+static uint32_t upb_perfectslot(uint32_t h, uint32_t d, uint32_t size) {
+  // Murmur3's 32-bit finalizer.
+  h ^= d;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return upb_scale32(h, size);
+}
+
+upb_value *upb_strtable_lookupl(const upb_strtable *t, const char *key,
+                                size_t len) {
+  uint32_t h = upb_strtable_hash(key, len);
+  upb_strent *e;
+  if (t->perfect) {
+    uint32_t d = t->displace[upb_scale32(h, t->perfect_buckets)];
+    if (d & UPB_PERFECT_REHASH) {
+      d &= ~UPB_PERFECT_REHASH;
+      e = t->perfect[upb_perfectslot(upb_perfect_rehash(key, len), d,
+                                     t->perfect_size)];
+    } else {
+      e = t->perfect[upb_perfectslot(h, d, t->perfect_size)];
+    }
+    if (e && !upb_strent_eql(e, key, len, h)) e = NULL;
+  } else {
+    e = upb_strtable_find(t, key, len, h);
+  }
+  return e ? &e->val : NULL;
+}
+
 upb_value *upb_strtable_lookup(const upb_strtable *t, const char *key) {
-  return upb_table_lookup(&t->t, upb_strkey(key), &upb_strhash, &upb_streql);
+  return upb_strtable_lookupl(t, key, strlen(key));
+}
+
+// Builds the perfect hash with "hash, displace" (Belazzougui, Botelho and
+// Dietzfelbinger's CHD, minus the compression): keys are split into buckets of
+// about four by hash, and buckets are placed largest first, each by trying
+// displacements until all of its keys land in free slots.  The last buckets
+// placed are the smallest, so the search still succeeds with no empty slots.
+typedef struct {
+  uint32_t hash;
+  uint32_t slothash;  // "hash", or the second hash if the bucket needs it.
+  uint32_t bucket;
+  upb_strent *e;
+} upb_perfectkey;
+
+static int upb_perfectkey_cmp(const void *_a, const void *_b) {
+  const upb_perfectkey *a = _a, *b = _b;
+  if (a->bucket != b->bucket) return a->bucket < b->bucket ? -1 : 1;
+  return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+typedef struct {
+  uint32_t begin, count;
+  bool rehash;
+} upb_perfectbucket;
+
+static int upb_perfectbucket_cmp(const void *_a, const void *_b) {
+  const upb_perfectbucket *a = _a, *b = _b;
+  return a->count > b->count ? -1 : a->count < b->count;
+}
+
+// Gives up on a bucket after this many displacements per slot; we then retry
+// with a few spare slots (the table is no longer minimal, but still perfect).
+#define UPB_PERFECT_MAXTRIES 64
+
+static bool upb_strtable_placeperfect(upb_strtable *t,
+                                      const upb_perfectkey *keys,
+                                      const upb_perfectbucket *buckets) {
+  // Buckets are sorted largest first.
+  uint32_t *slots = malloc(buckets[0].count * sizeof(uint32_t));
+  if (!slots) return false;
+  memset(t->perfect, 0, t->perfect_size * sizeof(*t->perfect));
+  memset(t->displace, 0, t->perfect_buckets * sizeof(*t->displace));
+  bool ok = true;
+  for (uint32_t b = 0; ok && b < t->perfect_buckets && buckets[b].count; b++) {
+    const upb_perfectkey *k = &keys[buckets[b].begin];
+    uint32_t n = buckets[b].count;
+    uint32_t maxtries = UPB_PERFECT_MAXTRIES * t->perfect_size;
+    uint32_t d;
+    for (d = 0; d < maxtries; d++) {
+      uint32_t i;
+      for (i = 0; i < n; i++) {
+        slots[i] = upb_perfectslot(k[i].slothash, d, t->perfect_size);
+        if (t->perfect[slots[i]]) break;
+        t->perfect[slots[i]] = k[i].e;
+      }
+      if (i == n) break;
+      while (i--) t->perfect[slots[i]] = NULL;
+    }
+    t->displace[k[0].bucket] = d | (buckets[b].rehash ? UPB_PERFECT_REHASH : 0);
+    ok = d < maxtries;
+  }
+  free(slots);
+  return ok;
+}
+
+bool upb_strtable_optimize(upb_strtable *t) {
+  upb_strtable_unoptimize(t);
+  uint32_t n = upb_strtable_count(t);
+  if (n == 0) return true;
+  // Displacements must stay below UPB_PERFECT_REHASH.
+  if (n > UPB_PERFECT_REHASH / UPB_PERFECT_MAXTRIES / 2) return false;
+  uint32_t nbuckets = (n + 3) / 4;
+  upb_perfectkey *keys = malloc(n * sizeof(*keys));
+  upb_perfectbucket *buckets = calloc(nbuckets, sizeof(*buckets));
+  if (!keys || !buckets) goto err;
+
+  uint32_t i = 0;
+  upb_strtable_iter iter;
+  upb_strtable_begin(&iter, t);
+  for (; !upb_strtable_done(&iter); upb_strtable_next(&iter), i++) {
+    keys[i].hash = iter.e->hash;
+    keys[i].bucket = upb_scale32(keys[i].hash, nbuckets);
+    keys[i].e = iter.e;
+  }
+  // Sorting by hash within each bucket puts keys with equal hashes next to
+  // each other.
+  qsort(keys, n, sizeof(*keys), &upb_perfectkey_cmp);
+  for (i = 0; i < n; i++) {
+    upb_perfectbucket *b = &buckets[keys[i].bucket];
+    if (b->count++ == 0) b->begin = i;
+    if (i > 0 && keys[i].hash == keys[i - 1].hash) b->rehash = true;
+  }
+  for (i = 0; i < n; i++) {
+    upb_strent *e = keys[i].e;
+    keys[i].slothash = buckets[keys[i].bucket].rehash ?
+        upb_perfect_rehash(e->key, e->keylen) : keys[i].hash;
+  }
+  // If the second hashes collide too no displacement can separate the keys,
+  // so don't bother searching for one.
+  for (i = 1; i < n; i++) {
+    if (keys[i].hash == keys[i - 1].hash &&
+        keys[i].slothash == keys[i - 1].slothash)
+      goto err;
+  }
+  qsort(buckets, nbuckets, sizeof(*buckets), &upb_perfectbucket_cmp);
+
+  t->perfect_buckets = nbuckets;
+  t->displace = malloc(nbuckets * sizeof(*t->displace));
+  if (!t->displace) goto err;
+  for (uint32_t size = n; size < n * 2; size += size / 16 + 1) {
+    t->perfect_size = size;
+    t->perfect = malloc(size * sizeof(*t->perfect));
+    if (!t->perfect) goto err;
+    if (upb_strtable_placeperfect(t, keys, buckets)) {
+      free(keys);
+      free(buckets);
+      return true;
+    }
+    free(t->perfect);
+    t->perfect = NULL;
+  }
+
+err:
+  upb_strtable_unoptimize(t);
+  free(keys);
+  free(buckets);
+  return false;
 }
 
 void upb_strtable_begin(upb_strtable_iter *i, const upb_strtable *t) {
   i->t = t;
-  i->e = upb_table_begin(&t->t);
+  i->e = t->entries - 1;
+  upb_strtable_next(i);
 }
 
 void upb_strtable_next(upb_strtable_iter *i) {
-  i->e = upb_table_next(&i->t->t, i->e);
+  upb_strent *end = i->t->entries + upb_strtable_size(i->t);
+  do { if (++i->e == end) { i->e = NULL; return; } } while (i->e->key == NULL);
 }
 
 
@@ -295,21 +666,33 @@ bool upb_inttable_remove(upb_inttable *t, uintptr_t key, upb_value *val) {
   }
 }
 
-void upb_inttable_compact(upb_inttable *t) {
-  // Find the largest power of two that satisfies the MIN_DENSITY definition.
+// Returns the size of the array part that is best for the current set of
+// keys: the largest power of two that satisfies the MIN_DENSITY definition.
+// Stores the number of keys that fall inside it in *array_count.
+static size_t upb_inttable_densesize(const upb_inttable *t, int *array_count) {
   int counts[UPB_MAXARRSIZE + 1] = {0};
   upb_inttable_iter i;
-  for (upb_inttable_begin(&i, t); !upb_inttable_done(&i); upb_inttable_next(&i))
-    counts[upb_log2(upb_inttable_iter_key(&i))]++;
+  for (upb_inttable_begin(&i, t); !upb_inttable_done(&i); upb_inttable_next(&i)) {
+    uintptr_t key = upb_inttable_iter_key(&i);
+    counts[key ? upb_log2(key) : 0]++;
+  }
   int count = upb_inttable_count(t);
   int size;
   for (size = UPB_MAXARRSIZE; size > 1; size--) {
     count -= counts[size];
     if (count >= (1 << size) * MIN_DENSITY) break;
   }
+  *array_count = count;
+  return 1 << size;
+}
+
+void upb_inttable_compact(upb_inttable *t) {
+  int count;
+  size_t size = upb_inttable_densesize(t, &count);
 
   // Insert all elements into new, perfectly-sized table.
   upb_inttable new_table;
+  upb_inttable_iter i;
   int hashsize = (upb_inttable_count(t) - count + 1) / MAX_LOAD;
   upb_inttable_sizedinit(&new_table, size, upb_log2(hashsize) + 1);
   for (upb_inttable_begin(&i, t); !upb_inttable_done(&i); upb_inttable_next(&i))
@@ -319,6 +702,91 @@ void upb_inttable_compact(upb_inttable *t) {
   *t = new_table;
 }
 
+
+
+/* upb_inttable32 *************************************************************/
+
+// The hash part is built in two passes, so that every chain starts at its
+// keys' main position: first each key that finds its main position free is
+// put there, then the remaining keys take free slots and are appended to the
+// chain that starts at their main position.
+
+static const upb_inttable32_ent upb_inttable32_empty = {
+  0, UPB_INTTABLE32_END, NULL
+};
+
+static void upb_inttable32_usefallback(upb_inttable32 *t,
+                                       const upb_inttable *src) {
+  upb_inttable32_uninit(t);
+  t->array = NULL;
+  t->array_size = 0;
+  t->entries = (upb_inttable32_ent*)&upb_inttable32_empty;
+  t->mask = 0;
+  t->fallback = src;
+}
+
+bool upb_inttable32_init(upb_inttable32 *t, const upb_inttable *src) {
+  int array_count;
+  size_t asize = upb_inttable_densesize(src, &array_count);
+  uint32_t hash_count = upb_inttable_count(src) - array_count;
+  uint32_t hsize = 1;
+  while (hsize < (hash_count + 1) / MAX_LOAD) hsize <<= 1;
+
+  t->array = NULL;
+  t->entries = NULL;
+  t->fallback = NULL;
+  t->array_size = asize;
+  t->mask = hsize - 1;
+  if (hsize > UPB_INTTABLE32_END) goto err;
+  t->array = calloc(asize, sizeof(*t->array));
+  t->entries = malloc(hsize * sizeof(*t->entries));
+  if (!t->array || !t->entries) goto err;
+  for (uint32_t j = 0; j < hsize; j++) t->entries[j] = upb_inttable32_empty;
+
+  upb_inttable_iter i;
+  for (int pass = 0; pass < 2; pass++) {
+    uint32_t free_slot = hsize;
+    upb_inttable_begin(&i, src);
+    for (; !upb_inttable_done(&i); upb_inttable_next(&i)) {
+      uintptr_t key = upb_inttable_iter_key(&i);
+      const void *val = upb_value_getptr(upb_inttable_iter_value(&i));
+      assert(key <= UINT32_MAX && val);
+      if (key < asize) {
+        if (pass == 0) t->array[key] = val;
+        continue;
+      }
+      upb_inttable32_ent *e = &t->entries[key & t->mask];
+      if (pass == 0) {
+        if (e->val == NULL) { e->key = key; e->val = val; }
+        continue;
+      }
+      if (e->key == key && e->val == val) continue;  // Placed in first pass.
+      while (t->entries[--free_slot].val != NULL)
+        ;
+      while (e->next != UPB_INTTABLE32_END) e = &t->entries[e->next];
+      e->next = free_slot;
+      t->entries[free_slot].key = key;
+      t->entries[free_slot].val = val;
+    }
+  }
+  return true;
+
+err:
+  upb_inttable32_usefallback(t, src);
+  return false;
+}
+
+void upb_inttable32_uninit(upb_inttable32 *t) {
+  free(t->array);
+  if (t->entries != &upb_inttable32_empty) free(t->entries);
+}
+
+const void *upb_inttable32_lookupfallback(const upb_inttable32 *t,
+                                          uint32_t key) {
+  const upb_value *v = upb_inttable_lookup32(t->fallback, key);
+  return v ? upb_value_getptr(*v) : NULL;
+}
+
 void upb_inttable_begin(upb_inttable_iter *i, const upb_inttable *t) {
   i->t = t;
   i->arrkey = -1;
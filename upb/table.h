@@ -7,9 +7,10 @@
  * This file defines very fast int->upb_value (inttable) and string->upb_value
  * (strtable) hash tables.
  *
- * The table uses chained scatter with Brent's variation (inspired by the Lua
- * implementation of hash tables).  The hash function for strings is Austin
- * Appleby's "MurmurHash."
+ * The inttable uses chained scatter with Brent's variation (inspired by the Lua
+ * implementation of hash tables).  The strtable uses open addressing with
+ * SIMD-probed control bytes (inspired by Abseil's "Swiss tables").  The hash
+ * function for strings is Austin Appleby's "MurmurHash."
  *
  * The inttable uses uintptr_t as its key, which guarantees it can be used to
  * store pointers or integers of at least 32 bits (upb isn't really useful on
@@ -32,7 +33,6 @@ extern "C" {
 
 typedef union {
   uintptr_t num;
-  char *str;  // We own, nullz.
 } upb_tabkey;
 
 typedef struct _upb_tabent {
@@ -48,8 +48,34 @@ typedef struct {
   uint8_t size_lg2;      // Size of the hash table part is 2^size_lg2 entries.
 } upb_table;
 
+// Strtable entries keep the key's length and hash next to it, so that probing
+// and resizing rarely need to touch the key itself.
 typedef struct {
-  upb_table t;
+  char *key;          // We own, nullz.  NULL for an empty slot.
+  uint32_t keylen;
+  uint32_t hash;      // MurmurHash2 of the key.
+  upb_value val;
+} upb_strent;
+
+typedef struct {
+  upb_strent *entries;   // Hash table (open addressing).
+  uint8_t *ctrl;         // One control byte per entry; see table.c.
+  size_t count;          // Number of entries in the table.
+  size_t mask;           // Mask to turn hash value -> slot.
+  uint8_t size_lg2;      // Size of the hash table is 2^size_lg2 entries.
+  // Minimal perfect hash over the current keys, built by
+  // upb_strtable_optimize() and dropped by the next insert or remove (NULL
+  // otherwise).
+  // A key's hash picks one of "perfect_buckets" displacements, which in turn
+  // picks the only one of the "perfect_size" slots that can hold the key.
+  // Buckets whose keys share a hash value have their top displacement bit set
+  // and place those keys with a second hash instead.  Lookups with a perfect
+  // hash never read "ctrl", which lets the static tables generated by upbc
+  // leave it out.
+  upb_strent **perfect;
+  uint32_t *displace;
+  uint32_t perfect_size;
+  uint32_t perfect_buckets;
 } upb_strtable;
 
 typedef struct {
@@ -76,34 +102,57 @@ void upb_strtable_uninit(upb_strtable *table);
 
 // Returns the number of values in the table.
 size_t upb_inttable_count(const upb_inttable *t);
-INLINE size_t upb_strtable_count(const upb_strtable *t) { return t->t.count; }
+INLINE size_t upb_strtable_count(const upb_strtable *t) { return t->count; }
 
 // Inserts the given key into the hashtable with the given value.  The key must
 // not already exist in the hash table.  For string tables, the key must be
-// NULL-terminated, and the table will make an internal copy of the key.
-// Inttables must not insert a value of UINTPTR_MAX.
+// NULL-terminated (or have its length given explicitly with insertl()), and
+// the table will make an internal copy of the key.  Inttables must not insert
+// a value of UINTPTR_MAX.
 //
 // If a table resize was required but memory allocation failed, false is
 // returned and the table is unchanged.
 bool upb_inttable_insert(upb_inttable *t, uintptr_t key, upb_value val);
+bool upb_strtable_insertl(upb_strtable *t, const char *key, size_t len,
+                          upb_value val);
 bool upb_strtable_insert(upb_strtable *t, const char *key, upb_value val);
 
 // Looks up key in this table, returning a pointer to the table's internal copy
 // of the user's inserted data, or NULL if this key is not in the table.  The
 // user is free to modify the given upb_value, which will be reflected in any
 // future lookups of this key.  The returned pointer is invalidated by inserts.
+//
+// The lookupl() variant takes the key's length, so keys can be looked up
+// directly from an input buffer without being copied to add a NULL.
 upb_value *upb_inttable_lookup(const upb_inttable *t, uintptr_t key);
+upb_value *upb_strtable_lookupl(const upb_strtable *t, const char *key,
+                                size_t len);
 upb_value *upb_strtable_lookup(const upb_strtable *t, const char *key);
 
 // Removes an item from the table.  Returns true if the remove was successful,
 // and stores the removed item in *val if non-NULL.
+//
+// Removing from a strtable invalidates pointers returned by lookups.  It may
+// have to rebuild the table; if memory allocation fails for that, false is
+// returned and the table is unchanged.
 bool upb_inttable_remove(upb_inttable *t, uintptr_t key, upb_value *val);
+bool upb_strtable_removel(upb_strtable *t, const char *key, size_t len,
+                          upb_value *val);
+bool upb_strtable_remove(upb_strtable *t, const char *key, upb_value *val);
 
 // Optimizes the table for the current set of entries, for both memory use and
 // lookup time.  Client should call this after all entries have been inserted;
 // inserting more entries is legal, but will likely require a table resize.
 void upb_inttable_compact(upb_inttable *t);
 
+// Builds a minimal perfect hash over the current set of keys, so that every
+// lookup is a single hash and a single string compare.  Client should call
+// this once the table is final (eg. when a def is finalized); inserting more
+// entries is legal, but discards the perfect hash until this is called again.
+// Returns false if memory allocation failed or no perfect hash was found, in
+// which case lookups simply keep using the regular hash table.
+bool upb_strtable_optimize(upb_strtable *t);
+
 // A special-case inlinable version of the lookup routine for 32-bit integers.
 INLINE upb_value *upb_inttable_lookup32(const upb_inttable *t, uint32_t key) {
   if (key < t->array_size) {
@@ -117,6 +166,55 @@ INLINE upb_value *upb_inttable_lookup32(const upb_inttable *t, uint32_t key) {
 }
 
 
+/* upb_inttable32 *************************************************************/
+
+// A read-only, compact copy of an inttable whose keys fit in 32 bits and whose
+// values are non-NULL pointers, for lookups on hot paths like the decoder's
+// field dispatch.  The array part holds bare pointers (NULL if absent) and is
+// sized as by upb_inttable_compact(); hash entries are 16 bytes instead of 24
+// (on 64-bit), chained by 16-bit index instead of by pointer.
+
+#define UPB_INTTABLE32_END 0xffff
+
+typedef struct {
+  uint32_t key;
+  uint16_t next;    // Next entry in this chain, or UPB_INTTABLE32_END.
+  const void *val;  // NULL for an empty entry.
+} upb_inttable32_ent;
+
+typedef struct {
+  const void **array;           // Array part of the table.
+  upb_inttable32_ent *entries;   // Hash part of the table.
+  uint32_t array_size;
+  uint32_t mask;                // Mask to turn key -> hash entry.
+  // Set if the table could not be built (out of memory, or more keys outside
+  // the array part than 16-bit chaining can address); lookups then go to the
+  // source table instead.
+  const upb_inttable *fallback;
+} upb_inttable32;
+
+// Builds a upb_inttable32 with the current contents of "src".  If this returns
+// false the table still works, by looking up in "src", which must then outlive
+// it.  Changes to "src" after this call are not reflected in the table.
+bool upb_inttable32_init(upb_inttable32 *t, const upb_inttable *src);
+void upb_inttable32_uninit(upb_inttable32 *t);
+const void *upb_inttable32_lookupfallback(const upb_inttable32 *t,
+                                          uint32_t key);
+
+// Returns the value for key, or NULL if it is not in the table.
+INLINE const void *upb_inttable32_lookup(const upb_inttable32 *t,
+                                         uint32_t key) {
+  if (key < t->array_size) return t->array[key];
+  const upb_inttable32_ent *e = &t->entries[key & t->mask];
+  while (1) {
+    if (e->key == key && e->val) return e->val;
+    if (e->next == UPB_INTTABLE32_END) break;
+    e = &t->entries[e->next];
+  }
+  return t->fallback ? upb_inttable32_lookupfallback(t, key) : NULL;
+}
+
+
 /* upb_strtable_iter **********************************************************/
 
 // Strtable iteration.  Order is undefined.  Insertions invalidate iterators.
@@ -129,14 +227,17 @@ INLINE upb_value *upb_inttable_lookup32(const upb_inttable *t, uint32_t key) {
 //   }
 typedef struct {
   const upb_strtable *t;
-  upb_tabent *e;
+  upb_strent *e;
 } upb_strtable_iter;
 
 void upb_strtable_begin(upb_strtable_iter *i, const upb_strtable *t);
 void upb_strtable_next(upb_strtable_iter *i);
 INLINE bool upb_strtable_done(upb_strtable_iter *i) { return i->e == NULL; }
 INLINE const char *upb_strtable_iter_key(upb_strtable_iter *i) {
-  return i->e->key.str;
+  return i->e->key;
+}
+INLINE size_t upb_strtable_iter_keylength(upb_strtable_iter *i) {
+  return i->e->keylen;
 }
 INLINE upb_value upb_strtable_iter_value(upb_strtable_iter *i) {
   return i->e->val;
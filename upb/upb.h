@@ -35,6 +35,12 @@ extern "C" {
 #define UINT16_MAX 65535
 #endif
 
+// UPB_USE_JIT is defined if any of the JIT backends (which are selected with
+// -DUPB_USE_JIT_X64 or -DUPB_USE_JIT_X86) is compiled in.
+#if defined(UPB_USE_JIT_X64) || defined(UPB_USE_JIT_X86)
+#define UPB_USE_JIT
+#endif
+
 #define UPB_MAX(x, y) ((x) > (y) ? (x) : (y))
 #define UPB_MIN(x, y) ((x) < (y) ? (x) : (y))
 
@@ -130,6 +136,15 @@ typedef struct {
 #define SET_TYPE(dest, val) dest = val
 #endif
 
+// Initializer for a upb_value in static storage, eg.
+//   upb_value v = UPB_VALUE_INIT(int32, 5, UPB_CTYPE_INT32);
+#ifdef NDEBUG
+#define UPB_VALUE_INIT(membername, cval, proto_type) {{.membername = cval}}
+#else
+#define UPB_VALUE_INIT(membername, cval, proto_type) \
+    {{.membername = cval}, proto_type}
+#endif
+
 // For each value type, define the following set of functions:
 //
 // // Get/set an int32 from a upb_value.